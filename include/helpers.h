@@ -29,4 +29,25 @@ void print_array(const uint8_t* data, const size_t size);
  */
 void input_secret_key(uint8_t secret_key[SECRET_KEY_SIZE]);
 
+#ifdef YKHMAC_METRICS
+    /**
+     * @brief Prints count, mean and maximum duration of each phase to the serial output
+     */
+    void print_metrics();
+#endif
+
+#ifdef YKHMAC_STACK
+    /**
+     * @brief Prints the stack high-water mark of each entry point to the serial output
+     */
+    void print_stack();
+#endif
+
+#ifdef YKHMAC_TRACE
+    /**
+     * @brief Prints and removes all records of the trace buffer, see scripts/ykhmac_trace.py
+     */
+    void print_trace();
+#endif
+
 #endif
\ No newline at end of file
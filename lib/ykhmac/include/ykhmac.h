@@ -11,6 +11,7 @@
 
 #include <inttypes.h>
 #include <aes.hpp>
+#include <sha/sha1.h>
 
 // Debugging
 #ifdef YKHMAC_DEBUG
@@ -36,10 +37,20 @@
     #endif
 #endif
 
+// Binary trace buffer and the logging macros of the library
+#include "ykhmac_trace.h"
+
 // Helpers
 #define MAX(x, y)               (((x) > (y)) ? (x) : (y))       //!< Maximum of two numbers
 #define MIN(x, y)               (((x) < (y)) ? (x) : (y))       //!< Minimum of two numbers
 
+// HMAC-SHA1 parameters
+#define HMAC_BLOCK_SIZE         64                              //!< Block size of SHA1, maximum size of a HMAC key
+#define HMAC_HASH_SIZE          20                              //!< Size of a SHA1 digest
+#define HMAC_IPAD               0x36                            //!< Inner HMAC key padding byte
+#define HMAC_OPAD               0x5C                            //!< Outer HMAC key padding byte
+#define HMAC_SINGLE_BLOCK_SIZE  (HMAC_BLOCK_SIZE - 9)           //!< Maximum challenge size whose inner hash takes a single block
+
 // Hardware limits
 #ifndef HW_BUF_SIZE
     #define HW_BUF_SIZE         64                              //!< Size of the transfer buffer of the NFC controller used
@@ -52,24 +63,127 @@
     #define RECV_BUF_OVERH      8                               //!< Overhead of the send buffer in bytes
 #endif
 #define RECV_BUF_SIZE           (HW_BUF_SIZE - RECV_BUF_OVERH)  //!< Usable space of the transfer buffer for receiving
-#define ARG_BUF_SIZE_MAX        (SEND_BUF_SIZE - 5)             //!< Maximum size of an ADPU without header
+#define APDU_HEADER_SIZE        5                               //!< Size of an APDU header (CLA, INS, P1, P2, P3)
+#define ARG_BUF_SIZE_MAX        (SEND_BUF_SIZE - APDU_HEADER_SIZE) //!< Maximum size of an ADPU without header
 #ifndef RESP_BUF_SIZE
     #define RESP_BUF_SIZE       20                              //!< Size of the response buffer (inherent to SHA1)
 #endif
+#define FRAME_RECV_SIZE         (RESP_BUF_SIZE + 2)             //!< Space for a response APDU, behind the command APDU
+#define FRAME_SIZE              (SEND_BUF_SIZE + FRAME_RECV_SIZE) //!< Size of the transport frame, see ykhmac_frame
+#define FRAME_DATA              (ykhmac_frame + APDU_HEADER_SIZE) //!< Data of the command APDU in the transport frame
+#define FRAME_RESPONSE          (ykhmac_frame + SEND_BUF_SIZE)  //!< Response APDU in the transport frame
+#if FRAME_RECV_SIZE < 12 || FRAME_RECV_SIZE > RECV_BUF_SIZE
+    #error "RESP_BUF_SIZE must be between 10 and RECV_BUF_SIZE - 2"
+#endif
 #ifndef SECRET_KEY_SIZE
     #define SECRET_KEY_SIZE     20                              //!< Size of the secret key
 #endif
+#if SECRET_KEY_SIZE > HMAC_BLOCK_SIZE
+    #error "SECRET_KEY_SIZE must not exceed the SHA1 block size"
+#endif
 #define SECRET_KEY_SIZE_PAD     (((SECRET_KEY_SIZE / AES_BLOCKLEN) + 1) * AES_BLOCKLEN) //!< Size of the secret key, padded for AES
 #ifndef CHALLENGE_SIZE
     #define CHALLENGE_SIZE      ARG_BUF_SIZE_MAX                //!< Size of the generated challenges, max. ARG_BUF_SIZE_MAX
 #endif
 
+// Persistent storage layout
+#ifdef YKHMAC_STORAGE_FLASH
+    #ifndef STORAGE_PAGE_SIZE
+        #define STORAGE_PAGE_SIZE   256                         //!< Size of an erasable flash page
+    #endif
+#else
+    #define STORAGE_PAGE_SIZE   1                               //!< EEPROM is byte-addressable
+#endif
+#ifndef STORAGE_CHUNK_SIZE
+    #define STORAGE_CHUNK_SIZE  16                              //!< Amount of bytes compared at once during writes
+#endif
+#define RECORD_GEN_SIZE         4                               //!< Size of the generation counter of an enrollment record
+#define RECORD_CRC_SIZE         2                               //!< Size of the CRC-16 of an enrollment record
+#define RECORD_SIZE             (RECORD_GEN_SIZE + CHALLENGE_SIZE + AES_BLOCKLEN + SECRET_KEY_SIZE_PAD + RECORD_CRC_SIZE) //!< Size of an enrollment record
+#define RECORD_SLOT_SIZE        (((RECORD_SIZE + STORAGE_PAGE_SIZE - 1) / STORAGE_PAGE_SIZE) * STORAGE_PAGE_SIZE) //!< Size of a record slot, aligned to pages
+#ifdef YKHMAC_TOKEN_TABLE
+    // Multi-token table: open-addressed index of serials, followed by a pool of record slots
+    #ifdef YKHMAC_STORAGE_FLASH
+        #error "The token table requires byte-writable storage"
+    #endif
+    #ifdef YKHMAC_PRECOMPUTE
+        #error "Precomputed records are not supported by the token table"
+    #endif
+    #ifndef TABLE_SIZE
+        #define TABLE_SIZE      7                               //!< Maximum amount of enrolled tokens, fits the Uno EEPROM
+    #endif
+    #ifndef TABLE_BUCKETS
+        #define TABLE_BUCKETS   (TABLE_SIZE + TABLE_SIZE / 2 + 1) //!< Amount of index buckets, load factor max. 2/3
+    #endif
+    #define TABLE_BUCKET_SIZE   5                               //!< Size of an index bucket (serial, record slot)
+    #define TABLE_INDEX_SIZE    (TABLE_BUCKETS * TABLE_BUCKET_SIZE) //!< Size of the index
+    #define TABLE_SLOTS         (TABLE_SIZE + 1)                //!< Amount of record slots, one spare for updates
+    #define STORAGE_SIZE        (TABLE_INDEX_SIZE + TABLE_SLOTS * RECORD_SLOT_SIZE) //!< Used size of the persistent storage
+    #ifndef STORAGE_CAPACITY
+        #define STORAGE_CAPACITY STORAGE_SIZE                   //!< Available persistent storage
+    #endif
+    #if STORAGE_SIZE > STORAGE_CAPACITY
+        #error "STORAGE_CAPACITY is too small for TABLE_SIZE tokens"
+    #endif
+    #if TABLE_BUCKETS < TABLE_SIZE || TABLE_BUCKETS > 254
+        #error "TABLE_BUCKETS must be at least TABLE_SIZE, and must not exceed 254"
+    #endif
+#elif defined(YKHMAC_PRECOMPUTE)
+    // Ring of precomputed records, each with a one-byte marker which is set once the record has been used
+    #ifdef YKHMAC_STORAGE_FLASH
+        #error "Precomputed records require byte-writable storage"
+    #endif
+    #if defined(YKHMAC_WRITE_BEHIND) || defined(YKHMAC_NONBLOCKING)
+        #error "Precomputed records only need a one-byte write per authentication, they do not support write-behind"
+    #endif
+    #ifndef STORAGE_CAPACITY
+        #define STORAGE_CAPACITY (8 * (RECORD_SLOT_SIZE + 1))   //!< Available persistent storage, used as a ring of record slots and their markers
+    #endif
+    #define RECORD_COUNT        (STORAGE_CAPACITY / (RECORD_SLOT_SIZE + 1)) //!< Amount of record slots in the ring
+    #define RECORD_MARK_OFFSET  (RECORD_COUNT * RECORD_SLOT_SIZE) //!< Start of the markers of the used records
+    #define STORAGE_SIZE        (RECORD_COUNT * (RECORD_SLOT_SIZE + 1)) //!< Used size of the persistent storage
+    #ifndef PRECOMPUTE_LOW
+        #define PRECOMPUTE_LOW  (RECORD_COUNT / 2)              //!< The secret key is kept for replenishing once at most this many records are left
+    #endif
+    #if RECORD_COUNT < 2
+        #error "STORAGE_CAPACITY must fit at least two record slots"
+    #endif
+    #if RECORD_COUNT > 254
+        #error "STORAGE_CAPACITY must not exceed 254 record slots"
+    #endif
+    #if PRECOMPUTE_LOW < 1 || PRECOMPUTE_LOW >= RECORD_COUNT
+        #error "PRECOMPUTE_LOW must be between 1 and RECORD_COUNT - 1"
+    #endif
+#else
+    #ifndef STORAGE_CAPACITY
+        #define STORAGE_CAPACITY (2 * RECORD_SLOT_SIZE)         //!< Available persistent storage, used as a ring of record slots
+    #endif
+    #define RECORD_COUNT        (STORAGE_CAPACITY / RECORD_SLOT_SIZE) //!< Amount of record slots in the ring
+    #define STORAGE_SIZE        (RECORD_COUNT * RECORD_SLOT_SIZE) //!< Used size of the persistent storage
+    #if RECORD_COUNT < 2
+        #error "STORAGE_CAPACITY must fit at least two record slots"
+    #endif
+    #if RECORD_COUNT > 254
+        #error "STORAGE_CAPACITY must not exceed 254 record slots"
+    #endif
+#endif
+
 // Response codess
 #define E_SUCCESS                   0 //!< Operation was successfull 
 #define E_UNEXPECTED                1 //!< Unexpected error occurred (protocol violation)
 #define E_CARD_NOT_AUTHENTICATED    2 //!< Token requires user interaction / unlocking
 #define E_FILE_NOT_FOUND            3 //!< The applet with the specified AID was not found
 
+/**
+ * @brief Progress of a resumable operation
+ */
+enum ykhmac_status : uint8_t
+{
+    YKHMAC_PENDING,     //!< Waiting for the transport or the storage, poll again
+    YKHMAC_DONE,        //!< Finished successfully
+    YKHMAC_FAILED       //!< Finished with an error
+};
+
 // Slot IDs
 #define SLOT_1 1 //!< Configuration slot 1
 #define SLOT_2 2 //!< Configuration slot 2
@@ -84,6 +198,14 @@
 #define CMD_HMAC_1          0x30 //!< Compute HMAC on slot 1 API command
 #define CMD_HMAC_2          0x38 //!< Compute HMAC on slot 2 API command
 
+// Status response: firmware version, program sequence and touch level (little endian)
+#define STATUS_SIZE         6    //!< Size of the status response
+#define CONFIG1_VALID       0x01 //!< Touch level: slot 1 is configured
+#define CONFIG2_VALID       0x02 //!< Touch level: slot 2 is configured
+#define CONFIG1_TOUCH       0x04 //!< Touch level: slot 1 is triggered by touch, i.e. emits an OTP or a static password
+#define CONFIG2_TOUCH       0x08 //!< Touch level: slot 2 is triggered by touch, i.e. emits an OTP or a static password
+#define SLOTS_UNKNOWN       0xFF //!< The status response does not tell which slots answer challenges
+
 #define SW_OK_HIGH          0x90 //!< Successfull response code, high byte
 #define SW_OK_LOW           0x00 //!< Successfull response code, low byte
 #define SW_PRECOND_HIGH     0x69 //!< Precondition failed error response code, high byte
@@ -99,9 +221,242 @@
 #define FIDESMO_AID         { 0xA0, 0x00, 0x00, 0x06, 0x17, 0x00, 0x07, 0x53, 0x4E, 0xAF, 0x01 } //!< Fidesmo development applet AID
 
 
+/**
+ * @brief HMAC-SHA1 context of a secret key
+ * 
+ * Holds the SHA1 midstates after absorbing the inner and outer key padding blocks,
+ * so that multiple HMACs using the same key only compress the message blocks.
+ * All crypto backends use the same layout, see ykhmac_crypto.h.
+ */
+struct ykhmac_hmac_ctx
+{
+    uint32_t state[2][5];               //!< SHA1 state words after the inner and the outer block, in host byte order
+};
+
+// Resumable authentication, the re-enrollment is always written behind
+#ifdef YKHMAC_NONBLOCKING
+    #ifdef YKHMAC_TOKEN_TABLE
+        #error "The resumable authentication does not support the token table"
+    #endif
+    #ifndef YKHMAC_WRITE_BEHIND
+        #define YKHMAC_WRITE_BEHIND
+    #endif
+#endif
+
+// Per-phase latency histograms, compiled out unless YKHMAC_METRICS is defined
+#ifdef YKHMAC_METRICS
+    #ifndef METRICS_BUCKETS
+        #ifdef ARDUINO_ARCH_AVR
+            #define METRICS_BUCKETS 16                          //!< Buckets of each histogram, bucket i counts durations below 2^i clock ticks
+        #else
+            #define METRICS_BUCKETS 32                          //!< Buckets of each histogram, bucket i counts durations below 2^i clock ticks
+        #endif
+    #endif
+    #if METRICS_BUCKETS < 2 || METRICS_BUCKETS > 32
+        #error "METRICS_BUCKETS must be between 2 and 32"
+    #endif
+
+    /**
+     * @brief Phases of an authentication or enrollment which are timed
+     */
+    enum ykhmac_phase : uint8_t
+    {
+        YKHMAC_PHASE_SELECT,    //!< Applet selection
+        YKHMAC_PHASE_LOAD,      //!< Reading the enrollment record from persistent storage
+        YKHMAC_PHASE_EXCHANGE,  //!< HMAC challenge-response exchange with the token
+        YKHMAC_PHASE_DECRYPT,   //!< AES decryption of the secret key
+        YKHMAC_PHASE_HMAC,      //!< Local HMAC computation
+        YKHMAC_PHASE_COMPARE,   //!< Comparison of the exchanged and the computed response
+        YKHMAC_PHASE_ENCRYPT,   //!< AES encryption of the secret key
+        YKHMAC_PHASE_STORE,     //!< Writing the enrollment record to persistent storage (or deferring it)
+        YKHMAC_PHASES           //!< Amount of phases
+    };
+
+    /**
+     * @brief Latency histogram of a phase, in ticks of ykhmac_clock
+     */
+    struct ykhmac_histogram
+    {
+        uint32_t count;                     //!< Amount of recorded durations
+        uint64_t sum;                       //!< Sum of the recorded durations
+        uint32_t max;                       //!< Longest recorded duration
+        #ifdef ARDUINO_ARCH_AVR
+            uint16_t buckets[METRICS_BUCKETS]; //!< Amount of durations per bucket, saturating
+        #else
+            uint32_t buckets[METRICS_BUCKETS]; //!< Amount of durations per bucket, saturating
+        #endif
+    };
+
+    #define METRICS_RAM_SIZE    (YKHMAC_PHASES * sizeof(struct ykhmac_histogram)) //!< Size of the histograms
+#else
+    #define METRICS_RAM_SIZE    0                               //!< No histograms without YKHMAC_METRICS
+#endif
+
+// Per-token session cache, compiled out unless YKHMAC_TOKEN_CACHE is defined
+#ifdef YKHMAC_TOKEN_CACHE
+    #ifndef CACHE_SIZE
+        #ifdef ARDUINO_ARCH_AVR
+            #define CACHE_SIZE  4                               //!< Amount of cached tokens, the least recently used one is replaced
+        #else
+            #define CACHE_SIZE  16                              //!< Amount of cached tokens, the least recently used one is replaced
+        #endif
+    #endif
+    #ifndef CACHE_UID_SIZE
+        #define CACHE_UID_SIZE  7                               //!< Maximum size of a cached UID (ISO 14443-A: 4, 7 or 10 bytes)
+    #endif
+    #if CACHE_SIZE < 1 || CACHE_SIZE > 255 || CACHE_UID_SIZE < 4 || CACHE_UID_SIZE > 10
+        #error "CACHE_SIZE must be between 1 and 255, CACHE_UID_SIZE between 4 and 10"
+    #endif
+
+    /**
+     * @brief Properties of a token, which are only read once per token, see ykhmac_token_info
+     */
+    struct ykhmac_token_info
+    {
+        uint32_t serial;                    //!< Serial number, see ykhmac_read_serial
+        uint8_t version[3];                 //!< Firmware version, see ykhmac_read_version
+        uint8_t program_sequence;           //!< Incremented by the token on each reconfiguration of a slot
+        uint8_t slots;                      //!< Configured slots, see ykhmac_find_slots
+    };
+
+    /**
+     * @brief Entry of the session cache
+     */
+    struct ykhmac_token_cache_entry
+    {
+        uint8_t uid[CACHE_UID_SIZE];        //!< UID of the token
+        uint8_t uid_length;                 //!< Size of the UID in bytes, 0 if the entry is empty
+        struct ykhmac_token_info info;      //!< Cached properties
+    };
+
+    #define CACHE_RAM_SIZE      (CACHE_SIZE * sizeof(struct ykhmac_token_cache_entry)) //!< Size of the session cache
+#else
+    #define CACHE_RAM_SIZE      0                               //!< No session cache without YKHMAC_TOKEN_CACHE
+#endif
+
+// Retries of failed APDUs, compiled out unless YKHMAC_RETRY is defined
+#ifdef YKHMAC_RETRY
+    #ifndef YKHMAC_CLOCK_HZ
+        #ifdef ARDUINO
+            #define YKHMAC_CLOCK_HZ     1000000                 //!< Frequency of ykhmac_clock, micros()
+        #else
+            #define YKHMAC_CLOCK_HZ     1000000000              //!< Frequency of ykhmac_clock, nanoseconds
+        #endif
+    #endif
+    #ifndef RETRY_ATTEMPTS
+        #define RETRY_ATTEMPTS          4                       //!< Maximum attempts of an APDU, including the first one
+    #endif
+    #ifndef RETRY_BACKOFF_US
+        #define RETRY_BACKOFF_US        2000                    //!< Wait before the first retry in microseconds, doubled for each further retry
+    #endif
+    #ifndef RETRY_BACKOFF_MAX_US
+        #define RETRY_BACKOFF_MAX_US    50000                   //!< Longest wait before a retry in microseconds
+    #endif
+    #ifndef RETRY_DEADLINE_SELECT_US
+        #define RETRY_DEADLINE_SELECT_US 250000                 //!< Time after the first attempt of an applet selection, after which it is not retried anymore
+    #endif
+    #ifndef RETRY_DEADLINE_QUERY_US
+        #define RETRY_DEADLINE_QUERY_US 250000                  //!< Time after the first attempt of a status or serial number request, after which it is not retried anymore
+    #endif
+    #ifndef RETRY_DEADLINE_HMAC_US
+        #define RETRY_DEADLINE_HMAC_US  1000000                 //!< Time after the first attempt of a HMAC exchange, after which it is not retried anymore
+    #endif
+    #if RETRY_ATTEMPTS < 1 || RETRY_ATTEMPTS > 255
+        #error "RETRY_ATTEMPTS must be between 1 and 255"
+    #endif
+    #define RETRY_TICKS(us)     ((uint32_t)((uint64_t)(us) * (YKHMAC_CLOCK_HZ / 1000) / 1000)) //!< Converts microseconds to ticks of ykhmac_clock
+
+    /**
+     * @brief Counters of failed and retried APDUs
+     *
+     * The faults up to YKHMAC_RETRY_TRUNCATED are transient and retried, the others are not.
+     */
+    enum ykhmac_retry_counter : uint8_t
+    {
+        YKHMAC_RETRY_TRANSPORT,         //!< The transport failed, e.g. the token left the field
+        YKHMAC_RETRY_TRUNCATED,         //!< The response did not even hold a status word (E_UNEXPECTED)
+        YKHMAC_RETRY_UNEXPECTED,        //!< The token answered an unknown status word (E_UNEXPECTED)
+        YKHMAC_RETRY_NOT_AUTHENTICATED, //!< The token requires user interaction (E_CARD_NOT_AUTHENTICATED)
+        YKHMAC_RETRY_NOT_FOUND,         //!< The applet has not been found or selected (E_FILE_NOT_FOUND)
+        YKHMAC_RETRY_RETRIED,           //!< APDUs which have been sent again
+        YKHMAC_RETRY_RECOVERED,         //!< APDUs which succeeded after a retry
+        YKHMAC_RETRY_EXPIRED,           //!< APDUs given up after RETRY_ATTEMPTS attempts or their deadline
+        YKHMAC_RETRY_COUNTERS           //!< Amount of counters
+    };
+
+    #define RETRY_RAM_SIZE      (YKHMAC_RETRY_COUNTERS * sizeof(uint32_t)) //!< Size of the retry counters
+#else
+    #define RETRY_RAM_SIZE      0                               //!< No retry counters without YKHMAC_RETRY
+#endif
+
+// Stack high-water marks of the entry points, compiled out unless YKHMAC_STACK is defined
+#ifdef YKHMAC_STACK
+    #ifndef STACK_PAINT_SIZE
+        #ifdef ARDUINO_ARCH_AVR
+            #define STACK_PAINT_SIZE    1024                    //!< Bytes painted below an entry point, limited by the end of the heap
+        #else
+            #define STACK_PAINT_SIZE    32768                   //!< Bytes painted below an entry point
+        #endif
+    #endif
+    #ifndef STACK_MARGIN
+        #ifdef ARDUINO_ARCH_AVR
+            #define STACK_MARGIN        8                       //!< Bytes below the stack pointer which are not painted
+        #else
+            #define STACK_MARGIN        128                     //!< Bytes below the frame of ykhmac_stack_paint which are not painted
+        #endif
+    #endif
+    #define STACK_PAINT         0xC5                            //!< Marker of unused stack bytes
+
+    /**
+     * @brief Entry points whose stack usage is measured
+     */
+    enum ykhmac_entry : uint8_t
+    {
+        YKHMAC_ENTRY_SELECT,        //!< ykhmac_select
+        YKHMAC_ENTRY_READ_SERIAL,   //!< ykhmac_read_serial
+        YKHMAC_ENTRY_READ_VERSION,  //!< ykhmac_read_version
+        YKHMAC_ENTRY_EXCHANGE_HMAC, //!< ykhmac_exchange_hmac
+        YKHMAC_ENTRY_FIND_SLOTS,    //!< ykhmac_find_slots, or ykhmac_probe_slots
+        YKHMAC_ENTRY_ENROLL_KEY,    //!< ykhmac_enroll_key, or ykhmac_table_enroll
+        YKHMAC_ENTRY_AUTHENTICATE,  //!< ykhmac_authenticate, or ykhmac_table_authenticate
+        YKHMAC_ENTRY_COMPUTE_HMAC,  //!< ykhmac_compute_hmac
+        YKHMAC_ENTRIES              //!< Amount of entry points
+    };
+
+    #define STACK_RAM_SIZE      (YKHMAC_ENTRIES * sizeof(uint16_t)) //!< Size of the high-water marks
+#else
+    #define STACK_RAM_SIZE      0                               //!< No high-water marks without YKHMAC_STACK
+#endif
+
+// Static RAM usage of the library buffers
+#ifdef YKHMAC_WRITE_BEHIND
+    #define PENDING_RAM_SIZE    (1 + CHALLENGE_SIZE + AES_BLOCKLEN + SECRET_KEY_SIZE_PAD) //!< Size of a pending record
+#else
+    #define PENDING_RAM_SIZE    0                               //!< No pending record without write-behind
+#endif
+#ifdef YKHMAC_PRECOMPUTE
+    #define PRECOMPUTE_RAM_SIZE (1 + SECRET_KEY_SIZE)           //!< Size of the secret key kept for replenishing
+#else
+    #define PRECOMPUTE_RAM_SIZE 0                               //!< No kept secret key without precomputed records
+#endif
+#define YKHMAC_STATIC_RAM       (sizeof(ykhmac_scratch) + FRAME_SIZE + PENDING_RAM_SIZE + METRICS_RAM_SIZE + TRACE_RAM_SIZE + CACHE_RAM_SIZE + PRECOMPUTE_RAM_SIZE + STACK_RAM_SIZE + RETRY_RAM_SIZE) //!< Static RAM used by the library buffers
+
+
+/**
+ * @brief Prototype declaration of the transport frame
+ * 
+ * Command APDUs are built in place at the start of the frame, the library passes
+ * FRAME_RESPONSE as response buffer, so that responses are parsed where they land.
+ * Challenges are generated and loaded in place at FRAME_DATA. The frame is also used
+ * as working memory during enrollment and authentication, and is purged afterwards.
+ */
+extern uint8_t ykhmac_frame[FRAME_SIZE];
+
 /**
  * @brief Prototype declaration of NFC hardware interfacing function
  * 
+ * The send buffer and the response buffer are both part of ykhmac_frame, but do not overlap.
+ * 
  * @param send_buffer Buffer to be sent to the target
  * @param send_length Amount of bytes to be sent
  * @param response_buffer Buffer to be read from the target
@@ -111,6 +466,29 @@
 extern bool ykhmac_data_exchange(uint8_t *send_buffer, uint8_t send_length,
     uint8_t* response_buffer, uint8_t* response_length);
 
+#ifdef YKHMAC_NONBLOCKING
+    /**
+     * @brief Prototype declaration of a function which starts an NFC exchange without waiting for it
+     * 
+     * The buffers stay valid until ykhmac_data_exchange_poll has reported the end of the exchange.
+     * 
+     * @param send_buffer Buffer to be sent to the target
+     * @param send_length Amount of bytes to be sent
+     * @param response_buffer Buffer to be read from the target
+     * @param response_length Size of the response buffer, set to the amount of bytes read once the exchange is done
+     * @return true if the exchange has been started
+     */
+    extern bool ykhmac_data_exchange_start(uint8_t *send_buffer, uint8_t send_length,
+        uint8_t* response_buffer, uint8_t* response_length);
+
+    /**
+     * @brief Prototype declaration of a function which polls the exchange started by ykhmac_data_exchange_start
+     * 
+     * @return YKHMAC_PENDING while the exchange is in progress, then YKHMAC_DONE or YKHMAC_FAILED
+     */
+    extern ykhmac_status ykhmac_data_exchange_poll();
+#endif
+
 /**
  * @brief Prototype declaration of random number generator
  * 
@@ -138,9 +516,23 @@ extern bool ykhmac_presistent_write(const uint8_t *data, const size_t size, cons
  */
 extern bool ykhmac_presistent_read(uint8_t *data, const size_t size, const size_t offset);
 
+#ifdef YKHMAC_STORAGE_FLASH
+    /**
+     * @brief Prototype declaration of a persistent erase function
+     * 
+     * Sets all bytes of a page to 0xFF. Only required for flash storage.
+     * 
+     * @param offset Start of the page to be erased, multiple of STORAGE_PAGE_SIZE
+     * @return true on success
+     */
+    extern bool ykhmac_presistent_erase(const size_t offset);
+#endif
+
 /**
  * @brief Selects an applet by its AID
  * 
+ * If aid points to FRAME_DATA, it is not copied.
+ * 
  * @param aid The AID of the applet
  * @param aid_size The length of the AID in bytes
  * @return true on success
@@ -167,6 +559,9 @@ bool ykhmac_read_version(uint8_t version[3]);
 /**
  * @brief Performs a HMAC-SHA1 challenge-response exchange with the target
  * 
+ * If challenge points to FRAME_DATA, it is not copied. The response stays at FRAME_RESPONSE,
+ * pass FRAME_RESPONSE or nullptr as response to skip copying it.
+ * 
  * @param slot Which slot to use, either SLOT_1 or SLOT_2
  * @param challenge Input buffer, contains challenge
  * @param challenge_length Size of the input buffer in bytes, max. ARG_BUF_SIZE_MAX
@@ -177,41 +572,371 @@ bool ykhmac_exchange_hmac(const uint8_t slot, const uint8_t* challenge,
     const uint8_t challenge_length, uint8_t response[RESP_BUF_SIZE] = nullptr);
 
 /**
- * @brief Tests both slots of the target for valid configurations
+ * @brief Finds the challenge-response slots of the target from a single status request
+ * 
+ * Configured slots which are not triggered by touch are reported as challenge-response slots.
+ * If the status response does not tell (firmware before 2.2, a short response, or no slot
+ * reported as configured, e.g. by other applets), both slots are probed, see ykhmac_probe_slots.
  * 
  * @return SLOT_1 | SLOT_2
  */
 uint8_t ykhmac_find_slots();
 
 /**
- * @brief Enrolls a secret key into encrypted persistent memory
+ * @brief Tests both slots of the target by a HMAC challenge-response exchange each
  * 
- * @param secret_key The secret key to be enrolled
- * @return true on success
+ * Slower than ykhmac_find_slots, but tells HMAC-SHA1 slots apart from Yubico OTP challenge-response slots.
+ * 
+ * @return SLOT_1 | SLOT_2
  */
-bool ykhmac_enroll_key(uint8_t secret_key[SECRET_KEY_SIZE]);
+uint8_t ykhmac_probe_slots();
+
+#ifdef YKHMAC_TOKEN_CACHE
+    /**
+     * @brief Returns serial number, firmware version and configured slots of the selected target
+     * 
+     * Unknown tokens are queried using a status request, which also tells the slots (see ykhmac_find_slots),
+     * and ykhmac_read_serial, which costs two APDUs. Known tokens are only
+     * validated by a status request: if firmware version or program sequence differ from the
+     * cached ones, the token has been swapped or reconfigured and is queried again. The applet
+     * has to be selected beforehand.
+     * 
+     * @param uid UID of the target, as reported by the NFC controller
+     * @param uid_length Size of the UID in bytes, UIDs longer than CACHE_UID_SIZE are not cached
+     * @param info Output, the properties of the target
+     * @return true on success
+     */
+    bool ykhmac_token_info(const uint8_t* uid, const uint8_t uid_length, struct ykhmac_token_info* info);
+
+    /**
+     * @brief Removes a token from the session cache, e.g. after its slots have been reconfigured
+     * 
+     * @param uid UID of the target
+     * @param uid_length Size of the UID in bytes
+     */
+    void ykhmac_token_forget(const uint8_t* uid, const uint8_t uid_length);
+
+    /**
+     * @brief Removes all tokens from the session cache
+     */
+    void ykhmac_token_cache_clear();
+#endif
+
+#ifdef YKHMAC_TOKEN_TABLE
+    /**
+     * @brief Enrolls the secret key of a token into the token table
+     * 
+     * Replaces a previous enrollment of the same token.
+     * 
+     * @param serial The serial number of the token, see ykhmac_read_serial
+     * @param secret_key The secret key to be enrolled
+     * @return true on success, false if the table is full
+     */
+    bool ykhmac_table_enroll(const uint32_t serial, uint8_t secret_key[SECRET_KEY_SIZE]);
+
+    /**
+     * @brief Reads the serial number of the target, and authenticates it against its stored secret key
+     * 
+     * In addition, this function will advance the stored secret key of the token.
+     * See ykhmac_authenticate for the behavior if YKHMAC_WRITE_BEHIND is defined.
+     * 
+     * @param slot Which slot to use, either SLOT_1 or SLOT_2
+     * @param serial Output, serial number of the target. May be nullptr
+     * @return true on successful authentication
+     */
+    bool ykhmac_table_authenticate(const uint8_t slot, uint32_t* serial = nullptr);
+
+    /**
+     * @brief Removes a token from the token table
+     * 
+     * @param serial The serial number of the token
+     * @return true if the token was enrolled and has been removed
+     */
+    bool ykhmac_table_revoke(const uint32_t serial);
+
+    /**
+     * @brief Removes all tokens from the token table
+     * 
+     * Has to be called once to initialize storage which is not blank (0xFF).
+     * 
+     * @return true on success
+     */
+    bool ykhmac_table_clear();
+#else
+    /**
+     * @brief Enrolls a secret key into encrypted persistent memory
+     * 
+     * @param secret_key The secret key to be enrolled
+     * @return true on success
+     */
+    bool ykhmac_enroll_key(uint8_t secret_key[SECRET_KEY_SIZE]);
+
+    /**
+     * @brief tries to authenticate a target against the stored secret key
+     * 
+     * In addition, this function will advance the stored secret key.
+     * If YKHMAC_WRITE_BEHIND is defined, the new enrollment record is only kept in RAM
+     * and has to be written using ykhmac_commit. If YKHMAC_PRECOMPUTE is defined, the
+     * used record is only marked by a single byte, see ykhmac_replenish.
+     * 
+     * @param slot Which slot to use, either SLOT_1 or SLOT_2
+     * 
+     * @return true on successful authentication
+     */
+    bool ykhmac_authenticate(const uint8_t slot);
+#endif
+
+#ifdef YKHMAC_NONBLOCKING
+    /**
+     * @brief Starts a resumable authentication, see ykhmac_authenticate
+     * 
+     * Only sends the first command, call ykhmac_authenticate_step until it returns something
+     * other than YKHMAC_PENDING. The new enrollment record is written behind, see ykhmac_commit.
+     * 
+     * @param slot Which slot to use, either SLOT_1 or SLOT_2
+     * @param aid The AID of the applet to select first, or nullptr if it has been selected already
+     * @param aid_size The length of the AID in bytes, max. ARG_BUF_SIZE_MAX
+     * @return true if the authentication is in progress
+     */
+    bool ykhmac_authenticate_start(const uint8_t slot, const uint8_t* aid = nullptr, const uint8_t aid_size = 0);
+
+    /**
+     * @brief Advances a resumable authentication
+     * 
+     * Each call either polls the transport, or performs one of the computations,
+     * so that the caller can do other work in between.
+     * 
+     * @return YKHMAC_DONE on successful authentication, YKHMAC_FAILED if it has failed
+     *         or none is in progress, YKHMAC_PENDING otherwise
+     */
+    ykhmac_status ykhmac_authenticate_step();
+#endif
+
+#ifdef YKHMAC_WRITE_BEHIND
+    /**
+     * @brief Writes a pending enrollment record from a previous authentication to persistent memory
+     * 
+     * Should be called from the main loop after ykhmac_authenticate, it is also called
+     * by ykhmac_authenticate itself before loading the stored record.
+     * 
+     * @return true if there was no pending record, or if it was written successfully
+     */
+    bool ykhmac_commit();
+
+    /**
+     * @brief Checks whether an enrollment record is waiting to be written
+     * 
+     * @return true if ykhmac_commit has work to do
+     */
+    bool ykhmac_commit_pending();
+#endif
+
+#ifdef YKHMAC_PRECOMPUTE
+    /**
+     * @brief Appends a precomputed enrollment record to the ring
+     * 
+     * Once at most PRECOMPUTE_LOW unused records are left, the secret key is kept in RAM after
+     * ykhmac_authenticate, until the ring has been filled again. Should be called from the main
+     * loop while the reader is idle, each call writes one record.
+     * 
+     * @return true if there was nothing to do, or if the record was written successfully
+     */
+    bool ykhmac_replenish();
+
+    /**
+     * @brief Checks whether the secret key is kept to replenish the ring
+     * 
+     * @return true if ykhmac_replenish has work to do
+     */
+    bool ykhmac_replenish_pending();
+
+    /**
+     * @brief Returns the amount of unused precomputed records
+     * 
+     * @return The amount of records, at most RECORD_COUNT
+     */
+    uint8_t ykhmac_records_available();
+#endif
 
 /**
- * @brief tries to authenticate a target against the stored secret key
+ * @brief Computes a HMAC-SHA1 response using a secret key and challenge
  * 
- * In addition, this function will advance the stored secret key.
+ * @param key Secret key buffer, size must be at least SECRET_KEY_SIZE
+ * @param challenge Input buffer, contains challenge
+ * @param challenge_length Size of the input buffer in bytes, max. ARG_BUF_SIZE_MAX
+ * @param response Output buffer, contains response. Must be at least RESP_BUF_SIZE
+ * @return true on success
+ */
+bool ykhmac_compute_hmac(const uint8_t* key, const uint8_t* challenge, 
+    const uint8_t challenge_length, uint8_t response[RESP_BUF_SIZE]);
+
+/**
+ * @brief A HMAC-SHA1 computation of a batch, see ykhmac_compute_hmac_batch
+ */
+struct ykhmac_hmac_job
+{
+    const uint8_t* key;         //!< Secret key buffer, size must be at least SECRET_KEY_SIZE
+    const uint8_t* challenge;   //!< Input buffer, contains challenge
+    uint8_t challenge_length;   //!< Size of the input buffer in bytes
+    uint8_t* response;          //!< Output buffer, contains response. Must be at least RESP_BUF_SIZE
+};
+
+/**
+ * @brief Computes the HMAC-SHA1 responses of many independent jobs, e.g. to verify a log
  * 
- * @param slot Which slot to use, either SLOT_1 or SLOT_2
+ * On x86-64 hosts, the jobs are hashed in parallel SIMD lanes (AVX-512, AVX2 or SSE2),
+ * otherwise one after the other. The responses are identical to those of ykhmac_compute_hmac.
  * 
- * @return true on successful authentication
+ * @param jobs The jobs
+ * @param count Amount of jobs
+ * @return true on success
  */
-bool ykhmac_authenticate(const uint8_t slot);
+bool ykhmac_compute_hmac_batch(struct ykhmac_hmac_job* jobs, const size_t count);
 
 /**
- * @brief Computes a HMAC-SHA1 response using a secret key and challenge
+ * @brief Precomputes the inner and outer SHA1 midstates of a secret key
  * 
+ * @param ctx The context to initialize
  * @param key Secret key buffer, size must be at least SECRET_KEY_SIZE
+ */
+void ykhmac_hmac_init(struct ykhmac_hmac_ctx* ctx, const uint8_t* key);
+
+/**
+ * @brief Computes a HMAC-SHA1 response using a precomputed key context and challenge
+ * 
+ * The context is not modified and can be reused for further challenges.
+ * 
+ * @param ctx Context of the secret key, see ykhmac_hmac_init
  * @param challenge Input buffer, contains challenge
  * @param challenge_length Size of the input buffer in bytes, max. ARG_BUF_SIZE_MAX
  * @param response Output buffer, contains response. Must be at least RESP_BUF_SIZE
  * @return true on success
  */
-bool ykhmac_compute_hmac(const uint8_t* key, const uint8_t* challenge, 
+bool ykhmac_hmac_compute(const struct ykhmac_hmac_ctx* ctx, const uint8_t* challenge,
     const uint8_t challenge_length, uint8_t response[RESP_BUF_SIZE]);
 
+/**
+ * @brief Purges a key context from RAM
+ * 
+ * @param ctx The context to purge
+ */
+void ykhmac_hmac_purge(struct ykhmac_hmac_ctx* ctx);
+
+#if defined(YKHMAC_METRICS) || defined(YKHMAC_TRACE) || defined(YKHMAC_RETRY)
+    /**
+     * @brief Prototype declaration of the clock of the per-phase instrumentation, the trace buffer and the retries
+     * 
+     * Any monotonic clock will do, e.g. micros() on Arduino. Only differences of
+     * timestamps are used, so the clock may wrap around.
+     * 
+     * @return The current time in clock ticks
+     */
+    extern uint32_t ykhmac_clock();
+#endif
+
+#ifdef YKHMAC_METRICS
+
+    /**
+     * @brief Records the duration of a phase in its histogram
+     * 
+     * Called by the engine at the end of each phase. Thread-safe on native builds,
+     * must not be called from an interrupt on microcontrollers.
+     * 
+     * @param phase The phase
+     * @param duration Duration in clock ticks
+     */
+    void ykhmac_metrics_record(const ykhmac_phase phase, const uint32_t duration);
+
+    /**
+     * @brief Copies the histogram of a phase
+     * 
+     * @param phase The phase
+     * @param histogram Output, the histogram
+     * @return true if the phase is valid
+     */
+    bool ykhmac_metrics_get(const ykhmac_phase phase, struct ykhmac_histogram* histogram);
+
+    /**
+     * @brief Clears all histograms
+     */
+    void ykhmac_metrics_reset();
+
+    #ifndef ARDUINO
+        /**
+         * @brief Writes all histograms as a metrics text page (Prometheus exposition format)
+         * 
+         * Durations are exported in seconds, the bucket boundaries are powers of two clock ticks.
+         * 
+         * @param buffer Output buffer, zero-terminated like snprintf
+         * @param size Size of the output buffer in bytes
+         * @param clock_hz Frequency of ykhmac_clock in Hz
+         * @return The length of the complete page, larger than size - 1 if it was truncated
+         */
+        size_t ykhmac_metrics_export(char* buffer, const size_t size, const uint32_t clock_hz);
+    #endif
+#endif
+
+#ifdef YKHMAC_RETRY
+    /**
+     * @brief Increments a retry counter, called by the engine for each failed or retried APDU
+     * 
+     * Thread-safe on native builds, must not be called from an interrupt on microcontrollers.
+     * 
+     * @param counter The counter
+     */
+    void ykhmac_retry_record(const ykhmac_retry_counter counter);
+
+    /**
+     * @brief Returns a retry counter
+     * 
+     * @param counter The counter
+     * @return Its value, 0 if the counter is not valid
+     */
+    uint32_t ykhmac_retry_count(const ykhmac_retry_counter counter);
+
+    /**
+     * @brief Clears all retry counters
+     */
+    void ykhmac_retry_reset();
+#endif
+
+#ifdef YKHMAC_STACK
+    /**
+     * @brief Paints the free stack below the caller, called on entry of each measured function
+     * 
+     * Paints STACK_PAINT_SIZE bytes, starting STACK_MARGIN bytes below the stack pointer.
+     * Measured functions must not be called from an interrupt or from several threads at once.
+     * 
+     * @return The top of the painted area
+     */
+    uint8_t* ykhmac_stack_paint();
+
+    /**
+     * @brief Finds the deepest overwritten byte of the painted area, and raises the high-water mark of an entry point
+     * 
+     * @param entry The entry point
+     * @param top The top of the painted area, see ykhmac_stack_paint
+     */
+    void ykhmac_stack_record(const ykhmac_entry entry, const uint8_t* top);
+
+    /**
+     * @brief Returns the high-water mark of an entry point
+     * 
+     * Includes everything below the entry point: the library, the crypto libraries, the
+     * hooks and any interrupt which occurred meanwhile. Saturates at STACK_PAINT_SIZE + STACK_MARGIN.
+     * 
+     * @param entry The entry point
+     * @return The deepest stack usage of any call so far in bytes, 0 if it has not been called
+     */
+    uint16_t ykhmac_stack_peak(const ykhmac_entry entry);
+
+    /**
+     * @brief Clears all high-water marks
+     */
+    void ykhmac_stack_reset();
+#endif
+
+// Header-only engine, which the functions above wrap
+#include "ykhmac_engine.h"
+
 #endif
\ No newline at end of file
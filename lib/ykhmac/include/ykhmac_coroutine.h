@@ -0,0 +1,137 @@
+/**
+ * @file ykhmac_coroutine.h
+ * @author Christoph Honal
+ * @brief Defines C++20 coroutine wrappers of the resumable authentication, for native builds
+ * @version 0.1
+ * @date 2021-12-17
+ */
+
+#ifndef YKHMAC_COROUTINE_H
+#define YKHMAC_COROUTINE_H
+
+#include "ykhmac.h"
+
+#if __cplusplus >= 202002L && __has_include(<coroutine>)
+
+#include <coroutine>
+#include <exception>
+
+
+namespace ykhmac
+{
+    /**
+     * @brief Coroutine of an operation, driven by a cooperative loop
+     *
+     * The coroutine runs until it has to wait for the first time, each call of poll
+     * resumes it until it has to wait again.
+     */
+    class Operation
+    {
+        public:
+            /**
+             * @brief Promise type of the coroutine, holds its result
+             */
+            struct promise_type
+            {
+                bool result = false; //!< Result of the operation
+
+                Operation get_return_object()
+                {
+                    return Operation(std::coroutine_handle<promise_type>::from_promise(*this));
+                }
+                std::suspend_never initial_suspend() noexcept { return {}; }
+                std::suspend_always final_suspend() noexcept { return {}; }
+                void return_value(const bool value) { result = value; }
+                void unhandled_exception() { std::terminate(); }
+            };
+
+            Operation(Operation&& other) noexcept : handle(other.handle) { other.handle = nullptr; }
+            Operation(const Operation&) = delete;
+            Operation& operator=(const Operation&) = delete;
+            ~Operation()
+            {
+                if (handle) handle.destroy();
+            }
+
+            /**
+             * @brief Resumes the operation, unless it has finished
+             *
+             * @return true if the operation has finished
+             */
+            bool poll()
+            {
+                if (!handle.done()) handle.resume();
+                return handle.done();
+            }
+
+            /**
+             * @brief Checks whether the operation has finished
+             *
+             * @return true if the operation has finished
+             */
+            bool done() const
+            {
+                return handle.done();
+            }
+
+            /**
+             * @brief Returns the result of a finished operation
+             *
+             * @return true on success
+             */
+            bool result() const
+            {
+                return handle.promise().result;
+            }
+
+        private:
+            explicit Operation(std::coroutine_handle<promise_type> handle) : handle(handle) { }
+
+            std::coroutine_handle<promise_type> handle; //!< The coroutine
+    };
+
+    /**
+     * @brief Authenticates a target using the resumable authentication of an engine
+     *
+     * Waits whenever a step of the authentication is pending.
+     *
+     * @tparam Engine Engine type, see ykhmac::Engine
+     * @param engine The engine, must outlive the operation
+     * @param slot Which slot to use, either SLOT_1 or SLOT_2
+     * @param aid The AID of the applet to select first, or nullptr if it has been selected already
+     * @param aid_size The length of the AID in bytes
+     * @return The operation, its result is true on successful authentication
+     */
+    template<class Engine> Operation authenticate(Engine& engine, const uint8_t slot,
+        const uint8_t* aid = nullptr, const uint8_t aid_size = 0)
+    {
+        if (!engine.authenticate_start(slot, aid, aid_size)) co_return false;
+
+        ykhmac_status status;
+        while ((status = engine.authenticate_step()) == YKHMAC_PENDING) co_await std::suspend_always();
+        co_return status == YKHMAC_DONE;
+    }
+
+    #ifdef YKHMAC_NONBLOCKING
+        /**
+         * @brief Authenticates a target using ykhmac_authenticate_start and ykhmac_authenticate_step
+         *
+         * @param slot Which slot to use, either SLOT_1 or SLOT_2
+         * @param aid The AID of the applet to select first, or nullptr if it has been selected already
+         * @param aid_size The length of the AID in bytes, max. ARG_BUF_SIZE_MAX
+         * @return The operation, its result is true on successful authentication
+         */
+        inline Operation authenticate(const uint8_t slot, const uint8_t* aid = nullptr, const uint8_t aid_size = 0)
+        {
+            if (!ykhmac_authenticate_start(slot, aid, aid_size)) co_return false;
+
+            ykhmac_status status;
+            while ((status = ykhmac_authenticate_step()) == YKHMAC_PENDING) co_await std::suspend_always();
+            co_return status == YKHMAC_DONE;
+        }
+    #endif
+}
+
+#endif
+
+#endif
@@ -0,0 +1,582 @@
+/**
+ * @file ykhmac_crypto.h
+ * @author Christoph Honal
+ * @brief Defines the crypto backends of the engine: HMAC-SHA1 and AES-128-CBC
+ * @version 0.1
+ * @date 2021-12-17
+ */
+
+// Included ahead of the guard, ykhmac.h includes the engine which depends on this file
+#include "ykhmac.h"
+
+#ifndef YKHMAC_CRYPTO_H
+#define YKHMAC_CRYPTO_H
+
+#include <stdio.h>
+#include <string.h>
+
+// Native x86-64 builds dispatch to SHA-NI and AES-NI at runtime, unless YKHMAC_CRYPTO_PORTABLE is defined
+#if defined(__x86_64__) && !defined(ARDUINO) && !defined(YKHMAC_CRYPTO_PORTABLE)
+    #define YKHMAC_CRYPTO_X86
+#endif
+#if defined(YKHMAC_AES_COMPACT) && AES_KEYLEN != 16
+    #error "YKHMAC_AES_COMPACT requires AES-128"
+#endif
+
+
+/**
+ * @brief Work area of the compact AES-128, which expands the round keys on the fly
+ */
+struct ykhmac_aes_compact_ctx
+{
+    uint8_t round_key[AES_BLOCKLEN];        //!< Round key of the current round
+    uint8_t decrypt_key[AES_BLOCKLEN];      //!< Last round key, where the decryption of each block starts
+};
+
+/**
+ * @brief Work area of any AES-128-CBC backend
+ */
+union ykhmac_aes_work
+{
+    struct AES_ctx tiny;                    //!< tiny-AES-c: expanded key and IV
+    struct ykhmac_aes_compact_ctx compact;  //!< Compact AES: current and last round key
+    uint8_t round_keys[AES_keyExpSize];     //!< AES-NI: round keys of the equivalent inverse cipher
+};
+
+/**
+ * @brief Work area of the word-wise SHA1, see ykhmac::FixedHmacCrypto
+ */
+struct ykhmac_sha1_work
+{
+    uint32_t state[5];                      //!< State words of the current hash
+    uint32_t block[HMAC_BLOCK_SIZE / 4];    //!< Message words of the current block
+};
+
+/**
+ * @brief Work area of any HMAC-SHA1 backend
+ */
+union ykhmac_hash_work
+{
+    struct sha1_hasher_s hasher;            //!< cryptosuite2: hasher of the current hash
+    struct ykhmac_sha1_work words;          //!< Word-wise SHA1: state and block of the current hash
+};
+
+/**
+ * @brief Encrypts a buffer in place using the compact AES-128-CBC, see ykhmac::PortableCrypto::cbc_encrypt
+ *
+ * Computes each round key from the previous one, so that only a single round key is held in RAM.
+ *
+ * @param work Work area
+ * @param key The key, AES_KEYLEN bytes
+ * @param iv The IV, AES_BLOCKLEN bytes
+ * @param data The buffer
+ * @param size Size of the buffer in bytes, a multiple of AES_BLOCKLEN
+ */
+void ykhmac_aes_compact_encrypt(struct ykhmac_aes_compact_ctx* work, const uint8_t* key, const uint8_t* iv,
+    uint8_t* data, const uint8_t size);
+
+/**
+ * @brief Decrypts a buffer in place using the compact AES-128-CBC, see ykhmac::PortableCrypto::cbc_decrypt
+ *
+ * Runs the key schedule forward to the last round key once, and then backwards through the
+ * rounds of each block. The blocks are decrypted from the last to the first one, so that no
+ * copy of the previous ciphertext block is needed.
+ *
+ * @param work Work area
+ * @param key The key, AES_KEYLEN bytes
+ * @param iv The IV, AES_BLOCKLEN bytes
+ * @param data The buffer
+ * @param size Size of the buffer in bytes, a multiple of AES_BLOCKLEN
+ */
+void ykhmac_aes_compact_decrypt(struct ykhmac_aes_compact_ctx* work, const uint8_t* key, const uint8_t* iv,
+    uint8_t* data, const uint8_t size);
+
+/**
+ * @brief Runs the key schedule of the compact AES-128 forward to the last round key, see ykhmac::PortableCrypto::cbc_decrypt_expand
+ *
+ * @param work Work area
+ * @param key The key, AES_KEYLEN bytes
+ */
+void ykhmac_aes_compact_decrypt_expand(struct ykhmac_aes_compact_ctx* work, const uint8_t* key);
+
+/**
+ * @brief Decrypts a buffer in place using the compact AES-128-CBC and the last round key in the work area
+ *
+ * @param work Work area, prepared by ykhmac_aes_compact_decrypt_expand
+ * @param iv The IV, AES_BLOCKLEN bytes
+ * @param data The buffer
+ * @param size Size of the buffer in bytes, a multiple of AES_BLOCKLEN
+ */
+void ykhmac_aes_compact_decrypt_expanded(struct ykhmac_aes_compact_ctx* work, const uint8_t* iv,
+    uint8_t* data, const uint8_t size);
+
+/**
+ * @brief Compresses one block into a SHA1 state, see ykhmac::FixedHmacCrypto
+ *
+ * Rotates the names of the working variables every five rounds instead of moving their values,
+ * and keeps the message schedule in the 16 words of the block.
+ *
+ * @param state The state words
+ * @param block The message words in host byte order, overwritten by the message schedule
+ */
+void ykhmac_sha1_compress(uint32_t state[5], uint32_t block[HMAC_BLOCK_SIZE / 4]);
+
+
+/**
+ * @brief HMAC-SHA1 implementation, see ykhmac::PortableCrypto for the semantics
+ */
+struct ykhmac_hmac_backend
+{
+    const char* name;                       //!< Name of the implementation
+    bool (*supported)();                    //!< Checks whether the CPU supports the implementation
+    void (*init)(struct ykhmac_hmac_ctx* ctx, const uint8_t* key, const uint8_t key_size, union ykhmac_hash_work* work);
+    bool (*compute)(const struct ykhmac_hmac_ctx* ctx, const uint8_t* message, const uint8_t length,
+        uint8_t* digest, const uint8_t digest_size, union ykhmac_hash_work* work);
+};
+
+/**
+ * @brief AES-128-CBC implementation, see ykhmac::PortableCrypto for the semantics
+ */
+struct ykhmac_aes_backend
+{
+    const char* name;                       //!< Name of the implementation
+    bool (*supported)();                    //!< Checks whether the CPU supports the implementation
+    void (*encrypt)(union ykhmac_aes_work* work, const uint8_t* key, const uint8_t* iv, uint8_t* data, const uint8_t size);
+    void (*decrypt)(union ykhmac_aes_work* work, const uint8_t* key, const uint8_t* iv, uint8_t* data, const uint8_t size);
+    void (*decrypt_expand)(union ykhmac_aes_work* work, const uint8_t* key);
+    void (*decrypt_expanded)(union ykhmac_aes_work* work, const uint8_t* iv, uint8_t* data, const uint8_t size);
+};
+
+extern const struct ykhmac_hmac_backend ykhmac_hmac_portable;   //!< HMAC-SHA1 using cryptosuite2
+extern const struct ykhmac_hmac_backend ykhmac_hmac_fixed;      //!< HMAC-SHA1 specialized for CHALLENGE_SIZE
+extern const struct ykhmac_aes_backend ykhmac_aes_portable;     //!< AES-128-CBC using tiny-AES-c
+#if AES_KEYLEN == 16
+    extern const struct ykhmac_aes_backend ykhmac_aes_compact;  //!< AES-128-CBC expanding the round keys on the fly
+#endif
+
+#ifdef YKHMAC_CRYPTO_X86
+    /**
+     * @brief CPU features used by the x86-64 backends
+     */
+    enum ykhmac_cpu_feature : uint8_t
+    {
+        YKHMAC_CPU_SHA      = 0x01, //!< SHA extensions, with SSSE3 and SSE4.1
+        YKHMAC_CPU_AES      = 0x02, //!< AES-NI
+        YKHMAC_CPU_AVX2     = 0x04, //!< AVX2, enabled by the OS
+        YKHMAC_CPU_AVX512   = 0x08  //!< AVX-512F, enabled by the OS
+    };
+
+    /**
+     * @brief Detects the CPU features once using CPUID
+     *
+     * @return The supported features, see ykhmac_cpu_feature
+     */
+    uint8_t ykhmac_cpu_features();
+
+    extern const struct ykhmac_hmac_backend ykhmac_hmac_shani;  //!< HMAC-SHA1 using the SHA extensions
+    extern const struct ykhmac_aes_backend ykhmac_aes_aesni;    //!< AES-128-CBC using AES-NI
+
+    /**
+     * @brief Returns the HMAC-SHA1 backend in use, the fastest one supported by the CPU unless selected
+     *
+     * @return The backend
+     */
+    const struct ykhmac_hmac_backend* ykhmac_crypto_hmac();
+
+    /**
+     * @brief Returns the AES-128-CBC backend in use, the fastest one supported by the CPU unless selected
+     *
+     * @return The backend
+     */
+    const struct ykhmac_aes_backend* ykhmac_crypto_aes();
+
+    /**
+     * @brief Overrides the backends in use, e.g. for testing. Not thread-safe
+     *
+     * @param hmac The HMAC-SHA1 backend, or nullptr to detect it
+     * @param aes The AES-128-CBC backend, or nullptr to detect it
+     */
+    void ykhmac_crypto_select(const struct ykhmac_hmac_backend* hmac, const struct ykhmac_aes_backend* aes);
+
+    /**
+     * @brief Batch HMAC-SHA1 implementation, see ykhmac_compute_hmac_batch
+     */
+    struct ykhmac_hmac_batch_backend
+    {
+        const char* name;                   //!< Name of the implementation
+        bool (*supported)();                //!< Checks whether the CPU supports the implementation
+        bool (*compute)(struct ykhmac_hmac_job* jobs, const size_t count);
+    };
+
+    extern const struct ykhmac_hmac_batch_backend ykhmac_hmac_batch_scalar; //!< One job after the other, using ykhmac_compute_hmac
+    extern const struct ykhmac_hmac_batch_backend ykhmac_hmac_batch_sse2;   //!< 4 lanes using SSE2
+    extern const struct ykhmac_hmac_batch_backend ykhmac_hmac_batch_avx2;   //!< 8 lanes using AVX2
+    extern const struct ykhmac_hmac_batch_backend ykhmac_hmac_batch_avx512; //!< 16 lanes using AVX-512F
+
+    /**
+     * @brief Returns the fastest batch HMAC-SHA1 backend supported by the CPU, scalar if SHA-NI beats SSE2
+     *
+     * @return The backend
+     */
+    const struct ykhmac_hmac_batch_backend* ykhmac_crypto_hmac_batch();
+#endif
+
+namespace ykhmac
+{
+    /**
+     * @brief Crypto policy using cryptosuite2 and tiny-AES-c, available on all platforms
+     *
+     * Custom crypto policies have to provide the same members. The work areas are part
+     * of the scratch arena, which the engine purges after each operation.
+     */
+    struct PortableCrypto
+    {
+        typedef struct AES_ctx AesWork;     //!< Work area of the AES phase
+        typedef struct sha1_hasher_s HashWork; //!< Work area of the HMAC phase
+
+        /**
+         * @brief Computes the HMAC-SHA1 context of a key
+         *
+         * @param ctx Output, the context
+         * @param key The key
+         * @param key_size Size of the key in bytes, max. HMAC_BLOCK_SIZE
+         * @param work Work area
+         */
+        static void hmac_init(struct ykhmac_hmac_ctx* ctx, const uint8_t* key, const uint8_t key_size,
+            struct sha1_hasher_s* work)
+        {
+            hmac_init_pad(ctx->state[0], key, key_size, HMAC_IPAD, work);
+            hmac_init_pad(ctx->state[1], key, key_size, HMAC_OPAD, work);
+
+            // Purge hasher RAM
+            memset(work, 0, sizeof(struct sha1_hasher_s));
+        }
+
+        /**
+         * @brief Computes a HMAC-SHA1 digest using a precomputed key context
+         *
+         * @param ctx The context of the key, see hmac_init
+         * @param message Input buffer, contains the message
+         * @param length Size of the message in bytes
+         * @param digest Output buffer, contains the truncated digest
+         * @param digest_size Size of the output buffer in bytes, max. HMAC_HASH_SIZE
+         * @param work Work area
+         * @return true on success
+         */
+        static bool hmac_compute(const struct ykhmac_hmac_ctx* ctx, const uint8_t* message, const uint8_t length,
+            uint8_t* digest, const uint8_t digest_size, struct sha1_hasher_s* work)
+        {
+            bool result = false;
+
+            // Resume from inner midstate, hash message
+            hmac_resume(work, ctx->state[0]);
+            uint8_t i = 0;
+            for (; i < length; i++)
+            {
+                if (sha1_hasher_putc(work, message[i]) == EOF) break;
+            }
+
+            if (i == length)
+            {
+                uint8_t inner_hash[HMAC_HASH_SIZE];
+                memcpy(inner_hash, sha1_hasher_gethash(work), HMAC_HASH_SIZE);
+
+                // Resume from outer midstate, hash inner hash
+                hmac_resume(work, ctx->state[1]);
+                for (i = 0; i < HMAC_HASH_SIZE; i++)
+                {
+                    sha1_hasher_putc(work, inner_hash[i]);
+                }
+                memset(inner_hash, 0, HMAC_HASH_SIZE);
+
+                // Compute and return hash
+                memcpy(digest, sha1_hasher_gethash(work), digest_size);
+                result = true;
+            }
+
+            // Purge hasher RAM
+            memset(work, 0, sizeof(struct sha1_hasher_s));
+
+            return result;
+        }
+
+        /**
+         * @brief Encrypts a buffer in place using AES-128-CBC
+         *
+         * @param work Work area
+         * @param key The key, AES_KEYLEN bytes
+         * @param iv The IV, AES_BLOCKLEN bytes
+         * @param data The buffer
+         * @param size Size of the buffer in bytes, a multiple of AES_BLOCKLEN
+         */
+        static void cbc_encrypt(struct AES_ctx* work, const uint8_t* key, const uint8_t* iv,
+            uint8_t* data, const uint8_t size)
+        {
+            AES_init_ctx_iv(work, key, iv);
+            AES_CBC_encrypt_buffer(work, data, size);
+        }
+
+        /**
+         * @brief Decrypts a buffer in place using AES-128-CBC
+         *
+         * @param work Work area
+         * @param key The key, AES_KEYLEN bytes
+         * @param iv The IV, AES_BLOCKLEN bytes
+         * @param data The buffer
+         * @param size Size of the buffer in bytes, a multiple of AES_BLOCKLEN
+         */
+        static void cbc_decrypt(struct AES_ctx* work, const uint8_t* key, const uint8_t* iv,
+            uint8_t* data, const uint8_t size)
+        {
+            cbc_decrypt_expand(work, key);
+            cbc_decrypt_expanded(work, iv, data, size);
+        }
+
+        /**
+         * @brief Expands the key for one or more cbc_decrypt_expanded calls
+         *
+         * @param work Work area, holds the expanded key
+         * @param key The key, AES_KEYLEN bytes
+         */
+        static void cbc_decrypt_expand(struct AES_ctx* work, const uint8_t* key)
+        {
+            AES_init_ctx(work, key);
+        }
+
+        /**
+         * @brief Decrypts a buffer in place using AES-128-CBC and the key expanded by cbc_decrypt_expand
+         *
+         * @param work Work area, holds the expanded key
+         * @param iv The IV, AES_BLOCKLEN bytes
+         * @param data The buffer
+         * @param size Size of the buffer in bytes, a multiple of AES_BLOCKLEN
+         */
+        static void cbc_decrypt_expanded(struct AES_ctx* work, const uint8_t* iv, uint8_t* data, const uint8_t size)
+        {
+            AES_ctx_set_iv(work, iv);
+            AES_CBC_decrypt_buffer(work, data, size);
+        }
+
+        private:
+            // Absorbs one padded key block into a fresh hasher, and keeps its state words
+            static void hmac_init_pad(uint32_t state[5], const uint8_t* key, const uint8_t key_size,
+                const uint8_t pad, struct sha1_hasher_s* hasher)
+            {
+                sha1_hasher_init(hasher);
+                for (uint8_t i = 0; i < HMAC_BLOCK_SIZE; i++)
+                {
+                    sha1_hasher_putc(hasher, (i < key_size) ? (key[i] ^ pad) : pad);
+                }
+                memcpy(state, hasher->state.w, sizeof(hasher->state.w));
+            }
+
+            // Restores a hasher which has absorbed exactly one block from its state words
+            static void hmac_resume(struct sha1_hasher_s* hasher, const uint32_t state[5])
+            {
+                memcpy(hasher->state.w, state, sizeof(hasher->state.w));
+                hasher->byteCount = HMAC_BLOCK_SIZE;
+                hasher->bufferOffset = 0;
+            }
+    };
+
+    #if AES_KEYLEN == 16
+        /**
+         * @brief Crypto policy using cryptosuite2 and the compact AES-128, see ykhmac_aes_compact_encrypt
+         */
+        struct CompactCrypto : PortableCrypto
+        {
+            typedef struct ykhmac_aes_compact_ctx AesWork; //!< Work area of the AES phase
+
+            static void cbc_encrypt(struct ykhmac_aes_compact_ctx* work, const uint8_t* key, const uint8_t* iv,
+                uint8_t* data, const uint8_t size)
+            {
+                ykhmac_aes_compact_encrypt(work, key, iv, data, size);
+            }
+
+            static void cbc_decrypt(struct ykhmac_aes_compact_ctx* work, const uint8_t* key, const uint8_t* iv,
+                uint8_t* data, const uint8_t size)
+            {
+                ykhmac_aes_compact_decrypt(work, key, iv, data, size);
+            }
+
+            static void cbc_decrypt_expand(struct ykhmac_aes_compact_ctx* work, const uint8_t* key)
+            {
+                ykhmac_aes_compact_decrypt_expand(work, key);
+            }
+
+            static void cbc_decrypt_expanded(struct ykhmac_aes_compact_ctx* work, const uint8_t* iv,
+                uint8_t* data, const uint8_t size)
+            {
+                ykhmac_aes_compact_decrypt_expanded(work, iv, data, size);
+            }
+        };
+    #endif
+
+    /**
+     * @brief Crypto policy computing HMAC-SHA1 word-wise, specialized for challenges of a fixed length
+     *
+     * The SHA1 padding of the inner hash and the whole last block of the outer hash are compile-time
+     * constants, the message is loaded a word at a time, and ykhmac_sha1_compress replaces the hasher
+     * of cryptosuite2. Messages of other lengths take the same path using padding computed at runtime.
+     * Its work area holds state words and a block instead of a hasher, AES-128-CBC is inherited from the base policy.
+     *
+     * @tparam Base Crypto policy providing AES-128-CBC
+     * @tparam Length Size of the challenges in bytes, at most HMAC_SINGLE_BLOCK_SIZE saves a SHA1 block
+     */
+    template<class Base, uint8_t Length = CHALLENGE_SIZE> struct FixedHmacCrypto : Base
+    {
+        static constexpr uint8_t inner_blocks = (Length + 9 + HMAC_BLOCK_SIZE - 1) / HMAC_BLOCK_SIZE; //!< Message blocks of the inner hash
+        static constexpr uint8_t pad_index = Length / 4;                                              //!< Message word holding the padding byte
+        static constexpr uint32_t pad_word = 0x80000000u >> (8 * (Length % 4));                       //!< Padding byte within its word
+        static constexpr uint32_t inner_bits = (HMAC_BLOCK_SIZE + Length) * 8u;                      //!< Length word of the inner hash
+        static constexpr uint32_t outer_bits = (HMAC_BLOCK_SIZE + HMAC_HASH_SIZE) * 8u;              //!< Length word of the outer hash
+
+        typedef struct ykhmac_sha1_work HashWork; //!< Work area of the HMAC phase
+
+        static void hmac_init(struct ykhmac_hmac_ctx* ctx, const uint8_t* key, const uint8_t key_size,
+            struct ykhmac_sha1_work* work)
+        {
+            init_pad(ctx->state[0], work->block, key, key_size, HMAC_IPAD);
+            init_pad(ctx->state[1], work->block, key, key_size, HMAC_OPAD);
+            memset(work, 0, sizeof(struct ykhmac_sha1_work));
+        }
+
+        static bool hmac_compute(const struct ykhmac_hmac_ctx* ctx, const uint8_t* message, const uint8_t length,
+            uint8_t* digest, const uint8_t digest_size, struct ykhmac_sha1_work* work)
+        {
+            uint32_t* state = work->state;
+            uint32_t* block = work->block;
+
+            // Resume from inner midstate, hash message
+            memcpy(state, ctx->state[0], sizeof(work->state));
+            if (length == Length)
+            {
+                absorb(state, block, message, Length, inner_blocks, pad_index, pad_word, inner_bits);
+            }
+            else
+            {
+                absorb(state, block, message, length, (length + 9 + HMAC_BLOCK_SIZE - 1) / HMAC_BLOCK_SIZE,
+                    length / 4, 0x80000000u >> (8 * (length % 4)), (HMAC_BLOCK_SIZE + length) * 8u);
+            }
+
+            // Resume from outer midstate, hash inner hash, its padding is constant
+            memcpy(block, state, sizeof(work->state));
+            block[5] = 0x80000000u;
+            memset(&block[6], 0, 9 * sizeof(uint32_t));
+            block[15] = outer_bits;
+            memcpy(state, ctx->state[1], sizeof(work->state));
+            ykhmac_sha1_compress(state, block);
+
+            // Return truncated hash
+            for (uint8_t i = 0; i < digest_size; i++) digest[i] = (uint8_t)(state[i / 4] >> (24 - 8 * (i % 4)));
+            memset(work, 0, sizeof(struct ykhmac_sha1_work));
+
+            return true;
+        }
+
+        private:
+            // Loads a big-endian word of up to four bytes, the missing bytes are zero
+            static inline uint32_t load_word(const uint8_t* data, const uint8_t size)
+            {
+                uint32_t word = 0;
+                for (uint8_t i = 0; i < 4; i++) word |= (uint32_t)((i < size) ? data[i] : 0) << (24 - 8 * i);
+                return word;
+            }
+
+            // Absorbs one padded key block, starting from the initial state
+            static void init_pad(uint32_t state[5], uint32_t block[HMAC_BLOCK_SIZE / 4], const uint8_t* key,
+                const uint8_t key_size, const uint8_t pad)
+            {
+                const uint32_t pad_bytes = pad * 0x01010101u;
+                for (uint8_t i = 0; i < HMAC_BLOCK_SIZE / 4; i++)
+                {
+                    const uint8_t offset = i * 4;
+                    block[i] = pad_bytes ^ ((offset < key_size) ? load_word(key + offset, key_size - offset) : 0);
+                }
+                state[0] = 0x67452301;
+                state[1] = 0xEFCDAB89;
+                state[2] = 0x98BADCFE;
+                state[3] = 0x10325476;
+                state[4] = 0xC3D2E1F0;
+                ykhmac_sha1_compress(state, block);
+            }
+
+            // Absorbs the message and its padding, the fixed-length call folds the padding into constants
+            static inline __attribute__((always_inline)) void absorb(uint32_t state[5], uint32_t block[HMAC_BLOCK_SIZE / 4],
+                const uint8_t* message, const uint8_t length, const uint8_t blocks, const uint8_t pad_at,
+                const uint32_t pad, const uint32_t bits)
+            {
+                const uint8_t words = blocks * (HMAC_BLOCK_SIZE / 4);
+                for (uint8_t i = 0; i < words; i++)
+                {
+                    const uint16_t offset = i * 4;
+                    uint32_t word;
+                    if (i == words - 1) word = bits;
+                    else if (offset + 4 <= length) word = load_word(message + offset, 4);
+                    else if (i == pad_at) word = load_word(message + offset, length - offset) | pad;
+                    else word = 0;
+
+                    block[i % (HMAC_BLOCK_SIZE / 4)] = word;
+                    if (i % (HMAC_BLOCK_SIZE / 4) == HMAC_BLOCK_SIZE / 4 - 1) ykhmac_sha1_compress(state, block);
+                }
+            }
+    };
+
+    #ifdef YKHMAC_CRYPTO_X86
+        /**
+         * @brief Crypto policy dispatching to the backends in use, see ykhmac_crypto_select
+         */
+        struct DispatchCrypto
+        {
+            typedef union ykhmac_aes_work AesWork; //!< Work area of the AES phase, fits all backends
+            typedef union ykhmac_hash_work HashWork; //!< Work area of the HMAC phase, fits all backends
+
+            static void hmac_init(struct ykhmac_hmac_ctx* ctx, const uint8_t* key, const uint8_t key_size,
+                union ykhmac_hash_work* work)
+            {
+                ykhmac_crypto_hmac()->init(ctx, key, key_size, work);
+            }
+
+            static bool hmac_compute(const struct ykhmac_hmac_ctx* ctx, const uint8_t* message, const uint8_t length,
+                uint8_t* digest, const uint8_t digest_size, union ykhmac_hash_work* work)
+            {
+                return ykhmac_crypto_hmac()->compute(ctx, message, length, digest, digest_size, work);
+            }
+
+            static void cbc_encrypt(union ykhmac_aes_work* work, const uint8_t* key, const uint8_t* iv,
+                uint8_t* data, const uint8_t size)
+            {
+                ykhmac_crypto_aes()->encrypt(work, key, iv, data, size);
+            }
+
+            static void cbc_decrypt(union ykhmac_aes_work* work, const uint8_t* key, const uint8_t* iv,
+                uint8_t* data, const uint8_t size)
+            {
+                ykhmac_crypto_aes()->decrypt(work, key, iv, data, size);
+            }
+
+            static void cbc_decrypt_expand(union ykhmac_aes_work* work, const uint8_t* key)
+            {
+                ykhmac_crypto_aes()->decrypt_expand(work, key);
+            }
+
+            static void cbc_decrypt_expanded(union ykhmac_aes_work* work, const uint8_t* iv,
+                uint8_t* data, const uint8_t size)
+            {
+                ykhmac_crypto_aes()->decrypt_expanded(work, iv, data, size);
+            }
+        };
+
+        typedef DispatchCrypto DefaultCrypto;  //!< Crypto policy of the default configuration
+    #elif defined(YKHMAC_AES_COMPACT) && defined(YKHMAC_HMAC_FIXED)
+        typedef FixedHmacCrypto<CompactCrypto> DefaultCrypto; //!< Crypto policy of the default configuration
+    #elif defined(YKHMAC_AES_COMPACT)
+        typedef CompactCrypto DefaultCrypto;   //!< Crypto policy of the default configuration
+    #elif defined(YKHMAC_HMAC_FIXED)
+        typedef FixedHmacCrypto<PortableCrypto> DefaultCrypto; //!< Crypto policy of the default configuration
+    #else
+        typedef PortableCrypto DefaultCrypto;  //!< Crypto policy of the default configuration
+    #endif
+}
+
+#endif
@@ -0,0 +1,1109 @@
+/**
+ * @file ykhmac_engine.h
+ * @author Christoph Honal
+ * @brief Defines the header-only authentication engine, which the functions from ykhmac.h wrap
+ * @version 0.1
+ * @date 2021-12-17
+ */
+
+#ifndef YKHMAC_ENGINE_H
+#define YKHMAC_ENGINE_H
+
+#include "ykhmac.h"
+#include "ykhmac_crypto.h"
+
+#include <string.h>
+
+
+// Timing of the phases, see ykhmac_metrics_record. Compiles to nothing unless YKHMAC_METRICS is defined
+#ifdef YKHMAC_METRICS
+    #define YKHMAC_PHASE_BEGIN(stamp)       const uint32_t stamp = ykhmac_clock()
+    #define YKHMAC_PHASE_MARK(stamp)        stamp = ykhmac_clock()
+    #define YKHMAC_PHASE_END(phase, stamp)  ykhmac_metrics_record(phase, ykhmac_clock() - (stamp))
+#else
+    #define YKHMAC_PHASE_BEGIN(stamp)
+    #define YKHMAC_PHASE_MARK(stamp)
+    #define YKHMAC_PHASE_END(phase, stamp)
+#endif
+
+namespace ykhmac
+{
+    /**
+     * @brief Configuration derived from the preprocessor constants, see ykhmac.h
+     *
+     * Custom configurations have to provide the same members.
+     */
+    struct DefaultConfig
+    {
+        static constexpr uint8_t hw_buf_size = HW_BUF_SIZE;             //!< Size of the transfer buffer of the NFC controller used
+        static constexpr uint8_t send_buf_overhead = SEND_BUF_OVERH;    //!< Overhead of the send buffer in bytes
+        static constexpr uint8_t recv_buf_overhead = RECV_BUF_OVERH;    //!< Overhead of the receive buffer in bytes
+        static constexpr uint8_t resp_buf_size = RESP_BUF_SIZE;         //!< Size of the response
+        static constexpr uint8_t secret_key_size = SECRET_KEY_SIZE;     //!< Size of the secret key
+        static constexpr uint8_t challenge_size = CHALLENGE_SIZE;       //!< Size of the generated challenges
+        typedef DefaultCrypto Crypto;                                   //!< Crypto policy, see ykhmac_crypto.h
+    };
+
+    /**
+     * @brief Scratch arena, holds all working buffers of an enrollment or authentication
+     *
+     * IV and secret key are used throughout, the AES and the HMAC phase never overlap
+     * and share the same memory. The arena is purged after each operation.
+     *
+     * @tparam Config Configuration, see DefaultConfig
+     */
+    template<class Config> struct Scratch
+    {
+        uint8_t iv[AES_BLOCKLEN];                                       //!< IV of the secret key encryption
+        uint8_t secret_key[((Config::secret_key_size / AES_BLOCKLEN) + 1) * AES_BLOCKLEN]; //!< Padded, possibly encrypted secret key
+        union
+        {
+            typename Config::Crypto::AesWork aes;                       //!< AES phase: work area of the crypto policy
+            struct
+            {
+                struct ykhmac_hmac_ctx hmac;                            //!< HMAC context of the secret key
+                typename Config::Crypto::HashWork work;                 //!< Work area of the crypto policy
+                uint8_t computed_response[Config::resp_buf_size];       //!< Locally computed response
+            } hash;                                                     //!< HMAC phase
+        } phase;                                                        //!< Phase overlays
+    };
+
+    /**
+     * @brief Boolean tag, selects an overload at compile time
+     *
+     * @tparam value The value
+     */
+    template<bool value> struct Flag { };
+
+    /**
+     * @brief Detects storage policies holding precomputed enrollment records
+     *
+     * @tparam Storage Storage policy
+     */
+    template<class Storage> struct Precomputed
+    {
+        template<class T> static char test(decltype(&T::consume));
+        template<class T> static long test(...);
+        static constexpr bool value = sizeof(test<Storage>(nullptr)) == sizeof(char); //!< Whether the policy provides consume
+    };
+
+    /**
+     * @brief Yubikey HMAC-SHA1 challenge-response engine
+     *
+     * All buffer sizes are compile-time constants of the configuration, and all calls
+     * into the policies can be inlined. Multiple engines with different configurations
+     * may exist in one program, each one owns its scratch arena.
+     *
+     * The transport policy provides the transport frame and the data exchange:
+     * `static constexpr size_t frame_capacity`, `uint8_t* frame()` and
+     * `bool exchange(uint8_t* send_buffer, uint8_t send_length, uint8_t* response_buffer, uint8_t* response_length)`.
+     *
+     * The storage policy persists the enrollment record:
+     * `bool load(uint8_t* challenge, uint8_t* iv, uint8_t* secret_key)`,
+     * `bool store(const uint8_t* challenge, const uint8_t* iv, const uint8_t* secret_key)` for enrollments and
+     * `bool update(const uint8_t* challenge, const uint8_t* iv, const uint8_t* secret_key)` for re-enrollments,
+     * which may be deferred.
+     *
+     * The random number generator policy provides `uint8_t random()`.
+     *
+     * The resumable authentication (authenticate_start, authenticate_step) additionally requires
+     * `bool exchange_start(uint8_t* send_buffer, uint8_t send_length, uint8_t* response_buffer, uint8_t* response_length)`
+     * and `ykhmac_status exchange_poll()` from the transport policy, and `ykhmac_status update_poll()`
+     * from the storage policy, which reports the progress of the last update.
+     *
+     * A storage policy may hold a run of precomputed records instead, then an authentication only marks
+     * the loaded record as used: `bool consume()`, `uint8_t available()`, `void retain(const uint8_t* secret_key)`
+     * which may keep the secret key for replenish, and `const uint8_t* retained()` which returns it,
+     * or nullptr. Its update appends a record to the run.
+     *
+     * @tparam Transport Transport policy
+     * @tparam Storage Storage policy
+     * @tparam Rng Random number generator policy
+     * @tparam Config Configuration, see DefaultConfig
+     */
+    template<class Transport, class Storage, class Rng, class Config = DefaultConfig>
+    class Engine : private Transport, private Storage, private Rng
+    {
+        public:
+            static constexpr uint8_t send_buf_size = Config::hw_buf_size - Config::send_buf_overhead;     //!< Usable space of the transfer buffer for sending
+            static constexpr uint8_t recv_buf_size = Config::hw_buf_size - Config::recv_buf_overhead;     //!< Usable space of the transfer buffer for receiving
+            static constexpr uint8_t arg_buf_size_max = send_buf_size - APDU_HEADER_SIZE;                 //!< Maximum size of an ADPU without header
+            static constexpr uint8_t frame_recv_size = Config::resp_buf_size + 2;                        //!< Space for a response APDU, behind the command APDU
+            static constexpr size_t frame_size = send_buf_size + frame_recv_size;                        //!< Size of the transport frame
+            static constexpr uint8_t challenge_size = Config::challenge_size;                            //!< Size of the generated challenges
+            static constexpr uint8_t resp_buf_size = Config::resp_buf_size;                              //!< Size of the response
+            static constexpr uint8_t secret_key_size = Config::secret_key_size;                          //!< Size of the secret key
+            static constexpr uint8_t secret_key_size_pad = ((secret_key_size / AES_BLOCKLEN) + 1) * AES_BLOCKLEN; //!< Size of the secret key, padded for AES
+
+            static_assert(Config::hw_buf_size > Config::send_buf_overhead + APDU_HEADER_SIZE
+                && Config::hw_buf_size > Config::recv_buf_overhead, "hw_buf_size is too small");
+            static_assert(challenge_size <= arg_buf_size_max, "challenge_size must not exceed arg_buf_size_max");
+            static_assert(secret_key_size <= HMAC_BLOCK_SIZE, "secret_key_size must not exceed the SHA1 block size");
+            static_assert(resp_buf_size >= AES_KEYLEN && resp_buf_size <= HMAC_HASH_SIZE,
+                "resp_buf_size must be between the AES key size and the SHA1 digest size");
+            static_assert(frame_recv_size >= 12 && frame_recv_size <= recv_buf_size,
+                "resp_buf_size must be between 10 and recv_buf_size - 2");
+            static_assert(Transport::frame_capacity >= frame_size, "The transport frame is too small");
+
+            /**
+             * @brief Constructs a new engine
+             *
+             * @param transport Transport policy
+             * @param storage Storage policy
+             * @param rng Random number generator policy
+             */
+            constexpr Engine(const Transport& transport = Transport(), const Storage& storage = Storage(),
+                const Rng& rng = Rng()) : Transport(transport), Storage(storage), Rng(rng), scratch(),
+                step_phase(Phase::idle), step_slot(0), step_length(0)
+                #ifdef YKHMAC_METRICS
+                    , step_time(0)
+                #endif
+                { }
+
+            /**
+             * @brief Returns the transport policy
+             *
+             * @return The transport policy
+             */
+            Transport& transport() { return *this; }
+
+            /**
+             * @brief Returns the storage policy
+             *
+             * @return The storage policy
+             */
+            Storage& storage() { return *this; }
+
+            /**
+             * @brief Returns the random number generator policy
+             *
+             * @return The random number generator policy
+             */
+            Rng& rng() { return *this; }
+
+            /**
+             * @brief Returns the data of the command APDU in the transport frame
+             *
+             * @return Buffer of arg_buf_size_max bytes
+             */
+            uint8_t* frame_data() { return Transport::frame() + APDU_HEADER_SIZE; }
+
+            /**
+             * @brief Returns the response APDU in the transport frame
+             *
+             * @return Buffer of frame_recv_size bytes
+             */
+            uint8_t* frame_response() { return Transport::frame() + send_buf_size; }
+
+            /**
+             * @brief Returns the scratch arena
+             *
+             * @return The scratch arena
+             */
+            Scratch<Config>& arena() { return scratch; }
+
+            /**
+             * @brief Selects an applet by its AID
+             *
+             * @tparam aid_size The length of the AID in bytes
+             * @param aid The AID of the applet
+             * @return true on success
+             */
+            template<uint8_t aid_size> bool select(const uint8_t (&aid)[aid_size])
+            {
+                static_assert(aid_size <= arg_buf_size_max, "aid_size must not exceed arg_buf_size_max");
+                return select(aid, aid_size);
+            }
+
+            /**
+             * @brief Selects an applet by its AID
+             *
+             * If aid points to frame_data(), it is not copied.
+             *
+             * @param aid The AID of the applet
+             * @param aid_size The length of the AID in bytes, max. arg_buf_size_max
+             * @return true on success
+             */
+            bool select(const uint8_t* aid, const uint8_t aid_size)
+            {
+                if (aid != frame_data()) memmove(frame_data(), aid, aid_size);
+                uint8_t recv_length = 0;
+                YKHMAC_PHASE_BEGIN(select_begin);
+                bool result = frame_exchange(INS_SELECT, SEL_APP_AID, aid_size, aid_size, &recv_length);
+                YKHMAC_PHASE_END(YKHMAC_PHASE_SELECT, select_begin);
+
+                return result;
+            }
+
+            /**
+             * @brief Reads the serial number of the target
+             *
+             * @param serial The serial number
+             * @return true on success
+             */
+            bool read_serial(uint32_t* serial)
+            {
+                uint8_t recv_length = 0;
+                if (frame_exchange(INS_API_REQ, CMD_GET_SERIAL, 6, 0, &recv_length) && recv_length >= 4)
+                {
+                    const uint8_t* response = frame_response();
+                    *serial = ((uint32_t)response[0] << 24) + ((uint32_t)response[1] << 16) +
+                              ((uint32_t)response[2] << 8) + response[3];
+                    return true;
+                }
+
+                return false;
+            }
+
+            /**
+             * @brief Reads the firmware version of the target
+             *
+             * @param version The firmware version
+             * @return true on success
+             */
+            bool read_version(uint8_t version[3])
+            {
+                uint8_t recv_length = 0;
+                if (frame_exchange(INS_STATUS, 0, STATUS_SIZE, 0, &recv_length) && recv_length >= 3)
+                {
+                    memcpy(version, frame_response(), 3);
+                    return true;
+                }
+
+                return false;
+            }
+
+            /**
+             * @brief Reads the firmware version and the program sequence of the target
+             *
+             * The program sequence is incremented on each reconfiguration of a slot.
+             *
+             * @param status Output, the firmware version followed by the program sequence
+             * @param slots Output, the challenge-response slots or SLOTS_UNKNOWN, see decode_slots. May be nullptr
+             * @return true on success
+             */
+            bool read_status(uint8_t status[4], uint8_t* slots = nullptr)
+            {
+                uint8_t recv_length = 0;
+                if (frame_exchange(INS_STATUS, 0, STATUS_SIZE, 0, &recv_length) && recv_length >= 4)
+                {
+                    memcpy(status, frame_response(), 4);
+                    if (slots != nullptr) *slots = decode_slots(frame_response(), recv_length);
+                    return true;
+                }
+
+                return false;
+            }
+
+            /**
+             * @brief Decodes the challenge-response slots from the touch level of a status response
+             *
+             * Configured slots which are not triggered by touch answer challenges. The status does not
+             * tell HMAC-SHA1 from Yubico OTP challenge-response, and does not tell anything before
+             * firmware 2.2 or if no slot is reported as configured, as other applets do.
+             *
+             * @param status The status response
+             * @param status_length Size of the status response in bytes, including the status word
+             * @return SLOT_1 | SLOT_2, or SLOTS_UNKNOWN if the slots have to be probed
+             */
+            static uint8_t decode_slots(const uint8_t* status, const uint8_t status_length)
+            {
+                if (status_length < STATUS_SIZE + 2 || status[0] < 2 || (status[0] == 2 && status[1] < 2))
+                    return SLOTS_UNKNOWN;
+
+                const uint8_t touch_level = status[4];
+                if (!(touch_level & (CONFIG1_VALID | CONFIG2_VALID))) return SLOTS_UNKNOWN;
+
+                uint8_t slots = 0;
+                if ((touch_level & (CONFIG1_VALID | CONFIG1_TOUCH)) == CONFIG1_VALID) slots |= SLOT_1;
+                if ((touch_level & (CONFIG2_VALID | CONFIG2_TOUCH)) == CONFIG2_VALID) slots |= SLOT_2;
+                return slots;
+            }
+
+            /**
+             * @brief Performs a HMAC-SHA1 challenge-response exchange with the target
+             *
+             * @tparam challenge_length Size of the challenge in bytes
+             * @param slot Which slot to use, either SLOT_1 or SLOT_2
+             * @param challenge Input buffer, contains challenge
+             * @param response Output buffer, contains response. May be nullptr to discard response
+             * @return true on success
+             */
+            template<uint8_t challenge_length> bool exchange_hmac(const uint8_t slot,
+                const uint8_t (&challenge)[challenge_length], uint8_t* response = nullptr)
+            {
+                static_assert(challenge_length <= arg_buf_size_max, "challenge_length must not exceed arg_buf_size_max");
+                return exchange_hmac(slot, challenge, challenge_length, response);
+            }
+
+            /**
+             * @brief Performs a HMAC-SHA1 challenge-response exchange with the target
+             *
+             * If challenge points to frame_data(), it is not copied. The response stays at frame_response(),
+             * pass frame_response() or nullptr as response to skip copying it.
+             *
+             * @param slot Which slot to use, either SLOT_1 or SLOT_2
+             * @param challenge Input buffer, contains challenge
+             * @param challenge_length Size of the input buffer in bytes, max. arg_buf_size_max
+             * @param response Output buffer, contains response. May be nullptr to discard response
+             * @return true on success
+             */
+            bool exchange_hmac(const uint8_t slot, const uint8_t* challenge,
+                const uint8_t challenge_length, uint8_t* response = nullptr)
+            {
+                uint8_t slot_cmd = slot_command(slot);
+                if (slot_cmd == 0) return false;
+
+                // Perform transfer
+                if (challenge != frame_data()) memmove(frame_data(), challenge, challenge_length);
+                uint8_t recv_length = 0;
+                if (frame_exchange(INS_API_REQ, slot_cmd, challenge_length, challenge_length, &recv_length)
+                    && recv_length >= resp_buf_size)
+                {
+                    if (response != nullptr && response != frame_response())
+                        memcpy(response, frame_response(), resp_buf_size);
+                    return true;
+                }
+
+                return false;
+            }
+
+            /**
+             * @brief Finds the challenge-response slots of the target from a status request
+             *
+             * Probes both slots if the status response does not tell, see decode_slots.
+             *
+             * @return SLOT_1 | SLOT_2
+             */
+            uint8_t find_slots()
+            {
+                uint8_t status[4];
+                uint8_t slots = SLOTS_UNKNOWN;
+                if (read_status(status, &slots) && slots != SLOTS_UNKNOWN) return slots;
+
+                return probe_slots();
+            }
+
+            /**
+             * @brief Tests both slots of the target by a HMAC challenge-response exchange each
+             *
+             * @return SLOT_1 | SLOT_2
+             */
+            uint8_t probe_slots()
+            {
+                uint8_t slots = 0;
+
+                // Perform dummy challenge agains both slots, the challenge stays in the frame
+                memset(frame_data(), 0x42, 8);
+
+                if (exchange_hmac(SLOT_1, frame_data(), 8))
+                    slots |= SLOT_1;
+                if (exchange_hmac(SLOT_2, frame_data(), 8))
+                    slots |= SLOT_2;
+
+                return slots;
+            }
+
+            /**
+             * @brief Computes the HMAC-SHA1 context of a secret key
+             *
+             * @param ctx Output, the context
+             * @param key The secret key, secret_key_size bytes
+             */
+            void hmac_init(struct ykhmac_hmac_ctx* ctx, const uint8_t* key)
+            {
+                Crypto::hmac_init(ctx, key, secret_key_size, &scratch.phase.hash.work);
+            }
+
+            /**
+             * @brief Computes a HMAC-SHA1 response using a precomputed key context
+             *
+             * @param ctx The context of the secret key, see hmac_init
+             * @param challenge Input buffer, contains challenge
+             * @param challenge_length Size of the input buffer in bytes
+             * @param response Output buffer, contains response
+             * @return true on success
+             */
+            bool hmac_compute(const struct ykhmac_hmac_ctx* ctx, const uint8_t* challenge,
+                const uint8_t challenge_length, uint8_t* response)
+            {
+                return Crypto::hmac_compute(ctx, challenge, challenge_length, response, resp_buf_size,
+                    &scratch.phase.hash.work);
+            }
+
+            /**
+             * @brief Purges a HMAC-SHA1 context from RAM
+             *
+             * @param ctx The context
+             */
+            static void hmac_purge(struct ykhmac_hmac_ctx* ctx)
+            {
+                memset(ctx, 0, sizeof(struct ykhmac_hmac_ctx));
+            }
+
+            /**
+             * @brief Computes a HMAC-SHA1 response locally
+             *
+             * @param key The secret key, secret_key_size bytes
+             * @param challenge Input buffer, contains challenge
+             * @param challenge_length Size of the input buffer in bytes
+             * @param response Output buffer, contains response
+             * @return true on success
+             */
+            bool compute_hmac(const uint8_t* key, const uint8_t* challenge,
+                const uint8_t challenge_length, uint8_t* response)
+            {
+                hmac_init(&scratch.phase.hash.hmac, key);
+                bool result = hmac_compute(&scratch.phase.hash.hmac, challenge, challenge_length, response);
+                hmac_purge(&scratch.phase.hash.hmac);
+
+                return result;
+            }
+
+            /**
+             * @brief Enrolls a secret key into encrypted persistent memory, see Storage::store
+             *
+             * @param secret_key The secret key to be enrolled, secret_key_size bytes
+             * @return true on success
+             */
+            bool enroll(const uint8_t* secret_key)
+            {
+                hmac_init(&scratch.phase.hash.hmac, secret_key);
+                bool result = enroll_ctx(&scratch.phase.hash.hmac, secret_key, false);
+                if (result) enroll_retain(Flag<Precomputed<Storage>::value>(), secret_key);
+                purge();
+
+                return result;
+            }
+
+            /**
+             * @brief Appends one precomputed record using the secret key retained by the storage policy
+             *
+             * Only available for storage policies holding precomputed records, see Storage::retained.
+             *
+             * @return true if there was nothing to do, or on success
+             */
+            bool replenish()
+            {
+                const uint8_t* secret_key = Storage::retained();
+                if (secret_key == nullptr) return true;
+
+                hmac_init(&scratch.phase.hash.hmac, secret_key);
+                bool result = enroll_ctx(&scratch.phase.hash.hmac, secret_key, true);
+                purge();
+
+                return result;
+            }
+
+            /**
+             * @brief Checks whether the storage policy retains the secret key, see replenish
+             *
+             * @return true if replenish has work to do
+             */
+            bool replenish_pending()
+            {
+                return Storage::retained() != nullptr;
+            }
+
+            /**
+             * @brief Tries to authenticate a target against the stored secret key
+             *
+             * In addition, this function will advance the stored secret key, see Storage::update.
+             *
+             * @param slot Which slot to use, either SLOT_1 or SLOT_2
+             * @return true on successful authentication
+             */
+            bool authenticate(const uint8_t slot)
+            {
+                YKHMAC_LOG(YKHMAC_EVENT_AUTHENTICATE, "Authenticating key\n");
+
+                bool result = false;
+
+                // Load stored challenge in place, IV and secret key
+                if (authenticate_load())
+                {
+                    // Perform challenge-response exchange, the challenge stays in the frame
+                    YKHMAC_PHASE_BEGIN(exchange_begin);
+                    bool exchanged = exchange_hmac(slot, frame_data(), challenge_size, frame_response());
+                    YKHMAC_PHASE_END(YKHMAC_PHASE_EXCHANGE, exchange_begin);
+                    if (exchanged)
+                    {
+                        // Check response, then perform re-enrollment and re-encryption of the secret using a new challenge
+                        if (authenticate_verify())
+                            result = authenticate_advance(Flag<Precomputed<Storage>::value>());
+                    }
+                    else
+                    {
+                        YKHMAC_LOG(YKHMAC_EVENT_EXCHANGE_FAILED, "Failed to exchange HMAC\n");
+                    }
+                }
+
+                purge();
+                authenticate_report(result);
+
+                return result;
+            }
+
+            /**
+             * @brief Starts a resumable authentication, see authenticate
+             *
+             * Only sends the first command, the authentication is driven by authenticate_step.
+             * An authentication which is still in progress is abandoned.
+             *
+             * @param slot Which slot to use, either SLOT_1 or SLOT_2
+             * @param aid The AID of the applet to select first, or nullptr if it has been selected already
+             * @param aid_size The length of the AID in bytes, max. arg_buf_size_max
+             * @return true if the authentication is in progress
+             */
+            bool authenticate_start(const uint8_t slot, const uint8_t* aid = nullptr, const uint8_t aid_size = 0)
+            {
+                YKHMAC_LOG(YKHMAC_EVENT_AUTHENTICATE, "Authenticating key\n");
+
+                step_slot = slot;
+                if (aid == nullptr) return authenticate_request();
+
+                // Select the applet first, the stored challenge is loaded afterwards
+                if (aid != frame_data()) memmove(frame_data(), aid, aid_size);
+                step_phase = Phase::select;
+                YKHMAC_PHASE_MARK(step_time);
+                if (step_begin(INS_SELECT, SEL_APP_AID, aid_size, aid_size)) return true;
+
+                authenticate_finish(false);
+                return false;
+            }
+
+            /**
+             * @brief Advances a resumable authentication by at most one phase
+             *
+             * Each call either polls the transport or the storage, or performs one of the computations
+             * (decryption and verification, re-encryption). Returns YKHMAC_PENDING until the authentication
+             * has finished, so that other work can be done in between.
+             *
+             * @return YKHMAC_DONE on successful authentication, YKHMAC_FAILED if it has failed
+             *         or none is in progress, YKHMAC_PENDING otherwise
+             */
+            ykhmac_status authenticate_step()
+            {
+                switch (step_phase)
+                {
+                    case Phase::select:
+                    case Phase::exchange:
+                    {
+                        ykhmac_status status = Transport::exchange_poll();
+                        if (status == YKHMAC_PENDING) return YKHMAC_PENDING;
+                        bool success = (status == YKHMAC_DONE)
+                            && response_code(frame_response(), step_length) == E_SUCCESS;
+                        YKHMAC_PHASE_END((step_phase == Phase::select) ? YKHMAC_PHASE_SELECT : YKHMAC_PHASE_EXCHANGE,
+                            step_time);
+
+                        if (step_phase == Phase::select)
+                        {
+                            if (!success)
+                            {
+                                YKHMAC_LOG(YKHMAC_EVENT_SELECT_FAILED, "Failed to select applet\n");
+                                return authenticate_finish(false);
+                            }
+
+                            return authenticate_request() ? YKHMAC_PENDING : YKHMAC_FAILED;
+                        }
+
+                        if (!success || step_length < resp_buf_size)
+                        {
+                            YKHMAC_LOG(YKHMAC_EVENT_EXCHANGE_FAILED, "Failed to exchange HMAC\n");
+                            return authenticate_finish(false);
+                        }
+
+                        step_phase = Phase::verify;
+                        return YKHMAC_PENDING;
+                    }
+
+                    case Phase::verify:
+                        if (!authenticate_verify()) return authenticate_finish(false);
+
+                        step_phase = Phase::enroll;
+                        return YKHMAC_PENDING;
+
+                    case Phase::enroll:
+                        return step_enroll(Flag<Precomputed<Storage>::value>());
+
+                    case Phase::store:
+                    {
+                        ykhmac_status status = Storage::update_poll();
+                        if (status == YKHMAC_PENDING) return YKHMAC_PENDING;
+                        YKHMAC_PHASE_END(YKHMAC_PHASE_STORE, step_time);
+
+                        enroll_stored(status == YKHMAC_DONE);
+                        enroll_report(status == YKHMAC_DONE);
+                        return authenticate_finish(status == YKHMAC_DONE);
+                    }
+
+                    default:
+                        return YKHMAC_FAILED;
+                }
+            }
+
+            /**
+             * @brief Checks whether a resumable authentication is in progress
+             *
+             * @return true if authenticate_step has work to do
+             */
+            bool authenticate_pending() const
+            {
+                return step_phase != Phase::idle;
+            }
+
+            /**
+             * @brief Purges the scratch arena and the transport frame from RAM
+             */
+            void purge()
+            {
+                memset(&scratch, 0, sizeof(Scratch<Config>));
+                memset(Transport::frame(), 0, frame_size);
+            }
+
+        private:
+            typedef typename Config::Crypto Crypto; // Crypto policy
+
+            // Phases of a resumable authentication
+            enum class Phase : uint8_t
+            {
+                idle,       // No authentication in progress
+                select,     // Waiting for the response to the applet selection
+                exchange,   // Waiting for the HMAC response
+                verify,     // Decrypting the secret key and verifying the response
+                enroll,     // Re-encrypting the secret key using a new challenge
+                store       // Waiting for the storage to write the new record
+            };
+
+            Scratch<Config> scratch;    //!< Working buffers
+            Phase step_phase;           //!< Phase of the resumable authentication
+            uint8_t step_slot;          //!< Slot of the resumable authentication
+            uint8_t step_length;        //!< Length of the response of the pending exchange
+            #ifdef YKHMAC_METRICS
+                uint32_t step_time;     //!< Start of the phase the resumable authentication waits for
+            #endif
+
+            // Decode APDU response code
+            static uint8_t response_code(const uint8_t* recv_buffer, const uint8_t recv_length)
+            {
+                if (recv_length < 2)
+                {
+                    return E_UNEXPECTED;
+                }
+
+                if (recv_buffer[recv_length - 2] == SW_OK_HIGH &&
+                    recv_buffer[recv_length - 1] == SW_OK_LOW)
+                {
+                    return E_SUCCESS;
+                }
+
+                if (recv_buffer[recv_length - 2] == SW_PRECOND_HIGH &&
+                    recv_buffer[recv_length - 1] == SW_PRECOND_LOW)
+                {
+                    return E_CARD_NOT_AUTHENTICATED;
+                }
+
+                if (recv_buffer[recv_length - 2] == SW_NOTFOUND_HIGH &&
+                    recv_buffer[recv_length - 1] == SW_NOTFOUND_LOW)
+                {
+                    return E_FILE_NOT_FOUND;
+                }
+
+                return E_UNEXPECTED;
+            }
+
+            // Maps a slot to its HMAC command, 0 if the slot is invalid
+            static uint8_t slot_command(const uint8_t slot)
+            {
+                if (slot == SLOT_1) return CMD_HMAC_1;
+                if (slot == SLOT_2) return CMD_HMAC_2;
+                return 0;
+            }
+
+            // Completes the APDU header in the transport frame, returns the length of the command APDU
+            uint8_t frame_command(const uint8_t ins, const uint8_t p1, const uint8_t p3, const uint8_t data_length)
+            {
+                uint8_t* frame = Transport::frame();
+                frame[0] = CLA_ISO;
+                frame[1] = ins;
+                frame[2] = p1;
+                frame[3] = 0;
+                frame[4] = p3;
+
+                return APDU_HEADER_SIZE + data_length;
+            }
+
+            // Completes the APDU header in the transport frame and performs the transfer
+            bool frame_exchange(const uint8_t ins, const uint8_t p1, const uint8_t p3,
+                const uint8_t data_length, uint8_t* recv_length)
+            {
+                // Perform transfer, the response lands behind the command
+                uint8_t send_length = frame_command(ins, p1, p3, data_length);
+                #ifdef YKHMAC_RETRY
+                    return frame_retry(send_length, retry_deadline(ins, p1), recv_length);
+                #else
+                    *recv_length = frame_recv_size;
+                    if (Transport::exchange(Transport::frame(), send_length, frame_response(), recv_length))
+                    {
+                        return response_code(frame_response(), *recv_length) == E_SUCCESS;
+                    }
+
+                    return false;
+                #endif
+            }
+
+            #ifdef YKHMAC_RETRY
+                // Time in clock ticks after the first attempt of a command, after which it is not retried anymore
+                static uint32_t retry_deadline(const uint8_t ins, const uint8_t p1)
+                {
+                    if (ins == INS_SELECT) return RETRY_TICKS(RETRY_DEADLINE_SELECT_US);
+                    if (ins == INS_API_REQ && (p1 == slot_command(SLOT_1) || p1 == slot_command(SLOT_2)))
+                        return RETRY_TICKS(RETRY_DEADLINE_HMAC_US);
+                    return RETRY_TICKS(RETRY_DEADLINE_QUERY_US);
+                }
+
+                // Classifies a failed attempt, transient faults come first
+                static ykhmac_retry_counter retry_fault(const bool exchanged, const uint8_t* recv_buffer,
+                    const uint8_t recv_length)
+                {
+                    if (!exchanged) return YKHMAC_RETRY_TRANSPORT;
+                    if (recv_length < 2) return YKHMAC_RETRY_TRUNCATED;
+
+                    switch (response_code(recv_buffer, recv_length))
+                    {
+                        case E_CARD_NOT_AUTHENTICATED: return YKHMAC_RETRY_NOT_AUTHENTICATED;
+                        case E_FILE_NOT_FOUND: return YKHMAC_RETRY_NOT_FOUND;
+                        default: return YKHMAC_RETRY_UNEXPECTED;
+                    }
+                }
+
+                // Sends the command in the frame until it succeeds, a permanent fault occurs, or its attempts or deadline run out
+                bool frame_retry(const uint8_t send_length, const uint32_t deadline, uint8_t* recv_length)
+                {
+                    const uint32_t start = ykhmac_clock();
+                    uint32_t backoff = RETRY_TICKS(RETRY_BACKOFF_US);
+                    for (uint8_t attempt = 1; ; attempt++)
+                    {
+                        // The command stays in the frame, the response lands behind it
+                        const uint32_t attempt_start = ykhmac_clock();
+                        *recv_length = frame_recv_size;
+                        bool exchanged = Transport::exchange(Transport::frame(), send_length, frame_response(), recv_length);
+                        if (exchanged && response_code(frame_response(), *recv_length) == E_SUCCESS)
+                        {
+                            if (attempt > 1) ykhmac_retry_record(YKHMAC_RETRY_RECOVERED);
+                            return true;
+                        }
+
+                        const ykhmac_retry_counter fault = retry_fault(exchanged, frame_response(), *recv_length);
+                        ykhmac_retry_record(fault);
+                        if (fault > YKHMAC_RETRY_TRUNCATED) return false;
+
+                        // An attempt which ran into a timeout has waited already, the wait adapts to it
+                        const uint32_t now = ykhmac_clock();
+                        const uint32_t waited = now - attempt_start;
+                        const uint32_t wait = (waited < backoff) ? backoff - waited : 0;
+                        if (attempt >= RETRY_ATTEMPTS || now - start + wait > deadline)
+                        {
+                            ykhmac_retry_record(YKHMAC_RETRY_EXPIRED);
+                            YKHMAC_LOG(YKHMAC_EVENT_RETRY_EXPIRED, "Gave up retrying APDU\n");
+                            return false;
+                        }
+
+                        while (ykhmac_clock() - now < wait) { }
+                        backoff = (backoff < RETRY_TICKS(RETRY_BACKOFF_MAX_US) / 2) ? backoff * 2
+                            : RETRY_TICKS(RETRY_BACKOFF_MAX_US);
+                        ykhmac_retry_record(YKHMAC_RETRY_RETRIED);
+                        YKHMAC_LOG(YKHMAC_EVENT_RETRY, "Retrying APDU\n");
+                    }
+                }
+            #endif
+
+            // Completes the APDU header in the transport frame and starts the transfer
+            bool step_begin(const uint8_t ins, const uint8_t p1, const uint8_t p3, const uint8_t data_length)
+            {
+                uint8_t send_length = frame_command(ins, p1, p3, data_length);
+                step_length = frame_recv_size;
+                return Transport::exchange_start(Transport::frame(), send_length, frame_response(), &step_length);
+            }
+
+            // Loads the stored challenge in place and starts the HMAC exchange of a resumable authentication
+            bool authenticate_request()
+            {
+                uint8_t slot_cmd = slot_command(step_slot);
+                step_phase = Phase::exchange;
+                if (slot_cmd != 0 && authenticate_load())
+                {
+                    YKHMAC_PHASE_MARK(step_time);
+                    if (step_begin(INS_API_REQ, slot_cmd, challenge_size, challenge_size)) return true;
+                }
+
+                if (slot_cmd == 0) YKHMAC_LOG(YKHMAC_EVENT_EXCHANGE_FAILED, "Failed to exchange HMAC\n");
+                authenticate_finish(false);
+                return false;
+            }
+
+            // Ends a resumable authentication
+            ykhmac_status authenticate_finish(const bool result)
+            {
+                step_phase = Phase::idle;
+                purge();
+                authenticate_report(result);
+
+                return result ? YKHMAC_DONE : YKHMAC_FAILED;
+            }
+
+            // Prints the outcome of an authentication
+            static void authenticate_report(const bool result)
+            {
+                if (result)
+                    YKHMAC_LOG(YKHMAC_EVENT_AUTHENTICATED, "Successfully authenticated token\n");
+                else
+                    YKHMAC_LOG(YKHMAC_EVENT_AUTHENTICATE_FAILED, "Failed to authenticate token\n");
+            }
+
+            // Re-encrypts the secret using a new challenge, the write may take a while
+            ykhmac_status step_enroll(Flag<false>)
+            {
+                if (!enroll_seal(&scratch.phase.hash.hmac, scratch.secret_key))
+                {
+                    enroll_report(false);
+                    return authenticate_finish(false);
+                }
+                YKHMAC_PHASE_MARK(step_time);
+                if (!Storage::update(frame_data(), scratch.iv, scratch.secret_key))
+                {
+                    enroll_stored(false);
+                    enroll_report(false);
+                    return authenticate_finish(false);
+                }
+
+                step_phase = Phase::store;
+                return YKHMAC_PENDING;
+            }
+
+            // Marks the precomputed record as used
+            ykhmac_status step_enroll(Flag<true>)
+            {
+                return authenticate_finish(authenticate_advance(Flag<true>()));
+            }
+
+            // Re-enrolls the verified secret key
+            bool authenticate_advance(Flag<false>)
+            {
+                return enroll_ctx(&scratch.phase.hash.hmac, scratch.secret_key, true);
+            }
+
+            // Marks the precomputed record as used, the last one is only used after another has been appended
+            bool authenticate_advance(Flag<true>)
+            {
+                Storage::retain(scratch.secret_key);
+                if (Storage::available() <= 1 && !enroll_ctx(&scratch.phase.hash.hmac, scratch.secret_key, true))
+                    return false;
+
+                YKHMAC_PHASE_BEGIN(consume_begin);
+                bool consumed = Storage::consume();
+                YKHMAC_PHASE_END(YKHMAC_PHASE_STORE, consume_begin);
+                if (consumed)
+                    YKHMAC_LOG(YKHMAC_EVENT_CONSUMED, "Marked precomputed record as used\n");
+                else
+                    YKHMAC_LOG(YKHMAC_EVENT_CONSUME_FAILED, "Failed to mark precomputed record as used\n");
+
+                return consumed;
+            }
+
+            // Keeps the enrolled secret key for replenishing
+            void enroll_retain(Flag<false>, const uint8_t*) { }
+
+            // Keeps the enrolled secret key for replenishing
+            void enroll_retain(Flag<true>, const uint8_t* secret_key)
+            {
+                Storage::retain(secret_key);
+            }
+
+            // Loads the stored challenge in place, the IV and the encrypted secret key
+            bool authenticate_load()
+            {
+                YKHMAC_PHASE_BEGIN(load_begin);
+                bool loaded = Storage::load(frame_data(), scratch.iv, scratch.secret_key);
+                YKHMAC_PHASE_END(YKHMAC_PHASE_LOAD, load_begin);
+                if (loaded)
+                {
+                    YKHMAC_LOG_PUBLIC(YKHMAC_EVENT_LOADED_CHALLENGE, "Loaded challenge:     ",
+                        frame_data(), challenge_size);
+                    YKHMAC_LOG_PUBLIC(YKHMAC_EVENT_LOADED_IV, "Loaded IV:            ",
+                        scratch.iv, AES_BLOCKLEN);
+                    YKHMAC_LOG_PUBLIC(YKHMAC_EVENT_LOADED_SECRET_KEY, "Loaded secret key:    ",
+                        scratch.secret_key, secret_key_size_pad);
+                    return true;
+                }
+
+                YKHMAC_LOG(YKHMAC_EVENT_LOAD_FAILED, "Failed to read data from persistent storage\n");
+                return false;
+            }
+
+            // Checks the padding at the end of the last decrypted block, without an early exit
+            static bool padding_valid(const uint8_t* last_block)
+            {
+                uint8_t bits = 0;
+                for (uint8_t i = AES_BLOCKLEN - (secret_key_size_pad - secret_key_size); i < AES_BLOCKLEN; i++)
+                {
+                    bits |= last_block[i];
+                }
+                return bits == 0;
+            }
+
+            // Decrypts the secret key using the response in the frame, and checks the response against it
+            bool authenticate_verify()
+            {
+                uint8_t* challenge = frame_data();
+                uint8_t* response = frame_response();
+                uint8_t* secret_key = scratch.secret_key;
+
+                YKHMAC_LOG_SECRET(YKHMAC_EVENT_EXCHANGED_RESPONSE, "Exchanged response:   ",
+                    response, resp_buf_size);
+
+                // Decrypt the last block first, its chaining value is the ciphertext block before it.
+                // It ends with the zero padding, a response of another token hardly ever yields it.
+                // The key is expanded once, for this block and the remaining ones.
+                YKHMAC_PHASE_BEGIN(decrypt_begin);
+                uint8_t* last_block = secret_key + secret_key_size_pad - AES_BLOCKLEN;
+                Crypto::cbc_decrypt_expand(&scratch.phase.aes, response);
+                Crypto::cbc_decrypt_expanded(&scratch.phase.aes,
+                    (secret_key_size_pad > AES_BLOCKLEN) ? last_block - AES_BLOCKLEN : scratch.iv,
+                    last_block, AES_BLOCKLEN);
+                if (!padding_valid(last_block))
+                {
+                    YKHMAC_PHASE_END(YKHMAC_PHASE_DECRYPT, decrypt_begin);
+                    YKHMAC_LOG(YKHMAC_EVENT_PADDING_MISMATCH, "Decrypted padding is not zero\n");
+                    return false;
+                }
+
+                // Decrypt the remaining blocks, their ciphertext is still intact
+                if (secret_key_size_pad > AES_BLOCKLEN)
+                {
+                    Crypto::cbc_decrypt_expanded(&scratch.phase.aes, scratch.iv, secret_key,
+                        secret_key_size_pad - AES_BLOCKLEN);
+                }
+                YKHMAC_PHASE_END(YKHMAC_PHASE_DECRYPT, decrypt_begin);
+                YKHMAC_LOG_SECRET(YKHMAC_EVENT_DECRYPTED_SECRET_KEY, "Decrypted secret key: ",
+                    secret_key, secret_key_size_pad);
+
+                // Compute response using secret key, keep its context for the re-enrollment
+                YKHMAC_PHASE_BEGIN(hmac_begin);
+                hmac_init(&scratch.phase.hash.hmac, secret_key);
+                bool computed = hmac_compute(&scratch.phase.hash.hmac, challenge, challenge_size,
+                    scratch.phase.hash.computed_response);
+                YKHMAC_PHASE_END(YKHMAC_PHASE_HMAC, hmac_begin);
+                if (computed)
+                {
+                    YKHMAC_LOG_SECRET(YKHMAC_EVENT_COMPUTED_RESPONSE, "Computed response:    ",
+                        scratch.phase.hash.computed_response, resp_buf_size);
+
+                    // Check response
+                    YKHMAC_PHASE_BEGIN(compare_begin);
+                    bool match = memcmp(response, scratch.phase.hash.computed_response, resp_buf_size) == 0;
+                    YKHMAC_PHASE_END(YKHMAC_PHASE_COMPARE, compare_begin);
+                    if (match)
+                    {
+                        YKHMAC_LOG(YKHMAC_EVENT_RESPONSES_MATCH, "Responses match\n");
+                        return true;
+                    }
+
+                    YKHMAC_LOG(YKHMAC_EVENT_RESPONSES_MISMATCH, "Responses do not match\n");
+                }
+                else
+                {
+                    YKHMAC_LOG(YKHMAC_EVENT_HMAC_FAILED, "Failed to compute HMAC\n");
+                }
+
+                return false;
+            }
+
+            // Enrolls a secret key whose HMAC context has already been computed
+            bool enroll_ctx(const struct ykhmac_hmac_ctx* ctx, const uint8_t* secret_key, const bool update)
+            {
+                bool result = false;
+                if (enroll_seal(ctx, secret_key))
+                {
+                    // Store challenge, IV and encrypted secret key
+                    YKHMAC_PHASE_BEGIN(store_begin);
+                    result = update ? Storage::update(frame_data(), scratch.iv, scratch.secret_key)
+                        : Storage::store(frame_data(), scratch.iv, scratch.secret_key);
+                    YKHMAC_PHASE_END(YKHMAC_PHASE_STORE, store_begin);
+                    enroll_stored(result);
+                }
+
+                enroll_report(result);
+                return result;
+            }
+
+            // Generates a new challenge in place, and encrypts the secret key using its response
+            bool enroll_seal(const struct ykhmac_hmac_ctx* ctx, const uint8_t* secret_key)
+            {
+                YKHMAC_LOG(YKHMAC_EVENT_ENROLL, "Enrolling key\n");
+                YKHMAC_LOG_SECRET(YKHMAC_EVENT_SECRET_KEY, "Using secret key:     ",
+                    secret_key, secret_key_size);
+
+                uint8_t* challenge = frame_data();
+                uint8_t* response = frame_response();
+                uint8_t* padded_secret_key = scratch.secret_key;
+
+                // Generate random challenge in place
+                for (uint8_t i = 0; i < challenge_size; i++) challenge[i] = Rng::random();
+                YKHMAC_LOG_PUBLIC(YKHMAC_EVENT_RANDOM_CHALLENGE, "Random challenge:     ",
+                    challenge, challenge_size);
+
+                // Compute response, the HMAC phase ends here
+                YKHMAC_PHASE_BEGIN(hmac_begin);
+                bool computed = hmac_compute(ctx, challenge, challenge_size, response);
+                YKHMAC_PHASE_END(YKHMAC_PHASE_HMAC, hmac_begin);
+                if (!computed)
+                {
+                    YKHMAC_LOG(YKHMAC_EVENT_HMAC_FAILED, "Failed to compute HMAC\n");
+                    return false;
+                }
+                YKHMAC_LOG_SECRET(YKHMAC_EVENT_COMPUTED_RESPONSE, "Computed response:    ",
+                    response, resp_buf_size);
+
+                // Pad secret key using zeros (fixed size)
+                memset(padded_secret_key + secret_key_size, 0, secret_key_size_pad - secret_key_size);
+                if (secret_key != padded_secret_key) memcpy(padded_secret_key, secret_key, secret_key_size);
+                YKHMAC_LOG_SECRET(YKHMAC_EVENT_PADDED_SECRET_KEY, "Padded secret key:    ",
+                    padded_secret_key, secret_key_size_pad);
+
+                // Encrypt secret key using response as encryption key
+                for (uint8_t i = 0; i < AES_BLOCKLEN; i++) scratch.iv[i] = Rng::random();
+                YKHMAC_LOG_PUBLIC(YKHMAC_EVENT_IV, "Using IV:             ",
+                    scratch.iv, AES_BLOCKLEN);
+                YKHMAC_PHASE_BEGIN(encrypt_begin);
+                Crypto::cbc_encrypt(&scratch.phase.aes, response, scratch.iv, padded_secret_key, secret_key_size_pad);
+                YKHMAC_PHASE_END(YKHMAC_PHASE_ENCRYPT, encrypt_begin);
+                YKHMAC_LOG_PUBLIC(YKHMAC_EVENT_ENCRYPTED_SECRET_KEY, "Encrypted secret key: ",
+                    padded_secret_key, secret_key_size_pad);
+
+                return true;
+            }
+
+            // Prints the outcome of storing an enrollment record
+            static void enroll_stored(const bool result)
+            {
+                if (result)
+                    YKHMAC_LOG(YKHMAC_EVENT_STORED, "Wrote data to persistent storage\n");
+                else
+                    YKHMAC_LOG(YKHMAC_EVENT_STORE_FAILED, "Failed to write data to persistent storage\n");
+            }
+
+            // Prints the outcome of an enrollment
+            static void enroll_report(const bool result)
+            {
+                if (result)
+                    YKHMAC_LOG(YKHMAC_EVENT_ENROLLED, "Successfully enrolled key\n");
+                else
+                    YKHMAC_LOG(YKHMAC_EVENT_ENROLL_FAILED, "Failed to enroll key\n");
+            }
+    };
+}
+
+typedef ykhmac::Scratch<ykhmac::DefaultConfig> ykhmac_scratch; //!< Scratch arena of the functions from ykhmac.h
+
+#endif
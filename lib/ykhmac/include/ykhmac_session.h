@@ -0,0 +1,258 @@
+/**
+ * @file ykhmac_session.h
+ * @author Christoph Honal
+ * @brief Defines the reentrant session API, which serves any amount of readers concurrently
+ * @version 0.1
+ * @date 2021-12-17
+ */
+
+#ifndef YKHMAC_SESSION_H
+#define YKHMAC_SESSION_H
+
+#include "ykhmac.h"
+
+
+/**
+ * @brief Interfaces of a session, each one receives the context pointer of the session
+ *
+ * They replace the global interfaces declared in ykhmac.h, see there. The storage holds
+ * a single enrollment record, the layout and the persistence are up to the implementation.
+ */
+struct ykhmac_session_hooks
+{
+    /**
+     * @brief NFC hardware interfacing function
+     *
+     * @param context Context pointer of the session
+     * @param send_buffer Buffer to be sent to the target
+     * @param send_length Amount of bytes to be sent
+     * @param response_buffer Buffer to be read from the target
+     * @param response_length Size of the response buffer, set to the amount of bytes read
+     * @return true on success
+     */
+    bool (*data_exchange)(void* context, uint8_t* send_buffer, uint8_t send_length,
+        uint8_t* response_buffer, uint8_t* response_length);
+
+    /**
+     * @brief Random number generator
+     *
+     * @param context Context pointer of the session
+     * @return Random byte
+     */
+    uint8_t (*random)(void* context);
+
+    /**
+     * @brief Loads the enrollment record
+     *
+     * @param context Context pointer of the session
+     * @param challenge Output buffer for the challenge
+     * @param iv Output buffer for the IV
+     * @param secret_key Output buffer for the encrypted secret key
+     * @return true if a valid record was found
+     */
+    bool (*load)(void* context, uint8_t challenge[CHALLENGE_SIZE], uint8_t iv[AES_BLOCKLEN],
+        uint8_t secret_key[SECRET_KEY_SIZE_PAD]);
+
+    /**
+     * @brief Stores a new enrollment record, replacing the previous one
+     *
+     * @param context Context pointer of the session
+     * @param challenge The challenge
+     * @param iv The IV
+     * @param secret_key The encrypted secret key
+     * @return true on success
+     */
+    bool (*store)(void* context, const uint8_t challenge[CHALLENGE_SIZE], const uint8_t iv[AES_BLOCKLEN],
+        const uint8_t secret_key[SECRET_KEY_SIZE_PAD]);
+
+    /**
+     * @brief Starts an NFC exchange without waiting for it, only required by the resumable authentication
+     *
+     * @param context Context pointer of the session
+     * @param send_buffer Buffer to be sent to the target
+     * @param send_length Amount of bytes to be sent
+     * @param response_buffer Buffer to be read from the target
+     * @param response_length Size of the response buffer, set to the amount of bytes read once the exchange is done
+     * @return true if the exchange has been started
+     */
+    bool (*data_exchange_start)(void* context, uint8_t* send_buffer, uint8_t send_length,
+        uint8_t* response_buffer, uint8_t* response_length);
+
+    /**
+     * @brief Polls the exchange started by data_exchange_start, only required by the resumable authentication
+     *
+     * @param context Context pointer of the session
+     * @return YKHMAC_PENDING while the exchange is in progress, then YKHMAC_DONE or YKHMAC_FAILED
+     */
+    ykhmac_status (*data_exchange_poll)(void* context);
+};
+
+namespace ykhmac
+{
+    /**
+     * @brief Hooks and context of a session, shared by its policies
+     */
+    struct SessionBinding
+    {
+        const ykhmac_session_hooks* hooks;  //!< Interfaces of the session
+        void* context;                      //!< Passed to each interface
+    };
+
+    /**
+     * @brief Transport policy of a session, owns its transport frame
+     */
+    struct SessionTransport
+    {
+        static constexpr size_t frame_capacity = FRAME_SIZE;    //!< Size of the transport frame
+
+        SessionBinding binding;                                 //!< Hooks and context
+        uint8_t frame_buffer[FRAME_SIZE];                       //!< Transport frame of the session
+
+        uint8_t* frame() { return frame_buffer; }
+        bool exchange(uint8_t* send_buffer, uint8_t send_length, uint8_t* response_buffer, uint8_t* response_length)
+        {
+            return binding.hooks->data_exchange(binding.context, send_buffer, send_length,
+                response_buffer, response_length);
+        }
+        bool exchange_start(uint8_t* send_buffer, uint8_t send_length, uint8_t* response_buffer, uint8_t* response_length)
+        {
+            return binding.hooks->data_exchange_start != nullptr
+                && binding.hooks->data_exchange_start(binding.context, send_buffer, send_length,
+                    response_buffer, response_length);
+        }
+        ykhmac_status exchange_poll()
+        {
+            return binding.hooks->data_exchange_poll(binding.context);
+        }
+    };
+
+    /**
+     * @brief Storage policy of a session, re-enrollments are stored immediately
+     */
+    struct SessionStorage
+    {
+        SessionBinding binding; //!< Hooks and context
+
+        bool load(uint8_t* challenge, uint8_t* iv, uint8_t* secret_key)
+        {
+            return binding.hooks->load(binding.context, challenge, iv, secret_key);
+        }
+        bool store(const uint8_t* challenge, const uint8_t* iv, const uint8_t* secret_key)
+        {
+            return binding.hooks->store(binding.context, challenge, iv, secret_key);
+        }
+        bool update(const uint8_t* challenge, const uint8_t* iv, const uint8_t* secret_key)
+        {
+            return store(challenge, iv, secret_key);
+        }
+        ykhmac_status update_poll()
+        {
+            return YKHMAC_DONE;
+        }
+    };
+
+    /**
+     * @brief Random number generator policy of a session
+     */
+    struct SessionRng
+    {
+        SessionBinding binding; //!< Hooks and context
+
+        uint8_t random() { return binding.hooks->random(binding.context); }
+    };
+}
+
+/**
+ * @brief State of a session: its transport frame, its scratch arena and its hooks
+ *
+ * Sessions do not share any state, so different sessions may be used from different threads
+ * at the same time. A single session must not be used concurrently.
+ */
+struct ykhmac_session
+{
+    ykhmac::Engine<ykhmac::SessionTransport, ykhmac::SessionStorage, ykhmac::SessionRng> engine; //!< Engine of the session
+};
+
+/**
+ * @brief Initializes a session
+ *
+ * @param session The session
+ * @param hooks Interfaces of the session, must stay valid while the session is used
+ * @param context Passed to each interface
+ */
+void ykhmac_session_init(struct ykhmac_session* session, const struct ykhmac_session_hooks* hooks, void* context);
+
+/**
+ * @brief Selects an applet by its AID, see ykhmac_select
+ *
+ * @param session The session
+ * @param aid The AID of the applet
+ * @param aid_size The length of the AID in bytes, max. ARG_BUF_SIZE_MAX
+ * @return true on success
+ */
+bool ykhmac_session_select(struct ykhmac_session* session, const uint8_t* aid, const uint8_t aid_size);
+
+/**
+ * @brief Reads the serial number of the target, see ykhmac_read_serial
+ *
+ * @param session The session
+ * @param serial The serial number
+ * @return true on success
+ */
+bool ykhmac_session_read_serial(struct ykhmac_session* session, uint32_t* serial);
+
+/**
+ * @brief Performs a HMAC-SHA1 challenge-response exchange with the target, see ykhmac_exchange_hmac
+ *
+ * @param session The session
+ * @param slot Which slot to use, either SLOT_1 or SLOT_2
+ * @param challenge Input buffer, contains challenge
+ * @param challenge_length Size of the input buffer in bytes, max. ARG_BUF_SIZE_MAX
+ * @param response Output buffer, contains response. May be nullptr to discard response
+ * @return true on success
+ */
+bool ykhmac_session_exchange_hmac(struct ykhmac_session* session, const uint8_t slot,
+    const uint8_t* challenge, const uint8_t challenge_length, uint8_t response[RESP_BUF_SIZE]);
+
+/**
+ * @brief Enrolls a secret key using the storage of the session, see ykhmac_enroll_key
+ *
+ * @param session The session
+ * @param secret_key The secret key to be enrolled
+ * @return true on success
+ */
+bool ykhmac_session_enroll_key(struct ykhmac_session* session, const uint8_t secret_key[SECRET_KEY_SIZE]);
+
+/**
+ * @brief Tries to authenticate a target against the secret key stored by the session, see ykhmac_authenticate
+ *
+ * @param session The session
+ * @param slot Which slot to use, either SLOT_1 or SLOT_2
+ * @return true on successful authentication
+ */
+bool ykhmac_session_authenticate(struct ykhmac_session* session, const uint8_t slot);
+
+/**
+ * @brief Starts a resumable authentication, see ykhmac_authenticate_start
+ *
+ * Requires the data_exchange_start and data_exchange_poll interfaces.
+ *
+ * @param session The session
+ * @param slot Which slot to use, either SLOT_1 or SLOT_2
+ * @param aid The AID of the applet to select first, or nullptr if it has been selected already
+ * @param aid_size The length of the AID in bytes, max. ARG_BUF_SIZE_MAX
+ * @return true if the authentication is in progress
+ */
+bool ykhmac_session_authenticate_start(struct ykhmac_session* session, const uint8_t slot,
+    const uint8_t* aid = nullptr, const uint8_t aid_size = 0);
+
+/**
+ * @brief Advances a resumable authentication, see ykhmac_authenticate_step
+ *
+ * @param session The session
+ * @return YKHMAC_DONE on successful authentication, YKHMAC_FAILED if it has failed
+ *         or none is in progress, YKHMAC_PENDING otherwise
+ */
+ykhmac_status ykhmac_session_authenticate_step(struct ykhmac_session* session);
+
+#endif
@@ -0,0 +1,187 @@
+/**
+ * @file ykhmac_storage.h
+ * @author Christoph Honal
+ * @brief Defines the persistent storage layer, the wear-leveled enrollment record ring and the token table
+ * @version 0.1
+ * @date 2021-12-17
+ */
+
+#ifndef YKHMAC_STORAGE_H
+#define YKHMAC_STORAGE_H
+
+#include "ykhmac.h"
+
+
+/**
+ * @brief Updates a CRC-16/CCITT-FALSE checksum
+ *
+ * @param crc The checksum so far, start with 0xFFFF
+ * @param data Buffer to be checksummed
+ * @param size Amount of bytes in the buffer
+ * @return The updated checksum
+ */
+uint16_t ykhmac_crc16(uint16_t crc, const uint8_t* data, const size_t size);
+
+/**
+ * @brief Writes only those bytes to persistent storage which differ from the stored ones
+ *
+ * Compares the stored data in chunks of STORAGE_CHUNK_SIZE bytes, and passes each run of
+ * changed bytes to ykhmac_presistent_write. On flash, the target range must be erased first.
+ *
+ * @param data Buffer to be written from
+ * @param size Amount of bytes to be written
+ * @param offset Where to write the bytes to
+ * @return true on success
+ */
+bool ykhmac_storage_write(const uint8_t* data, const size_t size, const size_t offset);
+
+/**
+ * @brief Prepares a page-aligned range of persistent storage for writing
+ *
+ * On flash, erases all pages of the range which are not blank. On EEPROM, does nothing.
+ *
+ * @param size Amount of bytes to be prepared, multiple of STORAGE_PAGE_SIZE
+ * @param offset Start of the range, multiple of STORAGE_PAGE_SIZE
+ * @return true on success
+ */
+bool ykhmac_storage_prepare(const size_t size, const size_t offset);
+
+/**
+ * @brief Reads and verifies the enrollment record in a slot
+ *
+ * @param offset Start of the record slot
+ * @param crc Initial checksum value, 0xFFFF or a checksum which binds the record to some context
+ * @param generation Output, generation counter of the record
+ * @param challenge Output buffer for the challenge
+ * @param iv Output buffer for the IV
+ * @param secret_key Output buffer for the encrypted secret key
+ * @return true if the record is valid
+ */
+bool ykhmac_record_read(const size_t offset, uint16_t crc, uint32_t* generation,
+    uint8_t challenge[CHALLENGE_SIZE], uint8_t iv[AES_BLOCKLEN], uint8_t secret_key[SECRET_KEY_SIZE_PAD]);
+
+/**
+ * @brief Writes an enrollment record into a slot
+ *
+ * The checksum is written last, an interrupted write leaves an invalid record.
+ *
+ * @param offset Start of the record slot
+ * @param crc Initial checksum value, see ykhmac_record_read
+ * @param generation Generation counter of the record
+ * @param challenge The challenge
+ * @param iv The IV
+ * @param secret_key The encrypted secret key
+ * @return true on success
+ */
+bool ykhmac_record_write(const size_t offset, uint16_t crc, const uint32_t generation,
+    const uint8_t challenge[CHALLENGE_SIZE], const uint8_t iv[AES_BLOCKLEN],
+    const uint8_t secret_key[SECRET_KEY_SIZE_PAD]);
+
+#ifdef YKHMAC_TOKEN_TABLE
+    /**
+     * @brief Loads challenge, IV and encrypted secret key of a token from the token table
+     *
+     * Reads one index bucket per probe, usually only one.
+     *
+     * @param serial The serial number of the token
+     * @param challenge Output buffer for the challenge
+     * @param iv Output buffer for the IV
+     * @param secret_key Output buffer for the encrypted secret key
+     * @return true if the token is enrolled and its record is valid
+     */
+    bool ykhmac_table_load(const uint32_t serial, uint8_t challenge[CHALLENGE_SIZE],
+        uint8_t iv[AES_BLOCKLEN], uint8_t secret_key[SECRET_KEY_SIZE_PAD]);
+
+    /**
+     * @brief Stores an enrollment record of a token in the token table
+     *
+     * The record is written into a free slot first, then the index bucket is pointed to it
+     * using a single byte write, so that an interrupted write leaves the previous record valid.
+     *
+     * @param serial The serial number of the token
+     * @param challenge The challenge
+     * @param iv The IV
+     * @param secret_key The encrypted secret key
+     * @return true on success, false if the table is full
+     */
+    bool ykhmac_table_store(const uint32_t serial, const uint8_t challenge[CHALLENGE_SIZE],
+        const uint8_t iv[AES_BLOCKLEN], const uint8_t secret_key[SECRET_KEY_SIZE_PAD]);
+
+    /**
+     * @brief Marks the index bucket of a token as deleted, and frees its record slot
+     *
+     * @param serial The serial number of the token
+     * @return true if the token was enrolled and has been removed
+     */
+    bool ykhmac_table_remove(const uint32_t serial);
+
+    /**
+     * @brief Marks all index buckets as empty
+     *
+     * @return true on success
+     */
+    bool ykhmac_table_format();
+#else
+    /**
+     * @brief Loads challenge, IV and encrypted secret key from the newest valid enrollment record
+     *
+     * @param challenge Output buffer for the challenge
+     * @param iv Output buffer for the IV
+     * @param secret_key Output buffer for the encrypted secret key
+     * @return true if a valid record was found
+     */
+    bool ykhmac_record_load(uint8_t challenge[CHALLENGE_SIZE], uint8_t iv[AES_BLOCKLEN],
+        uint8_t secret_key[SECRET_KEY_SIZE_PAD]);
+
+    /**
+     * @brief Stores a new enrollment record in the slot following the newest valid record
+     *
+     * The record slots form a ring, so that writes are distributed evenly across the storage.
+     * An interrupted write leaves an invalid checksum, the previous record stays valid.
+     *
+     * @param challenge The challenge
+     * @param iv The IV
+     * @param secret_key The encrypted secret key
+     * @return true on success
+     */
+    bool ykhmac_record_store(const uint8_t challenge[CHALLENGE_SIZE], const uint8_t iv[AES_BLOCKLEN],
+        const uint8_t secret_key[SECRET_KEY_SIZE_PAD]);
+
+    /**
+     * @brief Forgets the cached position of the newest record, so that the ring is scanned again
+     */
+    void ykhmac_record_reset();
+
+    #ifdef YKHMAC_PRECOMPUTE
+        /**
+         * @brief Appends a precomputed enrollment record to the unused records
+         *
+         * The unused records are those preceding the newest record in consecutive generations,
+         * ykhmac_record_load returns the oldest of them. ykhmac_record_store starts a new run,
+         * which leaves the records of the previous secret key behind.
+         *
+         * @param challenge The challenge
+         * @param iv The IV
+         * @param secret_key The encrypted secret key
+         * @return true on success, false if all slots hold unused records
+         */
+        bool ykhmac_record_append(const uint8_t challenge[CHALLENGE_SIZE], const uint8_t iv[AES_BLOCKLEN],
+            const uint8_t secret_key[SECRET_KEY_SIZE_PAD]);
+
+        /**
+         * @brief Marks the oldest unused record as used, using a single byte write
+         *
+         * @return true on success
+         */
+        bool ykhmac_record_consume();
+
+        /**
+         * @brief Returns the amount of unused records
+         *
+         * @return The amount of records, at most RECORD_COUNT
+         */
+        uint8_t ykhmac_record_available();
+    #endif
+#endif
+
+#endif
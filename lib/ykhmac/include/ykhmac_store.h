@@ -0,0 +1,178 @@
+/**
+ * @file ykhmac_store.h
+ * @author Christoph Honal
+ * @brief Defines the memory-mapped enrollment store for Linux hosts, which holds the records of many tokens
+ * @version 0.1
+ * @date 2021-12-17
+ *
+ * The store is a single file, mapped into the address space of each process using it. It starts with
+ * a header page, followed by shards of equal size. Each shard holds an open-addressed index of
+ * serial numbers and a pool of record pairs, the shard and the bucket of a token are derived from a hash
+ * of its serial number. The file uses the byte order of the host, the header identifies the layout.
+ *
+ * Readers never lock: they copy the active record of a token and check its CRC, and retry if the token
+ * has been updated in the meantime. An update writes the inactive record of the pair, and then swaps
+ * the active one by advancing the generation in the index bucket. Tokens never share a bucket or a
+ * record, so authentications of different tokens never contend.
+ */
+
+#ifndef YKHMAC_STORE_H
+#define YKHMAC_STORE_H
+
+#include "ykhmac.h"
+
+// Only available on Linux hosts
+#if defined(__linux__) && !defined(ARDUINO)
+    #define YKHMAC_STORE_MMAP
+#endif
+
+#ifdef YKHMAC_STORE_MMAP
+
+#define STORE_MAGIC             0x5453434d484b59ULL             //!< "YKHMCST", also identifies the byte order
+#define STORE_VERSION           1                               //!< Version of the file format
+#define STORE_HEADER_SIZE       4096                            //!< Size of the header page
+#define STORE_SHARD_ALIGN       64                              //!< Alignment of the shards and their parts
+#define STORE_RECORD_SIZE       (((8 + CHALLENGE_SIZE + AES_BLOCKLEN + SECRET_KEY_SIZE_PAD + 2) + 7) / 8 * 8) //!< Size of a stored record
+#define STORE_ENROLLED          0x40000000u                     //!< Bucket state: the active record is valid
+#define STORE_WRITING           0x80000000u                     //!< Bucket state: an update is in progress
+#define STORE_GENERATION        0x3FFFFFFFu                     //!< Bucket state: generation, its lowest bit selects the active record
+
+/**
+ * @brief Header of the store file
+ */
+struct ykhmac_store_header
+{
+    uint64_t magic;                 //!< STORE_MAGIC
+    uint32_t version;               //!< STORE_VERSION
+    uint16_t challenge_size;        //!< CHALLENGE_SIZE of the records
+    uint16_t secret_key_size_pad;   //!< SECRET_KEY_SIZE_PAD of the records
+    uint32_t record_size;           //!< STORE_RECORD_SIZE
+    uint32_t shards;                //!< Amount of shards
+    uint32_t buckets;               //!< Amount of index buckets per shard
+    uint32_t pairs;                 //!< Amount of record pairs per shard
+    uint64_t shard_size;            //!< Size of a shard in bytes
+    uint32_t reserved;              //!< Zero
+    uint32_t crc;                   //!< CRC-16 of the fields above
+};
+
+/**
+ * @brief Header of a shard, followed by its index and its record pool
+ */
+struct ykhmac_store_shard
+{
+    uint32_t allocated;             //!< Amount of record pairs handed out, atomic
+    uint32_t enrolled;              //!< Amount of enrolled tokens, atomic
+};
+
+/**
+ * @brief Index bucket of a token, its fields are accessed atomically
+ */
+struct ykhmac_store_bucket
+{
+    uint32_t serial;                //!< Serial number of the token, 0 if the bucket is empty
+    uint32_t pair;                  //!< Record pair of the token plus one, 0 if none has been allocated yet
+    uint32_t state;                 //!< STORE_WRITING, STORE_ENROLLED and the generation
+};
+
+/**
+ * @brief Handle of an open store, may be shared by any amount of threads
+ */
+struct ykhmac_store
+{
+    int fd;                                 //!< File descriptor of the store file
+    uint8_t* base;                          //!< Start of the mapping
+    size_t size;                            //!< Size of the mapping
+    const struct ykhmac_store_header* header; //!< Header page
+};
+
+/**
+ * @brief Opens a store file, creates it if it does not exist
+ *
+ * A new file is sized for the given capacity, with 50% spare index buckets per shard, and some spare
+ * records per shard for uneven hashing. The file stays sparse until the records have been written.
+ * An existing file keeps its layout, it is rejected if its header does not match this build.
+ *
+ * @param store The handle to be initialized
+ * @param path Path of the store file
+ * @param capacity Amount of tokens a new file is sized for
+ * @param shards Amount of shards of a new file
+ * @return true on success
+ */
+bool ykhmac_store_open(struct ykhmac_store* store, const char* path, const uint32_t capacity, const uint32_t shards);
+
+/**
+ * @brief Unmaps and closes a store, without syncing it
+ *
+ * @param store The store
+ */
+void ykhmac_store_close(struct ykhmac_store* store);
+
+/**
+ * @brief Loads the enrollment record of a token, lock-free
+ *
+ * @param store The store
+ * @param serial Serial number of the token
+ * @param challenge Output buffer for the challenge
+ * @param iv Output buffer for the IV
+ * @param secret_key Output buffer for the encrypted secret key
+ * @return true if the token is enrolled and its record is valid
+ */
+bool ykhmac_store_load(const struct ykhmac_store* store, const uint32_t serial, uint8_t challenge[CHALLENGE_SIZE],
+    uint8_t iv[AES_BLOCKLEN], uint8_t secret_key[SECRET_KEY_SIZE_PAD]);
+
+/**
+ * @brief Stores the enrollment record of a token, enrolls it if it is not known yet
+ *
+ * Writes the inactive record of the token, and then makes it the active one. Fails if the shard
+ * of the token is full, or if another update of the same token is in progress.
+ *
+ * @param store The store
+ * @param serial Serial number of the token, must not be 0
+ * @param challenge The challenge
+ * @param iv The IV
+ * @param secret_key The encrypted secret key
+ * @return true on success
+ */
+bool ykhmac_store_store(const struct ykhmac_store* store, const uint32_t serial, const uint8_t challenge[CHALLENGE_SIZE],
+    const uint8_t iv[AES_BLOCKLEN], const uint8_t secret_key[SECRET_KEY_SIZE_PAD]);
+
+/**
+ * @brief Revokes the enrollment of a token, its bucket and records are kept for a re-enrollment
+ *
+ * @param store The store
+ * @param serial Serial number of the token
+ * @return true if the token had been enrolled
+ */
+bool ykhmac_store_revoke(const struct ykhmac_store* store, const uint32_t serial);
+
+/**
+ * @brief Returns the amount of enrolled tokens
+ *
+ * @param store The store
+ * @return The amount of tokens
+ */
+uint64_t ykhmac_store_count(const struct ykhmac_store* store);
+
+/**
+ * @brief Clears the update flags left behind by crashed processes
+ *
+ * Must only be called while no other process or thread updates the store, e.g. on startup.
+ *
+ * @param store The store
+ * @return The amount of cleared flags
+ */
+uint64_t ykhmac_store_recover(const struct ykhmac_store* store);
+
+/**
+ * @brief Writes the modified pages of the store to disk
+ *
+ * Updates survive a crash of the process without it, but not a crash of the host.
+ *
+ * @param store The store
+ * @return true on success
+ */
+bool ykhmac_store_sync(const struct ykhmac_store* store);
+
+#endif
+
+#endif
@@ -0,0 +1,213 @@
+/**
+ * @file ykhmac_trace.h
+ * @author Christoph Honal
+ * @brief Defines the binary trace buffer, and the logging macros shared with YKHMAC_DEBUG
+ * @version 0.1
+ * @date 2021-12-17
+ */
+
+#ifndef YKHMAC_TRACE_H
+#define YKHMAC_TRACE_H
+
+#include <inttypes.h>
+#include <stddef.h>
+
+
+/**
+ * @brief Events of the library, logged to the debug output and the trace buffer
+ *
+ * scripts/ykhmac_trace.py reads the messages from the comments below, keep one event per line.
+ */
+enum ykhmac_trace_event : uint8_t
+{
+    YKHMAC_EVENT_AUTHENTICATE,          //!< Authenticating key
+    YKHMAC_EVENT_AUTHENTICATED,         //!< Successfully authenticated token
+    YKHMAC_EVENT_AUTHENTICATE_FAILED,   //!< Failed to authenticate token
+    YKHMAC_EVENT_SELECT_FAILED,         //!< Failed to select applet
+    YKHMAC_EVENT_SERIAL_FAILED,         //!< Failed to read serial number
+    YKHMAC_EVENT_EXCHANGE_FAILED,       //!< Failed to exchange HMAC
+    YKHMAC_EVENT_LOADED_CHALLENGE,      //!< Loaded challenge
+    YKHMAC_EVENT_LOADED_IV,             //!< Loaded IV
+    YKHMAC_EVENT_LOADED_SECRET_KEY,     //!< Loaded secret key
+    YKHMAC_EVENT_LOAD_FAILED,           //!< Failed to read data from persistent storage
+    YKHMAC_EVENT_EXCHANGED_RESPONSE,    //!< Exchanged response
+    YKHMAC_EVENT_DECRYPTED_SECRET_KEY,  //!< Decrypted secret key
+    YKHMAC_EVENT_COMPUTED_RESPONSE,     //!< Computed response
+    YKHMAC_EVENT_RESPONSES_MATCH,       //!< Responses match
+    YKHMAC_EVENT_RESPONSES_MISMATCH,    //!< Responses do not match
+    YKHMAC_EVENT_HMAC_FAILED,           //!< Failed to compute HMAC
+    YKHMAC_EVENT_ENROLL,                //!< Enrolling key
+    YKHMAC_EVENT_SECRET_KEY,            //!< Using secret key
+    YKHMAC_EVENT_RANDOM_CHALLENGE,      //!< Random challenge
+    YKHMAC_EVENT_PADDED_SECRET_KEY,     //!< Padded secret key
+    YKHMAC_EVENT_IV,                    //!< Using IV
+    YKHMAC_EVENT_ENCRYPTED_SECRET_KEY,  //!< Encrypted secret key
+    YKHMAC_EVENT_STORED,                //!< Wrote data to persistent storage
+    YKHMAC_EVENT_STORE_FAILED,          //!< Failed to write data to persistent storage
+    YKHMAC_EVENT_ENROLLED,              //!< Successfully enrolled key
+    YKHMAC_EVENT_ENROLL_FAILED,         //!< Failed to enroll key
+    YKHMAC_EVENT_DEFERRED,              //!< Deferred write to persistent storage
+    YKHMAC_EVENT_COMMITTED,             //!< Committed pending record
+    YKHMAC_EVENT_COMMIT_FAILED,         //!< Failed to commit pending record
+    YKHMAC_EVENT_CACHE_HIT,             //!< Found token in session cache
+    YKHMAC_EVENT_CACHE_STALE,           //!< Cached token has been swapped or reconfigured
+    YKHMAC_EVENT_CONSUMED,              //!< Marked precomputed record as used
+    YKHMAC_EVENT_CONSUME_FAILED,        //!< Failed to mark precomputed record as used
+    YKHMAC_EVENT_RETRY,                 //!< Retrying APDU after a transient fault
+    YKHMAC_EVENT_RETRY_EXPIRED,         //!< Gave up retrying APDU
+    YKHMAC_EVENT_PADDING_MISMATCH,      //!< Decrypted padding is not zero, rejected before the HMAC
+    YKHMAC_EVENTS                       //!< Amount of events
+};
+
+// Redaction levels of the trace buffer
+#define TRACE_EVENTS            0       //!< Events only, no payloads
+#define TRACE_PUBLIC            1       //!< Payloads which are stored unprotected anyway (challenge, IV, encrypted secret key)
+#define TRACE_SECRETS           2       //!< All payloads including key material, like YKHMAC_DEBUG. Do not use in production
+
+#ifdef YKHMAC_TRACE
+    // On AVR, the default buffer holds the events of one selection and authentication (18 records),
+    // the payloads of TRACE_PUBLIC take about twice as many records
+    #ifndef TRACE_LEVEL
+        #ifdef ARDUINO_ARCH_AVR
+            #define TRACE_LEVEL TRACE_EVENTS                    //!< Redaction level, key material is never recorded below TRACE_SECRETS
+        #else
+            #define TRACE_LEVEL TRACE_PUBLIC                    //!< Redaction level, key material is never recorded below TRACE_SECRETS
+        #endif
+    #endif
+    #ifndef TRACE_RECORDS
+        #ifdef ARDUINO_ARCH_AVR
+            #define TRACE_RECORDS 20                            //!< Capacity of the trace buffer in records, the oldest ones are overwritten
+        #else
+            #define TRACE_RECORDS 1024                          //!< Capacity of the trace buffer in records, the oldest ones are overwritten
+        #endif
+    #endif
+    #ifndef TRACE_PAYLOAD_SIZE
+        #define TRACE_PAYLOAD_SIZE 10                           //!< Payload bytes per record, longer payloads continue in the next records
+    #endif
+    #if TRACE_PAYLOAD_SIZE < 1 || TRACE_PAYLOAD_SIZE > 31
+        #error "TRACE_PAYLOAD_SIZE must be between 1 and 31"
+    #endif
+    #define TRACE_LENGTH_MASK   0x1F                            //!< Payload bytes of a record
+    #define TRACE_FOLLOWS       0x20                            //!< The payload continues the one of the previous record
+    #define TRACE_REDACTED      0x40                            //!< The payload has been left out because of the redaction level
+    #define TRACE_CONTINUED     0x80                            //!< The payload continues in the next record
+
+    /**
+     * @brief Record of the trace buffer, the timestamp is little-endian on all supported platforms
+     */
+    struct ykhmac_trace_record
+    {
+        uint32_t timestamp;                 //!< Time of the event, see ykhmac_clock
+        uint8_t event;                      //!< The event, see ykhmac_trace_event
+        uint8_t flags;                      //!< Payload length and TRACE_FOLLOWS, TRACE_REDACTED, TRACE_CONTINUED
+        uint8_t payload[TRACE_PAYLOAD_SIZE]; //!< Payload, or a part of it
+    };
+
+    #define TRACE_RAM_SIZE      (TRACE_RECORDS * sizeof(struct ykhmac_trace_record)) //!< Size of the trace buffer
+
+    /**
+     * @brief Records an event in the trace buffer, see YKHMAC_LOG
+     *
+     * Only copies the payload, formatting is left to scripts/ykhmac_trace.py.
+     * Thread-safe on native builds, must not be called from an interrupt on microcontrollers.
+     *
+     * @param event The event
+     * @param data The payload, may be nullptr
+     * @param size Size of the payload in bytes
+     * @param flags TRACE_REDACTED if the payload has been left out, 0 otherwise
+     */
+    void ykhmac_trace(const uint8_t event, const uint8_t* data, const uint8_t size, const uint8_t flags);
+
+    /**
+     * @brief Removes the oldest record from the trace buffer
+     *
+     * @param record Output, the record
+     * @return true if there was a record
+     */
+    bool ykhmac_trace_read(struct ykhmac_trace_record* record);
+
+    /**
+     * @brief Returns the amount of records which have been overwritten before being read
+     *
+     * @return The amount of records
+     */
+    uint32_t ykhmac_trace_dropped();
+
+    /**
+     * @brief Empties the trace buffer and resets the amount of dropped records
+     */
+    void ykhmac_trace_clear();
+
+    #define YKHMAC_TRACE_EVENT(event)               ykhmac_trace(event, nullptr, 0, 0)
+    #if TRACE_LEVEL >= TRACE_PUBLIC
+        #define YKHMAC_TRACE_PUBLIC(event, data, size) ykhmac_trace(event, data, size, 0)
+    #else
+        #define YKHMAC_TRACE_PUBLIC(event, data, size) ykhmac_trace(event, nullptr, 0, TRACE_REDACTED)
+    #endif
+    #if TRACE_LEVEL >= TRACE_SECRETS
+        #define YKHMAC_TRACE_SECRET(event, data, size) ykhmac_trace(event, data, size, 0)
+    #else
+        #define YKHMAC_TRACE_SECRET(event, data, size) ykhmac_trace(event, nullptr, 0, TRACE_REDACTED)
+    #endif
+#else
+    #define TRACE_RAM_SIZE      0                               //!< No trace buffer without YKHMAC_TRACE
+    #define YKHMAC_TRACE_EVENT(event)
+    #define YKHMAC_TRACE_PUBLIC(event, data, size)
+    #define YKHMAC_TRACE_SECRET(event, data, size)
+#endif
+
+#ifdef YKHMAC_DEBUG
+    // Print array as hex string to some debug output, one line at once
+    #ifdef ARDUINO_ARCH_AVR
+        inline void ykhmac_debug_print_array(const __FlashStringHelper* prefix,
+            const uint8_t* data, const size_t size)
+    #else
+        inline void ykhmac_debug_print_array(const char* prefix, const uint8_t* data,
+            const size_t size)
+    #endif
+        {
+            static const char digits[] = "0123456789abcdef";
+            char line[3 * 16 + 1];
+
+            ykhmac_debug_print(prefix);
+            for (size_t i = 0; i < size; i += 16)
+            {
+                uint8_t length = 0;
+                for (size_t j = i; j < size && j < i + 16; j++)
+                {
+                    line[length++] = digits[data[j] >> 4];
+                    line[length++] = digits[data[j] & 0x0F];
+                    line[length++] = ' ';
+                }
+                line[length] = '\0';
+                ykhmac_debug_print(line);
+            }
+            ykhmac_debug_print("\n");
+        }
+
+    #define YKHMAC_DEBUG_LOG(message)                   ykhmac_debug_print(F(message))
+    #define YKHMAC_DEBUG_LOG_ARRAY(prefix, data, size)  ykhmac_debug_print_array(F(prefix), data, size)
+#else
+    #define YKHMAC_DEBUG_LOG(message)
+    #define YKHMAC_DEBUG_LOG_ARRAY(prefix, data, size)
+#endif
+
+/**
+ * @brief Logs an event to the debug output and the trace buffer, compiles to nothing if neither is enabled
+ */
+#define YKHMAC_LOG(event, message) \
+    do { YKHMAC_DEBUG_LOG(message); YKHMAC_TRACE_EVENT(event); } while (0)
+
+/**
+ * @brief Logs an event with a payload which is stored unprotected anyway, e.g. the challenge
+ */
+#define YKHMAC_LOG_PUBLIC(event, prefix, data, size) \
+    do { YKHMAC_DEBUG_LOG_ARRAY(prefix, data, size); YKHMAC_TRACE_PUBLIC(event, data, size); } while (0)
+
+/**
+ * @brief Logs an event with key material as payload, which is only recorded at TRACE_SECRETS
+ */
+#define YKHMAC_LOG_SECRET(event, prefix, data, size) \
+    do { YKHMAC_DEBUG_LOG_ARRAY(prefix, data, size); YKHMAC_TRACE_SECRET(event, data, size); } while (0)
+
+#endif
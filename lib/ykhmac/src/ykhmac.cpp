@@ -7,411 +7,490 @@
  */
 
 #include "ykhmac.h"
+#include "ykhmac_storage.h"
 
+#include <string.h>
 #include <sha/sha1.h>
 #include <aes.hpp>
 
 
-#ifdef YKHMAC_DEBUG
-        // Print array as string to some debug output
-    #ifdef ARDUINO_ARCH_AVR
-        void ykhmac_debug_print_array(const __FlashStringHelper* prefix, 
-            const uint8_t* data, const size_t size)
-    #else
-        void ykhmac_debug_print_array(const char* prefix, const uint8_t* data, 
-            const size_t size)
-    #endif
+// Transport policy using ykhmac_data_exchange and ykhmac_frame
+struct ykhmac_c_transport
+{
+    static constexpr size_t frame_capacity = FRAME_SIZE;
+
+    uint8_t* frame()
+    {
+        return ykhmac_frame;
+    }
+
+    bool exchange(uint8_t* send_buffer, uint8_t send_length, uint8_t* response_buffer, uint8_t* response_length)
+    {
+        return ykhmac_data_exchange(send_buffer, send_length, response_buffer, response_length);
+    }
+
+    #ifdef YKHMAC_NONBLOCKING
+        bool exchange_start(uint8_t* send_buffer, uint8_t send_length, uint8_t* response_buffer, uint8_t* response_length)
         {
-            ykhmac_debug_print(prefix);
-            char hxdig[4] = {0};
-            for (size_t i = 0; i < size; i++)
-            {
-                sprintf(hxdig, "%02x ", data[i]);
-                ykhmac_debug_print(hxdig);
-            }
-            ykhmac_debug_print("\n");
+            return ykhmac_data_exchange_start(send_buffer, send_length, response_buffer, response_length);
         }
-#endif
 
-// Decode APDU response code
-uint8_t ykhmac_response_code(const uint8_t *recv_buffer, const uint8_t recv_length)
+        ykhmac_status exchange_poll()
+        {
+            return ykhmac_data_exchange_poll();
+        }
+    #endif
+};
+
+// Random number generator policy using ykhmac_random
+struct ykhmac_c_rng
 {
-    if (recv_length < 2)
+    uint8_t random()
     {
-        return E_UNEXPECTED;
+        return ykhmac_random();
     }
+};
 
-    if (recv_buffer[recv_length - 2] == SW_OK_HIGH &&
-        recv_buffer[recv_length - 1] == SW_OK_LOW)
+// Storage policy using the record ring or the token table, defers re-enrollments if YKHMAC_WRITE_BEHIND is defined,
+// or appends precomputed records if YKHMAC_PRECOMPUTE is defined
+struct ykhmac_c_storage
+{
+    #ifdef YKHMAC_TOKEN_TABLE
+        uint32_t serial;                                // Serial number of the token being enrolled or authenticated
+    #endif
+    #ifdef YKHMAC_WRITE_BEHIND
+        bool pending;                                   // Whether an enrollment record is waiting to be written
+        uint8_t pending_challenge[CHALLENGE_SIZE];      // Challenge of the pending record
+        uint8_t pending_iv[AES_BLOCKLEN];               // IV of the pending record
+        uint8_t pending_secret_key[SECRET_KEY_SIZE_PAD]; // Encrypted secret key of the pending record
+        #ifdef YKHMAC_TOKEN_TABLE
+            uint32_t pending_serial;                    // Serial number of the token of the pending record
+        #endif
+    #endif
+    #ifdef YKHMAC_PRECOMPUTE
+        bool kept;                                      // Whether the secret key is kept for replenishing
+        uint8_t kept_secret_key[SECRET_KEY_SIZE];       // Secret key, until the ring has been filled again
+    #endif
+
+    bool load(uint8_t* challenge, uint8_t* iv, uint8_t* secret_key)
     {
-        return E_SUCCESS;
+        #ifdef YKHMAC_WRITE_BEHIND
+            // The challenge of a pending record supersedes the stored one
+            if (!commit()) return false;
+        #endif
+
+        #ifdef YKHMAC_TOKEN_TABLE
+            return ykhmac_table_load(serial, challenge, iv, secret_key);
+        #else
+            return ykhmac_record_load(challenge, iv, secret_key);
+        #endif
     }
 
-    if (recv_buffer[recv_length - 2] == SW_PRECOND_HIGH &&
-        recv_buffer[recv_length - 1] == SW_PRECOND_LOW)
+    bool store(const uint8_t* challenge, const uint8_t* iv, const uint8_t* secret_key)
     {
-        return E_CARD_NOT_AUTHENTICATED;
+        #ifdef YKHMAC_WRITE_BEHIND
+            // A pending record would overwrite this enrollment
+            #ifdef YKHMAC_TOKEN_TABLE
+                drop(serial);
+            #else
+                drop();
+            #endif
+        #endif
+
+        #ifdef YKHMAC_PRECOMPUTE
+            // The run of the previous secret key is left behind
+            forget();
+        #endif
+
+        #ifdef YKHMAC_TOKEN_TABLE
+            return ykhmac_table_store(serial, challenge, iv, secret_key);
+        #else
+            return ykhmac_record_store(challenge, iv, secret_key);
+        #endif
     }
 
-    if (recv_buffer[recv_length - 2] == SW_NOTFOUND_HIGH &&
-        recv_buffer[recv_length - 1] == SW_NOTFOUND_LOW)
+    bool update(const uint8_t* challenge, const uint8_t* iv, const uint8_t* secret_key)
     {
-        return E_FILE_NOT_FOUND;
+        #ifdef YKHMAC_WRITE_BEHIND
+            // Keep challenge, IV and encrypted secret key until ykhmac_commit is called
+            memcpy(pending_challenge, challenge, CHALLENGE_SIZE);
+            memcpy(pending_iv, iv, AES_BLOCKLEN);
+            memcpy(pending_secret_key, secret_key, SECRET_KEY_SIZE_PAD);
+            #ifdef YKHMAC_TOKEN_TABLE
+                pending_serial = serial;
+            #endif
+            pending = true;
+            YKHMAC_LOG(YKHMAC_EVENT_DEFERRED, "Deferred write to persistent storage\n");
+            return true;
+        #elif defined(YKHMAC_PRECOMPUTE)
+            // The secret key is kept until the ring is full
+            bool result = ykhmac_record_append(challenge, iv, secret_key);
+            if (!result || ykhmac_record_available() >= RECORD_COUNT) forget();
+            return result;
+        #else
+            return store(challenge, iv, secret_key);
+        #endif
     }
 
-    return E_UNEXPECTED;
-}
+    #ifdef YKHMAC_PRECOMPUTE
+        bool consume()
+        {
+            return ykhmac_record_consume();
+        }
 
+        uint8_t available()
+        {
+            return ykhmac_record_available();
+        }
 
-bool ykhmac_select(const uint8_t *aid, const uint8_t aid_size)
-{
-    if (aid_size > ARG_BUF_SIZE_MAX) return false;
+        // The secret key is only kept in RAM once the ring runs low, the record being used is not counted
+        void retain(const uint8_t* secret_key)
+        {
+            if (kept || ykhmac_record_available() > PRECOMPUTE_LOW + 1) return;
+            memcpy(kept_secret_key, secret_key, SECRET_KEY_SIZE);
+            kept = true;
+        }
+
+        const uint8_t* retained() const
+        {
+            return kept ? kept_secret_key : nullptr;
+        }
 
-    // Communication buffers
-    uint8_t send_buffer[5 + aid_size];
-    uint8_t recv_length = 12;
-    uint8_t recv_buffer[recv_length];
-
-    // Setup command buffers
-    send_buffer[0] = CLA_ISO;
-    send_buffer[1] = INS_SELECT;
-    send_buffer[2] = SEL_APP_AID;
-    send_buffer[3] = 0;
-    send_buffer[4] = aid_size;
-    memcpy(send_buffer + 5, aid, aid_size);
-
-    // Perform transfer
-    if (ykhmac_data_exchange(send_buffer, 5 + aid_size, recv_buffer, &recv_length))
+        // Purges the kept secret key
+        void forget()
+        {
+            kept = false;
+            memset(kept_secret_key, 0, SECRET_KEY_SIZE);
+        }
+    #endif
+
+    #ifdef YKHMAC_NONBLOCKING
+        // The update has been deferred
+        ykhmac_status update_poll()
+        {
+            return YKHMAC_DONE;
+        }
+    #endif
+
+    #ifdef YKHMAC_WRITE_BEHIND
+        bool commit()
+        {
+            if (!pending) return true;
+
+            #ifdef YKHMAC_TOKEN_TABLE
+                bool result = ykhmac_table_store(pending_serial, pending_challenge, pending_iv, pending_secret_key);
+            #else
+                bool result = ykhmac_record_store(pending_challenge, pending_iv, pending_secret_key);
+            #endif
+            if (result)
+            {
+                drop();
+                YKHMAC_LOG(YKHMAC_EVENT_COMMITTED, "Committed pending record\n");
+            }
+            else
+            {
+                YKHMAC_LOG(YKHMAC_EVENT_COMMIT_FAILED, "Failed to commit pending record\n");
+            }
+
+            return result;
+        }
+
+        #ifdef YKHMAC_TOKEN_TABLE
+            // Drops a pending record of a token, it would overwrite a new enrollment or revocation
+            void drop(const uint32_t serial)
+            {
+                if (pending_serial == serial) drop();
+            }
+        #endif
+
+        // Drops the pending record
+        void drop()
+        {
+            pending = false;
+            memset(pending_challenge, 0, CHALLENGE_SIZE);
+            memset(pending_iv, 0, AES_BLOCKLEN);
+            memset(pending_secret_key, 0, SECRET_KEY_SIZE_PAD);
+        }
+    #endif
+};
+
+// Engine instance wrapped by the functions below
+ykhmac::Engine<ykhmac_c_transport, ykhmac_c_storage, ykhmac_c_rng> engine;
+
+#ifdef YKHMAC_RAM_BUDGET
+    static_assert(YKHMAC_STATIC_RAM <= YKHMAC_RAM_BUDGET, "Library buffers exceed YKHMAC_RAM_BUDGET");
+#endif
+#ifdef YKHMAC_RAM_REPORT
+    // Reports the static RAM usage as a compiler warning, along with the configuration
+    template<size_t bytes, size_t challenge_size, size_t secret_key_size, size_t hw_buf_size>
+    struct ykhmac_static_ram
     {
-        return ykhmac_response_code(recv_buffer, recv_length) == E_SUCCESS;
+        __attribute__((deprecated("static RAM report"))) static void report() { }
+    };
+    inline void ykhmac_static_ram_report()
+    {
+        ykhmac_static_ram<YKHMAC_STATIC_RAM, CHALLENGE_SIZE, SECRET_KEY_SIZE, HW_BUF_SIZE>::report();
     }
+#endif
+
+#ifdef YKHMAC_STACK
+    // Paints the stack on construction, and records the high-water mark of an entry point on destruction
+    struct ykhmac_stack_guard
+    {
+        const ykhmac_entry entry;
+        const uint8_t* top;
+
+        ykhmac_stack_guard(const ykhmac_entry entry) : entry(entry), top(ykhmac_stack_paint()) { }
+        ~ykhmac_stack_guard() { ykhmac_stack_record(entry, top); }
+    };
+    #define YKHMAC_STACK_MEASURE(entry) ykhmac_stack_guard stack_guard(entry)
+#else
+    #define YKHMAC_STACK_MEASURE(entry)
+#endif
 
-    return false;
+bool ykhmac_select(const uint8_t *aid, const uint8_t aid_size)
+{
+    YKHMAC_STACK_MEASURE(YKHMAC_ENTRY_SELECT);
+    if (aid_size > ARG_BUF_SIZE_MAX) return false;
+
+    return engine.select(aid, aid_size);
 }
 
 bool ykhmac_read_serial(uint32_t *serial)
 {
-    // Communication buffers
-    uint8_t send_buffer[5];
-    uint8_t recv_length = 6;
-    uint8_t recv_buffer[recv_length];
-
-    // Setup command buffers
-    send_buffer[0] = CLA_ISO;
-    send_buffer[1] = INS_API_REQ;
-    send_buffer[2] = CMD_GET_SERIAL;
-    send_buffer[3] = 0;
-    send_buffer[4] = 6;
-
-    // Perform transfer
-    if (ykhmac_data_exchange(send_buffer, 5, recv_buffer, &recv_length))
-    {
-        if (ykhmac_response_code(recv_buffer, recv_length) == E_SUCCESS && recv_length >= 4)
-        {
-            *serial = ((uint32_t)recv_buffer[0] << 24) + ((uint32_t)recv_buffer[1] << 16) +
-                      ((uint32_t)recv_buffer[2] << 8) + recv_buffer[3];
-            return true;
-        }
-    }
-
-    return false;
+    YKHMAC_STACK_MEASURE(YKHMAC_ENTRY_READ_SERIAL);
+    return engine.read_serial(serial);
 }
 
 bool ykhmac_read_version(uint8_t version[3])
 {
-    // Communication buffers
-    uint8_t send_buffer[5];
-    uint8_t recv_length = 8;
-    uint8_t recv_buffer[recv_length];
-
-    // Setup command buffers
-    send_buffer[0] = CLA_ISO;
-    send_buffer[1] = INS_STATUS;
-    send_buffer[2] = 0;
-    send_buffer[3] = 0;
-    send_buffer[4] = 6;
-
-    // Perform transfer
-    if (ykhmac_data_exchange(send_buffer, 5, recv_buffer, &recv_length))
-    {
-        if (ykhmac_response_code(recv_buffer, recv_length) == E_SUCCESS && recv_length >= 3)
-        {
-            memcpy(version, recv_buffer, 3);
-            return true;
-        }
-    }
-
-    return false;
+    YKHMAC_STACK_MEASURE(YKHMAC_ENTRY_READ_VERSION);
+    return engine.read_version(version);
 }
 
 bool ykhmac_exchange_hmac(const uint8_t slot, const uint8_t *challenge,
                           const uint8_t challenge_length, uint8_t response[RESP_BUF_SIZE])
 {
+    YKHMAC_STACK_MEASURE(YKHMAC_ENTRY_EXCHANGE_HMAC);
     if (challenge_length > ARG_BUF_SIZE_MAX)
         return false;
 
-    uint8_t slot_cmd = 0;
-    if (slot == SLOT_1)
-        slot_cmd = CMD_HMAC_1;
-    else if (slot == SLOT_2)
-        slot_cmd = CMD_HMAC_2;
-    else
-        return false;
+    return engine.exchange_hmac(slot, challenge, challenge_length, response);
+}
+
+uint8_t ykhmac_find_slots()
+{
+    YKHMAC_STACK_MEASURE(YKHMAC_ENTRY_FIND_SLOTS);
+    return engine.find_slots();
+}
+
+uint8_t ykhmac_probe_slots()
+{
+    YKHMAC_STACK_MEASURE(YKHMAC_ENTRY_FIND_SLOTS);
+    return engine.probe_slots();
+}
+
+#ifdef YKHMAC_TOKEN_CACHE
+    // Session cache, ordered from the most to the least recently used token
+    static struct ykhmac_token_cache_entry token_cache[CACHE_SIZE];
 
-    // Communication buffers
-    uint8_t send_buffer[challenge_length + 5];
-    uint8_t recv_length = RESP_BUF_SIZE + 2;
-    uint8_t recv_buffer[recv_length];
-
-    // Setup command buffers
-    send_buffer[0] = CLA_ISO;
-    send_buffer[1] = INS_API_REQ;
-    send_buffer[2] = slot_cmd;
-    send_buffer[3] = 0;
-    send_buffer[4] = challenge_length;
-    memcpy(send_buffer + 5, challenge, challenge_length);
-
-    // Perform transfer
-    if (ykhmac_data_exchange(send_buffer, 5 + challenge_length, recv_buffer, &recv_length))
+    // Returns the index of a cached token, or CACHE_SIZE if it is not cached
+    static uint8_t token_cache_find(const uint8_t* uid, const uint8_t uid_length)
     {
-        if (ykhmac_response_code(recv_buffer, recv_length) == E_SUCCESS 
-            && recv_length >= RESP_BUF_SIZE)
+        if (uid_length == 0 || uid_length > CACHE_UID_SIZE) return CACHE_SIZE;
+        for (uint8_t i = 0; i < CACHE_SIZE; i++)
         {
-            if (response != nullptr) memcpy(response, recv_buffer, RESP_BUF_SIZE);
-            return true;
+            if (token_cache[i].uid_length == uid_length && memcmp(token_cache[i].uid, uid, uid_length) == 0) return i;
         }
+        return CACHE_SIZE;
     }
 
-    return false;
-}
-
-uint8_t ykhmac_find_slots()
-{
-    uint8_t slots = 0;
+    bool ykhmac_token_info(const uint8_t* uid, const uint8_t uid_length, struct ykhmac_token_info* info)
+    {
+        // Firmware version and program sequence, validates a cached token
+        uint8_t status[4];
+        uint8_t slots = SLOTS_UNKNOWN;
+        if (!engine.read_status(status, &slots))
+        {
+            ykhmac_token_forget(uid, uid_length);
+            return false;
+        }
 
-    // Perform dummy challenge agains both slots
-    uint8_t challenge[8];
-    memset(challenge, 0x42, 8);
+        uint8_t index = token_cache_find(uid, uid_length);
+        if (index < CACHE_SIZE && memcmp(token_cache[index].info.version, status, 3) == 0
+            && token_cache[index].info.program_sequence == status[3])
+        {
+            YKHMAC_LOG(YKHMAC_EVENT_CACHE_HIT, "Found token in session cache\n");
+        }
+        else
+        {
+            if (index < CACHE_SIZE) YKHMAC_LOG(YKHMAC_EVENT_CACHE_STALE, "Cached token has been swapped or reconfigured\n");
 
-    if (ykhmac_exchange_hmac(SLOT_1, challenge, 8, nullptr))
-        slots |= SLOT_1;
-    if (ykhmac_exchange_hmac(SLOT_2, challenge, 8, nullptr))
-        slots |= SLOT_2;
+            struct ykhmac_token_info queried;
+            if (!engine.read_serial(&queried.serial))
+            {
+                ykhmac_token_forget(uid, uid_length);
+                return false;
+            }
+            memcpy(queried.version, status, 3);
+            queried.program_sequence = status[3];
+            queried.slots = (slots != SLOTS_UNKNOWN) ? slots : engine.probe_slots();
 
-    return slots;
-}
+            if (uid_length == 0 || uid_length > CACHE_UID_SIZE)
+            {
+                *info = queried;
+                return true;
+            }
 
-// Common buffers to save RAM
-struct sha1_hasher_s sha_context;
-uint8_t challenge[CHALLENGE_SIZE];
-uint8_t response[RESP_BUF_SIZE];
-uint8_t iv[AES_BLOCKLEN];
-uint8_t padded_secret_key[SECRET_KEY_SIZE_PAD];
-struct AES_ctx aes_context;
-uint8_t computed_response[RESP_BUF_SIZE];
+            // Replace the least recently used token
+            if (index == CACHE_SIZE) index = CACHE_SIZE - 1;
+            memcpy(token_cache[index].uid, uid, uid_length);
+            token_cache[index].uid_length = uid_length;
+            token_cache[index].info = queried;
+        }
 
-void ykhmac_purge_buffers()
-{
-    // Purge data from RAM
-    memset(challenge, 0, CHALLENGE_SIZE);
-    memset(response, 0, RESP_BUF_SIZE);
-    memset(iv, 0, AES_BLOCKLEN);
-    memset(padded_secret_key, 0, SECRET_KEY_SIZE_PAD);
-    memset(&aes_context, 0, sizeof(AES_ctx));
-    memset(computed_response, 0, RESP_BUF_SIZE);
-}
+        // Move the token to the front
+        struct ykhmac_token_cache_entry entry = token_cache[index];
+        memmove(&token_cache[1], &token_cache[0], index * sizeof(struct ykhmac_token_cache_entry));
+        token_cache[0] = entry;
+        *info = entry.info;
 
-bool ykhmac_compute_hmac(const uint8_t *key, const uint8_t *challenge,
-                         const uint8_t challenge_length, uint8_t response[RESP_BUF_SIZE])
-{
-    // Init hasher using key and data
-    sha1_hasher_init_hmac(&sha_context, key, SECRET_KEY_SIZE);
-    for (uint8_t i = 0; i < challenge_length; i++)
-    {
-        if (sha1_hasher_putc(&sha_context, challenge[i]) == EOF)
-            return false;
+        return true;
     }
 
-    // Compute and return hash
-    uint8_t *result = sha1_hasher_gethmac(&sha_context);
-    memcpy(response, result, RESP_BUF_SIZE);
-
-    // Purge hasher RAM
-    memset(&sha_context, 0, sizeof(struct sha1_hasher_s));
+    void ykhmac_token_forget(const uint8_t* uid, const uint8_t uid_length)
+    {
+        const uint8_t index = token_cache_find(uid, uid_length);
+        if (index == CACHE_SIZE) return;
 
-    return true;
-}
+        // Close the gap, the last entry becomes empty
+        memmove(&token_cache[index], &token_cache[index + 1],
+            (CACHE_SIZE - 1 - index) * sizeof(struct ykhmac_token_cache_entry));
+        memset(&token_cache[CACHE_SIZE - 1], 0, sizeof(struct ykhmac_token_cache_entry));
+    }
 
-bool ykhmac_enroll_key(uint8_t secret_key[SECRET_KEY_SIZE])
-{
-    #ifdef YKHMAC_DEBUG
-        ykhmac_debug_print(F("Enrolling key\n"));
-        ykhmac_debug_print_array(F("Using secret key:     "), secret_key, SECRET_KEY_SIZE);
-    #endif
+    void ykhmac_token_cache_clear()
+    {
+        memset(token_cache, 0, sizeof(token_cache));
+    }
+#endif
 
-    bool result = false;
+#ifdef YKHMAC_NONBLOCKING
+    bool ykhmac_authenticate_start(const uint8_t slot, const uint8_t* aid, const uint8_t aid_size)
+    {
+        if (aid_size > ARG_BUF_SIZE_MAX) return false;
 
-    // Generate random challenge
-    for (uint8_t i; i < CHALLENGE_SIZE; i++) challenge[i] = ykhmac_random();
-    #ifdef YKHMAC_DEBUG
-        ykhmac_debug_print_array(F("Random challenge:     "), challenge, CHALLENGE_SIZE);
-    #endif
+        return engine.authenticate_start(slot, aid, aid_size);
+    }
 
-    // Compute response
-    if (ykhmac_compute_hmac(secret_key, challenge, CHALLENGE_SIZE, response))
+    ykhmac_status ykhmac_authenticate_step()
     {
-        #ifdef YKHMAC_DEBUG
-            ykhmac_debug_print_array(F("Computed response:    "), response, RESP_BUF_SIZE);
-        #endif
+        return engine.authenticate_step();
+    }
+#endif
 
-        // Pad secret key using zeros (fixed size)
-        memset(padded_secret_key + SECRET_KEY_SIZE, 0, SECRET_KEY_SIZE_PAD - SECRET_KEY_SIZE_PAD);
-        memcpy(padded_secret_key, secret_key, SECRET_KEY_SIZE);
-        #ifdef YKHMAC_DEBUG
-            ykhmac_debug_print_array(F("Padded secret key:    "), padded_secret_key, SECRET_KEY_SIZE_PAD);
-        #endif
+#ifdef YKHMAC_WRITE_BEHIND
+    bool ykhmac_commit()
+    {
+        return engine.storage().commit();
+    }
 
-        // Encrypt secret key using response as encryption key
-        for (uint8_t i; i < AES_BLOCKLEN; i++) iv[i] = ykhmac_random();
-        #ifdef YKHMAC_DEBUG
-            ykhmac_debug_print_array(F("Using IV:             "), iv, AES_BLOCKLEN);
-        #endif
-        AES_init_ctx_iv(&aes_context, response, iv);
-        AES_CBC_encrypt_buffer(&aes_context, padded_secret_key, SECRET_KEY_SIZE_PAD);
-        #ifdef YKHMAC_DEBUG
-            ykhmac_debug_print_array(F("Encrypted secret key: "), padded_secret_key, SECRET_KEY_SIZE_PAD);
-        #endif
+    bool ykhmac_commit_pending()
+    {
+        return engine.storage().pending;
+    }
+#endif
 
-        // Store challenge, IV and encrypted secret key
-        if (ykhmac_presistent_write(challenge, CHALLENGE_SIZE, 0) 
-            && ykhmac_presistent_write(iv, AES_BLOCKLEN, CHALLENGE_SIZE) 
-            && ykhmac_presistent_write(padded_secret_key, SECRET_KEY_SIZE_PAD, 
-                CHALLENGE_SIZE + AES_BLOCKLEN))
-        {
-            #ifdef YKHMAC_DEBUG
-                ykhmac_debug_print(F("Wrote data to persistent storage\n"));
-            #endif
-            result = true;
-        }
-        else
-        {
-            #ifdef YKHMAC_DEBUG
-                ykhmac_debug_print(F("Failed to write data to persistent storage\n"));
-            #endif
-        }
+#ifdef YKHMAC_PRECOMPUTE
+    bool ykhmac_replenish()
+    {
+        return engine.replenish();
     }
-    else
+
+    bool ykhmac_replenish_pending()
     {
-        #ifdef YKHMAC_DEBUG
-            ykhmac_debug_print(F("Failed to compute HMAC\n"));
-        #endif
+        return engine.replenish_pending();
     }
 
-    ykhmac_purge_buffers();
+    uint8_t ykhmac_records_available()
+    {
+        return ykhmac_record_available();
+    }
+#endif
 
-    #ifdef YKHMAC_DEBUG
-        if (result)
-            ykhmac_debug_print(F("Successfully enrolled key\n"));
-        else
-            ykhmac_debug_print(F("Failed to enroll key\n"));
-    #endif
+void ykhmac_hmac_init(struct ykhmac_hmac_ctx* ctx, const uint8_t* key)
+{
+    engine.hmac_init(ctx, key);
+}
 
-    return result;
+bool ykhmac_hmac_compute(const struct ykhmac_hmac_ctx* ctx, const uint8_t* challenge,
+    const uint8_t challenge_length, uint8_t response[RESP_BUF_SIZE])
+{
+    return engine.hmac_compute(ctx, challenge, challenge_length, response);
 }
 
-bool ykhmac_authenticate(const uint8_t slot)
+void ykhmac_hmac_purge(struct ykhmac_hmac_ctx* ctx)
 {
-    #ifdef YKHMAC_DEBUG
-        ykhmac_debug_print(F("Authenticating key\n"));
-    #endif
+    engine.hmac_purge(ctx);
+}
 
-    bool result = false;
+bool ykhmac_compute_hmac(const uint8_t *key, const uint8_t *challenge,
+                         const uint8_t challenge_length, uint8_t response[RESP_BUF_SIZE])
+{
+    YKHMAC_STACK_MEASURE(YKHMAC_ENTRY_COMPUTE_HMAC);
+    return engine.compute_hmac(key, challenge, challenge_length, response);
+}
 
-    // Load stored challenge
-    if (ykhmac_presistent_read(challenge, CHALLENGE_SIZE, 0))
+#ifdef YKHMAC_TOKEN_TABLE
+    bool ykhmac_table_enroll(const uint32_t serial, uint8_t secret_key[SECRET_KEY_SIZE])
     {
-        #ifdef YKHMAC_DEBUG
-            ykhmac_debug_print_array(F("Loaded challenge:     "), challenge, CHALLENGE_SIZE);
-        #endif
+        YKHMAC_STACK_MEASURE(YKHMAC_ENTRY_ENROLL_KEY);
+        engine.storage().serial = serial;
+        return engine.enroll(secret_key);
+    }
 
-        // Perform challenge-response exchange
-        if (ykhmac_exchange_hmac(slot, challenge, CHALLENGE_SIZE, response))
-        {
-            #ifdef YKHMAC_DEBUG
-                ykhmac_debug_print_array(F("Exchanged response:   "), response, RESP_BUF_SIZE);
-            #endif
+    bool ykhmac_table_authenticate(const uint8_t slot, uint32_t* serial)
+    {
+        YKHMAC_STACK_MEASURE(YKHMAC_ENTRY_AUTHENTICATE);
 
-            // Load IV and secret key
-            if (ykhmac_presistent_read(iv, AES_BLOCKLEN, CHALLENGE_SIZE) 
-                && ykhmac_presistent_read(padded_secret_key, SECRET_KEY_SIZE_PAD,
-                    CHALLENGE_SIZE + AES_BLOCKLEN))
-            {
-                #ifdef YKHMAC_DEBUG
-                    ykhmac_debug_print_array(F("Loaded IV:            "), iv, AES_BLOCKLEN);
-                    ykhmac_debug_print_array(F("Loaded secret key:    "), padded_secret_key, SECRET_KEY_SIZE_PAD);
-                #endif
-
-                // Decrypt secret key
-                AES_init_ctx_iv(&aes_context, response, iv);
-                AES_CBC_decrypt_buffer(&aes_context, padded_secret_key, SECRET_KEY_SIZE_PAD);
-                #ifdef YKHMAC_DEBUG
-                    ykhmac_debug_print_array(F("Decrypted secret key: "), padded_secret_key, SECRET_KEY_SIZE_PAD);
-                #endif
-
-                // Compute response using secret key
-                if (ykhmac_compute_hmac(padded_secret_key, challenge, CHALLENGE_SIZE, computed_response))
-                {
-                    #ifdef YKHMAC_DEBUG
-                        ykhmac_debug_print_array(F("Computed response:    "), computed_response, RESP_BUF_SIZE);
-                    #endif
-
-                    // Check response
-                    if (memcmp(response, computed_response, RESP_BUF_SIZE) == 0)
-                    {
-                        #ifdef YKHMAC_DEBUG
-                            ykhmac_debug_print(F("Responses match\n"));
-                        #endif
-
-                        // Perform re-enrollment and re-encryption of the secret using a new challenge
-                        result = ykhmac_enroll_key(padded_secret_key);
-                    }
-                    else
-                    {
-                        #ifdef YKHMAC_DEBUG
-                            ykhmac_debug_print(F("Responses do not match\n"));
-                        #endif
-                    }
-                }
-                else
-                {
-                    #ifdef YKHMAC_DEBUG
-                        ykhmac_debug_print(F("Failed to compute HMAC\n"));
-                    #endif
-                }
-            }
-            else
-            {
-                #ifdef YKHMAC_DEBUG
-                    ykhmac_debug_print(F("Failed to read data from persistent storage\n"));
-                #endif
-            }
-        }
-        else
+        // The serial number selects the enrollment record
+        if (!engine.read_serial(&engine.storage().serial))
         {
-            #ifdef YKHMAC_DEBUG
-                ykhmac_debug_print(F("Failed to exchange HMAC\n"));
-            #endif
+            YKHMAC_LOG(YKHMAC_EVENT_SERIAL_FAILED, "Failed to read serial number\n");
+            return false;
         }
+        if (serial != nullptr) *serial = engine.storage().serial;
+
+        return engine.authenticate(slot);
+    }
+
+    bool ykhmac_table_revoke(const uint32_t serial)
+    {
+        #ifdef YKHMAC_WRITE_BEHIND
+            engine.storage().drop(serial);
+        #endif
+
+        return ykhmac_table_remove(serial);
     }
 
-    ykhmac_purge_buffers();
+    bool ykhmac_table_clear()
+    {
+        #ifdef YKHMAC_WRITE_BEHIND
+            engine.storage().drop();
+        #endif
 
-    #ifdef YKHMAC_DEBUG
-        if (result)
-            ykhmac_debug_print(F("Successfully authenticated token\n"));
-        else
-            ykhmac_debug_print(F("Failed to authenticate token\n"));
-    #endif
+        return ykhmac_table_format();
+    }
+#else
+    bool ykhmac_enroll_key(uint8_t secret_key[SECRET_KEY_SIZE])
+    {
+        YKHMAC_STACK_MEASURE(YKHMAC_ENTRY_ENROLL_KEY);
+        return engine.enroll(secret_key);
+    }
 
-    return result;
-}
\ No newline at end of file
+    bool ykhmac_authenticate(const uint8_t slot)
+    {
+        YKHMAC_STACK_MEASURE(YKHMAC_ENTRY_AUTHENTICATE);
+        return engine.authenticate(slot);
+    }
+#endif
@@ -0,0 +1,39 @@
+/**
+ * @file ykhmac_atomic.h
+ * @author Christoph Honal
+ * @brief Relaxed atomic counters and a spin lock for the metrics, trace and retry buffers, internal to the library
+ * @version 0.1
+ * @date 2021-12-17
+ */
+
+#ifndef YKHMAC_ATOMIC_H
+#define YKHMAC_ATOMIC_H
+
+// Native builds may authenticate on several threads, microcontrollers only from the main loop
+#ifdef ARDUINO
+    #define YKHMAC_ATOMIC_ADD(target, value)    ((target) += (value))
+    #define YKHMAC_ATOMIC_LOAD(source)          (source)
+    #define YKHMAC_ATOMIC_STORE(target, value)  ((target) = (value))
+    #define YKHMAC_ATOMIC_MAX(target, value)    do { if ((value) > (target)) (target) = (value); } while (0)
+
+    #define YKHMAC_LOCK_DEFINE(lock)
+    #define YKHMAC_LOCK(lock)
+    #define YKHMAC_UNLOCK(lock)
+#else
+    #define YKHMAC_ATOMIC_ADD(target, value)    __atomic_fetch_add(&(target), (value), __ATOMIC_RELAXED)
+    #define YKHMAC_ATOMIC_LOAD(source)          __atomic_load_n(&(source), __ATOMIC_RELAXED)
+    #define YKHMAC_ATOMIC_STORE(target, value)  __atomic_store_n(&(target), (value), __ATOMIC_RELAXED)
+    #define YKHMAC_ATOMIC_MAX(target, value) \
+        do \
+        { \
+            __typeof__(target) current = __atomic_load_n(&(target), __ATOMIC_RELAXED); \
+            while ((value) > current && !__atomic_compare_exchange_n(&(target), &current, (value), \
+                true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)); \
+        } while (0)
+
+    #define YKHMAC_LOCK_DEFINE(lock)            static bool lock = false
+    #define YKHMAC_LOCK(lock)                   while (__atomic_test_and_set(&(lock), __ATOMIC_ACQUIRE))
+    #define YKHMAC_UNLOCK(lock)                 __atomic_clear(&(lock), __ATOMIC_RELEASE)
+#endif
+
+#endif
@@ -0,0 +1,283 @@
+/**
+ * @file ykhmac_batch.cpp
+ * @author Christoph Honal
+ * @brief Implements ykhmac_compute_hmac_batch, using multi-buffer SHA1 on x86-64
+ * @version 0.1
+ * @date 2021-12-17
+ */
+
+#include "ykhmac.h"
+#include "ykhmac_crypto.h"
+
+#include <string.h>
+
+
+// Computes one job after the other
+static bool ykhmac_hmac_batch_scalar_compute(struct ykhmac_hmac_job* jobs, const size_t count)
+{
+    bool result = true;
+    for (size_t i = 0; i < count; i++)
+    {
+        result &= ykhmac_compute_hmac(jobs[i].key, jobs[i].challenge, jobs[i].challenge_length, jobs[i].response);
+    }
+    return result;
+}
+
+#ifdef YKHMAC_CRYPTO_X86
+
+#define BATCH_INLINE            inline __attribute__((always_inline))
+#define SHA1_ROUND_CONSTANTS    { 0x5A827999, 0x6ED9EBA1, 0x8F1BBCDC, 0xCA62C1D6 }
+
+typedef uint32_t batch_v4 __attribute__((vector_size(16)));     // SSE2
+typedef uint32_t batch_v8 __attribute__((vector_size(32)));     // AVX2
+typedef uint32_t batch_v16 __attribute__((vector_size(64)));    // AVX-512F
+
+static const uint32_t batch_sha1_iv[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+
+// Rotates each lane left
+#define BATCH_ROTL(x, n)        (((x) << (n)) | ((x) >> (32 - (n))))
+
+// Compresses one block in each lane, lanes whose mask is zero keep their state
+template<class V> static BATCH_INLINE void batch_sha1_compress(V* state, const V* block, const V& mask)
+{
+    static const uint32_t k[4] = SHA1_ROUND_CONSTANTS;
+    V w[16];
+    for (uint8_t t = 0; t < 16; t++) w[t] = block[t];
+
+    V a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+    #pragma GCC unroll 80
+    for (uint8_t t = 0; t < 80; t++)
+    {
+        if (t >= 16)
+        {
+            const V x = w[(t + 13) & 15] ^ w[(t + 8) & 15] ^ w[(t + 2) & 15] ^ w[t & 15];
+            w[t & 15] = BATCH_ROTL(x, 1);
+        }
+
+        V f;
+        if (t < 20) f = (b & c) | (~b & d);
+        else if (t < 40 || t >= 60) f = b ^ c ^ d;
+        else f = (b & c) | (b & d) | (c & d);
+
+        const V temp = BATCH_ROTL(a, 5) + f + e + k[t / 20] + w[t & 15];
+        e = d;
+        d = c;
+        c = BATCH_ROTL(b, 30);
+        b = a;
+        a = temp;
+    }
+
+    state[0] += a & mask;
+    state[1] += b & mask;
+    state[2] += c & mask;
+    state[3] += d & mask;
+    state[4] += e & mask;
+}
+
+// Writes word t of a lane into a transposed block
+static BATCH_INLINE void batch_put(uint32_t* words, const size_t lanes, const uint8_t t, const size_t lane,
+    const uint32_t value)
+{
+    words[t * lanes + lane] = value;
+}
+
+// Writes the key XOR pad block of a job into its lane
+static void batch_key_block(uint32_t* words, const size_t lanes, const size_t lane,
+    const uint8_t* key, const uint8_t pad)
+{
+    for (uint8_t t = 0; t < HMAC_BLOCK_SIZE / 4; t++)
+    {
+        uint32_t word = 0;
+        for (uint8_t i = 0; i < 4; i++)
+        {
+            const uint8_t p = t * 4 + i;
+            word = (word << 8) | ((p < SECRET_KEY_SIZE) ? (key[p] ^ pad) : pad);
+        }
+        batch_put(words, lanes, t, lane, word);
+    }
+}
+
+// Writes a block of a padded challenge into its lane, the key block precedes the challenge
+static void batch_message_block(uint32_t* words, const size_t lanes, const size_t lane,
+    const struct ykhmac_hmac_job* job, const uint8_t block, const uint8_t blocks)
+{
+    // Copy of the block, followed by the padding
+    uint8_t bytes[HMAC_BLOCK_SIZE];
+    const uint16_t start = block * HMAC_BLOCK_SIZE;
+    const uint16_t remaining = (job->challenge_length > start) ? (job->challenge_length - start) : 0;
+    const uint8_t length = (remaining < HMAC_BLOCK_SIZE) ? (uint8_t)remaining : HMAC_BLOCK_SIZE;
+    memcpy(bytes, job->challenge + start, length);
+    memset(bytes + length, 0, HMAC_BLOCK_SIZE - length);
+    if (length < HMAC_BLOCK_SIZE && start + length == job->challenge_length) bytes[length] = 0x80;
+
+    for (uint8_t t = 0; t < HMAC_BLOCK_SIZE / 4; t++)
+    {
+        uint32_t word;
+        memcpy(&word, bytes + t * 4, sizeof(word));
+        batch_put(words, lanes, t, lane, __builtin_bswap32(word));
+    }
+
+    // Length of the key block and the challenge in bits, at the end of the last block
+    if (block + 1 == blocks)
+    {
+        batch_put(words, lanes, 14, lane, 0);
+        batch_put(words, lanes, 15, lane, (HMAC_BLOCK_SIZE + job->challenge_length) * 8);
+    }
+}
+
+// Computes up to one vector width of jobs in parallel
+template<class V> static BATCH_INLINE void batch_hmac_lanes(struct ykhmac_hmac_job* jobs, const size_t count)
+{
+    constexpr size_t lanes = sizeof(V) / sizeof(uint32_t);
+    alignas(V) uint32_t words[16 * lanes];
+    alignas(V) uint32_t mask_words[lanes];
+    alignas(V) uint32_t digest[5 * lanes];
+    uint8_t blocks[lanes];
+    V state[5];
+    V mask;
+
+    // Blocks of each padded challenge
+    uint8_t max_blocks = 0;
+    for (size_t lane = 0; lane < lanes; lane++)
+    {
+        blocks[lane] = (lane < count) ? (uint8_t)((jobs[lane].challenge_length + 9 + HMAC_BLOCK_SIZE - 1) / HMAC_BLOCK_SIZE) : 0;
+        if (blocks[lane] > max_blocks) max_blocks = blocks[lane];
+    }
+
+    // Inner hash: key XOR HMAC_IPAD, then the challenge
+    memset(words, 0, sizeof(words));
+    for (uint8_t i = 0; i < 5; i++) state[i] = batch_sha1_iv[i] + V{};
+    for (size_t lane = 0; lane < count; lane++) batch_key_block(words, lanes, lane, jobs[lane].key, HMAC_IPAD);
+    batch_sha1_compress(state, (const V*)words, ~V{});
+    for (uint8_t block = 0; block < max_blocks; block++)
+    {
+        for (size_t lane = 0; lane < lanes; lane++)
+        {
+            mask_words[lane] = (block < blocks[lane]) ? UINT32_MAX : 0;
+            if (block < blocks[lane]) batch_message_block(words, lanes, lane, &jobs[lane], block, blocks[lane]);
+        }
+        memcpy(&mask, mask_words, sizeof(V));
+        batch_sha1_compress(state, (const V*)words, mask);
+    }
+    memcpy(digest, state, sizeof(state));
+
+    // Outer hash: key XOR HMAC_OPAD, then the inner hash
+    for (uint8_t i = 0; i < 5; i++) state[i] = batch_sha1_iv[i] + V{};
+    for (size_t lane = 0; lane < count; lane++) batch_key_block(words, lanes, lane, jobs[lane].key, HMAC_OPAD);
+    batch_sha1_compress(state, (const V*)words, ~V{});
+    memcpy(words, digest, sizeof(digest));
+    for (size_t lane = 0; lane < lanes; lane++)
+    {
+        batch_put(words, lanes, 5, lane, 0x80000000);
+        for (uint8_t t = 6; t < 15; t++) batch_put(words, lanes, t, lane, 0);
+        batch_put(words, lanes, 15, lane, (HMAC_BLOCK_SIZE + HMAC_HASH_SIZE) * 8);
+    }
+    batch_sha1_compress(state, (const V*)words, ~V{});
+    memcpy(digest, state, sizeof(state));
+
+    // Big-endian, truncated responses
+    for (size_t lane = 0; lane < count; lane++)
+    {
+        for (uint8_t i = 0; i < RESP_BUF_SIZE; i++)
+            jobs[lane].response[i] = (uint8_t)(digest[(i / 4) * lanes + lane] >> (24 - 8 * (i % 4)));
+    }
+
+    // Purge intermediate states
+    volatile uint8_t* purge = (volatile uint8_t*)words;
+    for (size_t i = 0; i < sizeof(words); i++) purge[i] = 0;
+    purge = (volatile uint8_t*)digest;
+    for (size_t i = 0; i < sizeof(digest); i++) purge[i] = 0;
+}
+
+// Computes all jobs, one vector width at a time
+template<class V> static BATCH_INLINE bool batch_hmac(struct ykhmac_hmac_job* jobs, const size_t count)
+{
+    constexpr size_t lanes = sizeof(V) / sizeof(uint32_t);
+    for (size_t i = 0; i < count; i += lanes)
+    {
+        batch_hmac_lanes<V>(jobs + i, (count - i < lanes) ? (count - i) : lanes);
+    }
+    return true;
+}
+
+static bool ykhmac_hmac_batch_sse2_compute(struct ykhmac_hmac_job* jobs, const size_t count)
+{
+    return batch_hmac<batch_v4>(jobs, count);
+}
+
+__attribute__((target("avx2")))
+static bool ykhmac_hmac_batch_avx2_compute(struct ykhmac_hmac_job* jobs, const size_t count)
+{
+    return batch_hmac<batch_v8>(jobs, count);
+}
+
+__attribute__((target("avx512f")))
+static bool ykhmac_hmac_batch_avx512_compute(struct ykhmac_hmac_job* jobs, const size_t count)
+{
+    return batch_hmac<batch_v16>(jobs, count);
+}
+
+static bool ykhmac_hmac_batch_always()
+{
+    return true;
+}
+
+static bool ykhmac_hmac_batch_avx2_supported()
+{
+    return (ykhmac_cpu_features() & YKHMAC_CPU_AVX2) != 0;
+}
+
+static bool ykhmac_hmac_batch_avx512_supported()
+{
+    return (ykhmac_cpu_features() & YKHMAC_CPU_AVX512) != 0;
+}
+
+const struct ykhmac_hmac_batch_backend ykhmac_hmac_batch_scalar =
+{
+    "scalar",
+    ykhmac_hmac_batch_always,
+    ykhmac_hmac_batch_scalar_compute
+};
+
+const struct ykhmac_hmac_batch_backend ykhmac_hmac_batch_sse2 =
+{
+    "sse2",
+    ykhmac_hmac_batch_always,
+    ykhmac_hmac_batch_sse2_compute
+};
+
+const struct ykhmac_hmac_batch_backend ykhmac_hmac_batch_avx2 =
+{
+    "avx2",
+    ykhmac_hmac_batch_avx2_supported,
+    ykhmac_hmac_batch_avx2_compute
+};
+
+const struct ykhmac_hmac_batch_backend ykhmac_hmac_batch_avx512 =
+{
+    "avx-512",
+    ykhmac_hmac_batch_avx512_supported,
+    ykhmac_hmac_batch_avx512_compute
+};
+
+const struct ykhmac_hmac_batch_backend* ykhmac_crypto_hmac_batch()
+{
+    // Detected once, thread-safe. Four SSE2 lanes are slower than one SHA-NI core
+    static const struct ykhmac_hmac_batch_backend* const detected =
+        ykhmac_hmac_batch_avx512.supported() ? &ykhmac_hmac_batch_avx512
+        : (ykhmac_hmac_batch_avx2.supported() ? &ykhmac_hmac_batch_avx2
+        : (ykhmac_hmac_shani.supported() ? &ykhmac_hmac_batch_scalar : &ykhmac_hmac_batch_sse2));
+
+    return detected;
+}
+
+#endif
+
+bool ykhmac_compute_hmac_batch(struct ykhmac_hmac_job* jobs, const size_t count)
+{
+    #ifdef YKHMAC_CRYPTO_X86
+        return ykhmac_crypto_hmac_batch()->compute(jobs, count);
+    #else
+        return ykhmac_hmac_batch_scalar_compute(jobs, count);
+    #endif
+}
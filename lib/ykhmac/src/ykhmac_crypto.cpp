@@ -0,0 +1,163 @@
+/**
+ * @file ykhmac_crypto.cpp
+ * @author Christoph Honal
+ * @brief Implements the portable backends and the runtime dispatch from ykhmac_crypto.h
+ * @version 0.1
+ * @date 2021-12-17
+ */
+
+#include "ykhmac_crypto.h"
+
+
+static bool ykhmac_crypto_portable_supported()
+{
+    return true;
+}
+
+static void ykhmac_hmac_portable_init(struct ykhmac_hmac_ctx* ctx, const uint8_t* key, const uint8_t key_size,
+    union ykhmac_hash_work* work)
+{
+    ykhmac::PortableCrypto::hmac_init(ctx, key, key_size, &work->hasher);
+}
+
+static bool ykhmac_hmac_portable_compute(const struct ykhmac_hmac_ctx* ctx, const uint8_t* message,
+    const uint8_t length, uint8_t* digest, const uint8_t digest_size, union ykhmac_hash_work* work)
+{
+    return ykhmac::PortableCrypto::hmac_compute(ctx, message, length, digest, digest_size, &work->hasher);
+}
+
+const struct ykhmac_hmac_backend ykhmac_hmac_portable =
+{
+    "portable",
+    ykhmac_crypto_portable_supported,
+    ykhmac_hmac_portable_init,
+    ykhmac_hmac_portable_compute
+};
+
+static void ykhmac_hmac_fixed_init(struct ykhmac_hmac_ctx* ctx, const uint8_t* key, const uint8_t key_size,
+    union ykhmac_hash_work* work)
+{
+    ykhmac::FixedHmacCrypto<ykhmac::PortableCrypto>::hmac_init(ctx, key, key_size, &work->words);
+}
+
+static bool ykhmac_hmac_fixed_compute(const struct ykhmac_hmac_ctx* ctx, const uint8_t* message,
+    const uint8_t length, uint8_t* digest, const uint8_t digest_size, union ykhmac_hash_work* work)
+{
+    return ykhmac::FixedHmacCrypto<ykhmac::PortableCrypto>::hmac_compute(ctx, message, length, digest, digest_size,
+        &work->words);
+}
+
+const struct ykhmac_hmac_backend ykhmac_hmac_fixed =
+{
+    "fixed",
+    ykhmac_crypto_portable_supported,
+    ykhmac_hmac_fixed_init,
+    ykhmac_hmac_fixed_compute
+};
+
+static void ykhmac_aes_portable_encrypt(union ykhmac_aes_work* work, const uint8_t* key, const uint8_t* iv,
+    uint8_t* data, const uint8_t size)
+{
+    ykhmac::PortableCrypto::cbc_encrypt(&work->tiny, key, iv, data, size);
+}
+
+static void ykhmac_aes_portable_decrypt(union ykhmac_aes_work* work, const uint8_t* key, const uint8_t* iv,
+    uint8_t* data, const uint8_t size)
+{
+    ykhmac::PortableCrypto::cbc_decrypt(&work->tiny, key, iv, data, size);
+}
+
+static void ykhmac_aes_portable_decrypt_expand(union ykhmac_aes_work* work, const uint8_t* key)
+{
+    ykhmac::PortableCrypto::cbc_decrypt_expand(&work->tiny, key);
+}
+
+static void ykhmac_aes_portable_decrypt_expanded(union ykhmac_aes_work* work, const uint8_t* iv,
+    uint8_t* data, const uint8_t size)
+{
+    ykhmac::PortableCrypto::cbc_decrypt_expanded(&work->tiny, iv, data, size);
+}
+
+const struct ykhmac_aes_backend ykhmac_aes_portable =
+{
+    "portable",
+    ykhmac_crypto_portable_supported,
+    ykhmac_aes_portable_encrypt,
+    ykhmac_aes_portable_decrypt,
+    ykhmac_aes_portable_decrypt_expand,
+    ykhmac_aes_portable_decrypt_expanded
+};
+
+#if AES_KEYLEN == 16
+    static void ykhmac_aes_compact_backend_encrypt(union ykhmac_aes_work* work, const uint8_t* key, const uint8_t* iv,
+        uint8_t* data, const uint8_t size)
+    {
+        ykhmac_aes_compact_encrypt(&work->compact, key, iv, data, size);
+    }
+
+    static void ykhmac_aes_compact_backend_decrypt(union ykhmac_aes_work* work, const uint8_t* key, const uint8_t* iv,
+        uint8_t* data, const uint8_t size)
+    {
+        ykhmac_aes_compact_decrypt(&work->compact, key, iv, data, size);
+    }
+
+    static void ykhmac_aes_compact_backend_decrypt_expand(union ykhmac_aes_work* work, const uint8_t* key)
+    {
+        ykhmac_aes_compact_decrypt_expand(&work->compact, key);
+    }
+
+    static void ykhmac_aes_compact_backend_decrypt_expanded(union ykhmac_aes_work* work, const uint8_t* iv,
+        uint8_t* data, const uint8_t size)
+    {
+        ykhmac_aes_compact_decrypt_expanded(&work->compact, iv, data, size);
+    }
+
+    const struct ykhmac_aes_backend ykhmac_aes_compact =
+    {
+        "compact",
+        ykhmac_crypto_portable_supported,
+        ykhmac_aes_compact_backend_encrypt,
+        ykhmac_aes_compact_backend_decrypt,
+        ykhmac_aes_compact_backend_decrypt_expand,
+        ykhmac_aes_compact_backend_decrypt_expanded
+    };
+#endif
+
+#ifdef YKHMAC_CRYPTO_X86
+    static const struct ykhmac_hmac_backend* hmac_selected = nullptr;
+    static const struct ykhmac_aes_backend* aes_selected = nullptr;
+
+    const struct ykhmac_hmac_backend* ykhmac_crypto_hmac()
+    {
+        // Detected once, thread-safe
+        #ifdef YKHMAC_HMAC_FIXED
+            static const struct ykhmac_hmac_backend* const hmac_detected =
+                ykhmac_hmac_shani.supported() ? &ykhmac_hmac_shani : &ykhmac_hmac_fixed;
+        #else
+            static const struct ykhmac_hmac_backend* const hmac_detected =
+                ykhmac_hmac_shani.supported() ? &ykhmac_hmac_shani : &ykhmac_hmac_portable;
+        #endif
+
+        return (hmac_selected != nullptr) ? hmac_selected : hmac_detected;
+    }
+
+    const struct ykhmac_aes_backend* ykhmac_crypto_aes()
+    {
+        // Detected once, thread-safe
+        #ifdef YKHMAC_AES_COMPACT
+            static const struct ykhmac_aes_backend* const aes_detected =
+                ykhmac_aes_aesni.supported() ? &ykhmac_aes_aesni : &ykhmac_aes_compact;
+        #else
+            static const struct ykhmac_aes_backend* const aes_detected =
+                ykhmac_aes_aesni.supported() ? &ykhmac_aes_aesni : &ykhmac_aes_portable;
+        #endif
+
+        return (aes_selected != nullptr) ? aes_selected : aes_detected;
+    }
+
+    void ykhmac_crypto_select(const struct ykhmac_hmac_backend* hmac, const struct ykhmac_aes_backend* aes)
+    {
+        hmac_selected = hmac;
+        aes_selected = aes;
+    }
+#endif
@@ -0,0 +1,358 @@
+/**
+ * @file ykhmac_crypto_x86.cpp
+ * @author Christoph Honal
+ * @brief Implements the SHA-NI and AES-NI backends from ykhmac_crypto.h
+ * @version 0.1
+ * @date 2021-12-17
+ */
+
+#include "ykhmac_crypto.h"
+
+#ifdef YKHMAC_CRYPTO_X86
+
+#include <cpuid.h>
+#include <immintrin.h>
+
+
+// CPUID feature bits
+#define CPUID_1_ECX_SSSE3       (1u << 9)
+#define CPUID_1_ECX_SSE41       (1u << 19)
+#define CPUID_1_ECX_AES         (1u << 25)
+#define CPUID_1_ECX_OSXSAVE     (1u << 27)
+#define CPUID_7_EBX_AVX2        (1u << 5)
+#define CPUID_7_EBX_AVX512F     (1u << 16)
+#define CPUID_7_EBX_SHA         (1u << 29)
+#define XCR0_AVX                0x06    // SSE and AVX state
+#define XCR0_AVX512             0xE6    // SSE, AVX and AVX-512 state
+
+#define SHANI_TARGET            __attribute__((target("sha,ssse3,sse4.1")))
+#define AESNI_TARGET            __attribute__((target("aes,sse2")))
+
+// Purges RAM, cannot be optimized away
+static void ykhmac_crypto_wipe(void* data, const size_t size)
+{
+    volatile uint8_t* bytes = (volatile uint8_t*)data;
+    for (size_t i = 0; i < size; i++) bytes[i] = 0;
+}
+
+
+// Detects the CPU features
+static uint8_t ykhmac_cpu_detect()
+{
+    unsigned int eax, ebx, ecx, edx;
+    uint8_t features = 0;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return 0;
+    const unsigned int ecx_1 = ecx;
+    if (ecx_1 & CPUID_1_ECX_AES) features |= YKHMAC_CPU_AES;
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) return features;
+
+    if ((ebx & CPUID_7_EBX_SHA) && (ecx_1 & CPUID_1_ECX_SSSE3) && (ecx_1 & CPUID_1_ECX_SSE41))
+        features |= YKHMAC_CPU_SHA;
+
+    // AVX needs the OS to save the vector registers
+    if (ecx_1 & CPUID_1_ECX_OSXSAVE)
+    {
+        unsigned int xcr0, xcr0_high;
+        __asm__ ("xgetbv" : "=a"(xcr0), "=d"(xcr0_high) : "c"(0));
+        if ((ebx & CPUID_7_EBX_AVX2) && (xcr0 & XCR0_AVX) == XCR0_AVX) features |= YKHMAC_CPU_AVX2;
+        if ((ebx & CPUID_7_EBX_AVX512F) && (xcr0 & XCR0_AVX512) == XCR0_AVX512) features |= YKHMAC_CPU_AVX512;
+    }
+
+    return features;
+}
+
+uint8_t ykhmac_cpu_features()
+{
+    // Detected once, thread-safe
+    static const uint8_t features = ykhmac_cpu_detect();
+    return features;
+}
+
+
+// SHA-NI
+
+static const uint32_t sha1_iv[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+
+static bool ykhmac_hmac_shani_supported()
+{
+    return (ykhmac_cpu_features() & YKHMAC_CPU_SHA) != 0;
+}
+
+// Reverses the bytes of a vector, converts between big-endian words and lanes
+SHANI_TARGET static inline __m128i sha1_shani_swap(const __m128i value)
+{
+    return _mm_shuffle_epi8(value, _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL));
+}
+
+// Four rounds, e is the E of the message words msg and receives the next E
+#define SHANI_ROUNDS(e, e_next, msg, f) \
+    e = _mm_sha1nexte_epu32(e, msg); \
+    e_next = abcd; \
+    abcd = _mm_sha1rnds4_epu32(abcd, e, f)
+
+// Four rounds, and advances the message schedule of the next three groups
+#define SHANI_ROUNDS_SCHEDULE(e, e_next, msg, msg_1, msg_2, msg_3, f) \
+    SHANI_ROUNDS(e, e_next, msg, f); \
+    msg_1 = _mm_sha1msg2_epu32(msg_1, msg); \
+    msg_2 = _mm_xor_si128(msg_2, msg); \
+    msg_3 = _mm_sha1msg1_epu32(msg_3, msg)
+
+// Compresses 64-byte blocks, abcd holds A in the highest lane, e holds E in the highest lane
+SHANI_TARGET static void sha1_shani_compress(__m128i* state_abcd, __m128i* state_e,
+    const uint8_t* data, size_t blocks)
+{
+    __m128i abcd = *state_abcd;
+    __m128i e0 = *state_e;
+    __m128i e1, msg0, msg1, msg2, msg3;
+
+    for (; blocks > 0; blocks--, data += HMAC_BLOCK_SIZE)
+    {
+        const __m128i abcd_save = abcd;
+        const __m128i e_save = e0;
+
+        msg0 = sha1_shani_swap(_mm_loadu_si128((const __m128i*)(data + 0)));
+        msg1 = sha1_shani_swap(_mm_loadu_si128((const __m128i*)(data + 16)));
+        msg2 = sha1_shani_swap(_mm_loadu_si128((const __m128i*)(data + 32)));
+        msg3 = sha1_shani_swap(_mm_loadu_si128((const __m128i*)(data + 48)));
+
+        // Rounds 0 - 15
+        e0 = _mm_add_epi32(e0, msg0);
+        e1 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+        SHANI_ROUNDS(e1, e0, msg1, 0);
+        msg0 = _mm_sha1msg1_epu32(msg0, msg1);
+        SHANI_ROUNDS(e0, e1, msg2, 0);
+        msg1 = _mm_sha1msg1_epu32(msg1, msg2);
+        msg0 = _mm_xor_si128(msg0, msg2);
+        SHANI_ROUNDS_SCHEDULE(e1, e0, msg3, msg0, msg1, msg2, 0);
+
+        // Rounds 16 - 67
+        SHANI_ROUNDS_SCHEDULE(e0, e1, msg0, msg1, msg2, msg3, 0);
+        SHANI_ROUNDS_SCHEDULE(e1, e0, msg1, msg2, msg3, msg0, 1);
+        SHANI_ROUNDS_SCHEDULE(e0, e1, msg2, msg3, msg0, msg1, 1);
+        SHANI_ROUNDS_SCHEDULE(e1, e0, msg3, msg0, msg1, msg2, 1);
+        SHANI_ROUNDS_SCHEDULE(e0, e1, msg0, msg1, msg2, msg3, 1);
+        SHANI_ROUNDS_SCHEDULE(e1, e0, msg1, msg2, msg3, msg0, 1);
+        SHANI_ROUNDS_SCHEDULE(e0, e1, msg2, msg3, msg0, msg1, 2);
+        SHANI_ROUNDS_SCHEDULE(e1, e0, msg3, msg0, msg1, msg2, 2);
+        SHANI_ROUNDS_SCHEDULE(e0, e1, msg0, msg1, msg2, msg3, 2);
+        SHANI_ROUNDS_SCHEDULE(e1, e0, msg1, msg2, msg3, msg0, 2);
+        SHANI_ROUNDS_SCHEDULE(e0, e1, msg2, msg3, msg0, msg1, 2);
+        SHANI_ROUNDS_SCHEDULE(e1, e0, msg3, msg0, msg1, msg2, 3);
+        SHANI_ROUNDS_SCHEDULE(e0, e1, msg0, msg1, msg2, msg3, 3);
+
+        // Rounds 68 - 79, the schedule runs out
+        SHANI_ROUNDS(e1, e0, msg1, 3);
+        msg2 = _mm_sha1msg2_epu32(msg2, msg1);
+        msg3 = _mm_xor_si128(msg3, msg1);
+        SHANI_ROUNDS(e0, e1, msg2, 3);
+        msg3 = _mm_sha1msg2_epu32(msg3, msg2);
+        SHANI_ROUNDS(e1, e0, msg3, 3);
+
+        // Add to the previous state
+        e0 = _mm_sha1nexte_epu32(e0, e_save);
+        abcd = _mm_add_epi32(abcd, abcd_save);
+    }
+
+    *state_abcd = abcd;
+    *state_e = e0;
+}
+
+// Loads state words into vectors
+SHANI_TARGET static inline void sha1_shani_load(const uint32_t state[5], __m128i* abcd, __m128i* e)
+{
+    *abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)state), 0x1B);
+    *e = _mm_set_epi32((int)state[4], 0, 0, 0);
+}
+
+// Stores vectors as big-endian digest
+SHANI_TARGET static inline void sha1_shani_digest(const __m128i abcd, const __m128i e, uint8_t digest[HMAC_HASH_SIZE])
+{
+    _mm_storeu_si128((__m128i*)digest, sha1_shani_swap(abcd));
+    const uint32_t e_word = (uint32_t)_mm_cvtsi128_si32(sha1_shani_swap(e));
+    memcpy(digest + 16, &e_word, sizeof(e_word));
+}
+
+// Absorbs one padded key block, starting from the initial state
+SHANI_TARGET static void hmac_shani_init_pad(uint32_t state[5], uint8_t block[HMAC_BLOCK_SIZE],
+    const uint8_t* key, const uint8_t key_size, const uint8_t pad)
+{
+    for (uint8_t i = 0; i < HMAC_BLOCK_SIZE; i++) block[i] = (i < key_size) ? (key[i] ^ pad) : pad;
+
+    __m128i abcd, e;
+    sha1_shani_load(sha1_iv, &abcd, &e);
+    sha1_shani_compress(&abcd, &e, block, 1);
+
+    _mm_storeu_si128((__m128i*)state, _mm_shuffle_epi32(abcd, 0x1B));
+    state[4] = (uint32_t)_mm_extract_epi32(e, 3);
+}
+
+SHANI_TARGET static void ykhmac_hmac_shani_init(struct ykhmac_hmac_ctx* ctx, const uint8_t* key, const uint8_t key_size,
+    union ykhmac_hash_work* work)
+{
+    (void)work;
+    uint8_t block[HMAC_BLOCK_SIZE];
+    hmac_shani_init_pad(ctx->state[0], block, key, key_size, HMAC_IPAD);
+    hmac_shani_init_pad(ctx->state[1], block, key, key_size, HMAC_OPAD);
+    ykhmac_crypto_wipe(block, HMAC_BLOCK_SIZE);
+}
+
+// Appends the SHA1 padding of a message of total_size bytes to its last partial block, returns the number of blocks
+static uint8_t sha1_pad(uint8_t* block, const uint8_t used, const uint32_t total_size)
+{
+    const uint8_t blocks = (used + 1 + 8 > HMAC_BLOCK_SIZE) ? 2 : 1;
+    const uint8_t end = blocks * HMAC_BLOCK_SIZE;
+    block[used] = 0x80;
+    memset(block + used + 1, 0, end - used - 1);
+    const uint64_t bits = (uint64_t)total_size * 8;
+    for (uint8_t i = 0; i < 8; i++) block[end - 1 - i] = (uint8_t)(bits >> (8 * i));
+    return blocks;
+}
+
+SHANI_TARGET static bool ykhmac_hmac_shani_compute(const struct ykhmac_hmac_ctx* ctx, const uint8_t* message,
+    const uint8_t length, uint8_t* digest, const uint8_t digest_size, union ykhmac_hash_work* work)
+{
+    (void)work;
+    uint8_t block[2 * HMAC_BLOCK_SIZE];
+    __m128i abcd, e;
+
+    // Resume from inner midstate, hash message
+    sha1_shani_load(ctx->state[0], &abcd, &e);
+    const uint8_t full_blocks = length / HMAC_BLOCK_SIZE;
+    const uint8_t rest = length % HMAC_BLOCK_SIZE;
+    sha1_shani_compress(&abcd, &e, message, full_blocks);
+    memcpy(block, message + full_blocks * HMAC_BLOCK_SIZE, rest);
+    sha1_shani_compress(&abcd, &e, block, sha1_pad(block, rest, HMAC_BLOCK_SIZE + length));
+
+    // Resume from outer midstate, hash inner hash
+    sha1_shani_digest(abcd, e, block);
+    sha1_pad(block, HMAC_HASH_SIZE, HMAC_BLOCK_SIZE + HMAC_HASH_SIZE);
+    sha1_shani_load(ctx->state[1], &abcd, &e);
+    sha1_shani_compress(&abcd, &e, block, 1);
+
+    // Return truncated hash
+    sha1_shani_digest(abcd, e, block);
+    memcpy(digest, block, digest_size);
+    ykhmac_crypto_wipe(block, sizeof(block));
+
+    return true;
+}
+
+const struct ykhmac_hmac_backend ykhmac_hmac_shani =
+{
+    "sha-ni",
+    ykhmac_hmac_shani_supported,
+    ykhmac_hmac_shani_init,
+    ykhmac_hmac_shani_compute
+};
+
+
+// AES-NI
+
+#define AES_ROUNDS              10
+
+static bool ykhmac_aes_aesni_supported()
+{
+    return AES_KEYLEN == 16 && (ykhmac_cpu_features() & YKHMAC_CPU_AES) != 0;
+}
+
+// Derives the next round key from the previous one and its key generation assist
+AESNI_TARGET static inline __m128i aes_aesni_expand(__m128i key, __m128i assist)
+{
+    assist = _mm_shuffle_epi32(assist, 0xFF);
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    return _mm_xor_si128(key, assist);
+}
+
+// Expands an AES-128 key into its round keys
+AESNI_TARGET static void aes_aesni_schedule(const uint8_t* key, __m128i round_keys[AES_ROUNDS + 1])
+{
+    round_keys[0] = _mm_loadu_si128((const __m128i*)key);
+    round_keys[1] = aes_aesni_expand(round_keys[0], _mm_aeskeygenassist_si128(round_keys[0], 0x01));
+    round_keys[2] = aes_aesni_expand(round_keys[1], _mm_aeskeygenassist_si128(round_keys[1], 0x02));
+    round_keys[3] = aes_aesni_expand(round_keys[2], _mm_aeskeygenassist_si128(round_keys[2], 0x04));
+    round_keys[4] = aes_aesni_expand(round_keys[3], _mm_aeskeygenassist_si128(round_keys[3], 0x08));
+    round_keys[5] = aes_aesni_expand(round_keys[4], _mm_aeskeygenassist_si128(round_keys[4], 0x10));
+    round_keys[6] = aes_aesni_expand(round_keys[5], _mm_aeskeygenassist_si128(round_keys[5], 0x20));
+    round_keys[7] = aes_aesni_expand(round_keys[6], _mm_aeskeygenassist_si128(round_keys[6], 0x40));
+    round_keys[8] = aes_aesni_expand(round_keys[7], _mm_aeskeygenassist_si128(round_keys[7], 0x80));
+    round_keys[9] = aes_aesni_expand(round_keys[8], _mm_aeskeygenassist_si128(round_keys[8], 0x1B));
+    round_keys[10] = aes_aesni_expand(round_keys[9], _mm_aeskeygenassist_si128(round_keys[9], 0x36));
+}
+
+AESNI_TARGET static void ykhmac_aes_aesni_encrypt(union ykhmac_aes_work* work, const uint8_t* key, const uint8_t* iv,
+    uint8_t* data, const uint8_t size)
+{
+    (void)work;
+    __m128i round_keys[AES_ROUNDS + 1];
+    aes_aesni_schedule(key, round_keys);
+
+    __m128i chain = _mm_loadu_si128((const __m128i*)iv);
+    for (uint8_t offset = 0; offset < size; offset += AES_BLOCKLEN)
+    {
+        chain = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(data + offset)), chain);
+        chain = _mm_xor_si128(chain, round_keys[0]);
+        for (uint8_t round = 1; round < AES_ROUNDS; round++) chain = _mm_aesenc_si128(chain, round_keys[round]);
+        chain = _mm_aesenclast_si128(chain, round_keys[AES_ROUNDS]);
+        _mm_storeu_si128((__m128i*)(data + offset), chain);
+    }
+
+    ykhmac_crypto_wipe(round_keys, sizeof(round_keys));
+}
+
+// Expands the key into the round keys of the equivalent inverse cipher, kept in the work area
+AESNI_TARGET static void ykhmac_aes_aesni_decrypt_expand(union ykhmac_aes_work* work, const uint8_t* key)
+{
+    __m128i round_keys[AES_ROUNDS + 1];
+    aes_aesni_schedule(key, round_keys);
+
+    for (uint8_t round = 1; round < AES_ROUNDS; round++) round_keys[round] = _mm_aesimc_si128(round_keys[round]);
+    for (uint8_t round = 0; round <= AES_ROUNDS; round++)
+    {
+        _mm_storeu_si128((__m128i*)(work->round_keys + round * AES_BLOCKLEN), round_keys[round]);
+    }
+
+    ykhmac_crypto_wipe(round_keys, sizeof(round_keys));
+}
+
+AESNI_TARGET static void ykhmac_aes_aesni_decrypt_expanded(union ykhmac_aes_work* work, const uint8_t* iv,
+    uint8_t* data, const uint8_t size)
+{
+    const __m128i* round_keys = (const __m128i*)work->round_keys;
+
+    // Equivalent inverse cipher, in reverse order
+    __m128i chain = _mm_loadu_si128((const __m128i*)iv);
+    for (uint8_t offset = 0; offset < size; offset += AES_BLOCKLEN)
+    {
+        const __m128i cipher = _mm_loadu_si128((const __m128i*)(data + offset));
+        __m128i plain = _mm_xor_si128(cipher, _mm_loadu_si128(round_keys + AES_ROUNDS));
+        for (uint8_t round = AES_ROUNDS - 1; round > 0; round--)
+        {
+            plain = _mm_aesdec_si128(plain, _mm_loadu_si128(round_keys + round));
+        }
+        plain = _mm_aesdeclast_si128(plain, _mm_loadu_si128(round_keys));
+        _mm_storeu_si128((__m128i*)(data + offset), _mm_xor_si128(plain, chain));
+        chain = cipher;
+    }
+}
+
+AESNI_TARGET static void ykhmac_aes_aesni_decrypt(union ykhmac_aes_work* work, const uint8_t* key, const uint8_t* iv,
+    uint8_t* data, const uint8_t size)
+{
+    ykhmac_aes_aesni_decrypt_expand(work, key);
+    ykhmac_aes_aesni_decrypt_expanded(work, iv, data, size);
+}
+
+const struct ykhmac_aes_backend ykhmac_aes_aesni =
+{
+    "aes-ni",
+    ykhmac_aes_aesni_supported,
+    ykhmac_aes_aesni_encrypt,
+    ykhmac_aes_aesni_decrypt,
+    ykhmac_aes_aesni_decrypt_expand,
+    ykhmac_aes_aesni_decrypt_expanded
+};
+
+#endif
@@ -0,0 +1,107 @@
+/**
+ * @file ykhmac_metrics.cpp
+ * @author Christoph Honal
+ * @brief Implements the per-phase latency histograms from ykhmac.h
+ * @version 0.1
+ * @date 2021-12-17
+ */
+
+#include "ykhmac.h"
+
+#ifdef YKHMAC_METRICS
+
+#include <stdio.h>
+#include <string.h>
+#include "ykhmac_atomic.h"
+
+static struct ykhmac_histogram histograms[YKHMAC_PHASES];
+
+
+void ykhmac_metrics_record(const ykhmac_phase phase, const uint32_t duration)
+{
+    if (phase >= YKHMAC_PHASES) return;
+    struct ykhmac_histogram* histogram = &histograms[phase];
+
+    // Bucket i holds the durations of i significant bits
+    uint8_t bucket = 0;
+    for (uint32_t rest = duration; rest != 0 && bucket < METRICS_BUCKETS - 1; rest >>= 1) bucket++;
+
+    YKHMAC_ATOMIC_ADD(histogram->count, 1);
+    YKHMAC_ATOMIC_ADD(histogram->sum, duration);
+    if (YKHMAC_ATOMIC_LOAD(histogram->buckets[bucket]) != (__typeof__(histogram->buckets[0]))-1)
+        YKHMAC_ATOMIC_ADD(histogram->buckets[bucket], 1);
+    YKHMAC_ATOMIC_MAX(histogram->max, duration);
+}
+
+bool ykhmac_metrics_get(const ykhmac_phase phase, struct ykhmac_histogram* histogram)
+{
+    if (phase >= YKHMAC_PHASES) return false;
+
+    histogram->count = YKHMAC_ATOMIC_LOAD(histograms[phase].count);
+    histogram->sum = YKHMAC_ATOMIC_LOAD(histograms[phase].sum);
+    histogram->max = YKHMAC_ATOMIC_LOAD(histograms[phase].max);
+    for (uint8_t i = 0; i < METRICS_BUCKETS; i++)
+        histogram->buckets[i] = YKHMAC_ATOMIC_LOAD(histograms[phase].buckets[i]);
+    return true;
+}
+
+void ykhmac_metrics_reset()
+{
+    for (uint8_t phase = 0; phase < YKHMAC_PHASES; phase++)
+    {
+        YKHMAC_ATOMIC_STORE(histograms[phase].count, 0);
+        YKHMAC_ATOMIC_STORE(histograms[phase].sum, 0);
+        YKHMAC_ATOMIC_STORE(histograms[phase].max, 0);
+        for (uint8_t i = 0; i < METRICS_BUCKETS; i++) YKHMAC_ATOMIC_STORE(histograms[phase].buckets[i], 0);
+    }
+}
+
+#ifndef ARDUINO
+    // Appends to the page like snprintf, keeps counting once the buffer is full
+    #define METRICS_PRINT(...) \
+        length += snprintf(buffer + MIN(length, size), (length < size) ? (size - length) : 0, __VA_ARGS__)
+
+    size_t ykhmac_metrics_export(char* buffer, const size_t size, const uint32_t clock_hz)
+    {
+        static const char* const names[YKHMAC_PHASES] =
+            { "select", "load", "exchange", "decrypt", "hmac", "compare", "encrypt", "store" };
+        size_t length = 0;
+        struct ykhmac_histogram histogram;
+
+        if (size > 0) buffer[0] = '\0';
+        METRICS_PRINT("# HELP ykhmac_phase_seconds Duration of the phases of an authentication or enrollment.\n");
+        METRICS_PRINT("# TYPE ykhmac_phase_seconds histogram\n");
+        for (uint8_t phase = 0; phase < YKHMAC_PHASES; phase++)
+        {
+            ykhmac_metrics_get((ykhmac_phase)phase, &histogram);
+
+            // Cumulative buckets, the last one is unbounded
+            uint64_t cumulative = 0;
+            for (uint8_t i = 0; i < METRICS_BUCKETS - 1; i++)
+            {
+                cumulative += histogram.buckets[i];
+                METRICS_PRINT("ykhmac_phase_seconds_bucket{phase=\"%s\",le=\"%g\"} %llu\n", names[phase],
+                    (double)(1ull << i) / clock_hz, (unsigned long long)cumulative);
+            }
+            METRICS_PRINT("ykhmac_phase_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %lu\n", names[phase],
+                (unsigned long)histogram.count);
+            METRICS_PRINT("ykhmac_phase_seconds_sum{phase=\"%s\"} %.9g\n", names[phase],
+                (double)histogram.sum / clock_hz);
+            METRICS_PRINT("ykhmac_phase_seconds_count{phase=\"%s\"} %lu\n", names[phase],
+                (unsigned long)histogram.count);
+        }
+
+        METRICS_PRINT("# HELP ykhmac_phase_max_seconds Longest duration of each phase.\n");
+        METRICS_PRINT("# TYPE ykhmac_phase_max_seconds gauge\n");
+        for (uint8_t phase = 0; phase < YKHMAC_PHASES; phase++)
+        {
+            ykhmac_metrics_get((ykhmac_phase)phase, &histogram);
+            METRICS_PRINT("ykhmac_phase_max_seconds{phase=\"%s\"} %.9g\n", names[phase],
+                (double)histogram.max / clock_hz);
+        }
+
+        return length;
+    }
+#endif
+
+#endif
@@ -0,0 +1,33 @@
+/**
+ * @file ykhmac_retry.cpp
+ * @author Christoph Honal
+ * @brief Implements the retry counters from ykhmac.h
+ * @version 0.1
+ * @date 2021-12-17
+ */
+
+#include "ykhmac.h"
+
+#ifdef YKHMAC_RETRY
+
+#include "ykhmac_atomic.h"
+
+static uint32_t counters[YKHMAC_RETRY_COUNTERS];
+
+
+void ykhmac_retry_record(const ykhmac_retry_counter counter)
+{
+    if (counter < YKHMAC_RETRY_COUNTERS) YKHMAC_ATOMIC_ADD(counters[counter], 1);
+}
+
+uint32_t ykhmac_retry_count(const ykhmac_retry_counter counter)
+{
+    return (counter < YKHMAC_RETRY_COUNTERS) ? YKHMAC_ATOMIC_LOAD(counters[counter]) : 0;
+}
+
+void ykhmac_retry_reset()
+{
+    for (uint8_t i = 0; i < YKHMAC_RETRY_COUNTERS; i++) YKHMAC_ATOMIC_STORE(counters[i], 0);
+}
+
+#endif
@@ -0,0 +1,68 @@
+/**
+ * @file ykhmac_session.cpp
+ * @author Christoph Honal
+ * @brief Implements the definitions from ykhmac_session.h
+ * @version 0.1
+ * @date 2021-12-17
+ */
+
+#include "ykhmac_session.h"
+
+#include <string.h>
+
+
+void ykhmac_session_init(struct ykhmac_session* session, const struct ykhmac_session_hooks* hooks, void* context)
+{
+    const ykhmac::SessionBinding binding = { hooks, context };
+
+    ykhmac::SessionTransport transport;
+    transport.binding = binding;
+    memset(transport.frame_buffer, 0, FRAME_SIZE);
+    ykhmac::SessionStorage storage = { binding };
+    ykhmac::SessionRng rng = { binding };
+
+    session->engine = decltype(session->engine)(transport, storage, rng);
+}
+
+bool ykhmac_session_select(struct ykhmac_session* session, const uint8_t* aid, const uint8_t aid_size)
+{
+    if (aid_size > ARG_BUF_SIZE_MAX) return false;
+
+    return session->engine.select(aid, aid_size);
+}
+
+bool ykhmac_session_read_serial(struct ykhmac_session* session, uint32_t* serial)
+{
+    return session->engine.read_serial(serial);
+}
+
+bool ykhmac_session_exchange_hmac(struct ykhmac_session* session, const uint8_t slot,
+    const uint8_t* challenge, const uint8_t challenge_length, uint8_t response[RESP_BUF_SIZE])
+{
+    if (challenge_length > ARG_BUF_SIZE_MAX) return false;
+
+    return session->engine.exchange_hmac(slot, challenge, challenge_length, response);
+}
+
+bool ykhmac_session_enroll_key(struct ykhmac_session* session, const uint8_t secret_key[SECRET_KEY_SIZE])
+{
+    return session->engine.enroll(secret_key);
+}
+
+bool ykhmac_session_authenticate(struct ykhmac_session* session, const uint8_t slot)
+{
+    return session->engine.authenticate(slot);
+}
+
+bool ykhmac_session_authenticate_start(struct ykhmac_session* session, const uint8_t slot,
+    const uint8_t* aid, const uint8_t aid_size)
+{
+    if (aid_size > ARG_BUF_SIZE_MAX) return false;
+
+    return session->engine.authenticate_start(slot, aid, aid_size);
+}
+
+ykhmac_status ykhmac_session_authenticate_step(struct ykhmac_session* session)
+{
+    return session->engine.authenticate_step();
+}
@@ -0,0 +1,81 @@
+/**
+ * @file ykhmac_sha1.cpp
+ * @author Christoph Honal
+ * @brief Implements the word-wise SHA1 compression of the fixed-length HMAC-SHA1 from ykhmac_crypto.h
+ * @version 0.1
+ * @date 2021-12-17
+ */
+
+#include "ykhmac_crypto.h"
+
+#if defined(YKHMAC_HMAC_FIXED) && CHALLENGE_SIZE > HMAC_SINGLE_BLOCK_SIZE && !defined(YKHMAC_HMAC_FIXED_QUIET)
+    #warning "CHALLENGE_SIZE exceeds HMAC_SINGLE_BLOCK_SIZE, each HMAC-SHA1 compresses an additional block"
+#endif
+
+#define SHA1_K0                 0x5A827999  //!< Round constant of rounds 0 to 19
+#define SHA1_K1                 0x6ED9EBA1  //!< Round constant of rounds 20 to 39
+#define SHA1_K2                 0x8F1BBCDC  //!< Round constant of rounds 40 to 59
+#define SHA1_K3                 0xCA62C1D6  //!< Round constant of rounds 60 to 79
+
+// Round functions
+#define SHA1_CH(b, c, d)        ((d) ^ ((b) & ((c) ^ (d))))
+#define SHA1_PARITY(b, c, d)    ((b) ^ (c) ^ (d))
+#define SHA1_MAJ(b, c, d)       (((b) & (c)) | ((d) & ((b) | (c))))
+
+// Message word t, rounds from 16 on advance the schedule in the ring of 16 words
+#define SHA1_W(t)               (block[(t) & 15])
+#define SHA1_SCHEDULE(t)        (SHA1_W(t) = sha1_rol(SHA1_W((t) + 13) ^ SHA1_W((t) + 8) ^ SHA1_W((t) + 2) ^ SHA1_W(t), 1))
+
+// One round, the caller rotates the names of the working variables instead of moving their values
+#define SHA1_ROUND(a, b, c, d, e, f, k, w) \
+    do { (e) += sha1_rol(a, 5) + f(b, c, d) + (k) + (w); (b) = sha1_rol(b, 30); } while (0)
+
+// Five rounds, after which the working variables are back in place
+#define SHA1_ROUNDS5(t, f, k, w) \
+    do \
+    { \
+        SHA1_ROUND(a, b, c, d, e, f, k, w((t) + 0)); \
+        SHA1_ROUND(e, a, b, c, d, f, k, w((t) + 1)); \
+        SHA1_ROUND(d, e, a, b, c, f, k, w((t) + 2)); \
+        SHA1_ROUND(c, d, e, a, b, f, k, w((t) + 3)); \
+        SHA1_ROUND(b, c, d, e, a, f, k, w((t) + 4)); \
+    } while (0)
+
+// The loops of five rounds are unrolled on hosts, on AVR the full 80 rounds would take several kilobytes of flash
+#if defined(ARDUINO_ARCH_AVR) || !defined(__GNUC__) || defined(__clang__)
+    #define SHA1_UNROLL
+#else
+    #define SHA1_UNROLL         _Pragma("GCC unroll 4")
+#endif
+
+
+static inline uint32_t sha1_rol(const uint32_t x, const uint8_t n)
+{
+    return (x << n) | (x >> (32 - n));
+}
+
+void ykhmac_sha1_compress(uint32_t state[5], uint32_t block[HMAC_BLOCK_SIZE / 4])
+{
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+
+    SHA1_ROUNDS5(0, SHA1_CH, SHA1_K0, SHA1_W);
+    SHA1_ROUNDS5(5, SHA1_CH, SHA1_K0, SHA1_W);
+    SHA1_ROUNDS5(10, SHA1_CH, SHA1_K0, SHA1_W);
+    SHA1_ROUND(a, b, c, d, e, SHA1_CH, SHA1_K0, SHA1_W(15));
+    SHA1_ROUND(e, a, b, c, d, SHA1_CH, SHA1_K0, SHA1_SCHEDULE(16));
+    SHA1_ROUND(d, e, a, b, c, SHA1_CH, SHA1_K0, SHA1_SCHEDULE(17));
+    SHA1_ROUND(c, d, e, a, b, SHA1_CH, SHA1_K0, SHA1_SCHEDULE(18));
+    SHA1_ROUND(b, c, d, e, a, SHA1_CH, SHA1_K0, SHA1_SCHEDULE(19));
+    SHA1_UNROLL
+    for (uint8_t t = 20; t < 40; t += 5) SHA1_ROUNDS5(t, SHA1_PARITY, SHA1_K1, SHA1_SCHEDULE);
+    SHA1_UNROLL
+    for (uint8_t t = 40; t < 60; t += 5) SHA1_ROUNDS5(t, SHA1_MAJ, SHA1_K2, SHA1_SCHEDULE);
+    SHA1_UNROLL
+    for (uint8_t t = 60; t < 80; t += 5) SHA1_ROUNDS5(t, SHA1_PARITY, SHA1_K3, SHA1_SCHEDULE);
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+}
@@ -0,0 +1,102 @@
+/**
+ * @file ykhmac_stack.cpp
+ * @author Christoph Honal
+ * @brief Implements the stack high-water marks from ykhmac.h
+ * @version 0.1
+ * @date 2021-12-17
+ */
+
+#include "ykhmac.h"
+
+#ifdef YKHMAC_STACK
+
+#include <string.h>
+#ifdef ARDUINO_ARCH_AVR
+    #include <avr/io.h>
+
+    extern uint8_t __heap_start;
+    extern void* __brkval;
+#elif defined(__linux__)
+    #include <pthread.h>
+#endif
+
+static uint16_t peaks[YKHMAC_ENTRIES];
+
+
+#if !defined(ARDUINO_ARCH_AVR) && defined(__linux__)
+    // Lowest address of the stack of the calling thread, queried once per thread, nullptr if unknown
+    static uint8_t* stack_limit()
+    {
+        static thread_local uint8_t* limit = nullptr;
+        if (limit == nullptr)
+        {
+            pthread_attr_t attr;
+            void* address = nullptr;
+            size_t size = 0;
+            if (pthread_getattr_np(pthread_self(), &attr) == 0)
+            {
+                if (pthread_attr_getstack(&attr, &address, &size) != 0) address = nullptr;
+                pthread_attr_destroy(&attr);
+            }
+            limit = (uint8_t*)address;
+        }
+        return limit;
+    }
+#elif !defined(ARDUINO_ARCH_AVR)
+    static uint8_t* stack_limit()
+    {
+        return nullptr;
+    }
+#endif
+
+
+// Lowest address painted below the top of the painted area
+static uint8_t* stack_bottom(uint8_t* top)
+{
+    #ifdef ARDUINO_ARCH_AVR
+        // Never paint the heap, the stack may not even reach STACK_PAINT_SIZE
+        uint8_t* heap_end = (__brkval != nullptr) ? (uint8_t*)__brkval : &__heap_start;
+        return ((size_t)(top - heap_end) > STACK_PAINT_SIZE) ? top - STACK_PAINT_SIZE : heap_end;
+    #else
+        // Never paint below the stack of the thread, which may be smaller than STACK_PAINT_SIZE
+        uint8_t* limit = stack_limit();
+        return (limit == nullptr || (size_t)(top - limit) > STACK_PAINT_SIZE) ? top - STACK_PAINT_SIZE : limit;
+    #endif
+}
+
+__attribute__((noinline)) uint8_t* ykhmac_stack_paint()
+{
+    #ifdef ARDUINO_ARCH_AVR
+        uint8_t* top = (uint8_t*)SP - STACK_MARGIN;
+    #else
+        // The margin covers the few locals of this frame, and the call to memset
+        uint8_t* top = (uint8_t*)__builtin_frame_address(0) - STACK_MARGIN;
+    #endif
+    uint8_t* bottom = stack_bottom(top);
+    if (bottom < top) memset(bottom, STACK_PAINT, top - bottom);
+    return top;
+}
+
+void ykhmac_stack_record(const ykhmac_entry entry, const uint8_t* top)
+{
+    if (entry >= YKHMAC_ENTRIES) return;
+
+    // The deepest byte which is not painted any more
+    const uint8_t* p = stack_bottom((uint8_t*)top);
+    while (p < top && *p == STACK_PAINT) p++;
+    const uint16_t peak = (uint16_t)(top - p) + STACK_MARGIN;
+
+    if (peak > peaks[entry]) peaks[entry] = peak;
+}
+
+uint16_t ykhmac_stack_peak(const ykhmac_entry entry)
+{
+    return (entry < YKHMAC_ENTRIES) ? peaks[entry] : 0;
+}
+
+void ykhmac_stack_reset()
+{
+    memset(peaks, 0, sizeof(peaks));
+}
+
+#endif
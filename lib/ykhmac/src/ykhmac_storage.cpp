@@ -0,0 +1,342 @@
+/**
+ * @file ykhmac_storage.cpp
+ * @author Christoph Honal
+ * @brief Implements the definitions from ykhmac_storage.h
+ * @version 0.1
+ * @date 2021-12-17
+ */
+
+#include "ykhmac_storage.h"
+
+#include <string.h>
+
+
+uint16_t ykhmac_crc16(uint16_t crc, const uint8_t* data, const size_t size)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        crc ^= (uint16_t)data[i] << 8;
+        for (uint8_t j = 0; j < 8; j++)
+        {
+            crc = (crc & 0x8000) ? ((crc << 1) ^ 0x1021) : (crc << 1);
+        }
+    }
+    return crc;
+}
+
+bool ykhmac_storage_write(const uint8_t* data, const size_t size, const size_t offset)
+{
+    uint8_t buffer[STORAGE_CHUNK_SIZE];
+
+    for (size_t done = 0; done < size; done += STORAGE_CHUNK_SIZE)
+    {
+        size_t length = MIN(STORAGE_CHUNK_SIZE, size - done);
+        if (!ykhmac_presistent_read(buffer, length, offset + done)) return false;
+
+        // Write each run of changed bytes
+        size_t i = 0;
+        while (i < length)
+        {
+            if (buffer[i] == data[done + i])
+            {
+                i++;
+                continue;
+            }
+
+            size_t start = i;
+            while (i < length && buffer[i] != data[done + i]) i++;
+            if (!ykhmac_presistent_write(data + done + start, i - start, offset + done + start))
+                return false;
+        }
+    }
+
+    return true;
+}
+
+bool ykhmac_storage_prepare(const size_t size, const size_t offset)
+{
+    #ifdef YKHMAC_STORAGE_FLASH
+        uint8_t buffer[STORAGE_CHUNK_SIZE];
+
+        for (size_t page = offset; page < offset + size; page += STORAGE_PAGE_SIZE)
+        {
+            // Skip pages which are already blank, to save erase cycles
+            bool blank = true;
+            for (size_t done = 0; blank && done < STORAGE_PAGE_SIZE; done += STORAGE_CHUNK_SIZE)
+            {
+                size_t length = MIN(STORAGE_CHUNK_SIZE, STORAGE_PAGE_SIZE - done);
+                if (!ykhmac_presistent_read(buffer, length, page + done)) return false;
+                for (size_t i = 0; i < length; i++) blank &= (buffer[i] == 0xFF);
+            }
+
+            if (!blank && !ykhmac_presistent_erase(page)) return false;
+        }
+    #else
+        (void)size;
+        (void)offset;
+    #endif
+
+    return true;
+}
+
+// Reads a persistent field and updates the checksum
+bool ykhmac_record_field(uint8_t* data, const size_t size, const size_t offset, uint16_t* crc)
+{
+    if (!ykhmac_presistent_read(data, size, offset)) return false;
+    *crc = ykhmac_crc16(*crc, data, size);
+    return true;
+}
+
+// Reads the generation counter of a record slot
+bool ykhmac_record_generation(const size_t offset, uint32_t* generation, uint16_t* crc)
+{
+    uint8_t buffer[RECORD_GEN_SIZE];
+    if (!ykhmac_record_field(buffer, RECORD_GEN_SIZE, offset, crc)) return false;
+
+    *generation = ((uint32_t)buffer[0] << 24) + ((uint32_t)buffer[1] << 16) +
+                  ((uint32_t)buffer[2] << 8) + buffer[3];
+    return true;
+}
+
+// Streams the remainder of a record through the checksum and compares it
+bool ykhmac_record_check(const size_t offset, uint16_t crc)
+{
+    uint8_t buffer[STORAGE_CHUNK_SIZE];
+
+    size_t end = offset + RECORD_SIZE - RECORD_CRC_SIZE;
+    for (size_t i = offset + RECORD_GEN_SIZE; i < end; i += STORAGE_CHUNK_SIZE)
+    {
+        if (!ykhmac_record_field(buffer, MIN(STORAGE_CHUNK_SIZE, end - i), i, &crc))
+            return false;
+    }
+
+    if (!ykhmac_presistent_read(buffer, RECORD_CRC_SIZE, end)) return false;
+    return buffer[0] == (uint8_t)(crc >> 8) && buffer[1] == (uint8_t)crc;
+}
+
+bool ykhmac_record_read(const size_t offset, uint16_t crc, uint32_t* generation,
+    uint8_t challenge[CHALLENGE_SIZE], uint8_t iv[AES_BLOCKLEN], uint8_t secret_key[SECRET_KEY_SIZE_PAD])
+{
+    uint8_t buffer[RECORD_CRC_SIZE];
+    size_t data_offset = offset + RECORD_GEN_SIZE;
+
+    if (ykhmac_record_generation(offset, generation, &crc)
+        && ykhmac_record_field(challenge, CHALLENGE_SIZE, data_offset, &crc)
+        && ykhmac_record_field(iv, AES_BLOCKLEN, data_offset + CHALLENGE_SIZE, &crc)
+        && ykhmac_record_field(secret_key, SECRET_KEY_SIZE_PAD,
+            data_offset + CHALLENGE_SIZE + AES_BLOCKLEN, &crc)
+        && ykhmac_presistent_read(buffer, RECORD_CRC_SIZE,
+            data_offset + CHALLENGE_SIZE + AES_BLOCKLEN + SECRET_KEY_SIZE_PAD))
+    {
+        return buffer[0] == (uint8_t)(crc >> 8) && buffer[1] == (uint8_t)crc;
+    }
+
+    return false;
+}
+
+bool ykhmac_record_write(const size_t offset, uint16_t crc, const uint32_t generation,
+    const uint8_t challenge[CHALLENGE_SIZE], const uint8_t iv[AES_BLOCKLEN],
+    const uint8_t secret_key[SECRET_KEY_SIZE_PAD])
+{
+    uint8_t buffer[RECORD_GEN_SIZE] = { (uint8_t)(generation >> 24), (uint8_t)(generation >> 16),
+        (uint8_t)(generation >> 8), (uint8_t)generation };
+    crc = ykhmac_crc16(crc, buffer, RECORD_GEN_SIZE);
+    crc = ykhmac_crc16(crc, challenge, CHALLENGE_SIZE);
+    crc = ykhmac_crc16(crc, iv, AES_BLOCKLEN);
+    crc = ykhmac_crc16(crc, secret_key, SECRET_KEY_SIZE_PAD);
+
+    // The checksum is written last, an interrupted write leaves an invalid record
+    if (ykhmac_storage_prepare(RECORD_SLOT_SIZE, offset)
+        && ykhmac_storage_write(buffer, RECORD_GEN_SIZE, offset)
+        && ykhmac_storage_write(challenge, CHALLENGE_SIZE, offset + RECORD_GEN_SIZE)
+        && ykhmac_storage_write(iv, AES_BLOCKLEN, offset + RECORD_GEN_SIZE + CHALLENGE_SIZE)
+        && ykhmac_storage_write(secret_key, SECRET_KEY_SIZE_PAD,
+            offset + RECORD_GEN_SIZE + CHALLENGE_SIZE + AES_BLOCKLEN))
+    {
+        buffer[0] = (uint8_t)(crc >> 8);
+        buffer[1] = (uint8_t)crc;
+        return ykhmac_storage_write(buffer, RECORD_CRC_SIZE, offset + RECORD_SIZE - RECORD_CRC_SIZE);
+    }
+
+    return false;
+}
+
+#ifndef YKHMAC_TOKEN_TABLE
+    // Enrollment record ring state
+    #define RECORD_UNKNOWN 0xFF
+    uint8_t record_active = RECORD_UNKNOWN;     // Index of the newest valid record
+    uint32_t record_generation = 0;             // Generation counter of the newest valid record
+    #ifdef YKHMAC_PRECOMPUTE
+        uint8_t record_next = 0;                // Index of the oldest unused record
+        uint8_t record_unused = 0;              // Amount of unused records, up to the newest one
+
+        // Checks the marker of a record slot, which holds the low byte of the generation once used
+        bool ykhmac_record_used(const uint8_t index, const uint32_t generation)
+        {
+            uint8_t marker = 0;
+            return !ykhmac_presistent_read(&marker, 1, RECORD_MARK_OFFSET + index)
+                || marker == (uint8_t)generation;
+        }
+
+        // Counts the unused records, which precede the newest record in consecutive generations
+        void ykhmac_record_count()
+        {
+            record_next = record_active;
+            record_unused = 0;
+
+            uint8_t index = record_active;
+            for (uint8_t i = 0; i < RECORD_COUNT; i++)
+            {
+                uint32_t generation = 0;
+                uint16_t crc = 0xFFFF;
+                if (!ykhmac_record_generation(index * RECORD_SLOT_SIZE, &generation, &crc)
+                    || generation != record_generation - i || ykhmac_record_used(index, generation)
+                    || !ykhmac_record_check(index * RECORD_SLOT_SIZE, crc)) break;
+
+                record_next = index;
+                record_unused++;
+                index = (index + RECORD_COUNT - 1) % RECORD_COUNT;
+            }
+        }
+    #endif
+
+    // Finds the newest valid record in the ring
+    bool ykhmac_record_find()
+    {
+        if (record_active != RECORD_UNKNOWN) return true;
+
+        for (uint8_t i = 0; i < RECORD_COUNT; i++)
+        {
+            // Only records newer than the best one so far need their checksum verified
+            uint32_t generation = 0;
+            uint16_t crc = 0xFFFF;
+            if (ykhmac_record_generation(i * RECORD_SLOT_SIZE, &generation, &crc)
+                && (record_active == RECORD_UNKNOWN || (int32_t)(generation - record_generation) > 0)
+                && ykhmac_record_check(i * RECORD_SLOT_SIZE, crc))
+            {
+                record_active = i;
+                record_generation = generation;
+            }
+        }
+
+        #ifdef YKHMAC_PRECOMPUTE
+            if (record_active != RECORD_UNKNOWN) ykhmac_record_count();
+        #endif
+        return record_active != RECORD_UNKNOWN;
+    }
+
+    void ykhmac_record_reset()
+    {
+        record_active = RECORD_UNKNOWN;
+        record_generation = 0;
+        #ifdef YKHMAC_PRECOMPUTE
+            record_next = 0;
+            record_unused = 0;
+        #endif
+    }
+
+    bool ykhmac_record_load(uint8_t challenge[CHALLENGE_SIZE], uint8_t iv[AES_BLOCKLEN],
+        uint8_t secret_key[SECRET_KEY_SIZE_PAD])
+    {
+        if (!ykhmac_record_find()) return false;
+
+        // The record may have been changed since it was checked
+        uint32_t generation = 0;
+        #ifdef YKHMAC_PRECOMPUTE
+            if (record_unused == 0) return false;
+            if (ykhmac_record_read(record_next * RECORD_SLOT_SIZE, 0xFFFF, &generation,
+                challenge, iv, secret_key) && generation == record_generation - (record_unused - 1)) return true;
+        #else
+            if (ykhmac_record_read(record_active * RECORD_SLOT_SIZE, 0xFFFF, &generation,
+                challenge, iv, secret_key) && generation == record_generation) return true;
+        #endif
+
+        ykhmac_record_reset();
+        return false;
+    }
+
+    // Writes a record into a slot of the ring, and makes it the newest one
+    bool ykhmac_record_place(const uint8_t index, const uint32_t generation, const uint8_t challenge[CHALLENGE_SIZE],
+        const uint8_t iv[AES_BLOCKLEN], const uint8_t secret_key[SECRET_KEY_SIZE_PAD])
+    {
+        bool success = ykhmac_record_write(index * RECORD_SLOT_SIZE, 0xFFFF, generation, challenge, iv, secret_key);
+        #ifdef YKHMAC_PRECOMPUTE
+            // A stale marker is cleared after the record, an interrupted write leaves a used or invalid record
+            const uint8_t marker = (uint8_t)~generation;
+            success = success && ykhmac_storage_write(&marker, 1, RECORD_MARK_OFFSET + index);
+        #endif
+
+        if (success)
+        {
+            record_active = index;
+            record_generation = generation;
+            return true;
+        }
+
+        // State of the slot is unknown now
+        ykhmac_record_reset();
+        return false;
+    }
+
+    bool ykhmac_record_store(const uint8_t challenge[CHALLENGE_SIZE], const uint8_t iv[AES_BLOCKLEN],
+        const uint8_t secret_key[SECRET_KEY_SIZE_PAD])
+    {
+        uint8_t index = 0;
+        uint32_t generation = 0;
+        if (ykhmac_record_find())
+        {
+            index = (record_active + 1) % RECORD_COUNT;
+            #ifdef YKHMAC_PRECOMPUTE
+                // Skipping a generation leaves the unused records of the previous secret key behind
+                generation = record_generation + 2;
+            #else
+                generation = record_generation + 1;
+            #endif
+        }
+
+        if (!ykhmac_record_place(index, generation, challenge, iv, secret_key)) return false;
+        #ifdef YKHMAC_PRECOMPUTE
+            record_next = index;
+            record_unused = 1;
+        #endif
+        return true;
+    }
+
+    #ifdef YKHMAC_PRECOMPUTE
+        bool ykhmac_record_append(const uint8_t challenge[CHALLENGE_SIZE], const uint8_t iv[AES_BLOCKLEN],
+            const uint8_t secret_key[SECRET_KEY_SIZE_PAD])
+        {
+            if (!ykhmac_record_find()) return ykhmac_record_store(challenge, iv, secret_key);
+            if (record_unused >= RECORD_COUNT) return false;
+
+            // Continues the run of unused records, or starts a new one if all have been used
+            const uint8_t index = (record_active + 1) % RECORD_COUNT;
+            if (!ykhmac_record_place(index, record_generation + 1, challenge, iv, secret_key)) return false;
+            if (record_unused == 0) record_next = index;
+            record_unused++;
+            return true;
+        }
+
+        bool ykhmac_record_consume()
+        {
+            if (!ykhmac_record_find() || record_unused == 0) return false;
+
+            // One byte, the marker of the oldest unused record
+            const uint8_t marker = (uint8_t)(record_generation - (record_unused - 1));
+            if (ykhmac_storage_write(&marker, 1, RECORD_MARK_OFFSET + record_next))
+            {
+                record_next = (record_next + 1) % RECORD_COUNT;
+                record_unused--;
+                return true;
+            }
+
+            ykhmac_record_reset();
+            return false;
+        }
+
+        uint8_t ykhmac_record_available()
+        {
+            return ykhmac_record_find() ? record_unused : 0;
+        }
+    #endif
+#endif
@@ -0,0 +1,383 @@
+/**
+ * @file ykhmac_store.cpp
+ * @author Christoph Honal
+ * @brief Implements the definitions from ykhmac_store.h
+ * @version 0.1
+ * @date 2021-12-17
+ */
+
+#include "ykhmac_store.h"
+
+#ifdef YKHMAC_STORE_MMAP
+
+#include "ykhmac_storage.h"
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+// Offsets within a stored record
+#define STORE_RECORD_SERIAL     0
+#define STORE_RECORD_GENERATION 4
+#define STORE_RECORD_CHALLENGE  8
+#define STORE_RECORD_IV         (STORE_RECORD_CHALLENGE + CHALLENGE_SIZE)
+#define STORE_RECORD_SECRET_KEY (STORE_RECORD_IV + AES_BLOCKLEN)
+#define STORE_RECORD_CRC        (STORE_RECORD_SECRET_KEY + SECRET_KEY_SIZE_PAD)
+#define STORE_RETRIES           64      // Attempts of a reader racing against updates of the same token
+
+// Updates a CRC-16/CCITT-FALSE checksum a byte at a time, same as ykhmac_crc16
+static uint16_t store_crc16(uint16_t crc, const uint8_t* data, const size_t size)
+{
+    static const struct crc_table
+    {
+        uint16_t entries[256];
+        crc_table()
+        {
+            for (uint16_t i = 0; i < 256; i++)
+            {
+                const uint8_t byte = (uint8_t)i;
+                entries[i] = ykhmac_crc16(0, &byte, 1);
+            }
+        }
+    } table;
+
+    for (size_t i = 0; i < size; i++) crc = (uint16_t)(crc << 8) ^ table.entries[(uint8_t)(crc >> 8) ^ data[i]];
+    return crc;
+}
+
+// Rounds up to a multiple of the shard alignment
+static uint64_t store_align(const uint64_t size)
+{
+    return (size + STORE_SHARD_ALIGN - 1) / STORE_SHARD_ALIGN * STORE_SHARD_ALIGN;
+}
+
+// Mixes the bits of a serial number, serials are often sequential
+static uint32_t store_hash(uint32_t x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352d;
+    x ^= x >> 15;
+    x *= 0x846ca68b;
+    x ^= x >> 16;
+    return x;
+}
+
+// Returns the shard of a serial number
+static uint8_t* store_shard(const struct ykhmac_store* store, const uint32_t hash)
+{
+    const uint64_t index = ((uint64_t)hash * store->header->shards) >> 32;
+    return store->base + STORE_HEADER_SIZE + index * store->header->shard_size;
+}
+
+// Returns the index of a shard
+static struct ykhmac_store_bucket* store_index(uint8_t* shard)
+{
+    return (struct ykhmac_store_bucket*)(shard + store_align(sizeof(struct ykhmac_store_shard)));
+}
+
+// Returns a record of a pair
+static uint8_t* store_record(const struct ykhmac_store* store, uint8_t* shard, const uint32_t pair, const uint32_t generation)
+{
+    const uint64_t index_size = store_align((uint64_t)store->header->buckets * sizeof(struct ykhmac_store_bucket));
+    return shard + store_align(sizeof(struct ykhmac_store_shard)) + index_size
+        + ((uint64_t)pair * 2 + (generation & 1)) * STORE_RECORD_SIZE;
+}
+
+// Computes the size of a shard
+static uint64_t store_shard_size(const uint32_t buckets, const uint32_t pairs)
+{
+    return store_align(sizeof(struct ykhmac_store_shard))
+        + store_align((uint64_t)buckets * sizeof(struct ykhmac_store_bucket))
+        + store_align((uint64_t)pairs * 2 * STORE_RECORD_SIZE);
+}
+
+// Checksum of the header fields
+static uint32_t store_header_crc(const struct ykhmac_store_header* header)
+{
+    return ykhmac_crc16(0xFFFF, (const uint8_t*)header, offsetof(struct ykhmac_store_header, crc));
+}
+
+// Finds the bucket of a serial number, or claims an empty one for it
+static struct ykhmac_store_bucket* store_find(const struct ykhmac_store* store, const uint32_t serial,
+    uint8_t** shard, const bool claim)
+{
+    if (serial == 0) return nullptr;
+
+    const uint32_t hash = store_hash(serial);
+    const uint32_t buckets = store->header->buckets;
+    *shard = store_shard(store, hash);
+    struct ykhmac_store_bucket* index = store_index(*shard);
+
+    // Linear probing, buckets are never emptied again, so a probe sequence ends at the first empty one
+    uint32_t position = ((uint64_t)store_hash(hash ^ 0x9e3779b9) * buckets) >> 32;
+    for (uint32_t i = 0; i < buckets; i++)
+    {
+        struct ykhmac_store_bucket* bucket = &index[position];
+        uint32_t found = __atomic_load_n(&bucket->serial, __ATOMIC_ACQUIRE);
+        if (found == 0)
+        {
+            if (!claim) return nullptr;
+            if (__atomic_compare_exchange_n(&bucket->serial, &found, serial, false,
+                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) return bucket;
+        }
+        if (found == serial) return bucket;
+
+        position = (position + 1 == buckets) ? 0 : position + 1;
+    }
+
+    return nullptr;
+}
+
+// Sets the update flag of a bucket, returns its previous state
+static bool store_lock(struct ykhmac_store_bucket* bucket, uint32_t* state)
+{
+    *state = __atomic_load_n(&bucket->state, __ATOMIC_RELAXED);
+    do
+    {
+        if (*state & STORE_WRITING) return false;
+    }
+    while (!__atomic_compare_exchange_n(&bucket->state, state, *state | STORE_WRITING, true,
+        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+
+    return true;
+}
+
+// Writes a record, the checksum binds it to the serial number and the generation
+static void store_write(uint8_t* record, const uint32_t serial, const uint32_t generation,
+    const uint8_t* challenge, const uint8_t* iv, const uint8_t* secret_key)
+{
+    memcpy(record + STORE_RECORD_SERIAL, &serial, 4);
+    memcpy(record + STORE_RECORD_GENERATION, &generation, 4);
+    memcpy(record + STORE_RECORD_CHALLENGE, challenge, CHALLENGE_SIZE);
+    memcpy(record + STORE_RECORD_IV, iv, AES_BLOCKLEN);
+    memcpy(record + STORE_RECORD_SECRET_KEY, secret_key, SECRET_KEY_SIZE_PAD);
+    const uint16_t crc = store_crc16(0xFFFF, record, STORE_RECORD_CRC);
+    memcpy(record + STORE_RECORD_CRC, &crc, 2);
+}
+
+
+bool ykhmac_store_open(struct ykhmac_store* store, const char* path, const uint32_t capacity, const uint32_t shards)
+{
+    store->fd = -1;
+    store->base = nullptr;
+    store->size = 0;
+    store->header = nullptr;
+
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) return false;
+
+    // Serializes the creation of a new file against other processes
+    struct stat status;
+    if (flock(fd, LOCK_EX) != 0 || fstat(fd, &status) != 0)
+    {
+        close(fd);
+        return false;
+    }
+
+    struct ykhmac_store_header header;
+    if (status.st_size == 0)
+    {
+        if (capacity == 0 || shards == 0)
+        {
+            close(fd);
+            return false;
+        }
+
+        // Spare buckets keep the probe sequences short, spare pairs absorb uneven shards (six standard deviations)
+        const uint32_t per_shard = (capacity + shards - 1) / shards;
+        uint32_t deviation = 1;
+        while (deviation * deviation < per_shard) deviation++;
+        memset(&header, 0, sizeof(header));
+        header.magic = STORE_MAGIC;
+        header.version = STORE_VERSION;
+        header.challenge_size = CHALLENGE_SIZE;
+        header.secret_key_size_pad = SECRET_KEY_SIZE_PAD;
+        header.record_size = STORE_RECORD_SIZE;
+        header.shards = shards;
+        header.pairs = per_shard + 6 * deviation + 16;
+        header.buckets = MAX(per_shard + per_shard / 2 + 1, header.pairs);
+        header.shard_size = store_shard_size(header.buckets, header.pairs);
+        header.crc = store_header_crc(&header);
+
+        // The file stays sparse, the kernel provides zeroed pages. A failed creation leaves an empty file
+        if (ftruncate(fd, STORE_HEADER_SIZE + header.shard_size * shards) != 0
+            || pwrite(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header))
+        {
+            (void)!ftruncate(fd, 0);
+            close(fd);
+            return false;
+        }
+    }
+    else if (pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header)
+        || header.magic != STORE_MAGIC || header.version != STORE_VERSION || header.crc != store_header_crc(&header)
+        || header.challenge_size != CHALLENGE_SIZE || header.secret_key_size_pad != SECRET_KEY_SIZE_PAD
+        || header.record_size != STORE_RECORD_SIZE || header.shards == 0
+        || header.shard_size != store_shard_size(header.buckets, header.pairs)
+        || (uint64_t)status.st_size != STORE_HEADER_SIZE + header.shard_size * header.shards)
+    {
+        close(fd);
+        return false;
+    }
+    flock(fd, LOCK_UN);
+
+    size_t size = STORE_HEADER_SIZE + header.shard_size * header.shards;
+    void* base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED)
+    {
+        close(fd);
+        return false;
+    }
+
+    // Lookups hit random pages, read-ahead would only evict useful ones
+    madvise(base, size, MADV_RANDOM);
+
+    store->fd = fd;
+    store->base = (uint8_t*)base;
+    store->size = size;
+    store->header = (const struct ykhmac_store_header*)base;
+    return true;
+}
+
+void ykhmac_store_close(struct ykhmac_store* store)
+{
+    if (store->base != nullptr) munmap(store->base, store->size);
+    if (store->fd >= 0) close(store->fd);
+    store->fd = -1;
+    store->base = nullptr;
+    store->size = 0;
+    store->header = nullptr;
+}
+
+bool ykhmac_store_load(const struct ykhmac_store* store, const uint32_t serial, uint8_t challenge[CHALLENGE_SIZE],
+    uint8_t iv[AES_BLOCKLEN], uint8_t secret_key[SECRET_KEY_SIZE_PAD])
+{
+    uint8_t* shard;
+    struct ykhmac_store_bucket* bucket = store_find(store, serial, &shard, false);
+    if (bucket == nullptr) return false;
+
+    uint8_t record[STORE_RECORD_SIZE];
+    for (uint8_t attempt = 0; attempt < STORE_RETRIES; attempt++)
+    {
+        const uint32_t state = __atomic_load_n(&bucket->state, __ATOMIC_ACQUIRE);
+        if (!(state & STORE_ENROLLED)) return false;
+        const uint32_t generation = state & STORE_GENERATION;
+        const uint32_t pair = __atomic_load_n(&bucket->pair, __ATOMIC_RELAXED);
+        memcpy(record, store_record(store, shard, pair - 1, generation), STORE_RECORD_SIZE);
+
+        // The record may have been overwritten once the generation advanced twice, or wiped by a revocation,
+        // any change is treated as such
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        const uint32_t after = __atomic_load_n(&bucket->state, __ATOMIC_RELAXED);
+        if ((after & ~STORE_WRITING) != (state & ~STORE_WRITING)) continue;
+
+        uint32_t stored_serial, stored_generation;
+        uint16_t crc;
+        memcpy(&stored_serial, record + STORE_RECORD_SERIAL, 4);
+        memcpy(&stored_generation, record + STORE_RECORD_GENERATION, 4);
+        memcpy(&crc, record + STORE_RECORD_CRC, 2);
+        if (stored_serial != serial || stored_generation != generation
+            || crc != store_crc16(0xFFFF, record, STORE_RECORD_CRC)) return false;
+
+        memcpy(challenge, record + STORE_RECORD_CHALLENGE, CHALLENGE_SIZE);
+        memcpy(iv, record + STORE_RECORD_IV, AES_BLOCKLEN);
+        memcpy(secret_key, record + STORE_RECORD_SECRET_KEY, SECRET_KEY_SIZE_PAD);
+        memset(record, 0, STORE_RECORD_SIZE);
+        return true;
+    }
+
+    return false;
+}
+
+bool ykhmac_store_store(const struct ykhmac_store* store, const uint32_t serial, const uint8_t challenge[CHALLENGE_SIZE],
+    const uint8_t iv[AES_BLOCKLEN], const uint8_t secret_key[SECRET_KEY_SIZE_PAD])
+{
+    uint8_t* shard;
+    struct ykhmac_store_bucket* bucket = store_find(store, serial, &shard, true);
+    uint32_t state;
+    if (bucket == nullptr || !store_lock(bucket, &state)) return false;
+
+    // The first update of a token allocates its pair, the flag keeps other updates out
+    struct ykhmac_store_shard* counters = (struct ykhmac_store_shard*)shard;
+    uint32_t pair = __atomic_load_n(&bucket->pair, __ATOMIC_RELAXED);
+    if (pair == 0)
+    {
+        pair = __atomic_fetch_add(&counters->allocated, 1, __ATOMIC_RELAXED) + 1;
+        if (pair > store->header->pairs)
+        {
+            __atomic_store_n(&bucket->state, state, __ATOMIC_RELEASE);
+            return false;
+        }
+        __atomic_store_n(&bucket->pair, pair, __ATOMIC_RELAXED);
+    }
+
+    // Write the inactive record, then swap
+    const uint32_t generation = ((state & STORE_GENERATION) + 1) & STORE_GENERATION;
+    store_write(store_record(store, shard, pair - 1, generation), serial, generation, challenge, iv, secret_key);
+    if (!(state & STORE_ENROLLED)) __atomic_fetch_add(&counters->enrolled, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&bucket->state, generation | STORE_ENROLLED, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+bool ykhmac_store_revoke(const struct ykhmac_store* store, const uint32_t serial)
+{
+    uint8_t* shard;
+    struct ykhmac_store_bucket* bucket = store_find(store, serial, &shard, false);
+    uint32_t state;
+    if (bucket == nullptr || !store_lock(bucket, &state)) return false;
+    if (!(state & STORE_ENROLLED))
+    {
+        __atomic_store_n(&bucket->state, state, __ATOMIC_RELEASE);
+        return false;
+    }
+
+    // Readers fail from here on, then both records are wiped
+    const uint32_t generation = state & STORE_GENERATION;
+    __atomic_store_n(&bucket->state, generation | STORE_WRITING, __ATOMIC_RELEASE);
+    const uint32_t pair = __atomic_load_n(&bucket->pair, __ATOMIC_RELAXED);
+    memset(store_record(store, shard, pair - 1, 0), 0, STORE_RECORD_SIZE * 2);
+    __atomic_fetch_sub(&((struct ykhmac_store_shard*)shard)->enrolled, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&bucket->state, generation, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+uint64_t ykhmac_store_count(const struct ykhmac_store* store)
+{
+    uint64_t count = 0;
+    for (uint32_t i = 0; i < store->header->shards; i++)
+    {
+        const struct ykhmac_store_shard* shard = (const struct ykhmac_store_shard*)
+            (store->base + STORE_HEADER_SIZE + (uint64_t)i * store->header->shard_size);
+        count += __atomic_load_n(&shard->enrolled, __ATOMIC_RELAXED);
+    }
+    return count;
+}
+
+uint64_t ykhmac_store_recover(const struct ykhmac_store* store)
+{
+    // The active record of an interrupted update is still intact
+    uint64_t cleared = 0;
+    for (uint32_t i = 0; i < store->header->shards; i++)
+    {
+        uint8_t* shard = store->base + STORE_HEADER_SIZE + (uint64_t)i * store->header->shard_size;
+        struct ykhmac_store_bucket* index = store_index(shard);
+        for (uint32_t j = 0; j < store->header->buckets; j++)
+        {
+            if (__atomic_fetch_and(&index[j].state, ~STORE_WRITING, __ATOMIC_RELAXED) & STORE_WRITING) cleared++;
+        }
+    }
+    return cleared;
+}
+
+bool ykhmac_store_sync(const struct ykhmac_store* store)
+{
+    return msync(store->base, store->size, MS_SYNC) == 0;
+}
+
+#endif
@@ -0,0 +1,211 @@
+/**
+ * @file ykhmac_table.cpp
+ * @author Christoph Honal
+ * @brief Implements the token table definitions from ykhmac_storage.h
+ * @version 0.1
+ * @date 2021-12-17
+ */
+
+#include "ykhmac_storage.h"
+
+#include <string.h>
+
+#ifdef YKHMAC_TOKEN_TABLE
+
+// Special serials of index buckets, neither can be enrolled
+#define TABLE_EMPTY     0xFFFFFFFF  // Bucket has never been used, ends a probe sequence
+#define TABLE_DELETED   0x00000000  // Bucket has been revoked, probing continues
+#define TABLE_NONE      0xFF        // No bucket or slot
+
+// Token table state, built from the index on first use
+bool table_scanned = false;                 // Whether the used slots are known
+uint8_t table_used[(TABLE_SLOTS + 7) / 8];  // Bitmap of record slots referenced by the index
+uint8_t table_cursor = 0;                   // Next slot to consider for allocation, rotates for wear leveling
+
+// Offset of a record slot
+#define TABLE_SLOT_OFFSET(slot) (TABLE_INDEX_SIZE + (size_t)(slot) * RECORD_SLOT_SIZE)
+
+// Home bucket of a serial (multiplicative hashing), the product wraps at 32 bits on all platforms
+uint8_t ykhmac_table_hash(const uint32_t serial)
+{
+    return (uint8_t)(((uint32_t)(serial * 2654435761UL) >> 16) % TABLE_BUCKETS);
+}
+
+// Checksum seed which binds a record to the serial of its token
+uint16_t ykhmac_table_seed(const uint32_t serial)
+{
+    uint8_t buffer[4] = { (uint8_t)(serial >> 24), (uint8_t)(serial >> 16),
+        (uint8_t)(serial >> 8), (uint8_t)serial };
+    return ykhmac_crc16(0xFFFF, buffer, 4);
+}
+
+// Reads an index bucket
+bool ykhmac_table_bucket(const uint8_t bucket, uint32_t* serial, uint8_t* slot)
+{
+    uint8_t buffer[TABLE_BUCKET_SIZE];
+    if (!ykhmac_presistent_read(buffer, TABLE_BUCKET_SIZE, (size_t)bucket * TABLE_BUCKET_SIZE))
+        return false;
+
+    *serial = ((uint32_t)buffer[0] << 24) + ((uint32_t)buffer[1] << 16) +
+              ((uint32_t)buffer[2] << 8) + buffer[3];
+    *slot = buffer[4];
+    return true;
+}
+
+// Builds the bitmap of used record slots from the index
+bool ykhmac_table_scan()
+{
+    if (table_scanned) return true;
+
+    memset(table_used, 0, sizeof(table_used));
+    for (uint8_t i = 0; i < TABLE_BUCKETS; i++)
+    {
+        uint32_t serial = 0;
+        uint8_t slot = 0;
+        if (!ykhmac_table_bucket(i, &serial, &slot)) return false;
+        if (serial != TABLE_EMPTY && serial != TABLE_DELETED && slot < TABLE_SLOTS)
+            table_used[slot / 8] |= 1 << (slot % 8);
+    }
+
+    // Start allocating at a random slot, so that wear is spread across reboots
+    table_cursor = ykhmac_random() % TABLE_SLOTS;
+    table_scanned = true;
+    return true;
+}
+
+// Probes the index for a serial, also returns the first bucket usable for inserting it
+bool ykhmac_table_find(const uint32_t serial, uint8_t* bucket, uint8_t* slot, uint8_t* free_bucket)
+{
+    *bucket = TABLE_NONE;
+    *free_bucket = TABLE_NONE;
+
+    uint8_t index = ykhmac_table_hash(serial);
+    for (uint8_t i = 0; i < TABLE_BUCKETS; i++)
+    {
+        uint32_t stored = 0;
+        if (!ykhmac_table_bucket(index, &stored, slot)) return false;
+
+        if (stored == serial)
+        {
+            *bucket = index;
+            return true;
+        }
+        if ((stored == TABLE_EMPTY || stored == TABLE_DELETED) && *free_bucket == TABLE_NONE)
+            *free_bucket = index;
+        if (stored == TABLE_EMPTY) break;
+
+        index = (index + 1) % TABLE_BUCKETS;
+    }
+
+    return true;
+}
+
+// Takes the next free record slot
+uint8_t ykhmac_table_allocate()
+{
+    for (uint8_t i = 0; i < TABLE_SLOTS; i++)
+    {
+        uint8_t slot = table_cursor;
+        table_cursor = (table_cursor + 1) % TABLE_SLOTS;
+        if (!(table_used[slot / 8] & (1 << (slot % 8)))) return slot;
+    }
+
+    return TABLE_NONE;
+}
+
+bool ykhmac_table_load(const uint32_t serial, uint8_t challenge[CHALLENGE_SIZE],
+    uint8_t iv[AES_BLOCKLEN], uint8_t secret_key[SECRET_KEY_SIZE_PAD])
+{
+    if (serial == TABLE_EMPTY || serial == TABLE_DELETED) return false;
+
+    uint8_t bucket = 0, slot = 0, free_bucket = 0;
+    if (!ykhmac_table_find(serial, &bucket, &slot, &free_bucket)
+        || bucket == TABLE_NONE || slot >= TABLE_SLOTS) return false;
+
+    uint32_t generation = 0;
+    return ykhmac_record_read(TABLE_SLOT_OFFSET(slot), ykhmac_table_seed(serial), &generation,
+        challenge, iv, secret_key);
+}
+
+bool ykhmac_table_store(const uint32_t serial, const uint8_t challenge[CHALLENGE_SIZE],
+    const uint8_t iv[AES_BLOCKLEN], const uint8_t secret_key[SECRET_KEY_SIZE_PAD])
+{
+    if (serial == TABLE_EMPTY || serial == TABLE_DELETED || !ykhmac_table_scan()) return false;
+
+    uint8_t bucket = 0, slot = 0, free_bucket = 0;
+    if (!ykhmac_table_find(serial, &bucket, &slot, &free_bucket)) return false;
+    if (bucket == TABLE_NONE && free_bucket == TABLE_NONE) return false;
+
+    // A new token needs one slot in addition to the spare one
+    uint8_t target = ykhmac_table_allocate();
+    if (target == TABLE_NONE) return false;
+    if (bucket == TABLE_NONE)
+    {
+        table_used[target / 8] |= 1 << (target % 8);
+        bool full = (ykhmac_table_allocate() == TABLE_NONE);
+        table_used[target / 8] &= ~(1 << (target % 8));
+        if (full) return false;
+    }
+
+    // Write the record into the free slot, the current record stays valid until the bucket is switched
+    if (!ykhmac_record_write(TABLE_SLOT_OFFSET(target), ykhmac_table_seed(serial), 0,
+        challenge, iv, secret_key)) return false;
+
+    uint8_t buffer[TABLE_BUCKET_SIZE] = { (uint8_t)(serial >> 24), (uint8_t)(serial >> 16),
+        (uint8_t)(serial >> 8), (uint8_t)serial, target };
+    if (bucket != TABLE_NONE)
+    {
+        // Switching the slot is a single byte write
+        if (!ykhmac_storage_write(buffer + 4, 1, (size_t)bucket * TABLE_BUCKET_SIZE + 4)) return false;
+        if (slot < TABLE_SLOTS) table_used[slot / 8] &= ~(1 << (slot % 8));
+    }
+    else
+    {
+        // The bucket stays empty or deleted until its serial is written
+        size_t offset = (size_t)free_bucket * TABLE_BUCKET_SIZE;
+        if (!ykhmac_storage_write(buffer + 4, 1, offset + 4)
+            || !ykhmac_storage_write(buffer, 4, offset))
+        {
+            // State of the bucket is unknown now
+            table_scanned = false;
+            return false;
+        }
+    }
+
+    table_used[target / 8] |= 1 << (target % 8);
+    return true;
+}
+
+bool ykhmac_table_remove(const uint32_t serial)
+{
+    if (serial == TABLE_EMPTY || serial == TABLE_DELETED || !ykhmac_table_scan()) return false;
+
+    uint8_t bucket = 0, slot = 0, free_bucket = 0;
+    if (!ykhmac_table_find(serial, &bucket, &slot, &free_bucket) || bucket == TABLE_NONE) return false;
+
+    const uint8_t buffer[4] = { 0, 0, 0, 0 };
+    if (!ykhmac_storage_write(buffer, 4, (size_t)bucket * TABLE_BUCKET_SIZE))
+    {
+        table_scanned = false;
+        return false;
+    }
+
+    if (slot < TABLE_SLOTS) table_used[slot / 8] &= ~(1 << (slot % 8));
+    return true;
+}
+
+bool ykhmac_table_format()
+{
+    uint8_t buffer[TABLE_BUCKET_SIZE];
+    memset(buffer, 0xFF, TABLE_BUCKET_SIZE);
+
+    table_scanned = false;
+    for (uint8_t i = 0; i < TABLE_BUCKETS; i++)
+    {
+        if (!ykhmac_storage_write(buffer, TABLE_BUCKET_SIZE, (size_t)i * TABLE_BUCKET_SIZE)) return false;
+    }
+
+    return ykhmac_table_scan();
+}
+
+#endif
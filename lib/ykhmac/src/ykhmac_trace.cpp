@@ -0,0 +1,92 @@
+/**
+ * @file ykhmac_trace.cpp
+ * @author Christoph Honal
+ * @brief Implements the binary trace buffer from ykhmac_trace.h
+ * @version 0.1
+ * @date 2021-12-17
+ */
+
+#include "ykhmac.h"
+
+#ifdef YKHMAC_TRACE
+
+#include <string.h>
+#include "ykhmac_atomic.h"
+
+#if TRACE_RECORDS > 0xFFFF
+    typedef uint32_t trace_index;
+#else
+    typedef uint16_t trace_index;
+#endif
+
+static struct ykhmac_trace_record records[TRACE_RECORDS];
+static trace_index trace_head = 0;      // Next record to write
+static trace_index trace_count = 0;     // Records not read yet
+static uint32_t trace_dropped = 0;
+YKHMAC_LOCK_DEFINE(trace_lock);
+
+
+void ykhmac_trace(const uint8_t event, const uint8_t* data, const uint8_t size, const uint8_t flags)
+{
+    const uint32_t timestamp = ykhmac_clock();
+    uint8_t offset = 0;
+
+    YKHMAC_LOCK(trace_lock);
+    do
+    {
+        // Overwrite the oldest record if the buffer is full
+        struct ykhmac_trace_record* record = &records[trace_head];
+        trace_head = (trace_head + 1 < TRACE_RECORDS) ? (trace_head + 1) : 0;
+        if (trace_count < TRACE_RECORDS) trace_count++;
+        else trace_dropped++;
+
+        const uint8_t length = MIN(size - offset, TRACE_PAYLOAD_SIZE);
+        record->timestamp = timestamp;
+        record->event = event;
+        record->flags = length | flags | ((offset > 0) ? TRACE_FOLLOWS : 0)
+            | ((offset + length < size) ? TRACE_CONTINUED : 0);
+        if (length > 0) memcpy(record->payload, data + offset, length);
+        offset += length;
+    }
+    while (offset < size);
+    YKHMAC_UNLOCK(trace_lock);
+}
+
+bool ykhmac_trace_read(struct ykhmac_trace_record* record)
+{
+    bool result = false;
+
+    YKHMAC_LOCK(trace_lock);
+    if (trace_count > 0)
+    {
+        const trace_index tail = (trace_head >= trace_count) ? (trace_head - trace_count)
+            : (trace_head + TRACE_RECORDS - trace_count);
+        memcpy(record, &records[tail], sizeof(struct ykhmac_trace_record));
+        trace_count--;
+        result = true;
+    }
+    YKHMAC_UNLOCK(trace_lock);
+
+    return result;
+}
+
+uint32_t ykhmac_trace_dropped()
+{
+    YKHMAC_LOCK(trace_lock);
+    const uint32_t dropped = trace_dropped;
+    YKHMAC_UNLOCK(trace_lock);
+
+    return dropped;
+}
+
+void ykhmac_trace_clear()
+{
+    YKHMAC_LOCK(trace_lock);
+    memset(records, 0, sizeof(records));
+    trace_head = 0;
+    trace_count = 0;
+    trace_dropped = 0;
+    YKHMAC_UNLOCK(trace_lock);
+}
+
+#endif
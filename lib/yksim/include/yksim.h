@@ -0,0 +1,203 @@
+/**
+ * @file yksim.h
+ * @author Christoph Honal
+ * @brief Defines a simulated Yubikey token and RAM-backed storage for native builds
+ * @version 0.1
+ * @date 2021-12-17
+ */
+
+#ifndef YKSIM_H
+#define YKSIM_H
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <ykhmac.h>
+
+#ifndef YKSIM_STORAGE_SIZE
+    #define YKSIM_STORAGE_SIZE  1024    //!< Size of the simulated persistent storage (Uno EEPROM size)
+#endif
+#define YKSIM_CLOCK_HZ      1000000000  //!< Frequency of ykhmac_clock, nanoseconds
+#if defined(YKHMAC_RETRY) && YKHMAC_CLOCK_HZ != YKSIM_CLOCK_HZ
+    #error "YKHMAC_CLOCK_HZ must match the simulated clock"
+#endif
+#if STORAGE_SIZE > YKSIM_STORAGE_SIZE
+    #error "STORAGE_CAPACITY exceeds the simulated persistent storage"
+#endif
+#if YKSIM_STORAGE_SIZE % STORAGE_PAGE_SIZE != 0
+    #error "YKSIM_STORAGE_SIZE must be a multiple of STORAGE_PAGE_SIZE"
+#endif
+
+// Response codes not used by the library itself
+#define SW_WRONG_DATA_HIGH  0x6A //!< Wrong data error response code, high byte
+#define SW_WRONG_DATA_LOW   0x80 //!< Wrong data error response code, low byte
+#define SW_UNSUP_LOW        0x00 //!< Unsupported operation error response code, low byte
+
+/**
+ * @brief State and configuration of a simulated token
+ */
+struct yksim_token
+{
+    uint32_t serial;                        //!< Serial number returned by CMD_GET_SERIAL
+    uint8_t version[3];                     //!< Firmware version returned by INS_STATUS
+    uint8_t program_sequence;               //!< Configuration sequence counter returned by INS_STATUS
+    uint8_t status_length;                  //!< Size of the status structure returned by INS_STATUS, STATUS_SIZE or less to truncate it
+    uint8_t slots;                          //!< Configured HMAC-SHA1 slots, SLOT_1 | SLOT_2
+    uint8_t otp_slots;                      //!< Slots emitting an OTP on touch, they do not answer challenges
+    uint8_t keys[2][SECRET_KEY_SIZE];       //!< HMAC-SHA1 secret keys of both slots
+    uint8_t aid[ARG_BUF_SIZE_MAX];          //!< AID of the simulated applet
+    uint8_t aid_length;                     //!< Size of the AID in bytes
+    uint32_t apdu_latency_us;               //!< Simulated latency of each APDU exchange in microseconds
+    bool selected;                          //!< Whether the applet has been selected
+    uint32_t apdu_count;                    //!< Number of APDUs exchanged since insertion
+};
+
+/**
+ * @brief Initializes a token with the Yubikey AID, a serial number and the given slot keys
+ *
+ * @param token The token to initialize
+ * @param serial The serial number of the token
+ * @param key_1 Secret key of slot 1, or nullptr if the slot is not configured
+ * @param key_2 Secret key of slot 2, or nullptr if the slot is not configured
+ */
+void yksim_token_init(yksim_token* token, const uint32_t serial,
+    const uint8_t* key_1, const uint8_t* key_2 = nullptr);
+
+/**
+ * @brief Places a token into the simulated field, it receives all subsequent exchanges
+ *
+ * The token is deselected, and its APDU counter is reset.
+ *
+ * @param token The token, or nullptr to remove the current token
+ */
+void yksim_insert(yksim_token* token);
+
+/**
+ * @brief Returns the token which currently is in the simulated field
+ *
+ * @return The token, or nullptr if there is none
+ */
+yksim_token* yksim_current();
+
+/**
+ * @brief Processes a single APDU as the token would
+ *
+ * Does not simulate any latency, see ykhmac_data_exchange for that.
+ *
+ * @param token The token which receives the APDU
+ * @param send_buffer The command APDU
+ * @param send_length Size of the command APDU in bytes
+ * @param response_buffer Buffer for the response APDU
+ * @param response_length Size of the response buffer, set to the size of the response APDU
+ * @return true if the response fits into the response buffer
+ */
+bool yksim_process(yksim_token* token, const uint8_t* send_buffer, const uint8_t send_length,
+    uint8_t* response_buffer, uint8_t* response_length);
+
+/**
+ * @brief Faults injected into the blocking exchanges of the simulated transport, see yksim_fault_permille
+ */
+enum yksim_fault : uint8_t
+{
+    YKSIM_FAULT_LOST = 1,       //!< The command does not reach the token, the exchange fails after yksim_fault_latency_us
+    YKSIM_FAULT_TRUNCATED = 2,  //!< The token processes the command, but only the first byte of the response arrives
+};
+
+/**
+ * @brief Lets the next exchanges fail, like a token which leaves the field for a while
+ *
+ * @param exchanges Amount of exchanges which fail with YKSIM_FAULT_LOST
+ */
+void yksim_fault_burst(const uint32_t exchanges);
+
+/**
+ * @brief Seeds the simulated random number generator
+ *
+ * @param seed The seed, must not be zero
+ */
+void yksim_seed(const uint64_t seed);
+
+/**
+ * @brief Erases the simulated persistent storage to 0xFF and resets its wear counters
+ */
+void yksim_storage_clear();
+
+/**
+ * @brief Resets the wear counters of the simulated persistent storage
+ */
+void yksim_storage_reset_wear();
+
+/**
+ * @brief Summarizes the wear counters of the simulated persistent storage
+ *
+ * @param total_writes Amount of bytes written in total
+ * @param max_writes Highest amount of writes to a single byte
+ * @param max_erases Highest amount of erases of a single page (always 0 for EEPROM)
+ */
+void yksim_storage_wear(uint32_t* total_writes, uint32_t* max_writes, uint32_t* max_erases);
+
+/**
+ * @brief Lets a token enter the simulated field of the PN532 after a delay
+ *
+ * The token only receives exchanges once it has been detected, see yksim_list_target and yksim_irq_wait.
+ * The current token is removed right away.
+ *
+ * @param token The token
+ * @param delay_us Time until the token enters the field in microseconds
+ */
+void yksim_arrive(yksim_token* token, const uint32_t delay_us);
+
+/**
+ * @brief Simulates InListPassiveTarget, blocks until a token has been activated or all attempts failed
+ *
+ * Each attempt takes yksim_activation_latency_us, and activates the token if it was in the field
+ * when the attempt started.
+ *
+ * @param retries Amount of retries after the first attempt (MxRtyPassiveActivation), 0xFF retries forever
+ * @return true if a token has been activated, it then receives all subsequent exchanges
+ */
+bool yksim_list_target(const uint8_t retries);
+
+/**
+ * @brief Starts the detection without waiting, like InListPassiveTarget with unlimited retries
+ *
+ * The PN532 polls on its own, and asserts its IRQ line once a token has been activated.
+ */
+void yksim_detect_start();
+
+/**
+ * @brief Returns the level of the simulated IRQ line
+ *
+ * @return true if the detection has activated a token, see yksim_irq_wait
+ */
+bool yksim_irq();
+
+/**
+ * @brief Sleeps until the simulated IRQ line is asserted, like a host waiting for the interrupt
+ *
+ * Reading the response ends the detection, the token then receives all subsequent exchanges.
+ *
+ * @param timeout_us Maximum time to sleep in microseconds
+ * @return true if a token has been activated
+ */
+bool yksim_irq_wait(const uint32_t timeout_us);
+
+/**
+ * @brief Returns the time from entering the field until the first exchange of the token
+ *
+ * @return The time in microseconds, or a negative value if the token did not receive any exchange yet
+ */
+double yksim_first_apdu_us();
+
+extern uint8_t yksim_storage[YKSIM_STORAGE_SIZE];           //!< Contents of the simulated persistent storage
+extern uint32_t yksim_storage_writes[YKSIM_STORAGE_SIZE];   //!< Amount of writes to each byte
+#ifdef YKHMAC_STORAGE_FLASH
+    extern uint32_t yksim_storage_erases[YKSIM_STORAGE_SIZE / STORAGE_PAGE_SIZE]; //!< Amount of erases of each page
+#endif
+extern uint32_t yksim_storage_write_latency_us;             //!< Simulated latency of writing one byte in microseconds
+extern uint32_t yksim_activation_latency_us;                //!< Simulated duration of one passive activation attempt in microseconds
+extern uint32_t yksim_fault_permille;                       //!< Probability of a random fault per exchange in 1/1000
+extern uint8_t yksim_fault_kinds;                           //!< Faults chosen from at random, yksim_fault bits
+extern uint32_t yksim_fault_latency_us;                     //!< Duration of a lost exchange in microseconds, like the timeout of the NFC controller
+extern uint32_t yksim_fault_count;                          //!< Amount of injected faults
+
+#endif
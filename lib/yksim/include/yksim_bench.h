@@ -0,0 +1,167 @@
+/**
+ * @file yksim_bench.h
+ * @author Christoph Honal
+ * @brief Defines latency sampling and reporting helpers for native benchmarks
+ * @version 0.1
+ * @date 2021-12-17
+ */
+
+#ifndef YKSIM_BENCH_H
+#define YKSIM_BENCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+
+/**
+ * @brief Collects latency samples of a benchmarked operation
+ */
+class yksim_bench
+{
+    public:
+        /**
+         * @brief Constructs a new benchmark
+         *
+         * @param name Name of the benchmarked operation, printed in the report
+         * @param iterations Amount of samples to reserve memory for
+         */
+        yksim_bench(const char* name, const size_t iterations) : name(name)
+        {
+            samples.reserve(iterations);
+        }
+
+        /**
+         * @brief Times a single invocation of an operation
+         *
+         * @param operation The operation, returns true on success
+         * @return The return value of the operation
+         */
+        template<typename F> bool run(F operation)
+        {
+            auto start = std::chrono::steady_clock::now();
+            bool result = operation();
+            auto end = std::chrono::steady_clock::now();
+            samples.push_back(std::chrono::duration<double, std::micro>(end - start).count());
+            if (!result) failures++;
+            return result;
+        }
+
+        /**
+         * @brief Records a latency which has been measured by the caller
+         *
+         * @param latency The latency in microseconds
+         * @param result Whether the operation succeeded
+         */
+        void add(const double latency, const bool result = true)
+        {
+            samples.push_back(latency);
+            if (!result) failures++;
+        }
+
+        /**
+         * @brief Returns a percentile of the collected samples
+         *
+         * @param p The percentile in [0, 100]
+         * @return The latency in microseconds
+         */
+        double percentile(const double p)
+        {
+            if (samples.empty()) return 0;
+            std::sort(samples.begin(), samples.end());
+            size_t index = (size_t)((p / 100.0) * (samples.size() - 1) + 0.5);
+            return samples[index];
+        }
+
+        /**
+         * @brief Prints a single report line
+         *
+         * The line contains throughput, mean, p50 and p99 latency, and the amount of failed invocations.
+         */
+        void report()
+        {
+            double total = 0;
+            for (double s : samples) total += s;
+            double mean = samples.empty() ? 0 : total / samples.size();
+            printf("%-28s %8zu %12.1f %10.2f %10.2f %10.2f %8zu\n", name, samples.size(),
+                (total > 0) ? samples.size() * 1e6 / total : 0, mean,
+                percentile(50), percentile(99), failures);
+        }
+
+        /**
+         * @brief Prints the header matching the report lines
+         */
+        static void header()
+        {
+            printf("%-28s %8s %12s %10s %10s %10s %8s\n", "operation", "n", "ops/s",
+                "mean [us]", "p50 [us]", "p99 [us]", "failed");
+        }
+
+    private:
+        const char* name;
+        std::vector<double> samples;
+        size_t failures = 0;
+};
+
+#ifdef YKHMAC_METRICS
+    #include "yksim.h"
+
+    /**
+     * @brief Writes the metrics page of the per-phase histograms, see ykhmac_metrics_export
+     *
+     * The page is written to a temporary file first and then renamed, so that a scraper
+     * never reads a partial page.
+     *
+     * @param path Path of the page, or "-" for the standard output
+     * @return true on success
+     */
+    inline bool yksim_metrics_write(const char* path)
+    {
+        std::vector<char> page(ykhmac_metrics_export(nullptr, 0, YKSIM_CLOCK_HZ) + 1);
+        ykhmac_metrics_export(page.data(), page.size(), YKSIM_CLOCK_HZ);
+        if (strcmp(path, "-") == 0) return fputs(page.data(), stdout) >= 0;
+
+        std::vector<char> temporary(strlen(path) + 5);
+        snprintf(temporary.data(), temporary.size(), "%s.tmp", path);
+        FILE* file = fopen(temporary.data(), "w");
+        if (file == nullptr) return false;
+        bool result = fputs(page.data(), file) >= 0;
+        result &= fclose(file) == 0;
+        return result && rename(temporary.data(), path) == 0;
+    }
+#endif
+
+#ifdef YKHMAC_TRACE
+    #include "yksim.h"
+
+    /**
+     * @brief Drains the trace buffer as hex lines, decode them using scripts/ykhmac_trace.py
+     *
+     * @param path Path of the dump, or "-" for the standard output
+     * @return true on success
+     */
+    inline bool yksim_trace_write(const char* path)
+    {
+        FILE* file = (strcmp(path, "-") == 0) ? stdout : fopen(path, "w");
+        if (file == nullptr) return false;
+
+        struct ykhmac_trace_record record;
+        bool result = fprintf(file, "# clock_hz %u, dropped %u\n", (unsigned)YKSIM_CLOCK_HZ,
+            (unsigned)ykhmac_trace_dropped()) >= 0;
+        while (ykhmac_trace_read(&record))
+        {
+            const uint8_t* data = (const uint8_t*)&record;
+            result &= fputs("trace ", file) >= 0;
+            for (size_t i = 0; i < sizeof(record); i++) result &= fprintf(file, "%02x", data[i]) >= 0;
+            result &= fputc('\n', file) >= 0;
+        }
+
+        if (file != stdout) result &= fclose(file) == 0;
+        return result;
+    }
+#endif
+
+#endif
@@ -0,0 +1,448 @@
+/**
+ * @file yksim.cpp
+ * @author Christoph Honal
+ * @brief Implements the definitions from yksim.h, as well as functions required by the ykhmac library
+ * @version 0.1
+ * @date 2021-12-17
+ */
+
+#include "yksim.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <sha/sha1.h>
+
+
+uint8_t yksim_storage[YKSIM_STORAGE_SIZE];
+uint32_t yksim_storage_writes[YKSIM_STORAGE_SIZE];
+#ifdef YKHMAC_STORAGE_FLASH
+    uint32_t yksim_storage_erases[YKSIM_STORAGE_SIZE / STORAGE_PAGE_SIZE];
+#endif
+uint32_t yksim_storage_write_latency_us = 0;
+uint32_t yksim_activation_latency_us = 0;
+uint32_t yksim_fault_permille = 0;
+uint8_t yksim_fault_kinds = YKSIM_FAULT_LOST | YKSIM_FAULT_TRUNCATED;
+uint32_t yksim_fault_latency_us = 0;
+uint32_t yksim_fault_count = 0;
+
+static yksim_token* current_token = nullptr;
+static uint64_t rng_state = 0x9E3779B97F4A7C15ull;
+static uint64_t fault_state = 0x2545F4914F6CDD1Dull;
+static uint32_t fault_burst = 0;
+
+// Simulated field of the PN532
+typedef std::chrono::steady_clock::time_point yksim_time;
+static yksim_token* field_token = nullptr;
+static yksim_time field_arrival;
+static yksim_time field_first_apdu;
+static bool field_exchanged = false;
+static bool field_detecting = false;
+static yksim_time field_irq;
+
+void yksim_token_init(yksim_token* token, const uint32_t serial,
+    const uint8_t* key_1, const uint8_t* key_2)
+{
+    const uint8_t aid[YUBIKEY_AID_LENGTH] = YUBIKEY_AID;
+
+    memset(token, 0, sizeof(yksim_token));
+    token->serial = serial;
+    token->version[0] = 5;
+    token->version[1] = 4;
+    token->version[2] = 3;
+    memcpy(token->aid, aid, YUBIKEY_AID_LENGTH);
+    token->aid_length = YUBIKEY_AID_LENGTH;
+    token->status_length = STATUS_SIZE;
+
+    if (key_1 != nullptr)
+    {
+        memcpy(token->keys[0], key_1, SECRET_KEY_SIZE);
+        token->slots |= SLOT_1;
+        token->program_sequence++;
+    }
+    if (key_2 != nullptr)
+    {
+        memcpy(token->keys[1], key_2, SECRET_KEY_SIZE);
+        token->slots |= SLOT_2;
+        token->program_sequence++;
+    }
+}
+
+void yksim_insert(yksim_token* token)
+{
+    current_token = token;
+    if (token != nullptr)
+    {
+        token->selected = false;
+        token->apdu_count = 0;
+    }
+}
+
+yksim_token* yksim_current()
+{
+    return current_token;
+}
+
+// Returns when the attempts starting back-to-back at start activate the token in the field
+static yksim_time yksim_activation(const yksim_time start)
+{
+    if (field_token == nullptr) return yksim_time::max();
+
+    const std::chrono::microseconds attempt(yksim_activation_latency_us);
+    if (attempt.count() == 0) return std::max(start, field_arrival);
+
+    // The first attempt which starts after the token entered the field
+    int64_t failed = 0;
+    if (field_arrival > start) failed = (field_arrival - start + attempt - std::chrono::nanoseconds(1)) / attempt;
+    return start + attempt * (failed + 1);
+}
+
+void yksim_arrive(yksim_token* token, const uint32_t delay_us)
+{
+    yksim_insert(nullptr);
+    field_token = token;
+    field_arrival = std::chrono::steady_clock::now() + std::chrono::microseconds(delay_us);
+    field_exchanged = false;
+    field_detecting = false;
+}
+
+bool yksim_list_target(const uint8_t retries)
+{
+    const yksim_time start = std::chrono::steady_clock::now();
+    const yksim_time activation = yksim_activation(start);
+
+    // Unlimited retries only return once a token has been activated
+    if (retries != 0xFF)
+    {
+        const yksim_time end = start + std::chrono::microseconds(yksim_activation_latency_us) * (retries + 1);
+        if (activation > end)
+        {
+            std::this_thread::sleep_until(end);
+            return false;
+        }
+    }
+    else if (activation == yksim_time::max()) return false;
+
+    std::this_thread::sleep_until(activation);
+    yksim_insert(field_token);
+    return true;
+}
+
+void yksim_detect_start()
+{
+    field_detecting = true;
+    field_irq = yksim_activation(std::chrono::steady_clock::now());
+}
+
+bool yksim_irq()
+{
+    return field_detecting && std::chrono::steady_clock::now() >= field_irq;
+}
+
+bool yksim_irq_wait(const uint32_t timeout_us)
+{
+    if (!field_detecting) return false;
+
+    std::this_thread::sleep_until(std::min(field_irq,
+        std::chrono::steady_clock::now() + std::chrono::microseconds(timeout_us)));
+    if (!yksim_irq()) return false;
+
+    field_detecting = false;
+    yksim_insert(field_token);
+    return true;
+}
+
+double yksim_first_apdu_us()
+{
+    if (!field_exchanged) return -1;
+
+    return std::chrono::duration<double, std::micro>(field_first_apdu - field_arrival).count();
+}
+
+// Records the first exchange of the token in the field
+static void yksim_field_exchange()
+{
+    if (field_exchanged || current_token != field_token) return;
+
+    field_first_apdu = std::chrono::steady_clock::now();
+    field_exchanged = true;
+}
+
+// Writes a status word and sets the response length
+static bool yksim_respond(uint8_t* response_buffer, uint8_t* response_length,
+    const uint8_t data_length, const uint8_t sw_high, const uint8_t sw_low)
+{
+    if (*response_length < data_length + 2) return false;
+
+    response_buffer[data_length] = sw_high;
+    response_buffer[data_length + 1] = sw_low;
+    *response_length = data_length + 2;
+    return true;
+}
+
+// Writes the status structure (version, program sequence, touch level)
+static uint8_t yksim_status(const yksim_token* token, uint8_t* buffer)
+{
+    memcpy(buffer, token->version, 3);
+    buffer[3] = token->program_sequence;
+    buffer[4] = token->slots | token->otp_slots | (token->otp_slots << 2); // CONFIGx_VALID, CONFIGx_TOUCH
+    buffer[5] = 0;
+    return token->status_length;
+}
+
+bool yksim_process(yksim_token* token, const uint8_t* send_buffer, const uint8_t send_length,
+    uint8_t* response_buffer, uint8_t* response_length)
+{
+    token->apdu_count++;
+
+    // A command without data carries the expected response length in place of the data length
+    if (send_length < 5 || (send_length > 5 && send_length != 5 + send_buffer[4]) || send_buffer[0] != CLA_ISO)
+        return yksim_respond(response_buffer, response_length, 0, SW_WRONG_DATA_HIGH, SW_WRONG_DATA_LOW);
+
+    const uint8_t* data = send_buffer + 5;
+    const uint8_t data_length = send_length - 5;
+
+    // Applet selection
+    if (send_buffer[1] == INS_SELECT && send_buffer[2] == SEL_APP_AID)
+    {
+        if (data_length != token->aid_length || memcmp(data, token->aid, data_length) != 0)
+        {
+            token->selected = false;
+            return yksim_respond(response_buffer, response_length, 0, SW_NOTFOUND_HIGH, SW_NOTFOUND_LOW);
+        }
+
+        token->selected = true;
+        if (*response_length < 8) return false;
+        return yksim_respond(response_buffer, response_length,
+            yksim_status(token, response_buffer), SW_OK_HIGH, SW_OK_LOW);
+    }
+
+    if (!token->selected)
+        return yksim_respond(response_buffer, response_length, 0, SW_NOTFOUND_HIGH, SW_NOTFOUND_LOW);
+
+    // Status request
+    if (send_buffer[1] == INS_STATUS)
+    {
+        if (*response_length < 8) return false;
+        return yksim_respond(response_buffer, response_length,
+            yksim_status(token, response_buffer), SW_OK_HIGH, SW_OK_LOW);
+    }
+
+    if (send_buffer[1] != INS_API_REQ)
+        return yksim_respond(response_buffer, response_length, 0, SW_UNSUP_HIGH, SW_UNSUP_LOW);
+
+    // Serial number request
+    if (send_buffer[2] == CMD_GET_SERIAL)
+    {
+        if (*response_length < 6) return false;
+        response_buffer[0] = (uint8_t)(token->serial >> 24);
+        response_buffer[1] = (uint8_t)(token->serial >> 16);
+        response_buffer[2] = (uint8_t)(token->serial >> 8);
+        response_buffer[3] = (uint8_t)token->serial;
+        return yksim_respond(response_buffer, response_length, 4, SW_OK_HIGH, SW_OK_LOW);
+    }
+
+    // HMAC-SHA1 challenge-response
+    if (send_buffer[2] == CMD_HMAC_1 || send_buffer[2] == CMD_HMAC_2)
+    {
+        const uint8_t slot = (send_buffer[2] == CMD_HMAC_1) ? SLOT_1 : SLOT_2;
+        if (!(token->slots & slot))
+            return yksim_respond(response_buffer, response_length, 0, SW_WRONG_DATA_HIGH, SW_WRONG_DATA_LOW);
+        if (*response_length < RESP_BUF_SIZE + 2) return false;
+
+        // The token strips trailing padding from maximum length challenges
+        uint8_t length = data_length;
+        if (length == 64)
+        {
+            while (length > 1 && data[length - 2] == data[63]) length--;
+            length--;
+        }
+
+        struct sha1_hasher_s hasher;
+        sha1_hasher_init_hmac(&hasher, token->keys[slot - 1], SECRET_KEY_SIZE);
+        for (uint8_t i = 0; i < length; i++) sha1_hasher_putc(&hasher, data[i]);
+        memcpy(response_buffer, sha1_hasher_gethmac(&hasher), RESP_BUF_SIZE);
+        return yksim_respond(response_buffer, response_length, RESP_BUF_SIZE, SW_OK_HIGH, SW_OK_LOW);
+    }
+
+    return yksim_respond(response_buffer, response_length, 0, SW_UNSUP_HIGH, SW_UNSUP_LOW);
+}
+
+void yksim_seed(const uint64_t seed)
+{
+    rng_state = seed;
+}
+
+void yksim_storage_clear()
+{
+    memset(yksim_storage, 0xFF, YKSIM_STORAGE_SIZE);
+    yksim_storage_reset_wear();
+}
+
+void yksim_storage_reset_wear()
+{
+    memset(yksim_storage_writes, 0, sizeof(yksim_storage_writes));
+    #ifdef YKHMAC_STORAGE_FLASH
+        memset(yksim_storage_erases, 0, sizeof(yksim_storage_erases));
+    #endif
+}
+
+void yksim_storage_wear(uint32_t* total_writes, uint32_t* max_writes, uint32_t* max_erases)
+{
+    *total_writes = 0;
+    *max_writes = 0;
+    *max_erases = 0;
+    for (size_t i = 0; i < YKSIM_STORAGE_SIZE; i++)
+    {
+        *total_writes += yksim_storage_writes[i];
+        if (yksim_storage_writes[i] > *max_writes) *max_writes = yksim_storage_writes[i];
+    }
+    #ifdef YKHMAC_STORAGE_FLASH
+        for (size_t i = 0; i < YKSIM_STORAGE_SIZE / STORAGE_PAGE_SIZE; i++)
+        {
+            if (yksim_storage_erases[i] > *max_erases) *max_erases = yksim_storage_erases[i];
+        }
+    #endif
+}
+
+
+// Specific implementations of interface methods
+uint8_t ykhmac_frame[FRAME_SIZE];
+
+void yksim_fault_burst(const uint32_t exchanges)
+{
+    fault_burst = exchanges;
+}
+
+// Picks the fault of the next exchange, 0 for none. Uses its own generator, so that the challenges do not change
+static uint8_t yksim_fault_next()
+{
+    if (fault_burst > 0)
+    {
+        fault_burst--;
+        return YKSIM_FAULT_LOST;
+    }
+    if (yksim_fault_permille == 0 || yksim_fault_kinds == 0) return 0;
+
+    fault_state ^= fault_state >> 12;
+    fault_state ^= fault_state << 25;
+    fault_state ^= fault_state >> 27;
+    const uint64_t random = fault_state * 0x2545F4914F6CDD1Dull;
+    if ((random >> 32) % 1000 >= yksim_fault_permille) return 0;
+    if (yksim_fault_kinds != (YKSIM_FAULT_LOST | YKSIM_FAULT_TRUNCATED)) return yksim_fault_kinds;
+    return (random & 1) ? YKSIM_FAULT_LOST : YKSIM_FAULT_TRUNCATED;
+}
+
+bool ykhmac_data_exchange(uint8_t *send_buffer, uint8_t send_length,
+    uint8_t* response_buffer, uint8_t* response_length)
+{
+    if (current_token == nullptr) return false;
+
+    const uint8_t fault = yksim_fault_next();
+    if (fault != 0) yksim_fault_count++;
+    if (fault == YKSIM_FAULT_LOST)
+    {
+        if (yksim_fault_latency_us > 0)
+            std::this_thread::sleep_for(std::chrono::microseconds(yksim_fault_latency_us));
+        return false;
+    }
+
+    yksim_field_exchange();
+    if (current_token->apdu_latency_us > 0)
+        std::this_thread::sleep_for(std::chrono::microseconds(current_token->apdu_latency_us));
+
+    bool result = yksim_process(current_token, send_buffer, send_length, response_buffer, response_length);
+    if (fault == YKSIM_FAULT_TRUNCATED) *response_length = MIN(*response_length, (uint8_t)1);
+    return result;
+}
+
+#ifdef YKHMAC_NONBLOCKING
+    // Exchange in progress, the response is computed right away but only released after the latency
+    static bool exchange_result = false;
+    static std::chrono::steady_clock::time_point exchange_ready;
+
+    bool ykhmac_data_exchange_start(uint8_t *send_buffer, uint8_t send_length,
+        uint8_t* response_buffer, uint8_t* response_length)
+    {
+        if (current_token == nullptr) return false;
+
+        yksim_field_exchange();
+        exchange_ready = std::chrono::steady_clock::now() +
+            std::chrono::microseconds(current_token->apdu_latency_us);
+        exchange_result = yksim_process(current_token, send_buffer, send_length, response_buffer, response_length);
+        return true;
+    }
+
+    ykhmac_status ykhmac_data_exchange_poll()
+    {
+        if (std::chrono::steady_clock::now() < exchange_ready) return YKHMAC_PENDING;
+
+        return exchange_result ? YKHMAC_DONE : YKHMAC_FAILED;
+    }
+#endif
+
+uint8_t ykhmac_random()
+{
+    // xorshift64*, deterministic so that benchmark runs are reproducible
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (uint8_t)((rng_state * 0x2545F4914F6CDD1Dull) >> 56);
+}
+
+bool ykhmac_presistent_write(const uint8_t *data, const size_t size, const size_t offset)
+{
+    if (offset + size > YKSIM_STORAGE_SIZE) return false;
+
+    if (yksim_storage_write_latency_us > 0)
+        std::this_thread::sleep_for(std::chrono::microseconds(yksim_storage_write_latency_us * size));
+
+    for (size_t i = 0; i < size; i++)
+    {
+        #ifdef YKHMAC_STORAGE_FLASH
+            // Programming flash can only clear bits
+            if ((yksim_storage[offset + i] & data[i]) != data[i]) return false;
+        #endif
+        yksim_storage[offset + i] = data[i];
+        yksim_storage_writes[offset + i]++;
+    }
+
+    return true;
+}
+
+bool ykhmac_presistent_read(uint8_t *data, const size_t size, const size_t offset)
+{
+    if (offset + size > YKSIM_STORAGE_SIZE) return false;
+
+    memcpy(data, yksim_storage + offset, size);
+    return true;
+}
+
+#ifdef YKHMAC_STORAGE_FLASH
+    bool ykhmac_presistent_erase(const size_t offset)
+    {
+        if (offset % STORAGE_PAGE_SIZE != 0 || offset >= YKSIM_STORAGE_SIZE) return false;
+
+        memset(yksim_storage + offset, 0xFF, STORAGE_PAGE_SIZE);
+        yksim_storage_erases[offset / STORAGE_PAGE_SIZE]++;
+        return true;
+    }
+#endif
+
+#if defined(YKHMAC_METRICS) || defined(YKHMAC_TRACE) || defined(YKHMAC_RETRY)
+    uint32_t ykhmac_clock()
+    {
+        // Nanoseconds, see YKSIM_CLOCK_HZ
+        return (uint32_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+#endif
+
+#ifdef YKHMAC_DEBUG
+    void ykhmac_debug_print(const char* message)
+    {
+        fputs(message, stderr);
+    }
+#endif
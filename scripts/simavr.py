@@ -0,0 +1,145 @@
+# Cycle, stack and size regression suite of the ykhmac library under simavr
+#
+# Adds the targets `simavr` and `simavr_baseline` to the environment using it, see platformio.ini.
+# `simavr` runs the firmware from src/simavr, and fails if an operation fails, or if a cycle count,
+# a stack peak, or the flash or RAM size (of the image, and of the library functions) exceeds the baseline by more than the tolerance
+# (`custom_simavr_tolerance`, in percent), or if there is no baseline. `simavr_baseline` records
+# the current values as the new baseline, it is the only target which writes it. Both run locally,
+# no hardware is required.
+
+import json
+import os
+import re
+import subprocess
+
+Import("env")
+
+BASELINE = os.path.join(env.subst("$PROJECT_SRC_DIR"), "simavr", "baseline.json")
+TOLERANCE = float(env.GetProjectOption("custom_simavr_tolerance", "2"))
+TIMEOUT = 300
+ROW = re.compile(r"^(\S+)\s+(\d+)\s+(\d+)\s+(\d+)\s+(ok|FAILED)$")
+COLOR = re.compile(r"\x1b\[[0-9;]*m")
+
+
+def run_firmware(elf):
+    simavr = os.path.join(env.PioPlatform().get_package_dir("tool-simavr"), "bin", "simavr")
+    mcu = env.BoardConfig().get("build.mcu")
+    f_cpu = env.BoardConfig().get("build.f_cpu").rstrip("L")
+    output = subprocess.run([simavr, "-m", mcu, "-f", f_cpu, elf], stdout=subprocess.PIPE,
+        stderr=subprocess.STDOUT, timeout=TIMEOUT, universal_newlines=True).stdout
+
+    # simavr prints each line of the UART, with line breaks replaced by dots
+    metrics = {}
+    done = False
+    for line in output.splitlines():
+        line = COLOR.sub("", line).rstrip(". ")
+        print(line)
+        row = ROW.match(line)
+        if row:
+            if row.group(5) != "ok":
+                print("simavr: %s failed" % row.group(1))
+                return None
+            metrics[row.group(1) + ".cycles"] = int(row.group(2))
+            metrics[row.group(1) + ".stack"] = int(row.group(4))
+        done |= line.endswith("simavr done")
+    if not done:
+        print("simavr: the firmware did not finish")
+        return None
+    return metrics
+
+
+def image_size(elf):
+    output = subprocess.run([env.subst("$SIZETOOL"), "-A", elf], stdout=subprocess.PIPE,
+        env=env["ENV"], universal_newlines=True).stdout
+    sections = {}
+    for line in output.splitlines():
+        fields = line.split()
+        if len(fields) >= 2 and fields[0].startswith(".") and fields[1].isdigit():
+            sections[fields[0]] = int(fields[1])
+    return {
+        "flash": sections.get(".text", 0) + sections.get(".data", 0),
+        "ram": sections.get(".data", 0) + sections.get(".bss", 0) + sections.get(".noinit", 0)
+    }
+
+
+def library_size(elf):
+    # The C API and the engine, the policies are mostly inlined into them
+    nm = env.subst("$SIZETOOL")[:-len("size")] + "nm"
+    output = subprocess.run([nm, "-S", "-C", elf], stdout=subprocess.PIPE,
+        env=env["ENV"], universal_newlines=True).stdout
+    flash = 0
+    for line in output.splitlines():
+        fields = line.split(None, 3)
+        if len(fields) == 4 and fields[2] in "tTwW" and fields[3].startswith(("ykhmac_", "ykhmac::")):
+            flash += int(fields[1], 16)
+    return {"library.flash": flash}
+
+
+def measure(source):
+    elf = source[0].get_abspath()
+    metrics = run_firmware(elf)
+    if metrics is not None:
+        metrics.update(image_size(elf))
+        metrics.update(library_size(elf))
+    return metrics
+
+
+def write_baseline(metrics):
+    with open(BASELINE, "w") as file:
+        json.dump(metrics, file, indent=4, sort_keys=True)
+        file.write("\n")
+    print("simavr: baseline written to %s" % BASELINE)
+
+
+def simavr(target, source, env):
+    if not os.path.isfile(BASELINE):
+        print("simavr: no baseline at %s, record it using the target simavr_baseline" % BASELINE)
+        return 1
+    metrics = measure(source)
+    if metrics is None:
+        return 1
+
+    with open(BASELINE) as file:
+        baseline = json.load(file)
+    print("\n%-32s %10s %10s %8s" % ("metric", "baseline", "current", "change"))
+    regressions = 0
+    for name in sorted(metrics):
+        current = metrics[name]
+        previous = baseline.get(name)
+        if previous is None:
+            print("%-32s %10s %10d %8s" % (name, "-", current, "new"))
+            continue
+        change = (current - previous) * 100.0 / previous if previous else 0.0
+        regressed = current > previous * (1 + TOLERANCE / 100.0)
+        regressions += regressed
+        print("%-32s %10d %10d %+7.1f%%%s" % (name, previous, current, change, " REGRESSED" if regressed else ""))
+
+    if regressions:
+        print("simavr: %d metrics regressed by more than %.1f%%" % (regressions, TOLERANCE))
+        return 1
+    return 0
+
+
+def simavr_baseline(target, source, env):
+    metrics = measure(source)
+    if metrics is None:
+        return 1
+    write_baseline(metrics)
+    return 0
+
+
+env.AddCustomTarget(
+    name="simavr",
+    dependencies="$BUILD_DIR/${PROGNAME}.elf",
+    actions=simavr,
+    title="simavr",
+    description="Runs the cycle, stack and size regression suite under simavr"
+)
+
+env.AddCustomTarget(
+    name="simavr_baseline",
+    dependencies="$BUILD_DIR/${PROGNAME}.elf",
+    actions=simavr_baseline,
+    title="simavr baseline",
+    description="Records the baseline of the simavr regression suite"
+)
@@ -0,0 +1,84 @@
+#!/usr/bin/env python3
+# Decoder of the binary trace buffer of the ykhmac library
+#
+# Reads the lines `trace <hex record>` printed by print_trace() (Arduino) or yksim_trace_write()
+# (native), from a file or the standard input, and formats them like the YKHMAC_DEBUG output.
+# Other lines are ignored, so a whole serial log can be passed. The messages are read from the
+# comments of the event enumeration in ykhmac_trace.h, so the decoder always matches the library.
+#
+# Usage: ykhmac_trace.py [-c clock_hz] [--header ykhmac_trace.h] [file]
+
+import argparse
+import os
+import re
+import struct
+import sys
+
+HEADER = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "lib", "ykhmac", "include", "ykhmac_trace.h")
+EVENT = re.compile(r"^\s*YKHMAC_EVENT_\w+\s*(?:=\s*\d+\s*)?,\s*//!<\s*(.*?)\s*$")
+RECORD = re.compile(r"trace ([0-9a-fA-F]+)\s*$")
+CLOCK = re.compile(r"#\s*clock_hz\s+(\d+)")
+
+TRACE_LENGTH_MASK = 0x1F
+TRACE_FOLLOWS = 0x20
+TRACE_REDACTED = 0x40
+TRACE_CONTINUED = 0x80
+
+
+def read_events(header):
+    with open(header) as file:
+        return [match.group(1) for match in map(EVENT.match, file) if match]
+
+
+def decode(lines, events, clock_hz):
+    previous = None
+    pending = None
+    for line in lines:
+        clock = CLOCK.search(line)
+        if clock and clock_hz is None:
+            clock_hz = int(clock.group(1))
+        record = RECORD.search(line)
+        if not record:
+            continue
+
+        data = bytes.fromhex(record.group(1))
+        timestamp, event, flags = struct.unpack_from("<IBB", data)
+        payload = data[6:6 + (flags & TRACE_LENGTH_MASK)]
+
+        # Records of a long payload follow each other, only the last one is printed. The first
+        # records of the oldest payload may have been overwritten already
+        if flags & TRACE_FOLLOWS:
+            if pending is None or (pending[0], pending[1]) != (timestamp, event):
+                pending = None
+                continue
+            payload = pending[3] + payload
+        pending = (timestamp, event, flags, payload) if flags & TRACE_CONTINUED else None
+        if pending is not None:
+            continue
+
+        scale = 1e6 / clock_hz if clock_hz else 1
+        delta = ((timestamp - previous) & 0xFFFFFFFF) * scale if previous is not None else 0
+        previous = timestamp
+        message = events[event] if event < len(events) else "Unknown event %u" % event
+        if flags & TRACE_REDACTED:
+            message += ": <redacted>"
+        elif payload:
+            message += ": " + " ".join("%02x" % byte for byte in payload)
+        print("%14.1f %+12.1f  %s" % (timestamp * scale, delta, message))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Decodes the trace buffer of the ykhmac library")
+    parser.add_argument("file", nargs="?", help="Log containing the trace lines, default: standard input")
+    parser.add_argument("-c", "--clock-hz", type=int, help="Frequency of ykhmac_clock, default: from the log")
+    parser.add_argument("--header", default=HEADER, help="ykhmac_trace.h of the traced firmware")
+    args = parser.parse_args()
+
+    events = read_events(args.header)
+    print("%14s %12s  %s" % ("time [us]", "delta [us]", "event"))
+    with (open(args.file) if args.file else sys.stdin) as lines:
+        decode(lines, events, args.clock_hz)
+
+
+if __name__ == "__main__":
+    main()
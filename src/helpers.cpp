@@ -60,14 +60,105 @@ void input_secret_key(uint8_t secret_key[SECRET_KEY_SIZE])
     }
 }
 
+#ifdef YKHMAC_METRICS
+    // Prints a summary of the per-phase histograms, durations in microseconds
+    void print_metrics()
+    {
+        static const char phase_names[YKHMAC_PHASES][9] PROGMEM =
+            { "select", "load", "exchange", "decrypt", "hmac", "compare", "encrypt", "store" };
+        struct ykhmac_histogram histogram;
+
+        for (uint8_t phase = 0; phase < YKHMAC_PHASES; phase++)
+        {
+            ykhmac_metrics_get((ykhmac_phase)phase, &histogram);
+            Serial.print((const __FlashStringHelper*)phase_names[phase]);
+            Serial.print(F(": n="));
+            Serial.print(histogram.count);
+            Serial.print(F(", mean="));
+            Serial.print(histogram.count ? (uint32_t)(histogram.sum / histogram.count) : 0);
+            Serial.print(F(" us, max="));
+            Serial.print(histogram.max);
+            Serial.println(F(" us"));
+        }
+    }
+#endif
+
+#ifdef YKHMAC_STACK
+    // Prints the deepest stack usage of each entry point so far, in bytes
+    void print_stack()
+    {
+        static const char entry_names[YKHMAC_ENTRIES][14] PROGMEM = { "select", "read_serial", "read_version",
+            "exchange_hmac", "find_slots", "enroll_key", "authenticate", "compute_hmac" };
+
+        for (uint8_t entry = 0; entry < YKHMAC_ENTRIES; entry++)
+        {
+            Serial.print((const __FlashStringHelper*)entry_names[entry]);
+            Serial.print(F(": stack="));
+            Serial.println(ykhmac_stack_peak((ykhmac_entry)entry));
+        }
+    }
+#endif
+
+#ifdef YKHMAC_TRACE
+    // Drains the trace buffer as hex lines, decode them using scripts/ykhmac_trace.py
+    void print_trace()
+    {
+        static const char digits[] = "0123456789abcdef";
+        struct ykhmac_trace_record record;
+        char line[7 + 2 * sizeof(record) + 1] = "trace ";
+
+        Serial.print(F("# clock_hz 1000000, dropped "));
+        Serial.println(ykhmac_trace_dropped());
+        while (ykhmac_trace_read(&record))
+        {
+            const uint8_t* data = (const uint8_t*)&record;
+            for (uint8_t i = 0; i < sizeof(record); i++)
+            {
+                line[6 + 2 * i] = digits[data[i] >> 4];
+                line[7 + 2 * i] = digits[data[i] & 0x0F];
+            }
+            line[6 + 2 * sizeof(record)] = '\0';
+            Serial.println(line);
+        }
+    }
+#endif
+
 
 // Specific implementations of interface methods
+uint8_t ykhmac_frame[FRAME_SIZE];
+
 bool ykhmac_data_exchange(uint8_t *send_buffer, uint8_t send_length,
     uint8_t* response_buffer, uint8_t* response_length) 
 {
     return nfc.inDataExchange(send_buffer, send_length, response_buffer, response_length);
 }
 
+#ifdef YKHMAC_NONBLOCKING
+    // Result of the last exchange
+    bool exchange_result = false;
+
+    // The PN532 library only offers a blocking exchange, so the exchange finishes right away.
+    // A driver which watches the IRQ line of the PN532 would return YKHMAC_PENDING until it is asserted.
+    bool ykhmac_data_exchange_start(uint8_t *send_buffer, uint8_t send_length,
+        uint8_t* response_buffer, uint8_t* response_length)
+    {
+        exchange_result = nfc.inDataExchange(send_buffer, send_length, response_buffer, response_length);
+        return true;
+    }
+
+    ykhmac_status ykhmac_data_exchange_poll()
+    {
+        return exchange_result ? YKHMAC_DONE : YKHMAC_FAILED;
+    }
+#endif
+
+#if defined(YKHMAC_METRICS) || defined(YKHMAC_TRACE) || defined(YKHMAC_RETRY)
+    uint32_t ykhmac_clock()
+    {
+        return micros();
+    }
+#endif
+
 uint8_t ykhmac_random()
 {
     return (uint8_t)random(0, 255);
@@ -18,6 +18,57 @@ Adafruit_PN532 nfc(13, 12, 11, 10); // Use SPI
 
 const uint8_t aid[YUBIKEY_AID_LENGTH] = YUBIKEY_AID; //!<  AID of the YubiKey HMAC applet
 
+#ifdef YKHMAC_NONBLOCKING
+    bool authenticating = false; //!< Whether a resumable authentication is in progress
+#endif
+
+#ifdef DETECT_IRQ
+    #include <avr/sleep.h>
+
+    #define PN532_IRQ 2 //!< IRQ line of the PN532, pulled low when a response is ready
+
+    volatile bool pn532_ready = false; //!< Set by the falling edge of the IRQ line
+    bool detecting = false; //!< Whether the PN532 is polling for a token
+
+    void pn532_irq()
+    {
+        pn532_ready = true;
+    }
+
+    // Starts the detection once, and reads the UID after the PN532 has activated a token
+    bool detect_token(uint8_t* uid, uint8_t* uid_length)
+    {
+        if (!detecting)
+        {
+            // The PN532 polls on its own, the edge of the ACK frame is discarded,
+            // unless the response is ready already
+            detecting = nfc.startPassiveTargetIDDetection(PN532_MIFARE_ISO14443A);
+            pn532_ready = (digitalRead(PN532_IRQ) == LOW);
+            if (!pn532_ready) return false;
+        }
+        else if (!pn532_ready) return false;
+
+        detecting = false;
+        pn532_ready = false;
+        return nfc.readDetectedPassiveTargetID(uid, uid_length);
+    }
+
+    // Sleeps until the next interrupt: PN532 IRQ, timer or serial input
+    void sleep_until_interrupt()
+    {
+        set_sleep_mode(SLEEP_MODE_IDLE);
+        noInterrupts();
+        if (!pn532_ready)
+        {
+            sleep_enable();
+            interrupts();
+            sleep_cpu();
+            sleep_disable();
+        }
+        interrupts();
+    }
+#endif
+
 
 void setup(void)
 {
@@ -46,10 +97,29 @@ void setup(void)
     Serial.print('.');
     Serial.println((versiondata >> 8) & 0xFF, DEC);
 
-    // Setup module
-    nfc.setPassiveActivationRetries(0xFF);
+    // Setup module, the cooperative loop only checks for a token once per iteration,
+    // unless the PN532 signals it using its IRQ line
+    #ifdef DETECT_IRQ
+        pinMode(PN532_IRQ, INPUT_PULLUP);
+        attachInterrupt(digitalPinToInterrupt(PN532_IRQ), pn532_irq, FALLING);
+        nfc.setPassiveActivationRetries(0xFF);
+    #elif defined(YKHMAC_NONBLOCKING)
+        nfc.setPassiveActivationRetries(0x01);
+    #else
+        nfc.setPassiveActivationRetries(0xFF);
+    #endif
     nfc.SAMConfig();
 
+    #ifdef YKHMAC_TOKEN_TABLE
+        // When the forget pin is connected to ground during reset,
+        // all tokens are removed from the table
+        if (digitalRead(FORGET_BTN) == LOW)
+        {
+            if (ykhmac_table_clear()) Serial.println(F("Cleared token table"));
+            else Serial.println(F("Failed to clear token table"));
+        }
+    #endif
+
     Serial.flush();
 }
 
@@ -85,80 +155,212 @@ void simple_chalresp(uint8_t slot)
     else Serial.println("Challenge computation error");
 }
 
-// Example of the token interfacing functions
-void full_scan()
+// Prints the properties of a token, and performs challenge-response for each slot found
+void print_token(const uint32_t serial, const uint8_t version[3], const uint8_t slots)
 {
-    uint32_t serial = 0;
+    Serial.print(F("Serial number: "));
+    Serial.println(serial);
+    Serial.print(F("Firmware version: "));
+    Serial.print(version[0]);
+    Serial.print(".");
+    Serial.print(version[1]);
+    Serial.print(".");
+    Serial.println(version[2]);
 
-    if (ykhmac_read_serial(&serial))
+    if (slots != 0) 
     {
-        Serial.print(F("Serial number: "));
-        Serial.println(serial);
-
-        uint8_t version[3] = {0};
-
-        if (ykhmac_read_version(version))
+        for(uint8_t i = SLOT_1; i <= SLOT_2; i++)
         {
-            Serial.print(F("Firmware version: "));
-            Serial.print(version[0]);
-            Serial.print(".");
-            Serial.print(version[1]);
-            Serial.print(".");
-            Serial.println(version[2]);
-
-            // Test slots
-            uint8_t slots = ykhmac_find_slots();
-            if (slots != 0) 
+            if (slots & i)
             {
-                // Perform challenge-response for each slot found
-                for(uint8_t i = SLOT_1; i <= SLOT_2; i++)
-                {
-                    if (slots & i)
-                    {
-                        Serial.print(F("Slot "));
-                        Serial.print(i);
-                        Serial.println(F(" configured"));
+                Serial.print(F("Slot "));
+                Serial.print(i);
+                Serial.println(F(" configured"));
 
-                        simple_chalresp(i);
-                    }
-                }
+                simple_chalresp(i);
             }
-            else Serial.println(F("No slots configured"));
         }
-        else Serial.println(F("Read version error"));
     }
-    else Serial.println(F("Read serial error"));
+    else Serial.println(F("No slots configured"));
 }
 
+#ifdef YKHMAC_TOKEN_CACHE
+    // Example of the token interfacing functions, using the session cache
+    void full_scan(const uint8_t* uid, const uint8_t uid_length)
+    {
+        // Known tokens are only validated by a single status request
+        struct ykhmac_token_info info;
 
-void loop(void)
-{
-    // First byte in EEPROM is used to mark enrollment status
-    if(EEPROM.read(0) != 1)
+        if (ykhmac_token_info(uid, uid_length, &info))
+        {
+            print_token(info.serial, info.version, info.slots);
+        }
+        else Serial.println(F("Read token info error"));
+    }
+#else
+    // Example of the token interfacing functions
+    void full_scan()
+    {
+        uint32_t serial = 0;
+
+        if (ykhmac_read_serial(&serial))
+        {
+            uint8_t version[3] = {0};
+
+            if (ykhmac_read_version(version))
+            {
+                // Test slots
+                print_token(serial, version, ykhmac_find_slots());
+            }
+            else Serial.println(F("Read version error"));
+        }
+        else Serial.println(F("Read serial error"));
+    }
+#endif
+
+#ifdef YKHMAC_TOKEN_TABLE
+    // Enrolls a secret key into the token table, under the serial number of the next token presented
+    void enroll_token()
     {
-        // Enroll key
         uint8_t secret_key[SECRET_KEY_SIZE];
         input_secret_key(secret_key);
+        Serial.println(F("Present the token to enroll"));
         Serial.flush();
-        if(ykhmac_enroll_key(secret_key)) EEPROM.write(0, 1);
+
+        #ifdef DETECT_IRQ
+            uint8_t uid[10];
+            uint8_t uid_length = 0;
+            while (!detect_token(uid, &uid_length)) sleep_until_interrupt();
+        #else
+            while (!nfc.inListPassiveTarget());
+        #endif
+
+        uint32_t serial = 0;
+        if (ykhmac_select(aid, YUBIKEY_AID_LENGTH) && ykhmac_read_serial(&serial)
+            && ykhmac_table_enroll(serial, secret_key))
+        {
+            Serial.print(F("Enrolled token "));
+            Serial.println(serial);
+        }
+        else Serial.println(F("Enrollment error"));
 
         // Purge key from RAM
         memset(secret_key, 0, SECRET_KEY_SIZE);
         Serial.println();
     }
-    else
+
+    // Removes the presented token from the token table
+    void revoke_token()
     {
-        // When the forget pin is connected to ground,
-        // the enrollment is invalidated
-        if(digitalRead(FORGET_BTN) == LOW)
+        uint32_t serial = 0;
+        if (ykhmac_read_serial(&serial) && ykhmac_table_revoke(serial))
         {
-            Serial.println(F("Invalidating enrollment"));
-            EEPROM.write(0, 0);
-            return;
+            Serial.print(F("Revoked token "));
+            Serial.println(serial);
+        }
+        else Serial.println(F("Token not enrolled"));
+    }
+#endif
+
+
+void loop(void)
+{
+    #ifdef YKHMAC_TOKEN_TABLE
+        // Any serial input starts the enrollment of another token
+        if (Serial.available())
+        {
+            enroll_token();
         }
+    #else
+        // First byte in EEPROM is used to mark enrollment status
+        if(EEPROM.read(0) != 1)
+        {
+            // Enroll key
+            uint8_t secret_key[SECRET_KEY_SIZE];
+            input_secret_key(secret_key);
+            Serial.flush();
+            if(ykhmac_enroll_key(secret_key)) EEPROM.write(0, 1);
+
+            // Purge key from RAM
+            memset(secret_key, 0, SECRET_KEY_SIZE);
+            Serial.println();
+        }
+    #endif
+    else
+    {
+        #ifndef YKHMAC_TOKEN_TABLE
+            // When the forget pin is connected to ground,
+            // the enrollment is invalidated
+            if(digitalRead(FORGET_BTN) == LOW)
+            {
+                Serial.println(F("Invalidating enrollment"));
+                EEPROM.write(0, 0);
+                return;
+            }
+        #endif
+
+        #ifdef YKHMAC_WRITE_BEHIND
+            // Write the enrollment record of the last authentication,
+            // access has already been granted at this point
+            if (ykhmac_commit_pending() && !ykhmac_commit())
+            {
+                Serial.println(F("Failed to commit enrollment record"));
+            }
+        #endif
+        #ifdef YKHMAC_PRECOMPUTE
+            // Refill the ring of precomputed records one at a time, while no token is present
+            if (ykhmac_replenish_pending() && !ykhmac_replenish())
+            {
+                Serial.println(F("Failed to replenish enrollment records"));
+            }
+        #endif
+
+        #if defined(DETECT_IRQ) || defined(YKHMAC_TOKEN_CACHE)
+            // UID of the detected token
+            uint8_t uid[10];
+            uint8_t uid_length = 0;
+        #endif
+
+        #ifdef YKHMAC_NONBLOCKING
+            // Advance the authentication in progress by one step
+            if (authenticating)
+            {
+                ykhmac_status status = ykhmac_authenticate_step();
+                if (status != YKHMAC_PENDING)
+                {
+                    authenticating = false;
+                    if (status == YKHMAC_DONE)
+                        Serial.println(F("Access granted :)"));
+                    else
+                        Serial.println(F("Communication error or access denied :("));
+                    Serial.println();
+                }
+            }
+            #ifdef DETECT_IRQ
+                else if (detect_token(uid, &uid_length))
+            #else
+                else if (nfc.inListPassiveTarget())
+            #endif
+            {
+                // Select the applet and start the authentication
+                Serial.println(F("Found token"));
+                authenticating = ykhmac_authenticate_start(SLOT_1, aid, YUBIKEY_AID_LENGTH);
+                if (!authenticating) Serial.println(F("Communication error"));
+            }
+
+            // Keypad, relay, ... can be handled here, the loop never waits for the token
+            return;
+        #endif
 
-        // Block until a token arrives
-        if (nfc.inListPassiveTarget())
+        // Block until a token arrives, the session cache is keyed by its UID.
+        // Using the IRQ line, the MCU sleeps in between, and the forget button stays responsive
+        #ifdef DETECT_IRQ
+            if (detect_token(uid, &uid_length))
+        #elif defined(YKHMAC_TOKEN_CACHE)
+            if (nfc.readPassiveTargetID(PN532_MIFARE_ISO14443A, uid, &uid_length))
+        #else
+            if (nfc.inListPassiveTarget())
+        #endif
         {
             Serial.println(F("Found token"));
             
@@ -167,8 +369,18 @@ void loop(void)
             {
                 Serial.println(F("Select OK"));
 
-                // Perform authentication
-                if(ykhmac_authenticate(SLOT_1))
+                #ifdef YKHMAC_TOKEN_TABLE
+                    // When the forget pin is connected to ground, the presented token is revoked,
+                    // otherwise it is authenticated against its own secret key
+                    if (digitalRead(FORGET_BTN) == LOW)
+                    {
+                        revoke_token();
+                    }
+                    else if (ykhmac_table_authenticate(SLOT_1))
+                #else
+                    // Perform authentication
+                    if(ykhmac_authenticate(SLOT_1))
+                #endif
                 {
                     Serial.println(F("Access granted :)"));
                 }
@@ -176,12 +388,28 @@ void loop(void)
                 {
                     Serial.println(F("Communication error or access denied :("));
                 }
+                #ifdef YKHMAC_METRICS
+                    print_metrics();
+                #endif
+                #ifdef YKHMAC_TRACE
+                    print_trace();
+                #endif
+                #ifdef YKHMAC_STACK
+                    print_stack();
+                #endif
 
-                // full_scan();
+                #ifdef YKHMAC_TOKEN_CACHE
+                    // full_scan(uid, uid_length);
+                #else
+                    // full_scan();
+                #endif
                 // simple_chalresp();
             }
             else Serial.println(F("Select error"));
             Serial.println();
         }
+        #ifdef DETECT_IRQ
+            else sleep_until_interrupt();
+        #endif
     }
 }
\ No newline at end of file
@@ -0,0 +1,1363 @@
+/**
+ * @file main.cpp
+ * @author Christoph Honal
+ * @brief Benchmarks the ykhmac library against a simulated token
+ * @version 0.1
+ * @date 2021-12-17
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <chrono>
+#include <thread>
+#include <ykhmac.h>
+#include <yksim.h>
+#include <yksim_bench.h>
+#ifdef YKHMAC_NONBLOCKING
+    #include <ykhmac_coroutine.h>
+#endif
+#ifdef YKHMAC_PRECOMPUTE
+    #include <ykhmac_storage.h>
+#endif
+#if defined(YKHMAC_STACK) && defined(__linux__)
+    #include <pthread.h>
+#endif
+
+
+const uint8_t aid[YUBIKEY_AID_LENGTH] = YUBIKEY_AID; //!<  AID of the YubiKey HMAC applet
+
+// Secret key from the enrollment log in the README
+const uint8_t secret_key[SECRET_KEY_SIZE] = { 0xb6, 0xe3, 0xf5,
+    0x55, 0x56, 0x2c, 0x89, 0x4b, 0x7a, 0xf1, 0x3b, 0x1d,
+    0xb3, 0x7f, 0x28, 0xde, 0xff, 0x3e, 0xa8, 0x9b };
+const uint8_t wrong_key[SECRET_KEY_SIZE] = { 0 };
+
+#ifdef YKHMAC_TOKEN_TABLE
+    yksim_token table_tokens[TABLE_SIZE]; //!< Tokens filling the token table, the first one uses the README key
+
+    // Inserts and selects a random token of the table
+    yksim_token* table_insert_random()
+    {
+        yksim_token* token = &table_tokens[rand() % TABLE_SIZE];
+        yksim_insert(token);
+        ykhmac_select(aid, YUBIKEY_AID_LENGTH);
+        return token;
+    }
+#endif
+
+// Enrolls the README key, for the serial number of the token when using the token table
+bool enroll_fixture(const yksim_token* token)
+{
+    uint8_t key[SECRET_KEY_SIZE];
+    memcpy(key, secret_key, SECRET_KEY_SIZE);
+    #ifdef YKHMAC_TOKEN_TABLE
+        return ykhmac_table_enroll(token->serial, key);
+    #else
+        (void)token;
+        return ykhmac_enroll_key(key);
+    #endif
+}
+
+// Selects the applet and authenticates the inserted token, a deferred record is committed right away
+bool authenticate_fixture()
+{
+    #ifdef YKHMAC_TOKEN_TABLE
+        bool result = ykhmac_select(aid, YUBIKEY_AID_LENGTH) && ykhmac_table_authenticate(SLOT_1);
+    #else
+        bool result = ykhmac_select(aid, YUBIKEY_AID_LENGTH) && ykhmac_authenticate(SLOT_1);
+    #endif
+    #ifdef YKHMAC_WRITE_BEHIND
+        result &= ykhmac_commit();
+    #endif
+    return result;
+}
+
+// Selects the applet and checks that the inserted token is rejected
+bool reject_fixture()
+{
+    #ifdef YKHMAC_TOKEN_TABLE
+        return ykhmac_select(aid, YUBIKEY_AID_LENGTH) && !ykhmac_table_authenticate(SLOT_1);
+    #else
+        return ykhmac_select(aid, YUBIKEY_AID_LENGTH) && !ykhmac_authenticate(SLOT_1);
+    #endif
+}
+
+
+#ifdef YKHMAC_NONBLOCKING
+    #define BENCH_ENGINES 8 //!< Amount of engines authenticated concurrently
+
+    // Transport policy using its own simulated token, releases each response after the APDU latency
+    struct bench_transport
+    {
+        static constexpr size_t frame_capacity = FRAME_SIZE;
+
+        yksim_token* token;
+        uint8_t frame_buffer[FRAME_SIZE];
+        bool result;
+        std::chrono::steady_clock::time_point ready;
+
+        uint8_t* frame() { return frame_buffer; }
+        bool exchange(uint8_t* send_buffer, uint8_t send_length, uint8_t* response_buffer, uint8_t* response_length)
+        {
+            if (!exchange_start(send_buffer, send_length, response_buffer, response_length)) return false;
+            std::this_thread::sleep_until(ready);
+            return result;
+        }
+        bool exchange_start(uint8_t* send_buffer, uint8_t send_length, uint8_t* response_buffer, uint8_t* response_length)
+        {
+            ready = std::chrono::steady_clock::now() + std::chrono::microseconds(token->apdu_latency_us);
+            result = yksim_process(token, send_buffer, send_length, response_buffer, response_length);
+            return true;
+        }
+        ykhmac_status exchange_poll()
+        {
+            if (std::chrono::steady_clock::now() < ready) return YKHMAC_PENDING;
+            return result ? YKHMAC_DONE : YKHMAC_FAILED;
+        }
+    };
+
+    // Storage policy keeping the record in RAM, updates take the simulated write latency
+    struct bench_storage
+    {
+        bool valid;
+        uint8_t challenge[CHALLENGE_SIZE];
+        uint8_t iv[AES_BLOCKLEN];
+        uint8_t secret_key[SECRET_KEY_SIZE_PAD];
+        std::chrono::steady_clock::time_point ready;
+
+        bool load(uint8_t* challenge, uint8_t* iv, uint8_t* secret_key)
+        {
+            memcpy(challenge, this->challenge, CHALLENGE_SIZE);
+            memcpy(iv, this->iv, AES_BLOCKLEN);
+            memcpy(secret_key, this->secret_key, SECRET_KEY_SIZE_PAD);
+            return valid;
+        }
+        bool store(const uint8_t* challenge, const uint8_t* iv, const uint8_t* secret_key)
+        {
+            memcpy(this->challenge, challenge, CHALLENGE_SIZE);
+            memcpy(this->iv, iv, AES_BLOCKLEN);
+            memcpy(this->secret_key, secret_key, SECRET_KEY_SIZE_PAD);
+            valid = true;
+            return true;
+        }
+        bool update(const uint8_t* challenge, const uint8_t* iv, const uint8_t* secret_key)
+        {
+            ready = std::chrono::steady_clock::now() +
+                std::chrono::microseconds(yksim_storage_write_latency_us * RECORD_SIZE);
+            return store(challenge, iv, secret_key);
+        }
+        ykhmac_status update_poll()
+        {
+            return (std::chrono::steady_clock::now() < ready) ? YKHMAC_PENDING : YKHMAC_DONE;
+        }
+    };
+
+    // Random number generator policy using the simulated one
+    struct bench_rng
+    {
+        uint8_t random() { return ykhmac_random(); }
+    };
+
+    ykhmac::Engine<bench_transport, bench_storage, bench_rng> bench_engines[BENCH_ENGINES]; //!< Engines authenticated concurrently
+    yksim_token bench_tokens[BENCH_ENGINES]; //!< Tokens of the engines
+
+    // Drives an authentication of an engine to its end
+    template<class Engine> bool authenticate_blocking(Engine& engine)
+    {
+        if (!engine.authenticate_start(SLOT_1, aid, YUBIKEY_AID_LENGTH)) return false;
+
+        ykhmac_status status;
+        while ((status = engine.authenticate_step()) == YKHMAC_PENDING) { }
+        return status == YKHMAC_DONE;
+    }
+#endif
+
+
+// Enrollment log vectors from the README: padded secret key, challenge, response, IV and encrypted secret key
+const uint8_t kat_key[32] = {
+    0xb6, 0xe3, 0xf5, 0x55, 0x56, 0x2c, 0x89, 0x4b, 0x7a, 0xf1, 0x3b, 0x1d,
+    0xb3, 0x7f, 0x28, 0xde, 0xff, 0x3e, 0xa8, 0x9b, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+const uint8_t kat_challenge[57] = {
+    0x24, 0x5e, 0x5a, 0x69, 0xda, 0xa8, 0x0f, 0xe6, 0x14, 0xf6, 0x04, 0x14,
+    0xef, 0x06, 0x3f, 0x01, 0xda, 0xd8, 0x13, 0x6f, 0x33, 0x64, 0x0a, 0x2c,
+    0x9a, 0x71, 0x55, 0x16, 0x70, 0xa6, 0x98, 0xa8, 0x6e, 0x72, 0xbd, 0x9e,
+    0x7d, 0x03, 0x47, 0x12, 0xcc, 0x0b, 0xa5, 0xa6, 0x6e, 0x1f, 0x3e, 0x35,
+    0xab, 0xca, 0xa9, 0x93, 0x55, 0x4a, 0xe1, 0xd2, 0xa7 };
+const uint8_t kat_response[HMAC_HASH_SIZE] = {
+    0xf8, 0x7b, 0x62, 0x6d, 0x77, 0xad, 0x56, 0x46, 0x5f, 0x28, 0xc0, 0x01,
+    0x67, 0xc7, 0xae, 0x96, 0x73, 0xaf, 0x96, 0xf0 };
+const uint8_t kat_iv[AES_BLOCKLEN] = {
+    0xdd, 0x99, 0x69, 0x62, 0x48, 0x97, 0x63, 0xc4, 0x17, 0xd8, 0x16, 0x60,
+    0xf3, 0x89, 0x2d, 0xfa };
+const uint8_t kat_encrypted_key[32] = {
+    0x27, 0x19, 0xab, 0x85, 0x06, 0x21, 0xb6, 0xd2, 0x90, 0xd2, 0xa8, 0xb4,
+    0x1a, 0x4a, 0xc6, 0x7e, 0x17, 0x5b, 0x57, 0x80, 0x8f, 0x5e, 0xee, 0xb9,
+    0x3c, 0x7e, 0x16, 0xc9, 0x36, 0x66, 0x8d, 0xbd };
+
+// Crypto backends, see ykhmac_crypto.h
+const ykhmac_hmac_backend* const hmac_backends[] =
+{
+    &ykhmac_hmac_portable,
+    &ykhmac_hmac_fixed,
+    #ifdef YKHMAC_CRYPTO_X86
+        &ykhmac_hmac_shani,
+    #endif
+};
+const ykhmac_aes_backend* const aes_backends[] =
+{
+    &ykhmac_aes_portable,
+    #if AES_KEYLEN == 16
+        &ykhmac_aes_compact,
+    #endif
+    #ifdef YKHMAC_CRYPTO_X86
+        &ykhmac_aes_aesni,
+    #endif
+};
+
+// Checks a HMAC-SHA1 backend against the README, and against the portable backend for all message lengths
+bool crypto_check_hmac(const ykhmac_hmac_backend* backend)
+{
+    ykhmac_hmac_ctx ctx, portable_ctx;
+    ykhmac_hash_work work;
+    uint8_t digest[HMAC_HASH_SIZE], portable_digest[HMAC_HASH_SIZE];
+    uint8_t message[UINT8_MAX];
+
+    backend->init(&ctx, kat_key, 20, &work);
+    if (!backend->compute(&ctx, kat_challenge, sizeof(kat_challenge), digest, HMAC_HASH_SIZE, &work)
+        || memcmp(digest, kat_response, HMAC_HASH_SIZE) != 0) return false;
+
+    for (size_t i = 0; i < UINT8_MAX; i++) message[i] = (uint8_t)(i * 151 + 7);
+    ykhmac_hmac_portable.init(&portable_ctx, kat_key, 20, &work);
+    for (uint16_t length = 0; length < UINT8_MAX; length++)
+    {
+        // Contexts are interchangeable between backends
+        if (!backend->compute(&portable_ctx, message, (uint8_t)length, digest, HMAC_HASH_SIZE, &work)
+            || !ykhmac_hmac_portable.compute(&portable_ctx, message, (uint8_t)length, portable_digest, HMAC_HASH_SIZE, &work)
+            || memcmp(digest, portable_digest, HMAC_HASH_SIZE) != 0) return false;
+    }
+    return true;
+}
+
+// Decrypts the README secret key as authentication does: the padding block first, and the remaining blocks
+// using the same expanded key only if its padding is zero. Returns whether it is
+bool verify_decrypt(const ykhmac_aes_backend* backend, ykhmac_aes_work* work, const uint8_t* response,
+    uint8_t data[sizeof(kat_encrypted_key)])
+{
+    uint8_t* last_block = data + sizeof(kat_encrypted_key) - AES_BLOCKLEN;
+    memcpy(data, kat_encrypted_key, sizeof(kat_encrypted_key));
+    backend->decrypt_expand(work, response);
+    backend->decrypt_expanded(work, last_block - AES_BLOCKLEN, last_block, AES_BLOCKLEN);
+
+    uint8_t bits = 0;
+    for (size_t i = SECRET_KEY_SIZE; i < sizeof(kat_encrypted_key); i++) bits |= data[i];
+    if (bits != 0) return false;
+
+    backend->decrypt_expanded(work, kat_iv, data, sizeof(kat_encrypted_key) - AES_BLOCKLEN);
+    return true;
+}
+
+// Checks an AES-128-CBC backend against the README
+bool crypto_check_aes(const ykhmac_aes_backend* backend)
+{
+    ykhmac_aes_work work;
+    uint8_t data[sizeof(kat_key)];
+
+    memcpy(data, kat_key, sizeof(kat_key));
+    backend->encrypt(&work, kat_response, kat_iv, data, sizeof(data));
+    if (memcmp(data, kat_encrypted_key, sizeof(data)) != 0) return false;
+    backend->decrypt(&work, kat_response, kat_iv, data, sizeof(data));
+    if (memcmp(data, kat_key, sizeof(data)) != 0) return false;
+
+    // The response of another token fails the padding check
+    return verify_decrypt(backend, &work, kat_response, data) && memcmp(data, kat_key, sizeof(data)) == 0
+        && !verify_decrypt(backend, &work, kat_key, data);
+}
+
+#define BATCH_JOBS 256 //!< Jobs per batch of the batch HMAC-SHA1
+
+// Batch of HMAC-SHA1 jobs using random keys and challenges
+struct batch_jobs
+{
+    uint8_t keys[BATCH_JOBS][SECRET_KEY_SIZE];
+    uint8_t challenges[BATCH_JOBS][UINT8_MAX];
+    uint8_t responses[BATCH_JOBS][RESP_BUF_SIZE];
+    ykhmac_hmac_job jobs[BATCH_JOBS];
+} batch;
+
+#ifdef YKHMAC_CRYPTO_X86
+    const ykhmac_hmac_batch_backend* const batch_backends[] =
+    {
+        &ykhmac_hmac_batch_scalar,
+        &ykhmac_hmac_batch_sse2,
+        &ykhmac_hmac_batch_avx2,
+        &ykhmac_hmac_batch_avx512
+    };
+#endif
+
+// Fills the batch, using challenges of random lengths if length is negative
+void batch_fill(const int length)
+{
+    for (size_t i = 0; i < BATCH_JOBS; i++)
+    {
+        for (uint8_t j = 0; j < SECRET_KEY_SIZE; j++) batch.keys[i][j] = rand();
+        for (uint8_t j = 0; j < UINT8_MAX; j++) batch.challenges[i][j] = rand();
+        batch.jobs[i] = { batch.keys[i], batch.challenges[i],
+            (uint8_t)((length < 0) ? (rand() % UINT8_MAX) : length), batch.responses[i] };
+    }
+}
+
+// Checks a batch HMAC-SHA1 against ykhmac_compute_hmac
+bool batch_check(bool (*compute)(struct ykhmac_hmac_job* jobs, const size_t count))
+{
+    uint8_t expected[RESP_BUF_SIZE];
+
+    batch_fill(-1);
+    if (!compute(batch.jobs, BATCH_JOBS)) return false;
+    for (size_t i = 0; i < BATCH_JOBS; i++)
+    {
+        const ykhmac_hmac_job* job = &batch.jobs[i];
+        if (!ykhmac_compute_hmac(job->key, job->challenge, job->challenge_length, expected)
+            || memcmp(expected, job->response, RESP_BUF_SIZE) != 0) return false;
+    }
+    return true;
+}
+
+// Finds the slots of a token, and counts the APDUs exchanged
+uint8_t slots_query(yksim_token* token, uint8_t (*find)(), uint32_t* apdus)
+{
+    yksim_insert(token);
+    ykhmac_select(aid, YUBIKEY_AID_LENGTH);
+    const uint32_t start = token->apdu_count;
+    const uint8_t slots = find();
+    *apdus = token->apdu_count - start;
+    return slots;
+}
+
+// Checks that the status response tells the slots in one APDU, and that ambiguous responses fall back to probing
+bool slots_check(const yksim_token* token)
+{
+    yksim_token probed = *token;
+    uint32_t apdus;
+
+    // HMAC-SHA1 in slot 1, and in slot 2 next to an OTP in slot 1
+    bool result = slots_query(&probed, ykhmac_find_slots, &apdus) == SLOT_1 && apdus == 1;
+    result &= slots_query(&probed, ykhmac_probe_slots, &apdus) == SLOT_1 && apdus == 2;
+    memcpy(probed.keys[1], probed.keys[0], SECRET_KEY_SIZE);
+    probed.slots = SLOT_2;
+    probed.otp_slots = SLOT_1;
+    result &= slots_query(&probed, ykhmac_find_slots, &apdus) == SLOT_2 && apdus == 1;
+    result &= slots_query(&probed, ykhmac_probe_slots, &apdus) == SLOT_2 && apdus == 2;
+
+    // A status cut short before its last byte
+    probed.status_length = STATUS_SIZE - 1;
+    result &= slots_query(&probed, ykhmac_find_slots, &apdus) == SLOT_2 && apdus == 3;
+    probed.status_length = STATUS_SIZE;
+
+    // Firmware without touch level, and a token without any configured slot
+    probed.version[0] = 2;
+    probed.version[1] = 1;
+    result &= slots_query(&probed, ykhmac_find_slots, &apdus) == SLOT_2 && apdus == 3;
+    probed = *token;
+    probed.slots = 0;
+    result &= slots_query(&probed, ykhmac_find_slots, &apdus) == 0 && apdus == 3;
+
+    yksim_insert(nullptr);
+    return result;
+}
+
+#ifdef YKHMAC_TRACE
+    // Enrolls and authenticates once, checks that the trace holds the outcome but no key material
+    bool trace_check(yksim_token* token)
+    {
+        yksim_insert(token);
+        ykhmac_trace_clear();
+        bool result = enroll_fixture(token) && authenticate_fixture();
+        #ifdef YKHMAC_TOKEN_TABLE
+            result &= ykhmac_table_revoke(token->serial);
+        #endif
+        yksim_insert(nullptr);
+
+        bool authenticated = false;
+        struct ykhmac_trace_record record;
+        while (ykhmac_trace_read(&record))
+        {
+            authenticated |= record.event == YKHMAC_EVENT_AUTHENTICATED;
+            switch (record.event)
+            {
+                case YKHMAC_EVENT_EXCHANGED_RESPONSE:
+                case YKHMAC_EVENT_DECRYPTED_SECRET_KEY:
+                case YKHMAC_EVENT_COMPUTED_RESPONSE:
+                case YKHMAC_EVENT_SECRET_KEY:
+                case YKHMAC_EVENT_PADDED_SECRET_KEY:
+                    if (TRACE_LEVEL < TRACE_SECRETS)
+                        result &= record.flags == TRACE_REDACTED;
+                    break;
+                default:
+                    break;
+            }
+        }
+        return result && authenticated && ykhmac_trace_dropped() == 0;
+    }
+#endif
+
+#ifdef YKHMAC_PRECOMPUTE
+    // Fills the ring of precomputed records
+    bool precompute_fill()
+    {
+        bool result = true;
+        while (result && ykhmac_replenish_pending()) result = ykhmac_replenish();
+        return result && ykhmac_records_available() == RECORD_COUNT;
+    }
+
+    // Checks that each authentication uses one record, that the last one is replaced, and that a reboot keeps the ring
+    bool precompute_check(yksim_token* token, yksim_token* foreign_token)
+    {
+        bool result = enroll_fixture(token) && ykhmac_records_available() == 1 && precompute_fill();
+
+        // The secret key is kept once PRECOMPUTE_LOW records are left
+        yksim_insert(token);
+        result &= ykhmac_select(aid, YUBIKEY_AID_LENGTH);
+        for (uint8_t left = RECORD_COUNT - 1; left > 0; left--)
+        {
+            result &= ykhmac_authenticate(SLOT_1) && ykhmac_records_available() == left
+                && ykhmac_replenish_pending() == (left <= PRECOMPUTE_LOW);
+        }
+        result &= ykhmac_authenticate(SLOT_1) && ykhmac_records_available() == 1;
+
+        // Failed authentications do not use a record, the ring is found again after a reboot
+        yksim_insert(foreign_token);
+        result &= reject_fixture();
+        ykhmac_record_reset();
+        result &= ykhmac_records_available() == 1 && precompute_fill();
+        ykhmac_record_reset();
+        result &= ykhmac_records_available() == RECORD_COUNT;
+
+        yksim_insert(token);
+        result &= authenticate_fixture() && ykhmac_records_available() == RECORD_COUNT - 1;
+        yksim_insert(nullptr);
+        return result;
+    }
+#endif
+
+#ifdef YKHMAC_TOKEN_CACHE
+    // Queries the token info, and counts the APDUs exchanged
+    bool cache_query(yksim_token* token, const uint8_t* uid, struct ykhmac_token_info* info, uint32_t* apdus)
+    {
+        const uint32_t start = token->apdu_count;
+        const bool result = ykhmac_token_info(uid, 7, info);
+        *apdus = token->apdu_count - start;
+        return result && info->serial == token->serial && info->slots == token->slots
+            && info->program_sequence == token->program_sequence;
+    }
+
+    // Checks that known tokens cost a single APDU, and that swapped or reconfigured tokens are queried again
+    bool cache_check(yksim_token* token, yksim_token* foreign_token)
+    {
+        const uint8_t uid[7] = { 0x04, 0x12, 0x34, 0x56, 0x78, 0x9A, 0xBC };
+        const yksim_token original = *token;
+        struct ykhmac_token_info info;
+        uint32_t apdus;
+
+        ykhmac_token_cache_clear();
+        yksim_insert(token);
+        bool result = ykhmac_select(aid, YUBIKEY_AID_LENGTH);
+        result &= cache_query(token, uid, &info, &apdus) && apdus == 2;
+        result &= cache_query(token, uid, &info, &apdus) && apdus == 1;
+
+        // Reconfiguration of slot 2
+        memcpy(token->keys[1], wrong_key, SECRET_KEY_SIZE);
+        token->slots |= SLOT_2;
+        token->program_sequence++;
+        result &= cache_query(token, uid, &info, &apdus) && apdus == 2;
+        result &= cache_query(token, uid, &info, &apdus) && apdus == 1;
+
+        // Another token using the same UID, running a different firmware
+        foreign_token->version[2]++;
+        yksim_insert(foreign_token);
+        result &= ykhmac_select(aid, YUBIKEY_AID_LENGTH);
+        result &= cache_query(foreign_token, uid, &info, &apdus) && apdus == 2;
+        foreign_token->version[2]--;
+
+        // Forgotten tokens are queried again
+        ykhmac_token_forget(uid, sizeof(uid));
+        result &= cache_query(foreign_token, uid, &info, &apdus) && apdus == 2;
+
+        yksim_insert(nullptr);
+        *token = original;
+        ykhmac_token_cache_clear();
+        return result;
+    }
+#endif
+
+#ifdef YKHMAC_METRICS
+    // Returns the amount of recorded durations of a phase
+    uint32_t phase_count(const ykhmac_phase phase)
+    {
+        struct ykhmac_histogram histogram;
+        return ykhmac_metrics_get(phase, &histogram) ? histogram.count : 0;
+    }
+
+    // Checks that a token with a different key is rejected after decrypting the padding block, without any HMAC
+    bool reject_check(yksim_token* token, yksim_token* foreign_token)
+    {
+        bool result = enroll_fixture(token);
+        #ifdef YKHMAC_TOKEN_TABLE
+            // The foreign token claims the serial number of the enrolled one
+            const uint32_t foreign_serial = foreign_token->serial;
+            foreign_token->serial = token->serial;
+        #endif
+        yksim_insert(foreign_token);
+        ykhmac_metrics_reset();
+        result &= reject_fixture();
+        #ifdef YKHMAC_TOKEN_TABLE
+            foreign_token->serial = foreign_serial;
+        #endif
+        result &= phase_count(YKHMAC_PHASE_DECRYPT) == 1 && phase_count(YKHMAC_PHASE_HMAC) == 0;
+
+        // The accept path still runs the full check
+        yksim_insert(token);
+        result &= authenticate_fixture();
+        #ifdef YKHMAC_TOKEN_TABLE
+            result &= ykhmac_table_revoke(token->serial);
+        #endif
+        result &= phase_count(YKHMAC_PHASE_DECRYPT) == 2 && phase_count(YKHMAC_PHASE_HMAC) >= 1;
+
+        yksim_insert(nullptr);
+        ykhmac_metrics_reset();
+        return result;
+    }
+#endif
+
+#if defined(YKHMAC_RETRY) && !defined(YKHMAC_TOKEN_TABLE)
+    // Returns whether the retry counters have grown by the given amounts since the last reset
+    bool retry_counted(const uint32_t transport, const uint32_t truncated, const uint32_t unexpected,
+        const uint32_t not_found, const uint32_t retried, const uint32_t recovered, const uint32_t expired)
+    {
+        bool result = ykhmac_retry_count(YKHMAC_RETRY_TRANSPORT) == transport
+            && ykhmac_retry_count(YKHMAC_RETRY_TRUNCATED) == truncated
+            && ykhmac_retry_count(YKHMAC_RETRY_UNEXPECTED) == unexpected
+            && ykhmac_retry_count(YKHMAC_RETRY_NOT_AUTHENTICATED) == 0
+            && ykhmac_retry_count(YKHMAC_RETRY_NOT_FOUND) == not_found
+            && ykhmac_retry_count(YKHMAC_RETRY_RETRIED) == retried
+            && ykhmac_retry_count(YKHMAC_RETRY_RECOVERED) == recovered
+            && ykhmac_retry_count(YKHMAC_RETRY_EXPIRED) == expired;
+        ykhmac_retry_reset();
+        return result;
+    }
+
+    // Checks that transient faults are retried within the same phase, and that permanent ones and deadlines are not
+    bool retry_check(yksim_token* token)
+    {
+        const uint8_t foreign_aid[FIDESMO_AID_LENGTH] = FIDESMO_AID;
+        uint32_t serial;
+        yksim_insert(token);
+        bool result = enroll_fixture(token) && ykhmac_select(aid, YUBIKEY_AID_LENGTH);
+        ykhmac_retry_reset();
+
+        // The token leaves the field during the HMAC exchange, the stored challenge is sent again
+        yksim_fault_burst(2);
+        uint32_t start = token->apdu_count;
+        result &= ykhmac_authenticate(SLOT_1) && token->apdu_count - start == 1;
+        result &= retry_counted(2, 0, 0, 0, 2, 1, 0);
+        #ifdef YKHMAC_WRITE_BEHIND
+            ykhmac_commit();
+        #endif
+
+        // A token which does not come back in time fails the authentication, but keeps its record valid
+        yksim_fault_burst(RETRY_ATTEMPTS);
+        result &= !ykhmac_authenticate(SLOT_1) && retry_counted(RETRY_ATTEMPTS, 0, 0, 0, RETRY_ATTEMPTS - 1, 0, 1);
+        result &= ykhmac_authenticate(SLOT_1);
+        #ifdef YKHMAC_WRITE_BEHIND
+            ykhmac_commit();
+        #endif
+        ykhmac_retry_reset();
+
+        // Truncated responses are retried, unknown status words and unknown applets are not
+        yksim_fault_permille = 1000;
+        yksim_fault_kinds = YKSIM_FAULT_TRUNCATED;
+        result &= !ykhmac_read_serial(&serial) && retry_counted(0, RETRY_ATTEMPTS, 0, 0, RETRY_ATTEMPTS - 1, 0, 1);
+        yksim_fault_permille = 0;
+        yksim_fault_kinds = YKSIM_FAULT_LOST | YKSIM_FAULT_TRUNCATED;
+        result &= !ykhmac_exchange_hmac(SLOT_2, secret_key, SECRET_KEY_SIZE) && retry_counted(0, 0, 1, 0, 0, 0, 0);
+        result &= !ykhmac_select(foreign_aid, FIDESMO_AID_LENGTH) && retry_counted(0, 0, 0, 1, 0, 0, 0);
+
+        // A lost exchange which takes longer than the deadline is not retried
+        result &= ykhmac_select(aid, YUBIKEY_AID_LENGTH);
+        yksim_fault_latency_us = RETRY_DEADLINE_QUERY_US + 10000;
+        yksim_fault_burst(1);
+        result &= !ykhmac_read_serial(&serial) && retry_counted(1, 0, 0, 0, 0, 0, 1);
+        yksim_fault_latency_us = 0;
+
+        yksim_insert(nullptr);
+        return result;
+    }
+#endif
+
+#ifdef YKHMAC_STACK
+    // Stack budgets of the entry points in bytes on x86-64, including STACK_MARGIN and the simulated token
+    const uint16_t stack_budgets[YKHMAC_ENTRIES] = { 768, 256, 256, 1024, 1024, 512, 1024, 384 };
+    const char* const stack_names[YKHMAC_ENTRIES] = { "select", "read_serial", "read_version", "exchange_hmac",
+        "find_slots", "enroll_key", "authenticate", "compute_hmac" };
+
+    #ifdef __linux__
+        // Computes a HMAC on a thread whose stack is smaller than STACK_PAINT_SIZE
+        static void* stack_small_thread(void* result)
+        {
+            uint8_t response[RESP_BUF_SIZE];
+            const uint8_t challenge[CHALLENGE_SIZE] = { 0 };
+            *(bool*)result = ykhmac_compute_hmac(secret_key, challenge, CHALLENGE_SIZE, response);
+            return nullptr;
+        }
+    #endif
+
+    // Calls each entry point, prints its stack high-water mark, and checks it against its budget
+    bool stack_check(yksim_token* token)
+    {
+        uint8_t response[RESP_BUF_SIZE], version[3];
+        const uint8_t challenge[CHALLENGE_SIZE] = { 0 };
+        uint32_t serial;
+
+        // The first round resolves lazily bound symbols, which takes several kilobytes of stack
+        bool result = true;
+        yksim_insert(token);
+        for (uint8_t round = 0; round < 2; round++)
+        {
+            ykhmac_stack_reset();
+            result &= enroll_fixture(token) && authenticate_fixture();
+            result &= ykhmac_read_serial(&serial) && ykhmac_read_version(version)
+                && ykhmac_exchange_hmac(SLOT_1, challenge, CHALLENGE_SIZE, response) && ykhmac_find_slots() == SLOT_1
+                && ykhmac_compute_hmac(secret_key, challenge, CHALLENGE_SIZE, response);
+        }
+        yksim_insert(nullptr);
+
+        #ifdef __linux__
+            // Painting stays within the stack of the calling thread
+            pthread_attr_t attr;
+            pthread_t thread;
+            bool small_result = false;
+            pthread_attr_init(&attr);
+            pthread_attr_setstacksize(&attr, STACK_PAINT_SIZE / 2);
+            result &= pthread_create(&thread, &attr, stack_small_thread, &small_result) == 0
+                && pthread_join(thread, nullptr) == 0 && small_result;
+            pthread_attr_destroy(&attr);
+        #endif
+
+        printf("stack [bytes]:");
+        for (uint8_t entry = 0; entry < YKHMAC_ENTRIES; entry++)
+        {
+            const uint16_t peak = ykhmac_stack_peak((ykhmac_entry)entry);
+            printf(" %s %u/%u%s", stack_names[entry], peak, stack_budgets[entry], (entry + 1 < YKHMAC_ENTRIES) ? "," : "\n");
+            result &= peak != 0 && peak <= stack_budgets[entry];
+        }
+        return result;
+    }
+#endif
+
+// Benchmarks a batch HMAC-SHA1, returns the verifications per second
+double batch_bench(const char* backend, bool (*compute)(struct ykhmac_hmac_job* jobs, const size_t count),
+    const size_t iterations)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "hmac batch (%s)", backend);
+    yksim_bench bench(name, iterations);
+    batch_fill(CHALLENGE_SIZE);
+    for (size_t i = 0; i < iterations; i++) bench.run([&] { return compute(batch.jobs, BATCH_JOBS); });
+    bench.report();
+    return BATCH_JOBS * 1e6 / bench.percentile(50);
+}
+
+
+#define DETECT_TAPS         50      //!< Amount of simulated taps per detection mode
+#define DETECT_MAX_DELAY_US 10000   //!< Maximum time until the token enters the field
+#define DETECT_LOOP_US      2000    //!< Other work of the main loop per iteration (keypad, relay, ...)
+
+/**
+ * @brief Ways of waiting for a token, see detect_bench
+ */
+enum detect_mode
+{
+    DETECT_BLOCKING,    //!< InListPassiveTarget retrying forever, the host waits in the call
+    DETECT_LOOP,        //!< InListPassiveTarget retrying once per iteration of a main loop
+    DETECT_IRQ          //!< Detection started once, the host sleeps until the IRQ line is asserted
+};
+
+// Benchmarks the time from the token entering the field until its first APDU, returns the share
+// of that time the host spent communicating with the PN532
+double detect_bench(const char* name, const detect_mode mode, yksim_token* token)
+{
+    yksim_bench bench(name, DETECT_TAPS);
+    double busy = 0, total = 0;
+    for (size_t i = 0; i < DETECT_TAPS; i++)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        yksim_arrive(token, rand() % DETECT_MAX_DELAY_US);
+        if (mode == DETECT_IRQ) yksim_detect_start();
+
+        bool found = false;
+        while (!found)
+        {
+            const auto before = std::chrono::steady_clock::now();
+            switch (mode)
+            {
+                case DETECT_BLOCKING: found = yksim_list_target(0xFF); break;
+                case DETECT_LOOP: found = yksim_list_target(0x01); break;
+                case DETECT_IRQ: found = yksim_irq_wait(DETECT_LOOP_US); break;
+            }
+            if (mode != DETECT_IRQ)
+                busy += std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - before).count();
+            if (!found && mode == DETECT_LOOP) std::this_thread::sleep_for(std::chrono::microseconds(DETECT_LOOP_US));
+        }
+
+        bool result = ykhmac_select(aid, YUBIKEY_AID_LENGTH);
+        total += std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+        bench.add(yksim_first_apdu_us(), result);
+    }
+
+    bench.report();
+    return busy / total;
+}
+
+
+void usage(const char* name)
+{
+    fprintf(stderr, "Usage: %s [-n iterations] [-l apdu latency in us] [-w storage write latency per byte in us] "
+        "[-a passive activation latency in us] [-f faulty exchanges per mille] [-m metrics page, - for stdout] "
+        "[-t trace dump, - for stdout]\n", name);
+}
+
+int main(int argc, char** argv)
+{
+    size_t iterations = 10000;
+    uint32_t latency = 0;
+    const char* metrics_path = nullptr;
+    const char* trace_path = nullptr;
+    uint32_t fault_permille = 20;
+
+    int opt;
+    yksim_activation_latency_us = 1000;
+    while ((opt = getopt(argc, argv, "n:l:w:a:f:m:t:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 'n': iterations = strtoul(optarg, nullptr, 10); break;
+            case 'l': latency = strtoul(optarg, nullptr, 10); break;
+            case 'w': yksim_storage_write_latency_us = strtoul(optarg, nullptr, 10); break;
+            case 'a': yksim_activation_latency_us = strtoul(optarg, nullptr, 10); break;
+            case 'f': fault_permille = strtoul(optarg, nullptr, 10); break;
+            #ifdef YKHMAC_METRICS
+                case 'm': metrics_path = optarg; break;
+            #endif
+            #ifdef YKHMAC_TRACE
+                case 't': trace_path = optarg; break;
+            #endif
+            default: usage(argv[0]); return 1;
+        }
+    }
+
+    yksim_token token, foreign_token;
+    yksim_token_init(&token, 1234567, secret_key);
+    yksim_token_init(&foreign_token, 7654321, wrong_key);
+    token.apdu_latency_us = latency;
+    foreign_token.apdu_latency_us = latency;
+    yksim_storage_clear();
+    srand(1);
+
+    printf("iterations: %zu, APDU latency: %u us, storage write latency: %u us/byte, challenge size: %u bytes\n",
+        iterations, latency, yksim_storage_write_latency_us, CHALLENGE_SIZE);
+    printf("static RAM: %zu bytes (scratch arena %zu, AES phase %zu, HMAC phase %zu, frame %u, pending record %u)\n",
+        (size_t)YKHMAC_STATIC_RAM, sizeof(ykhmac_scratch), sizeof(((ykhmac_scratch*)nullptr)->phase.aes),
+        sizeof(((ykhmac_scratch*)nullptr)->phase.hash), FRAME_SIZE, PENDING_RAM_SIZE);
+    #ifdef YKHMAC_WRITE_BEHIND
+        printf("write-behind re-enrollment enabled\n");
+    #endif
+    #ifdef YKHMAC_TOKEN_TABLE
+        printf("token table of %u tokens, %u index buckets\n", TABLE_SIZE, TABLE_BUCKETS);
+    #endif
+    #ifdef YKHMAC_PRECOMPUTE
+        printf("precomputed records enabled, %u records, replenished at %u\n", RECORD_COUNT, PRECOMPUTE_LOW);
+    #endif
+    #ifdef YKHMAC_METRICS
+        printf("per-phase metrics enabled, %u buckets per phase, %zu bytes\n", METRICS_BUCKETS, METRICS_RAM_SIZE);
+    #endif
+    #ifdef YKHMAC_TOKEN_CACHE
+        printf("session cache of %u tokens, %zu bytes\n", CACHE_SIZE, CACHE_RAM_SIZE);
+    #endif
+    #ifdef YKHMAC_RETRY
+        printf("retries enabled, %u attempts, backoff %u to %u us, deadlines %u us (select), %u us (query), "
+            "%u us (hmac)\n", RETRY_ATTEMPTS, RETRY_BACKOFF_US, RETRY_BACKOFF_MAX_US, RETRY_DEADLINE_SELECT_US,
+            RETRY_DEADLINE_QUERY_US, RETRY_DEADLINE_HMAC_US);
+    #endif
+    #ifdef YKHMAC_STACK
+        printf("stack high-water marks enabled, %u bytes painted per call\n", STACK_PAINT_SIZE);
+    #endif
+    #ifdef YKHMAC_TRACE
+        printf("trace buffer enabled, %u records, level %u, %zu bytes\n", TRACE_RECORDS, TRACE_LEVEL, TRACE_RAM_SIZE);
+    #endif
+    printf("AES work area: %zu bytes using tiny-AES-c, %zu bytes using the compact AES\n",
+        sizeof(struct AES_ctx), sizeof(struct ykhmac_aes_compact_ctx));
+    printf("crypto backends:");
+    for (const ykhmac_hmac_backend* backend : hmac_backends)
+    {
+        if (!backend->supported()) continue;
+        bool result = crypto_check_hmac(backend);
+        printf(" hmac %s %s,", backend->name, result ? "ok" : "FAILED");
+        if (!result) return 1;
+    }
+    for (const ykhmac_aes_backend* backend : aes_backends)
+    {
+        if (!backend->supported()) continue;
+        bool result = crypto_check_aes(backend);
+        printf(" aes %s %s,", backend->name, result ? "ok" : "FAILED");
+        if (!result) return 1;
+    }
+    #ifdef YKHMAC_CRYPTO_X86
+        printf(" using %s and %s\n", ykhmac_crypto_hmac()->name, ykhmac_crypto_aes()->name);
+    #else
+        printf(" using portable\n");
+    #endif
+    printf("batch HMAC-SHA1:");
+    #ifdef YKHMAC_CRYPTO_X86
+        for (const ykhmac_hmac_batch_backend* backend : batch_backends)
+        {
+            if (!backend->supported()) continue;
+            bool result = batch_check(backend->compute);
+            printf(" %s %s,", backend->name, result ? "ok" : "FAILED");
+            if (!result) return 1;
+        }
+        printf(" using %s\n", ykhmac_crypto_hmac_batch()->name);
+    #else
+        bool batch_result = batch_check(ykhmac_compute_hmac_batch);
+        printf(" scalar %s\n", batch_result ? "ok" : "FAILED");
+        if (!batch_result) return 1;
+    #endif
+    bool slots_result = slots_check(&token);
+    printf("slot discovery: %s\n", slots_result ? "ok" : "FAILED");
+    if (!slots_result) return 1;
+    #ifdef YKHMAC_TOKEN_CACHE
+        bool cache_result = cache_check(&token, &foreign_token);
+        printf("session cache: %s\n", cache_result ? "ok" : "FAILED");
+        if (!cache_result) return 1;
+    #endif
+    #ifdef YKHMAC_PRECOMPUTE
+        bool precompute_result = precompute_check(&token, &foreign_token);
+        printf("precomputed records: %s\n", precompute_result ? "ok" : "FAILED");
+        if (!precompute_result) return 1;
+        yksim_storage_clear();
+    #endif
+    #ifdef YKHMAC_METRICS
+        bool reject_result = reject_check(&token, &foreign_token);
+        printf("fast reject: %s\n", reject_result ? "ok" : "FAILED");
+        if (!reject_result) return 1;
+        yksim_storage_clear();
+    #endif
+    #if defined(YKHMAC_RETRY) && !defined(YKHMAC_TOKEN_TABLE)
+        bool retry_result = retry_check(&token);
+        printf("retries: %s\n", retry_result ? "ok" : "FAILED");
+        if (!retry_result) return 1;
+        yksim_storage_clear();
+    #endif
+    #ifdef YKHMAC_STACK
+        bool stack_result = stack_check(&token);
+        printf("stack budgets: %s\n", stack_result ? "ok" : "FAILED");
+        if (!stack_result) return 1;
+        yksim_storage_clear();
+    #endif
+    #ifdef YKHMAC_TRACE
+        bool trace_result = trace_check(&token);
+        printf("trace: %s\n", trace_result ? "ok" : "FAILED");
+        if (!trace_result) return 1;
+        yksim_storage_clear();
+    #endif
+    printf("\n");
+    yksim_bench::header();
+
+    // HMAC-SHA1 of each backend using challenges of CHALLENGE_SIZE, and AES-128-CBC using the README vectors
+    uint8_t bench_challenge[CHALLENGE_SIZE];
+    for (size_t i = 0; i < CHALLENGE_SIZE; i++) bench_challenge[i] = kat_challenge[i % sizeof(kat_challenge)];
+    for (const ykhmac_hmac_backend* backend : hmac_backends)
+    {
+        if (!backend->supported()) continue;
+        char name[32];
+        snprintf(name, sizeof(name), "hmac (%s)", backend->name);
+        yksim_bench bench(name, iterations);
+        ykhmac_hmac_ctx ctx;
+        ykhmac_hash_work work;
+        uint8_t digest[HMAC_HASH_SIZE];
+        backend->init(&ctx, kat_key, 20, &work);
+        for (size_t i = 0; i < iterations; i++)
+            bench.run([&] { return backend->compute(&ctx, bench_challenge, CHALLENGE_SIZE, digest, HMAC_HASH_SIZE, &work); });
+        bench.report();
+    }
+    for (const ykhmac_aes_backend* backend : aes_backends)
+    {
+        if (!backend->supported()) continue;
+        char name[32];
+        snprintf(name, sizeof(name), "cbc decrypt (%s)", backend->name);
+        yksim_bench bench(name, iterations);
+        ykhmac_aes_work work;
+        uint8_t data[sizeof(kat_encrypted_key)];
+        memcpy(data, kat_encrypted_key, sizeof(data));
+        for (size_t i = 0; i < iterations; i++)
+            bench.run([&] { backend->decrypt(&work, kat_response, kat_iv, data, sizeof(data)); return true; });
+        bench.report();
+    }
+
+    // The decryption of each authentication, accepting the README response and rejecting another one
+    for (const ykhmac_aes_backend* backend : aes_backends)
+    {
+        if (!backend->supported()) continue;
+        char accept_name[32], reject_name[32];
+        snprintf(accept_name, sizeof(accept_name), "verify accept (%s)", backend->name);
+        snprintf(reject_name, sizeof(reject_name), "verify reject (%s)", backend->name);
+        yksim_bench accept(accept_name, iterations), reject(reject_name, iterations);
+        ykhmac_aes_work work;
+        uint8_t data[sizeof(kat_encrypted_key)];
+        for (size_t i = 0; i < iterations; i++)
+        {
+            accept.run([&] { return verify_decrypt(backend, &work, kat_response, data); });
+            reject.run([&] { return !verify_decrypt(backend, &work, kat_key, data); });
+        }
+        accept.report();
+        reject.report();
+    }
+
+    // Batch HMAC-SHA1 of each backend, BATCH_JOBS per invocation
+    {
+        size_t batch_iterations = MAX(iterations / BATCH_JOBS, (size_t)1);
+        #ifdef YKHMAC_CRYPTO_X86
+            printf("\n");
+            double rates[sizeof(batch_backends) / sizeof(batch_backends[0])] = { 0 };
+            for (size_t i = 0; i < sizeof(batch_backends) / sizeof(batch_backends[0]); i++)
+            {
+                if (batch_backends[i]->supported())
+                    rates[i] = batch_bench(batch_backends[i]->name, batch_backends[i]->compute, batch_iterations);
+            }
+            printf("batch of %u: ", BATCH_JOBS);
+            for (size_t i = 0; i < sizeof(batch_backends) / sizeof(batch_backends[0]); i++)
+            {
+                if (batch_backends[i]->supported()) printf("%s %.0f, ", batch_backends[i]->name, rates[i]);
+            }
+            printf("verifications/s per core\n\n");
+        #else
+            printf("\nbatch of %u: scalar %.0f verifications/s per core\n\n", BATCH_JOBS,
+                batch_bench("scalar", ykhmac_compute_hmac_batch, batch_iterations));
+        #endif
+    }
+
+    // Local HMAC computation
+    {
+        yksim_bench bench("compute_hmac", iterations);
+        uint8_t challenge[CHALLENGE_SIZE];
+        uint8_t response[RESP_BUF_SIZE];
+        for (uint8_t i = 0; i < CHALLENGE_SIZE; i++) challenge[i] = ykhmac_random();
+        for (size_t i = 0; i < iterations; i++)
+            bench.run([&] { return ykhmac_compute_hmac(secret_key, challenge, CHALLENGE_SIZE, response); });
+        bench.report();
+    }
+
+    // Local HMAC computation reusing the key context
+    {
+        yksim_bench bench("hmac_compute (cached key)", iterations);
+        ykhmac_hmac_ctx ctx;
+        uint8_t challenge[CHALLENGE_SIZE];
+        uint8_t response[RESP_BUF_SIZE];
+        for (uint8_t i = 0; i < CHALLENGE_SIZE; i++) challenge[i] = ykhmac_random();
+        ykhmac_hmac_init(&ctx, secret_key);
+        for (size_t i = 0; i < iterations; i++)
+            bench.run([&] { return ykhmac_hmac_compute(&ctx, challenge, CHALLENGE_SIZE, response); });
+        ykhmac_hmac_purge(&ctx);
+        bench.report();
+    }
+
+    // Slot discovery from the status response, and by probing both slots
+    {
+        yksim_insert(&token);
+        ykhmac_select(aid, YUBIKEY_AID_LENGTH);
+
+        yksim_bench status_bench("find_slots (status)", iterations);
+        uint32_t start = token.apdu_count;
+        for (size_t i = 0; i < iterations; i++)
+            status_bench.run([&] { return ykhmac_find_slots() == SLOT_1; });
+        status_bench.report();
+        const uint32_t status_apdus = token.apdu_count - start;
+
+        yksim_bench probe_bench("probe_slots", iterations);
+        start = token.apdu_count;
+        for (size_t i = 0; i < iterations; i++)
+            probe_bench.run([&] { return ykhmac_probe_slots() == SLOT_1; });
+        probe_bench.report();
+        printf("APDUs per slot discovery: status %.0f, probing %.0f\n", (double)status_apdus / iterations,
+            (double)(token.apdu_count - start) / iterations);
+        yksim_insert(nullptr);
+    }
+
+    #ifdef YKHMAC_TOKEN_CACHE
+        // Serial number, firmware version and slots of a new and of a known token
+        {
+            const uint8_t uid[7] = { 0x04, 0x12, 0x34, 0x56, 0x78, 0x9A, 0xBC };
+            struct ykhmac_token_info info;
+            uint32_t apdus[2] = { 0 };
+            yksim_insert(&token);
+            ykhmac_select(aid, YUBIKEY_AID_LENGTH);
+
+            yksim_bench cold_bench("token_info (new token)", iterations);
+            for (size_t i = 0; i < iterations; i++)
+            {
+                ykhmac_token_cache_clear();
+                cold_bench.run([&] { return cache_query(&token, uid, &info, &apdus[0]); });
+            }
+            cold_bench.report();
+
+            yksim_bench cached_bench("token_info (cached)", iterations);
+            for (size_t i = 0; i < iterations; i++)
+                cached_bench.run([&] { return cache_query(&token, uid, &info, &apdus[1]); });
+            cached_bench.report();
+            printf("APDUs per tap: new token %u, cached %u\n", apdus[0], apdus[1]);
+            ykhmac_token_cache_clear();
+        }
+    #endif
+
+    #ifdef YKHMAC_TOKEN_TABLE
+        // Enrollment of a full table, each token with its own key
+        {
+            size_t count = MAX(iterations, (size_t)TABLE_SIZE);
+            yksim_bench bench("table_enroll", count);
+            uint8_t key[SECRET_KEY_SIZE];
+            for (uint32_t i = 0; i < TABLE_SIZE; i++)
+            {
+                memcpy(key, secret_key, SECRET_KEY_SIZE);
+                key[0] ^= i;
+                yksim_token_init(&table_tokens[i], 1000000 + i * 7919, key);
+                table_tokens[i].apdu_latency_us = latency;
+            }
+            for (size_t i = 0; i < count; i++)
+            {
+                yksim_token* enrolled = &table_tokens[i % TABLE_SIZE];
+                memcpy(key, enrolled->keys[0], SECRET_KEY_SIZE);
+                bench.run([&] { return ykhmac_table_enroll(enrolled->serial, key); });
+            }
+            bench.report();
+        }
+
+        // Successful authentication of random tokens, includes the lookup and re-enrollment
+        yksim_storage_reset_wear();
+        {
+            yksim_bench bench("table_authenticate (success)", iterations);
+            for (size_t i = 0; i < iterations; i++)
+            {
+                yksim_token* inserted = table_insert_random();
+                uint32_t serial = 0;
+                bench.run([&] { return ykhmac_table_authenticate(SLOT_1, &serial) && serial == inserted->serial; });
+                #ifdef YKHMAC_WRITE_BEHIND
+                    ykhmac_commit();
+                #endif
+            }
+            bench.report();
+        }
+    #else
+        // Enrollment
+        {
+            yksim_bench bench("enroll_key", iterations);
+            uint8_t key[SECRET_KEY_SIZE];
+            for (size_t i = 0; i < iterations; i++)
+            {
+                memcpy(key, secret_key, SECRET_KEY_SIZE);
+                bench.run([&] { return ykhmac_enroll_key(key); });
+            }
+            bench.report();
+        }
+
+        // Successful authentication, includes the re-enrollment
+        yksim_storage_reset_wear();
+        {
+            yksim_bench bench("authenticate (success)", iterations);
+            yksim_insert(&token);
+            if (!ykhmac_select(aid, YUBIKEY_AID_LENGTH))
+            {
+                fprintf(stderr, "Select failed\n");
+                return 1;
+            }
+            #ifdef YKHMAC_WRITE_BEHIND
+                yksim_bench commit_bench("commit (write-behind)", iterations);
+                for (size_t i = 0; i < iterations; i++)
+                {
+                    bench.run([&] { return ykhmac_authenticate(SLOT_1); });
+                    commit_bench.run([&] { return ykhmac_commit(); });
+                }
+                bench.report();
+                commit_bench.report();
+            #elif defined(YKHMAC_PRECOMPUTE)
+                // The ring is replenished in between, as the main loop would while the reader is idle
+                yksim_bench replenish_bench("replenish (idle)", iterations);
+                uint32_t total_writes, max_writes, max_erases, critical_writes = 0;
+                precompute_fill();
+                yksim_storage_reset_wear();
+                for (size_t i = 0; i < iterations; i++)
+                {
+                    yksim_storage_wear(&total_writes, &max_writes, &max_erases);
+                    const uint32_t before = total_writes;
+                    bench.run([&] { return ykhmac_authenticate(SLOT_1); });
+                    yksim_storage_wear(&total_writes, &max_writes, &max_erases);
+                    critical_writes += total_writes - before;
+                    while (ykhmac_replenish_pending()) replenish_bench.run([&] { return ykhmac_replenish(); });
+                }
+                bench.report();
+                replenish_bench.report();
+                printf("%.1f bytes written per authentication, %.1f while replenishing\n",
+                    (double)critical_writes / iterations, (double)(total_writes - critical_writes) / iterations);
+            #else
+                for (size_t i = 0; i < iterations; i++)
+                    bench.run([&] { return ykhmac_authenticate(SLOT_1); });
+                bench.report();
+            #endif
+        }
+    #endif
+
+    // Wear of the persistent storage caused by the successful authentications
+    {
+        uint32_t total_writes, max_writes, max_erases;
+        yksim_storage_wear(&total_writes, &max_writes, &max_erases);
+        printf("\nstorage: %u record slots of %u bytes, %.1f bytes written per authentication, "
+            "max. %u writes per byte, max. %u erases per page\n\n",
+            #ifdef YKHMAC_TOKEN_TABLE
+                TABLE_SLOTS,
+            #else
+                RECORD_COUNT,
+            #endif
+            RECORD_SLOT_SIZE,
+            (double)total_writes / iterations, max_writes, max_erases);
+    }
+
+    // Taps of a token which leaves the field now and then, each tap selects the applet and authenticates
+    if (fault_permille > 0)
+    {
+        yksim_bench bench("authenticate (faults)", iterations);
+        uint32_t taps = 0;
+        #ifdef YKHMAC_TOKEN_TABLE
+            yksim_insert(&table_tokens[0]);
+        #else
+            yksim_insert(&token);
+        #endif
+        yksim_fault_count = 0;
+        yksim_fault_permille = fault_permille;
+        #ifdef YKHMAC_RETRY
+            ykhmac_retry_reset();
+        #endif
+        for (size_t i = 0; i < iterations; i++)
+        {
+            bench.run([&]
+            {
+                for (uint8_t tap = 0; tap < 10; tap++)
+                {
+                    taps++;
+                    #ifdef YKHMAC_TOKEN_TABLE
+                        if (ykhmac_select(aid, YUBIKEY_AID_LENGTH) && ykhmac_table_authenticate(SLOT_1)) return true;
+                    #else
+                        if (ykhmac_select(aid, YUBIKEY_AID_LENGTH) && ykhmac_authenticate(SLOT_1)) return true;
+                    #endif
+                }
+                return false;
+            });
+            #if defined(YKHMAC_WRITE_BEHIND)
+                ykhmac_commit();
+            #elif defined(YKHMAC_PRECOMPUTE)
+                while (ykhmac_replenish_pending()) ykhmac_replenish();
+            #endif
+        }
+        yksim_fault_permille = 0;
+        bench.report();
+        printf("%u faults injected (%.1f%% of the exchanges), %.3f taps per authentication", yksim_fault_count,
+            fault_permille / 10.0, (double)taps / iterations);
+        #ifdef YKHMAC_RETRY
+            printf(", %u retried, %u recovered, %u expired", ykhmac_retry_count(YKHMAC_RETRY_RETRIED),
+                ykhmac_retry_count(YKHMAC_RETRY_RECOVERED), ykhmac_retry_count(YKHMAC_RETRY_EXPIRED));
+        #endif
+        printf("\n\n");
+    }
+
+    #ifdef YKHMAC_NONBLOCKING
+        // Resumable authentication, polled in a loop
+        {
+            yksim_bench bench("authenticate (step)", iterations);
+            yksim_bench commit_bench("commit (step)", iterations);
+            for (size_t i = 0; i < iterations; i++)
+            {
+                bench.run([&]
+                {
+                    if (!ykhmac_authenticate_start(SLOT_1, aid, YUBIKEY_AID_LENGTH)) return false;
+                    ykhmac_status status;
+                    while ((status = ykhmac_authenticate_step()) == YKHMAC_PENDING) { }
+                    return status == YKHMAC_DONE;
+                });
+                commit_bench.run([&] { return ykhmac_commit(); });
+            }
+            bench.report();
+            commit_bench.report();
+        }
+    #endif
+
+    // Failed authentication using a token with a different key
+    {
+        yksim_bench bench("authenticate (failure)", iterations);
+        yksim_insert(&foreign_token);
+        ykhmac_select(aid, YUBIKEY_AID_LENGTH);
+        for (size_t i = 0; i < iterations; i++)
+        #ifdef YKHMAC_TOKEN_TABLE
+            bench.run([&] { return !ykhmac_table_authenticate(SLOT_1); });
+        #else
+            bench.run([&] { return !ykhmac_authenticate(SLOT_1); });
+        #endif
+        bench.report();
+    }
+
+    #ifdef YKHMAC_NONBLOCKING
+        // Several engines with their own tokens, each round authenticates all of them
+        {
+            for (uint32_t i = 0; i < BENCH_ENGINES; i++)
+            {
+                uint8_t key[SECRET_KEY_SIZE];
+                memcpy(key, secret_key, SECRET_KEY_SIZE);
+                key[0] ^= i;
+                yksim_token_init(&bench_tokens[i], 2000000 + i, key);
+                bench_tokens[i].apdu_latency_us = latency;
+                bench_engines[i].transport().token = &bench_tokens[i];
+                bench_engines[i].enroll(key);
+            }
+            size_t rounds = MAX(iterations / BENCH_ENGINES, (size_t)1);
+
+            // One authentication after the other
+            yksim_bench sequential_bench("8 engines (sequential)", rounds);
+            for (size_t i = 0; i < rounds; i++)
+            {
+                sequential_bench.run([&]
+                {
+                    bool result = true;
+                    for (auto& engine : bench_engines) result &= authenticate_blocking(engine);
+                    return result;
+                });
+            }
+            sequential_bench.report();
+
+            // All authentications interleaved in one loop, stepping each engine in turn
+            yksim_bench step_bench("8 engines (step)", rounds);
+            for (size_t i = 0; i < rounds; i++)
+            {
+                step_bench.run([&]
+                {
+                    ykhmac_status status[BENCH_ENGINES];
+                    for (uint32_t j = 0; j < BENCH_ENGINES; j++)
+                    {
+                        status[j] = bench_engines[j].authenticate_start(SLOT_1, aid, YUBIKEY_AID_LENGTH) ?
+                            YKHMAC_PENDING : YKHMAC_FAILED;
+                    }
+
+                    bool result = true, pending = true;
+                    while (pending)
+                    {
+                        pending = false;
+                        for (uint32_t j = 0; j < BENCH_ENGINES; j++)
+                        {
+                            if (status[j] != YKHMAC_PENDING) continue;
+                            status[j] = bench_engines[j].authenticate_step();
+                            pending |= (status[j] == YKHMAC_PENDING);
+                            result &= (status[j] != YKHMAC_FAILED);
+                        }
+                    }
+                    return result;
+                });
+            }
+            step_bench.report();
+
+            #ifdef __cpp_impl_coroutine
+                // The same using a coroutine per engine
+                yksim_bench coroutine_bench("8 engines (coroutine)", rounds);
+                for (size_t i = 0; i < rounds; i++)
+                {
+                    coroutine_bench.run([&]
+                    {
+                        std::vector<ykhmac::Operation> operations;
+                        for (auto& engine : bench_engines)
+                            operations.push_back(ykhmac::authenticate(engine, SLOT_1, aid, YUBIKEY_AID_LENGTH));
+
+                        bool result = true, pending = true;
+                        while (pending)
+                        {
+                            pending = false;
+                            for (auto& operation : operations) pending |= !operation.poll();
+                        }
+                        for (auto& operation : operations) result &= operation.result();
+                        return result;
+                    });
+                }
+                coroutine_bench.report();
+            #endif
+        }
+    #endif
+
+    #ifdef YKHMAC_TOKEN_TABLE
+        // Revocation and re-enrollment of random tokens
+        {
+            yksim_bench revoke_bench("table_revoke", iterations);
+            yksim_bench enroll_bench("table_enroll (re-enroll)", iterations);
+            for (size_t i = 0; i < iterations; i++)
+            {
+                yksim_token* revoked = &table_tokens[rand() % TABLE_SIZE];
+                uint8_t key[SECRET_KEY_SIZE];
+                memcpy(key, revoked->keys[0], SECRET_KEY_SIZE);
+                revoke_bench.run([&] { return ykhmac_table_revoke(revoked->serial); });
+                enroll_bench.run([&] { return ykhmac_table_enroll(revoked->serial, key); });
+            }
+            revoke_bench.report();
+            enroll_bench.report();
+        }
+
+        // All tokens must still authenticate
+        {
+            yksim_bench bench("table_authenticate (all)", TABLE_SIZE);
+            for (uint32_t i = 0; i < TABLE_SIZE; i++)
+            {
+                yksim_insert(&table_tokens[i]);
+                ykhmac_select(aid, YUBIKEY_AID_LENGTH);
+                bench.run([&] { return ykhmac_table_authenticate(SLOT_1); });
+            }
+            bench.report();
+        }
+    #endif
+
+    // Time to the first APDU after a token enters the field, and host time spent waiting for it
+    {
+        printf("\n");
+        double busy_blocking = detect_bench("detect (blocking poll)", DETECT_BLOCKING, &token);
+        double busy_loop = detect_bench("detect (loop poll)", DETECT_LOOP, &token);
+        double busy_irq = detect_bench("detect (irq)", DETECT_IRQ, &token);
+        printf("\ndetection: %u us per activation attempt, host busy %.0f%% (blocking poll), "
+            "%.0f%% (loop poll), %.0f%% (irq) of the waiting time\n",
+            yksim_activation_latency_us, busy_blocking * 100, busy_loop * 100, busy_irq * 100);
+    }
+
+    yksim_insert(nullptr);
+
+    #ifdef YKHMAC_METRICS
+        if (metrics_path != nullptr && !yksim_metrics_write(metrics_path))
+        {
+            fprintf(stderr, "Failed to write metrics page to %s\n", metrics_path);
+            return 1;
+        }
+    #else
+        (void)metrics_path;
+    #endif
+    #ifdef YKHMAC_TRACE
+        if (trace_path != nullptr && !yksim_trace_write(trace_path))
+        {
+            fprintf(stderr, "Failed to write trace dump to %s\n", trace_path);
+            return 1;
+        }
+    #else
+        (void)trace_path;
+    #endif
+
+    return 0;
+}
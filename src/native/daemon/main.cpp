@@ -0,0 +1,533 @@
+/**
+ * @file main.cpp
+ * @author Christoph Honal
+ * @brief Authentication daemon, serves many readers concurrently using the session API
+ * @version 0.1
+ * @date 2021-12-17
+ *
+ * Each reader endpoint is a Unix SOCK_SEQPACKET socket, which carries one APDU per packet.
+ * Readers are scheduled on a work-stealing thread pool: every worker owns a queue of readers,
+ * and steals from a random other worker when its own queue is empty. A reader is queued at most
+ * once, so its exchanges are serialized without any locks besides the per-worker queue locks.
+ *
+ * The daemon enrolls the keys of the simulated tokens (see -s), and authenticates them in a closed
+ * loop to measure the throughput. Without -p, it forks a simulator on temporary endpoints. Using -f,
+ * the records are kept in a memory-mapped store file keyed by the serial number of each token, and
+ * tokens which are found there are not enrolled again.
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/random.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <ykhmac_session.h>
+#include <ykhmac_store.h>
+#include <yksim.h>
+#include <yksim_bench.h>
+
+
+const uint8_t aid[YUBIKEY_AID_LENGTH] = YUBIKEY_AID; //!<  AID of the YubiKey HMAC applet
+
+// Secret key from the enrollment log in the README, each reader uses a variation of it
+const uint8_t secret_key[SECRET_KEY_SIZE] = { 0xb6, 0xe3, 0xf5,
+    0x55, 0x56, 0x2c, 0x89, 0x4b, 0x7a, 0xf1, 0x3b, 0x1d,
+    0xb3, 0x7f, 0x28, 0xde, 0xff, 0x3e, 0xa8, 0x9b };
+
+/**
+ * @brief State of a reader endpoint
+ */
+struct reader
+{
+    int fd;                                     //!< Connected endpoint socket
+    uint32_t serial;                            //!< Serial number of the token, keys its record in the store
+    struct ykhmac_session session;              //!< Session of the reader
+    bool enrolled;                              //!< Whether the record below is valid
+    uint8_t challenge[CHALLENGE_SIZE];          //!< Enrollment record: challenge
+    uint8_t iv[AES_BLOCKLEN];                   //!< Enrollment record: IV
+    uint8_t secret_key[SECRET_KEY_SIZE_PAD];    //!< Enrollment record: encrypted secret key
+    uint8_t entropy[64];                        //!< Random bytes from the kernel
+    uint8_t entropy_used;                       //!< Amount of random bytes consumed
+    uint64_t authentications;                   //!< Successful authentications, only touched by the running worker
+    uint64_t failures;                          //!< Failed authentications, only touched by the running worker
+};
+
+/**
+ * @brief Worker of the thread pool
+ */
+struct alignas(64) worker
+{
+    std::mutex lock;                            //!< Protects the queue, contended only by thieves
+    std::deque<reader*> queue;                  //!< Readers which are ready to be served
+    std::atomic<uint64_t> authentications{0};   //!< Successful authentications
+    std::atomic<uint64_t> failures{0};          //!< Failed authentications
+    std::atomic<uint64_t> steals{0};            //!< Readers taken from other workers
+};
+
+std::vector<std::unique_ptr<worker>> workers;   //!< Workers of the thread pool
+std::atomic<bool> stopping{false};              //!< Set to stop the workers
+struct ykhmac_store enrollments;                //!< Store of the enrollment records, if opened using -f
+
+// Derives the secret key of a reader
+void reader_key(const uint32_t index, uint8_t key[SECRET_KEY_SIZE])
+{
+    memcpy(key, secret_key, SECRET_KEY_SIZE);
+    key[0] ^= (uint8_t)index;
+    key[1] ^= (uint8_t)(index >> 8);
+}
+
+// Builds the socket path of an endpoint
+bool endpoint_address(const char* prefix, const uint32_t index, struct sockaddr_un* address)
+{
+    memset(address, 0, sizeof(struct sockaddr_un));
+    address->sun_family = AF_UNIX;
+    int length = snprintf(address->sun_path, sizeof(address->sun_path), "%s.%u", prefix, index);
+    return length > 0 && (size_t)length < sizeof(address->sun_path);
+}
+
+
+// Serves a simulated token on an endpoint, one connection at a time
+void simulate_endpoint(const int listen_fd, const uint32_t index, const uint32_t latency)
+{
+    uint8_t key[SECRET_KEY_SIZE];
+    reader_key(index, key);
+    yksim_token token;
+    yksim_token_init(&token, 1000000 + index, key);
+
+    uint8_t command[UINT8_MAX];
+    uint8_t response[UINT8_MAX];
+    int fd;
+    while ((fd = accept(listen_fd, nullptr, nullptr)) >= 0)
+    {
+        token.selected = false;
+        ssize_t length;
+        while ((length = recv(fd, command, sizeof(command), 0)) > 0)
+        {
+            if (latency > 0) std::this_thread::sleep_for(std::chrono::microseconds(latency));
+
+            // An empty packet signals a failed exchange
+            uint8_t response_length = sizeof(response);
+            if (!yksim_process(&token, command, (uint8_t)length, response, &response_length))
+                response_length = 0;
+            if (send(fd, response, response_length, MSG_NOSIGNAL) < 0) break;
+        }
+        close(fd);
+    }
+}
+
+// Serves simulated tokens on all endpoints, does not return
+int simulate(const char* prefix, const uint32_t readers, const uint32_t latency)
+{
+    std::vector<std::thread> threads;
+    for (uint32_t i = 0; i < readers; i++)
+    {
+        struct sockaddr_un address;
+        int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+        if (fd < 0 || !endpoint_address(prefix, i, &address))
+        {
+            fprintf(stderr, "Failed to create endpoint %u\n", i);
+            return 1;
+        }
+
+        unlink(address.sun_path);
+        if (bind(fd, (struct sockaddr*)&address, sizeof(address)) < 0 || listen(fd, 1) < 0)
+        {
+            fprintf(stderr, "Failed to bind %s: %s\n", address.sun_path, strerror(errno));
+            return 1;
+        }
+        threads.emplace_back(simulate_endpoint, fd, i, latency);
+    }
+
+    for (std::thread& thread : threads) thread.join();
+    return 0;
+}
+
+
+// Session interface: exchanges one APDU with the reader endpoint
+bool reader_exchange(void* context, uint8_t* send_buffer, uint8_t send_length,
+    uint8_t* response_buffer, uint8_t* response_length)
+{
+    reader* r = (reader*)context;
+    if (send(r->fd, send_buffer, send_length, MSG_NOSIGNAL) != send_length) return false;
+
+    ssize_t length = recv(r->fd, response_buffer, *response_length, MSG_TRUNC);
+    if (length <= 0 || length > *response_length) return false;
+
+    *response_length = (uint8_t)length;
+    return true;
+}
+
+// Session interface: draws random bytes from the kernel, buffered per reader
+uint8_t reader_random(void* context)
+{
+    reader* r = (reader*)context;
+    if (r->entropy_used >= sizeof(r->entropy))
+    {
+        if (getrandom(r->entropy, sizeof(r->entropy), 0) != (ssize_t)sizeof(r->entropy)) abort();
+        r->entropy_used = 0;
+    }
+
+    return r->entropy[r->entropy_used++];
+}
+
+// Session interface: loads the enrollment record of the reader
+bool reader_load(void* context, uint8_t challenge[CHALLENGE_SIZE], uint8_t iv[AES_BLOCKLEN],
+    uint8_t secret_key[SECRET_KEY_SIZE_PAD])
+{
+    reader* r = (reader*)context;
+    if (enrollments.base != nullptr)
+        return ykhmac_store_load(&enrollments, r->serial, challenge, iv, secret_key);
+    if (!r->enrolled) return false;
+
+    memcpy(challenge, r->challenge, CHALLENGE_SIZE);
+    memcpy(iv, r->iv, AES_BLOCKLEN);
+    memcpy(secret_key, r->secret_key, SECRET_KEY_SIZE_PAD);
+    return true;
+}
+
+// Session interface: stores the enrollment record of the reader
+bool reader_store(void* context, const uint8_t challenge[CHALLENGE_SIZE], const uint8_t iv[AES_BLOCKLEN],
+    const uint8_t secret_key[SECRET_KEY_SIZE_PAD])
+{
+    reader* r = (reader*)context;
+    if (enrollments.base != nullptr)
+        return ykhmac_store_store(&enrollments, r->serial, challenge, iv, secret_key);
+    memcpy(r->challenge, challenge, CHALLENGE_SIZE);
+    memcpy(r->iv, iv, AES_BLOCKLEN);
+    memcpy(r->secret_key, secret_key, SECRET_KEY_SIZE_PAD);
+    r->enrolled = true;
+    return true;
+}
+
+const struct ykhmac_session_hooks reader_hooks = { reader_exchange, reader_random, reader_load, reader_store,
+    nullptr, nullptr };
+
+// Connects a reader to its endpoint, retries while the endpoint does not exist yet
+bool reader_connect(reader* r, const char* prefix, const uint32_t index)
+{
+    struct sockaddr_un address;
+    if (!endpoint_address(prefix, index, &address)) return false;
+
+    for (int attempt = 0; attempt < 200; attempt++)
+    {
+        r->fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+        if (r->fd < 0) return false;
+        if (connect(r->fd, (struct sockaddr*)&address, sizeof(address)) == 0) return true;
+
+        close(r->fd);
+        r->fd = -1;
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    return false;
+}
+
+
+// Takes the next reader from the own queue
+reader* worker_pop(worker& self)
+{
+    std::lock_guard<std::mutex> guard(self.lock);
+    if (self.queue.empty()) return nullptr;
+
+    reader* r = self.queue.front();
+    self.queue.pop_front();
+    return r;
+}
+
+// Takes a reader from the back of a random other queue
+reader* worker_steal(const size_t index, uint32_t* seed)
+{
+    for (size_t attempt = 1; attempt < workers.size(); attempt++)
+    {
+        *seed = *seed * 1664525 + 1013904223;
+        size_t victim = (index + 1 + (*seed >> 8) % (workers.size() - 1)) % workers.size();
+
+        worker& other = *workers[victim];
+        std::lock_guard<std::mutex> guard(other.lock);
+        if (!other.queue.empty())
+        {
+            reader* r = other.queue.back();
+            other.queue.pop_back();
+            workers[index]->steals.fetch_add(1, std::memory_order_relaxed);
+            return r;
+        }
+    }
+
+    return nullptr;
+}
+
+// Serves readers until the pool is stopped
+void worker_run(const size_t index)
+{
+    worker& self = *workers[index];
+    uint32_t seed = (uint32_t)index * 2654435761u + 1;
+    uint32_t idle = 0;
+
+    while (!stopping.load(std::memory_order_relaxed))
+    {
+        reader* r = worker_pop(self);
+        if (r == nullptr) r = worker_steal(index, &seed);
+        if (r == nullptr)
+        {
+            if (++idle < 64)
+                std::this_thread::yield();
+            else
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            continue;
+        }
+        idle = 0;
+
+        // Every round simulates a new tap of the token, its serial number selects the stored record
+        if (ykhmac_session_select(&r->session, aid, YUBIKEY_AID_LENGTH)
+            && (enrollments.base == nullptr || ykhmac_session_read_serial(&r->session, &r->serial))
+            && ykhmac_session_authenticate(&r->session, SLOT_1))
+        {
+            r->authentications++;
+            self.authentications.fetch_add(1, std::memory_order_relaxed);
+        }
+        else
+        {
+            r->failures++;
+            self.failures.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        // The reader is served again as soon as it is ready
+        std::lock_guard<std::mutex> guard(self.lock);
+        self.queue.push_back(r);
+    }
+}
+
+// Returns the CPU time used by this process in seconds
+double cpu_seconds()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec * 1e-6 +
+           usage.ru_stime.tv_sec + usage.ru_stime.tv_usec * 1e-6;
+}
+
+
+void usage(const char* name)
+{
+    fprintf(stderr, "Usage: %s [-r readers] [-t threads] [-d duration in s] [-l apdu latency in us] "
+        "[-p endpoint prefix] [-f store file] [-m metrics page, rewritten every second] [-s]\n", name);
+}
+
+int main(int argc, char** argv)
+{
+    uint32_t readers = 16;
+    uint32_t threads = std::max(1u, std::thread::hardware_concurrency());
+    uint32_t duration = 5;
+    uint32_t latency = 0;
+    const char* prefix = nullptr;
+    bool simulator = false;
+    const char* metrics_path = nullptr;
+    const char* store_path = nullptr;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "r:t:d:l:p:f:m:sh")) != -1)
+    {
+        switch (opt)
+        {
+            case 'r': readers = strtoul(optarg, nullptr, 10); break;
+            case 't': threads = strtoul(optarg, nullptr, 10); break;
+            case 'd': duration = strtoul(optarg, nullptr, 10); break;
+            case 'l': latency = strtoul(optarg, nullptr, 10); break;
+            case 'p': prefix = optarg; break;
+            case 'f': store_path = optarg; break;
+            #ifdef YKHMAC_METRICS
+                case 'm': metrics_path = optarg; break;
+            #endif
+            case 's': simulator = true; break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if (readers == 0 || threads == 0 || (simulator && prefix == nullptr))
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    if (simulator) return simulate(prefix, readers, latency);
+
+    // Without endpoints, serve simulated tokens from a child process
+    char temporary[64];
+    pid_t child = -1;
+    if (prefix == nullptr)
+    {
+        snprintf(temporary, sizeof(temporary), "/tmp/ykhmacd.%d", (int)getpid());
+        prefix = temporary;
+        child = fork();
+        if (child < 0)
+        {
+            fprintf(stderr, "Failed to fork simulator\n");
+            return 1;
+        }
+        if (child == 0) return simulate(prefix, readers, latency);
+    }
+
+    // Records of earlier runs are reused, updates interrupted by a crash are discarded
+    if (store_path != nullptr)
+    {
+        if (!ykhmac_store_open(&enrollments, store_path, std::max(readers, 1024u), 64))
+        {
+            fprintf(stderr, "Failed to open store file %s\n", store_path);
+            if (child > 0) kill(child, SIGTERM);
+            return 1;
+        }
+        ykhmac_store_recover(&enrollments);
+    }
+
+    // Connect and enroll all readers
+    uint32_t known = 0;
+    std::vector<std::unique_ptr<reader>> reader_list;
+    for (uint32_t i = 0; i < readers; i++)
+    {
+        reader_list.emplace_back(new reader());
+        reader* r = reader_list.back().get();
+        r->entropy_used = sizeof(r->entropy);
+        ykhmac_session_init(&r->session, &reader_hooks, r);
+
+        if (!reader_connect(r, prefix, i))
+        {
+            fprintf(stderr, "Failed to connect to endpoint %s.%u\n", prefix, i);
+            if (child > 0) kill(child, SIGTERM);
+            return 1;
+        }
+
+        // Tokens with a stored record are known already
+        if (enrollments.base != nullptr)
+        {
+            uint8_t challenge[CHALLENGE_SIZE], iv[AES_BLOCKLEN], stored_key[SECRET_KEY_SIZE_PAD];
+            if (!ykhmac_session_select(&r->session, aid, YUBIKEY_AID_LENGTH)
+                || !ykhmac_session_read_serial(&r->session, &r->serial))
+            {
+                fprintf(stderr, "Failed to read the serial number of reader %u\n", i);
+                if (child > 0) kill(child, SIGTERM);
+                return 1;
+            }
+            if (reader_load(r, challenge, iv, stored_key))
+            {
+                known++;
+                continue;
+            }
+        }
+
+        // Provisioning of the simulated tokens
+        uint8_t key[SECRET_KEY_SIZE];
+        reader_key(i, key);
+        bool enrolled = ykhmac_session_enroll_key(&r->session, key);
+        memset(key, 0, SECRET_KEY_SIZE);
+        if (!enrolled)
+        {
+            fprintf(stderr, "Failed to enroll reader %u\n", i);
+            if (child > 0) kill(child, SIGTERM);
+            return 1;
+        }
+    }
+
+    printf("readers: %u, threads: %u, duration: %u s, APDU latency: %u us, session size: %zu bytes\n",
+        readers, threads, duration, latency, sizeof(struct ykhmac_session));
+    if (enrollments.base != nullptr)
+        printf("store: %s, %llu enrolled tokens, %u readers found there\n", store_path,
+            (unsigned long long)ykhmac_store_count(&enrollments), known);
+    printf("\n");
+
+    // Distribute the readers round-robin and start the pool
+    for (uint32_t i = 0; i < threads; i++) workers.emplace_back(new worker());
+    for (uint32_t i = 0; i < readers; i++) workers[i % threads]->queue.push_back(reader_list[i].get());
+
+    std::vector<std::thread> pool;
+    auto start = std::chrono::steady_clock::now();
+    double cpu_start = cpu_seconds();
+    for (uint32_t i = 0; i < threads; i++) pool.emplace_back(worker_run, i);
+
+    // Report the sustained throughput once per second
+    printf("%8s %12s %14s %8s %8s\n", "time [s]", "auth/s", "auth/s/core", "cores", "failed");
+    uint64_t last_total = 0, last_failures = 0;
+    double last_cpu = cpu_start;
+    for (uint32_t second = 1; second <= duration; second++)
+    {
+        std::this_thread::sleep_until(start + std::chrono::seconds(second));
+
+        uint64_t total = 0, failures = 0;
+        for (auto& w : workers)
+        {
+            total += w->authentications.load(std::memory_order_relaxed);
+            failures += w->failures.load(std::memory_order_relaxed);
+        }
+        double cpu = cpu_seconds();
+
+        printf("%8u %12llu %14.0f %8.2f %8llu\n", second, (unsigned long long)(total - last_total),
+            (cpu > last_cpu) ? (total - last_total) / (cpu - last_cpu) : 0, cpu - last_cpu,
+            (unsigned long long)(failures - last_failures));
+        fflush(stdout);
+        #ifdef YKHMAC_METRICS
+            if (metrics_path != nullptr && !yksim_metrics_write(metrics_path))
+                fprintf(stderr, "Failed to write metrics page to %s\n", metrics_path);
+        #endif
+        last_total = total;
+        last_failures = failures;
+        last_cpu = cpu;
+    }
+
+    stopping = true;
+    for (std::thread& thread : pool) thread.join();
+    #ifndef YKHMAC_METRICS
+        (void)metrics_path;
+    #endif
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double cpu = cpu_seconds() - cpu_start;
+
+    // Summary, the per-reader counters show how evenly the readers have been served
+    uint64_t total = 0, failures = 0, steals = 0;
+    for (auto& w : workers)
+    {
+        total += w->authentications;
+        failures += w->failures;
+        steals += w->steals;
+    }
+    uint64_t min_reader = UINT64_MAX, max_reader = 0;
+    for (auto& r : reader_list)
+    {
+        min_reader = std::min(min_reader, r->authentications);
+        max_reader = std::max(max_reader, r->authentications);
+        close(r->fd);
+    }
+
+    printf("\ntotal: %llu authentications, %llu failed, %.0f auth/s, %.0f auth/s/core (%.2f cores), "
+        "%llu steals, %llu - %llu per reader\n", (unsigned long long)total, (unsigned long long)failures,
+        total / elapsed, (cpu > 0) ? total / cpu : 0, cpu / elapsed, (unsigned long long)steals,
+        (unsigned long long)min_reader, (unsigned long long)max_reader);
+
+    if (enrollments.base != nullptr)
+    {
+        ykhmac_store_sync(&enrollments);
+        ykhmac_store_close(&enrollments);
+    }
+
+    if (child > 0)
+    {
+        kill(child, SIGTERM);
+        waitpid(child, nullptr, 0);
+        for (uint32_t i = 0; i < readers; i++)
+        {
+            struct sockaddr_un address;
+            if (endpoint_address(prefix, i, &address)) unlink(address.sun_path);
+        }
+    }
+
+    return failures == 0 ? 0 : 2;
+}
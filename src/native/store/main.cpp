@@ -0,0 +1,303 @@
+/**
+ * @file main.cpp
+ * @author Christoph Honal
+ * @brief Benchmarks the memory-mapped enrollment store
+ * @version 0.1
+ * @date 2021-12-17
+ *
+ * Checks the store first, then fills a store file with one record per token, and measures the
+ * latency of random lookups and the throughput of random updates, from one and from many threads.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <vector>
+#include <ykhmac_store.h>
+#include <yksim_bench.h>
+
+
+/**
+ * @brief Enrollment record of a token, its contents are derived from the serial number and a counter
+ */
+struct record
+{
+    uint8_t challenge[CHALLENGE_SIZE];      //!< Challenge
+    uint8_t iv[AES_BLOCKLEN];               //!< IV
+    uint8_t secret_key[SECRET_KEY_SIZE_PAD]; //!< Encrypted secret key
+
+    void fill(const uint32_t serial, const uint32_t counter)
+    {
+        const uint8_t seed[8] = { (uint8_t)serial, (uint8_t)(serial >> 8), (uint8_t)(serial >> 16),
+            (uint8_t)(serial >> 24), (uint8_t)counter, (uint8_t)(counter >> 8), (uint8_t)(counter >> 16),
+            (uint8_t)(counter >> 24) };
+        for (size_t i = 0; i < CHALLENGE_SIZE; i++) challenge[i] = seed[i % 8] + (uint8_t)i;
+        for (size_t i = 0; i < AES_BLOCKLEN; i++) iv[i] = seed[i % 8] ^ (uint8_t)i;
+        for (size_t i = 0; i < SECRET_KEY_SIZE_PAD; i++) secret_key[i] = seed[i % 8] - (uint8_t)i;
+    }
+
+    bool equals(const record& other) const
+    {
+        return memcmp(this, &other, sizeof(record)) == 0;
+    }
+};
+
+// Serial number of a token, spread over the serial space like real ones
+uint32_t token_serial(const uint32_t index)
+{
+    return 1000000 + index * 7;
+}
+
+bool store(const ykhmac_store* s, const uint32_t serial, const record& r)
+{
+    return ykhmac_store_store(s, serial, r.challenge, r.iv, r.secret_key);
+}
+
+bool load(const ykhmac_store* s, const uint32_t serial, record* r)
+{
+    return ykhmac_store_load(s, serial, r->challenge, r->iv, r->secret_key);
+}
+
+// Checks updates, revocations, reopening, corruption and concurrent readers on a small store
+bool store_check(const char* path)
+{
+    ykhmac_store s;
+    record written, read;
+    unlink(path);
+    if (!ykhmac_store_open(&s, path, 1000, 8)) return false;
+
+    // Enrollment and updates of every token, serial 0 is rejected
+    bool result = !store(&s, 0, written);
+    for (uint32_t i = 0; i < 1000; i++)
+    {
+        written.fill(token_serial(i), 0);
+        result &= store(&s, token_serial(i), written);
+        written.fill(token_serial(i), 1);
+        result &= store(&s, token_serial(i), written) && load(&s, token_serial(i), &read) && read.equals(written);
+    }
+    result &= ykhmac_store_count(&s) == 1000 && !load(&s, token_serial(1000), &read);
+
+    // Revoked tokens are not found, until they are enrolled again
+    result &= ykhmac_store_revoke(&s, token_serial(3)) && !ykhmac_store_revoke(&s, token_serial(3));
+    result &= !load(&s, token_serial(3), &read) && ykhmac_store_count(&s) == 999;
+    written.fill(token_serial(3), 2);
+    result &= store(&s, token_serial(3), written) && load(&s, token_serial(3), &read) && read.equals(written);
+
+    // Records persist, a flipped bit in a record fails its checksum
+    ykhmac_store_close(&s);
+    result &= ykhmac_store_open(&s, path, 0, 0) && ykhmac_store_count(&s) == 1000;
+    written.fill(token_serial(5), 1);
+    result &= load(&s, token_serial(5), &read) && read.equals(written);
+    bool corrupted = false;
+    for (size_t offset = STORE_HEADER_SIZE; !corrupted && offset < s.size; offset += STORE_RECORD_SIZE / 2)
+    {
+        // Find the challenge of token 5 in the mapping
+        uint8_t* data = (uint8_t*)memmem(s.base + offset, MIN((size_t)STORE_RECORD_SIZE, s.size - offset),
+            written.challenge, CHALLENGE_SIZE);
+        if (data != nullptr)
+        {
+            data[3] ^= 0x10;
+            corrupted = true;
+        }
+    }
+    result &= corrupted && !load(&s, token_serial(5), &read);
+
+    // Readers never see a torn record while a writer updates the same token
+    std::atomic<bool> done{false};
+    std::atomic<uint32_t> torn{0};
+    std::thread reader([&]
+    {
+        record seen, expected;
+        while (!done.load())
+        {
+            // The IV holds the counter of the writer
+            if (!load(&s, token_serial(7), &seen)) continue;
+            expected.fill(token_serial(7), seen.iv[4] ^ 4u);
+            if (!seen.equals(expected)) torn++;
+        }
+    });
+    for (uint32_t counter = 0; counter < 200000; counter++)
+    {
+        written.fill(token_serial(7), counter & 0xFF);
+        store(&s, token_serial(7), written);
+    }
+    done = true;
+    reader.join();
+    result &= torn == 0;
+    ykhmac_store_close(&s);
+
+    // A header of another build is rejected
+    FILE* file = fopen(path, "r+b");
+    const uint32_t version = STORE_VERSION + 1;
+    result &= file != nullptr && fseek(file, 8, SEEK_SET) == 0 && fwrite(&version, 4, 1, file) == 1;
+    if (file != nullptr) fclose(file);
+    result &= !ykhmac_store_open(&s, path, 0, 0);
+
+    unlink(path);
+    return result;
+}
+
+// Updates random tokens from several threads, returns the updates per second
+double update_bench(const ykhmac_store* s, const uint32_t tokens, const uint32_t threads, const uint64_t updates,
+    uint64_t* failures)
+{
+    std::atomic<uint64_t> failed{0};
+    std::vector<std::thread> pool;
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t t = 0; t < threads; t++)
+    {
+        // Each thread updates its own share of the tokens, as each reader serves other tokens
+        pool.emplace_back([&, t]
+        {
+            std::mt19937 random(t + 1);
+            record r;
+            uint64_t local = 0;
+            for (uint64_t i = 0; i < updates / threads; i++)
+            {
+                uint32_t index = (uint32_t)(random() % (tokens / threads)) * threads + t;
+                r.fill(token_serial(index), (uint32_t)i + 1);
+                if (!store(s, token_serial(index), r)) local++;
+            }
+            failed += local;
+        });
+    }
+    for (std::thread& thread : pool) thread.join();
+
+    *failures = failed;
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return (updates / threads) * threads / elapsed;
+}
+
+
+void usage(const char* name)
+{
+    fprintf(stderr, "Usage: %s [-n tokens] [-s shards] [-l lookups] [-u updates] [-t threads] [-f store file] [-k]\n",
+        name);
+}
+
+int main(int argc, char** argv)
+{
+    uint32_t tokens = 10000000;
+    uint32_t shards = 4096;
+    uint32_t lookups = 1000000;
+    uint64_t updates = 1000000;
+    uint32_t threads = std::max(1u, std::thread::hardware_concurrency());
+    const char* path = nullptr;
+    bool keep = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:l:u:t:f:kh")) != -1)
+    {
+        switch (opt)
+        {
+            case 'n': tokens = strtoul(optarg, nullptr, 10); break;
+            case 's': shards = strtoul(optarg, nullptr, 10); break;
+            case 'l': lookups = strtoul(optarg, nullptr, 10); break;
+            case 'u': updates = strtoull(optarg, nullptr, 10); break;
+            case 't': threads = strtoul(optarg, nullptr, 10); break;
+            case 'f': path = optarg; break;
+            case 'k': keep = true; break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if (tokens == 0 || shards == 0 || threads == 0 || threads > tokens)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    char temporary[64];
+    if (path == nullptr)
+    {
+        snprintf(temporary, sizeof(temporary), "/tmp/ykhmac_store.%d", (int)getpid());
+        path = temporary;
+    }
+
+    char check_path[80];
+    snprintf(check_path, sizeof(check_path), "%s.check", path);
+    bool check_result = store_check(check_path);
+    printf("store check: %s\n", check_result ? "ok" : "FAILED");
+    if (!check_result) return 1;
+
+    ykhmac_store s;
+    unlink(path);
+    if (!ykhmac_store_open(&s, path, tokens, shards))
+    {
+        fprintf(stderr, "Failed to create store file %s\n", path);
+        return 1;
+    }
+    printf("tokens: %u, shards: %u, %u buckets and %u record pairs per shard, record size: %u bytes, "
+        "file size: %.1f MiB\n\n", tokens, shards, s.header->buckets, s.header->pairs, STORE_RECORD_SIZE,
+        s.size / 1048576.0);
+    yksim_bench::header();
+
+    // Enrollment of all tokens, each allocates a record pair
+    {
+        yksim_bench bench("store (enroll)", tokens);
+        record r;
+        for (uint32_t i = 0; i < tokens; i++)
+        {
+            r.fill(token_serial(i), 0);
+            bench.run([&] { return store(&s, token_serial(i), r); });
+        }
+        bench.report();
+    }
+
+    // Lookups of random tokens, mostly cache misses
+    {
+        yksim_bench bench("load (random)", lookups);
+        std::mt19937 random(1);
+        record r;
+        for (uint32_t i = 0; i < lookups; i++)
+        {
+            uint32_t serial = token_serial(random() % tokens);
+            bench.run([&] { return load(&s, serial, &r); });
+        }
+        bench.report();
+    }
+
+    // Lookups of unknown tokens, end at the first empty bucket
+    {
+        yksim_bench bench("load (unknown)", lookups);
+        std::mt19937 random(2);
+        record r;
+        for (uint32_t i = 0; i < lookups; i++)
+        {
+            uint32_t serial = token_serial(tokens + random() % tokens);
+            bench.run([&] { return !load(&s, serial, &r); });
+        }
+        bench.report();
+    }
+
+    // Updates of random tokens
+    {
+        yksim_bench bench("store (update)", lookups);
+        std::mt19937 random(3);
+        record r;
+        for (uint32_t i = 0; i < lookups; i++)
+        {
+            uint32_t serial = token_serial(random() % tokens);
+            r.fill(serial, i + 1);
+            bench.run([&] { return store(&s, serial, r); });
+        }
+        bench.report();
+    }
+
+    uint64_t single_failures = 0, pool_failures = 0;
+    double single = update_bench(&s, tokens, 1, updates, &single_failures);
+    double pool = update_bench(&s, tokens, threads, updates, &pool_failures);
+    printf("\nupdate throughput: %.0f updates/s on 1 thread, %.0f updates/s on %u threads, %llu failed\n",
+        single, pool, threads, (unsigned long long)(single_failures + pool_failures));
+    printf("enrolled: %llu tokens\n", (unsigned long long)ykhmac_store_count(&s));
+
+    bool synced = ykhmac_store_sync(&s);
+    ykhmac_store_close(&s);
+    if (!keep) unlink(path);
+
+    return (synced && single_failures + pool_failures == 0) ? 0 : 2;
+}
@@ -0,0 +1,304 @@
+/**
+ * @file main.cpp
+ * @author Christoph Honal
+ * @brief Measures cycles and stack usage of the ykhmac library on the ATmega328P, run under simavr
+ * @version 0.1
+ * @date 2021-12-17
+ */
+
+#include <Arduino.h>
+#include <avr/eeprom.h>
+#include <avr/sleep.h>
+#include <ykhmac.h>
+#include <ykhmac_crypto.h>
+
+
+#define STACK_PAINT     0xC5    //!< Marker of unused stack bytes
+#define STACK_MARGIN    8       //!< Bytes below the stack pointer which are not painted
+
+const uint8_t aid[YUBIKEY_AID_LENGTH] = YUBIKEY_AID; //!<  AID of the YubiKey HMAC applet
+
+// Secret key from the enrollment log in the README, also used by the simulated token
+const uint8_t secret_key[SECRET_KEY_SIZE] = { 0xb6, 0xe3, 0xf5,
+    0x55, 0x56, 0x2c, 0x89, 0x4b, 0x7a, 0xf1, 0x3b, 0x1d,
+    0xb3, 0x7f, 0x28, 0xde, 0xff, 0x3e, 0xa8, 0x9b };
+const uint32_t token_serial = 12345678; //!< Serial number of the simulated token
+const uint8_t* token_key = secret_key;  //!< Secret key of the simulated token, swapped to measure a rejection
+
+volatile uint16_t timer_overflows = 0;  //!< Overflows of the cycle counter (timer 1)
+uint32_t hook_cycles = 0;               //!< Cycles spent in the transport and storage hooks
+uint32_t cycles_overhead = 0;           //!< Cycles of an empty measurement
+uint32_t rng_state = 0x2545F491;        //!< State of the deterministic random number generator
+bool failed = false;                    //!< Whether any measured operation failed
+
+extern uint8_t __heap_start;
+extern void* __brkval;
+
+
+ISR(TIMER1_OVF_vect)
+{
+    timer_overflows++;
+}
+
+// Returns the cycles since the timer has been started, at a resolution of one cycle
+static uint32_t cycles()
+{
+    const uint8_t sreg = SREG;
+    cli();
+    const uint16_t low = TCNT1;
+    uint16_t high = timer_overflows;
+    if ((TIFR1 & _BV(TOV1)) && low < 0x8000) high++;
+    SREG = sreg;
+    return ((uint32_t)high << 16) | low;
+}
+
+// Lowest address the stack can grow to
+static uint8_t* stack_bottom()
+{
+    return (__brkval != nullptr) ? (uint8_t*)__brkval : &__heap_start;
+}
+
+// Paints the free RAM below the stack, returns the top of the painted area
+static __attribute__((noinline)) uint8_t* stack_paint()
+{
+    uint8_t* top = (uint8_t*)SP - STACK_MARGIN;
+    for (uint8_t* p = stack_bottom(); p < top; p++) *p = STACK_PAINT;
+    return top;
+}
+
+// Returns the amount of bytes used below the top of the painted area
+static uint16_t stack_peak(const uint8_t* top)
+{
+    const uint8_t* p = stack_bottom();
+    while (p < top && *p == STACK_PAINT) p++;
+    return (uint16_t)(top - p) + STACK_MARGIN;
+}
+
+// Measures an operation, and prints its cycles and stack usage. Cycles spent in the hooks are excluded
+template<class F> static void measure(const __FlashStringHelper* name, F operation)
+{
+    char line[80];
+
+    Serial.flush();
+    uint8_t* top = stack_paint();
+    hook_cycles = 0;
+    const uint32_t start = cycles();
+    const bool result = operation();
+    const uint32_t total = cycles() - start - hook_cycles - cycles_overhead;
+    const uint16_t stack = stack_peak(top);
+
+    snprintf_P(line, sizeof(line), PSTR("%-24S %10lu %10lu %8u %s"), (const char*)name,
+        total, total / (F_CPU / 1000000UL), stack, result ? "ok" : "FAILED");
+    Serial.println(line);
+    failed |= !result;
+}
+
+// Writes a status word behind the response data
+static bool token_respond(uint8_t* response_buffer, uint8_t* response_length, const uint8_t data_length,
+    const uint8_t sw_high, const uint8_t sw_low)
+{
+    if (*response_length < data_length + 2) return false;
+    response_buffer[data_length] = sw_high;
+    response_buffer[data_length + 1] = sw_low;
+    *response_length = data_length + 2;
+    return true;
+}
+
+// Processes an APDU as a token with a configured slot 1 would
+static bool token_process(const uint8_t* send_buffer, const uint8_t send_length,
+    uint8_t* response_buffer, uint8_t* response_length)
+{
+    const uint8_t* data = send_buffer + APDU_HEADER_SIZE;
+    const uint8_t data_length = (send_length > APDU_HEADER_SIZE) ? (send_length - APDU_HEADER_SIZE) : 0;
+
+    // Applet selection and status request: version 5.4.3, program sequence 1
+    if ((send_buffer[1] == INS_SELECT && data_length == YUBIKEY_AID_LENGTH
+            && memcmp(data, aid, YUBIKEY_AID_LENGTH) == 0) || send_buffer[1] == INS_STATUS)
+    {
+        const uint8_t status[6] = { 5, 4, 3, 1, 0, 0 };
+        if (*response_length < sizeof(status) + 2) return false;
+        memcpy(response_buffer, status, sizeof(status));
+        return token_respond(response_buffer, response_length, sizeof(status), SW_OK_HIGH, SW_OK_LOW);
+    }
+    if (send_buffer[1] == INS_API_REQ && send_buffer[2] == CMD_GET_SERIAL)
+    {
+        if (*response_length < 6) return false;
+        response_buffer[0] = (uint8_t)(token_serial >> 24);
+        response_buffer[1] = (uint8_t)(token_serial >> 16);
+        response_buffer[2] = (uint8_t)(token_serial >> 8);
+        response_buffer[3] = (uint8_t)token_serial;
+        return token_respond(response_buffer, response_length, 4, SW_OK_HIGH, SW_OK_LOW);
+    }
+    if (send_buffer[1] == INS_API_REQ && send_buffer[2] == CMD_HMAC_1)
+    {
+        if (*response_length < RESP_BUF_SIZE + 2) return false;
+        if (!ykhmac_compute_hmac(token_key, data, data_length, response_buffer)) return false;
+        return token_respond(response_buffer, response_length, RESP_BUF_SIZE, SW_OK_HIGH, SW_OK_LOW);
+    }
+    return token_respond(response_buffer, response_length, 0, SW_NOTFOUND_HIGH, SW_NOTFOUND_LOW);
+}
+
+
+void setup(void)
+{
+    Serial.begin(115200);
+    Serial.println(F("ykhmac under simavr, ATmega328P"));
+
+    // Timer 1 counts every cycle, the Arduino core only uses it for PWM
+    TCCR1A = 0;
+    TCCR1B = _BV(CS10);
+    TCNT1 = 0;
+    TIFR1 = _BV(TOV1);
+    TIMSK1 = _BV(TOIE1);
+    const uint32_t start = cycles();
+    cycles_overhead = cycles() - start;
+
+    // RAM of the library, the flash and RAM of the whole image are reported by the host script
+    Serial.print(F("static RAM: "));
+    Serial.print(YKHMAC_STATIC_RAM);
+    Serial.print(F(" bytes, challenge size: "));
+    Serial.print(CHALLENGE_SIZE);
+    Serial.println(F(" bytes"));
+    Serial.print(F("HMAC work area: cryptosuite2 "));
+    Serial.print(sizeof(ykhmac::PortableCrypto::HashWork));
+    Serial.print(F(" bytes, fixed "));
+    Serial.print(sizeof(ykhmac::FixedHmacCrypto<ykhmac::PortableCrypto>::HashWork));
+    Serial.println(F(" bytes"));
+    Serial.print(F("AES work area: tiny-AES-c "));
+    Serial.print(sizeof(ykhmac::PortableCrypto::AesWork));
+    Serial.print(F(" bytes, compact "));
+    Serial.print(sizeof(ykhmac::CompactCrypto::AesWork));
+    Serial.println(F(" bytes"));
+    Serial.println();
+    Serial.println(F("operation                    cycles       [us]  stack [bytes]"));
+
+    uint8_t challenge[CHALLENGE_SIZE];
+    uint8_t response[RESP_BUF_SIZE];
+    for (uint8_t i = 0; i < CHALLENGE_SIZE; i++) challenge[i] = ykhmac_random();
+    measure(F("compute_hmac"), [&] { return ykhmac_compute_hmac(secret_key, challenge, CHALLENGE_SIZE, response); });
+
+    // The same using the fixed-length HMAC-SHA1, see YKHMAC_HMAC_FIXED
+    typedef ykhmac::FixedHmacCrypto<ykhmac::PortableCrypto> FixedCrypto;
+    measure(F("compute_hmac_fixed"), [&] {
+        struct ykhmac_hmac_ctx fixed_ctx;
+        FixedCrypto::HashWork fixed_work;
+        FixedCrypto::hmac_init(&fixed_ctx, secret_key, SECRET_KEY_SIZE, &fixed_work);
+        const bool result = FixedCrypto::hmac_compute(&fixed_ctx, challenge, CHALLENGE_SIZE, response, RESP_BUF_SIZE,
+            &fixed_work);
+        ykhmac_hmac_purge(&fixed_ctx);
+        return result;
+    });
+
+    // The same HMAC through the C API and the engine, and through the crypto policy only
+    struct ykhmac_hmac_ctx ctx;
+    ykhmac_hmac_init(&ctx, secret_key);
+    measure(F("hmac_compute"), [&] { return ykhmac_hmac_compute(&ctx, challenge, CHALLENGE_SIZE, response); });
+    measure(F("hmac_compute_policy"), [&] {
+        ykhmac::DefaultCrypto::HashWork work;
+        return ykhmac::DefaultCrypto::hmac_compute(&ctx, challenge, CHALLENGE_SIZE, response, RESP_BUF_SIZE, &work);
+    });
+    ykhmac_hmac_purge(&ctx);
+
+    // Secret key encryption and decryption, as performed by each authentication, using tiny-AES-c
+    ykhmac::PortableCrypto::AesWork aes_work;
+    uint8_t data[SECRET_KEY_SIZE_PAD] = { 0 };
+    memcpy(data, secret_key, SECRET_KEY_SIZE);
+    measure(F("cbc_encrypt"), [&] {
+        ykhmac::PortableCrypto::cbc_encrypt(&aes_work, response, challenge, data, sizeof(data));
+        return true;
+    });
+    measure(F("cbc_decrypt"), [&] {
+        ykhmac::PortableCrypto::cbc_decrypt(&aes_work, response, challenge, data, sizeof(data));
+        return memcmp(data, secret_key, SECRET_KEY_SIZE) == 0;
+    });
+
+    // The same using the compact AES-128, see YKHMAC_AES_COMPACT
+    ykhmac::CompactCrypto::AesWork compact_work;
+    measure(F("cbc_encrypt_compact"), [&] {
+        ykhmac::CompactCrypto::cbc_encrypt(&compact_work, response, challenge, data, sizeof(data));
+        return true;
+    });
+    measure(F("cbc_decrypt_compact"), [&] {
+        ykhmac::CompactCrypto::cbc_decrypt(&compact_work, response, challenge, data, sizeof(data));
+        return memcmp(data, secret_key, SECRET_KEY_SIZE) == 0;
+    });
+
+    // Enrollment and authentication against the simulated token
+    measure(F("select"), [&] { return ykhmac_select(aid, YUBIKEY_AID_LENGTH); });
+    measure(F("enroll_key"), [&] {
+        uint8_t key[SECRET_KEY_SIZE];
+        memcpy(key, secret_key, SECRET_KEY_SIZE);
+        return ykhmac_enroll_key(key);
+    });
+    measure(F("authenticate"), [&] { return ykhmac_authenticate(SLOT_1); });
+    #ifdef YKHMAC_WRITE_BEHIND
+        measure(F("commit"), [&] { return ykhmac_commit(); });
+    #endif
+
+    // Rejection of a token with a different key, which never reaches the HMAC
+    const uint8_t wrong_key[SECRET_KEY_SIZE] = { 0 };
+    token_key = wrong_key;
+    measure(F("reject"), [&] { return !ykhmac_authenticate(SLOT_1); });
+    token_key = secret_key;
+
+    Serial.println();
+    Serial.println(failed ? F("simavr failed") : F("simavr done"));
+    Serial.flush();
+
+    // Sleeping with interrupts disabled ends the simulation
+    cli();
+    sleep_enable();
+    sleep_cpu();
+}
+
+void loop(void)
+{
+}
+
+
+// Specific implementations of interface methods
+uint8_t ykhmac_frame[FRAME_SIZE];
+
+bool ykhmac_data_exchange(uint8_t *send_buffer, uint8_t send_length,
+    uint8_t* response_buffer, uint8_t* response_length)
+{
+    const uint32_t start = cycles();
+    const bool result = token_process(send_buffer, send_length, response_buffer, response_length);
+    hook_cycles += cycles() - start;
+    return result;
+}
+
+// Deterministic, so that each run takes the same amount of cycles
+uint8_t ykhmac_random()
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return (uint8_t)rng_state;
+}
+
+bool ykhmac_presistent_write(const uint8_t *data, const size_t size, const size_t offset)
+{
+    const uint32_t start = cycles();
+    eeprom_update_block(data, (void*)offset, size);
+    hook_cycles += cycles() - start;
+    return true;
+}
+
+bool ykhmac_presistent_read(uint8_t *data, const size_t size, const size_t offset)
+{
+    const uint32_t start = cycles();
+    eeprom_read_block(data, (const void*)offset, size);
+    hook_cycles += cycles() - start;
+    return true;
+}
+
+void ykhmac_debug_print(const __FlashStringHelper* message)
+{
+    Serial.print(message);
+}
+
+void ykhmac_debug_print(const char* message)
+{
+    Serial.print(message);
+}